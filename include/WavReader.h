@@ -2,6 +2,7 @@
 #define WAV_READER_C_H 
 
 #include <stdint.h>
+#include <stdio.h>
 
 // Source : https://ccrma.stanford.edu/courses/422-winter-2014/projects/WaveFormat/
 
@@ -23,9 +24,97 @@ typedef enum {
 	NumStates,
 } WAV_State;
 
+// How a file opened with WAV_open_mapped() is mapped into memory
+typedef enum {
+	WAV_MAP_READ_ONLY = 0,	// read only; functions that change the sound data copy it to the heap first
+	WAV_MAP_PRIVATE,	// copy-on-write; edits stay in memory and never reach the file
+	WAV_MAP_SHARED,		// writable; edits to the buffers are written back to the file
+	WAV_MAP_NumModes,
+} WAV_MapMode;
+
+// How the gain passed to WAV_apply_gain() is given
+typedef enum {
+	WAV_GAIN_LINEAR = 0,	// multiplier; negative values invert the polarity
+	WAV_GAIN_DB,		// decibels
+	WAV_GAIN_NumUnits,
+} WAV_GainUnit;
+
+// Noise added before samples are rounded back to their bit depth
+typedef enum {
+	WAV_DITHER_NONE = 0,
+	WAV_DITHER_TPDF,	// triangular noise of +-1 LSB
+	WAV_DITHER_NumModes,
+} WAV_Dither;
+
+// Response of a single biquad section, from the Audio EQ Cookbook
+typedef enum {
+	WAV_BIQUAD_LOW_PASS = 0,
+	WAV_BIQUAD_HIGH_PASS,
+	WAV_BIQUAD_BAND_PASS,	// 0 dB at the centre frequency
+	WAV_BIQUAD_NOTCH,
+	WAV_BIQUAD_PEAKING,
+	WAV_BIQUAD_LOW_SHELF,
+	WAV_BIQUAD_HIGH_SHELF,
+	WAV_BIQUAD_NumTypes,
+} WAV_BiquadType;
+
+// Filter families built from cascaded biquad sections
+typedef enum {
+	WAV_CASCADE_BUTTERWORTH = 0,
+	WAV_CASCADE_LINKWITZ_RILEY,	// Butterworth of half the order, squared; even orders only
+	WAV_CASCADE_NumTypes,
+} WAV_CascadeType;
+
+// Windowed-sinc responses designed by WAV_fir_design()
+typedef enum {
+	WAV_FIR_LOW_PASS = 0,
+	WAV_FIR_HIGH_PASS,
+	WAV_FIR_NumTypes,
+} WAV_FirType;
+
+// Stages of a WAV_chain
+typedef enum {
+	WAV_STAGE_GAIN = 0,
+	WAV_STAGE_BIQUAD,
+	WAV_STAGE_DC_REMOVAL,
+	WAV_STAGE_CLIP,
+	WAV_STAGE_FADE,
+	WAV_STAGE_NumTypes,
+} WAV_StageType;
+
+typedef enum {
+	WAV_FADE_IN = 0,
+	WAV_FADE_OUT,
+	WAV_FADE_NumTypes,
+} WAV_FadeType;
+
+// Frequency laws of WAV_write_sweep()
+typedef enum {
+	WAV_SWEEP_LINEAR = 0,
+	WAV_SWEEP_LOG,		// exponential, the same time per octave
+	WAV_SWEEP_NumTypes,
+} WAV_SweepType;
+
+// Spectra of WAV_write_noise()
+typedef enum {
+	WAV_NOISE_WHITE = 0,
+	WAV_NOISE_PINK,		// -3dB per octave
+	WAV_NOISE_BROWN,	// -6dB per octave
+	WAV_NOISE_NumTypes,
+} WAV_NoiseType;
+
+// Largest RIFF or data chunk size that fits the 32-bit size fields of a plain RIFF file.
+// Anything larger is written as RF64, with the real sizes kept in a ds64 chunk.
+#define WAV_RIFF_MAX_SIZE 0xFFFFFFFFu
+
+// Values of FMT_chunk.audio_format
+#define WAV_FORMAT_PCM		1
+#define WAV_FORMAT_IEEE_FLOAT	3
+
 struct RIFF_chunk {
-	unsigned char 	id[4];		// ascii letters "RIFF" for little-endian, "RIFX" for big-endian
-	uint32_t 	size;		// 36 + subchunk2_size
+	unsigned char 	id[4];		// ascii letters "RIFF" for little-endian, "RIFX" for big-endian,
+					// "RF64" or "BW64" for files with 64-bit sizes
+	uint64_t 	size;		// 36 + subchunk2_size; taken from the ds64 chunk for RF64/BW64
 	unsigned char 	format[4];	// ascii letters "WAVE"
 };
 
@@ -43,7 +132,7 @@ struct FMT_chunk {
 
 struct DATA_chunk {
 	unsigned char 	id[4];	// ascii letters "data"
-	uint32_t	size;	// Number of bytes in sound data
+	uint64_t	size;	// Number of bytes in sound data
 	unsigned char   *buff;	// actual sound data
 };
 
@@ -53,8 +142,66 @@ struct DATA_chunk {
 struct EXTRA_chunk {
 	unsigned char 	   id[4];
 	uint32_t 	   size;
-	unsigned char 	   *buff;
+	unsigned char 	   *buff;	// NULL until loaded for files opened with WAV_open_lazy
+	uint64_t	   offset;	// byte offset of the payload in the source file
 	struct EXTRA_chunk *next;
+	struct EXTRA_chunk *next_of_id;	// next chunk with the same id
+};
+
+struct WAV_arena_block;
+struct WAV_chunk_slot;
+
+// Storage of the EXTRA_chunk list of a WAV_file. Chunk headers and the
+// payloads read from the file are carved out of large blocks that WAV_free
+// releases together, and a hash table of chunk ids finds the first and last
+// chunk of each id without walking the list.
+struct WAV_chunk_arena {
+	struct WAV_arena_block	*blocks;	// the block being filled first
+	struct EXTRA_chunk	*tail;		// last chunk of the list
+	struct WAV_chunk_slot	*slots;		// hash table of chunk ids, NULL until the first chunk
+	uint32_t		num_slots;	// a power of two
+	uint32_t		num_ids;	// slots in use
+};
+
+// Entry of the chunk index built while parsing a file
+struct WAV_chunk_info {
+	unsigned char	id[4];
+	uint64_t	offset;		// byte offset of the payload in the file
+	uint64_t	size;		// payload size in bytes, 64-bit for the data chunk of RF64 files
+};
+
+// Backing storage of a WAV_file whose chunk buffers are not owned heap allocations.
+// Buffers that point inside [map, map + map_size) belong to the mapping and are never free()'d.
+struct WAV_source {
+	unsigned char	*map;		// base address of the mmap'd file, NULL if not mapped
+	uint64_t	map_size;	// length of the mapping in bytes
+	WAV_MapMode	map_mode;
+	FILE		*file;		// open file that payloads are loaded from on first access
+	int		writable;	// set if file was opened for writing with WAV_open_lazy_rw
+	uint64_t	data_offset;	// byte offset of the sound data in the file
+
+	struct WAV_chunk_info *index;	// every chunk of the file in file order
+	uint32_t	index_count;
+};
+
+// Statistics of one channel of the waveform data, in sample units.
+// 8-bit samples are measured from their 128 midpoint.
+struct WAV_channel_stats {
+	uint64_t	peak;		// largest absolute sample value
+	double		rms;		// root mean square of the samples
+	double		dc_offset;	// mean of the samples
+	uint64_t	clip_count;	// samples at the most negative or most positive value of the bit depth
+};
+
+// Analysis of the waveform data, computed on first use and dropped by every
+// function that changes the waveform data. Integer PCM only.
+struct WAV_stats {
+	int		valid;		// set while channels and frames are up to date
+	int		peak_valid;	// set while peak is up to date
+	uint64_t	peak;		// largest peak of any channel
+	uint64_t	frames;
+	uint16_t	num_channels;
+	struct WAV_channel_stats *channels;
 };
 
 struct WAV_file {
@@ -62,6 +209,148 @@ struct WAV_file {
 	struct FMT_chunk   fmt;
 	struct DATA_chunk  data;
 	struct EXTRA_chunk *extra;
+	struct WAV_chunk_arena chunks;
+	struct WAV_source  source;
+	struct WAV_stats   stats;
+};
+
+// Default working buffer of the streaming operations, in bytes
+#define WAV_STREAM_DEFAULT_BUFFER (1 << 20)
+
+// Blocks the working buffer of a streaming operation is split into. A reader
+// thread, the worker and a writer thread pass them along so disk reads,
+// processing and disk writes overlap.
+#define WAV_PIPELINE_BLOCKS 4
+
+typedef enum {
+	WAV_STREAM_READ = 0,
+	WAV_STREAM_WRITE,
+} WAV_StreamMode;
+
+// A .wav file processed a block of frames at a time, so memory use does not
+// depend on the length of the file. Only the fmt and data chunks are handled;
+// wav.data.buff is never allocated.
+struct WAV_stream {
+	FILE		*file;
+	struct WAV_file	wav;		// header of the stream
+	uint64_t	data_offset;	// byte offset of the sound data in the file
+	uint64_t	frames;		// frames in the data chunk, or frames written so far
+	uint64_t	position;	// next frame to be read
+	WAV_StreamMode	mode;
+};
+
+// Alignment of each channel of a WAV_planar, in bytes
+#define WAV_PLANAR_ALIGN 64
+
+// Waveform data split into one contiguous float array per channel, with
+// samples scaled to [-1, 1). Each channel is WAV_PLANAR_ALIGN aligned.
+struct WAV_planar {
+	float		**channels;	// num_channels arrays of frames samples
+	uint16_t	num_channels;
+	uint64_t	frames;
+};
+
+// Coefficients of a second order section, normalized so that a0 is 1:
+// y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+struct WAV_biquad_section {
+	double b0, b1, b2;
+	double a1, a2;
+};
+
+// A cascade of biquad sections applied to every channel. The state of each
+// channel is kept between calls, so a long signal can be filtered a block
+// at a time. Set up with WAV_biquad_init and released with WAV_biquad_free.
+struct WAV_biquad {
+	struct WAV_biquad_section *sections;
+	uint16_t	num_sections;
+	uint16_t	num_channels;
+	uint16_t	stride;		// channels of state per value, padded for the vector kernels
+	float		*coeffs;	// b0, b1, b2, a1, a2 of each section as floats
+	float		*state;		// two values per section and channel
+};
+
+// Transformed taps shared by every WAV_fir built from the same taps
+struct WAV_fir_kernel;
+
+// FIR filter applied to every channel by FFT convolution. The state of each
+// channel is kept between calls, so a long signal can be filtered a block
+// at a time. Set up with WAV_fir_init and released with WAV_fir_free.
+struct WAV_fir {
+	struct WAV_fir_kernel *kernel;
+	uint16_t	num_channels;
+	uint32_t	num_taps;
+	float		*tail;		// num_taps - 1 pending outputs per channel
+	float		*work;		// transform scratch per channel
+};
+
+// Convolution with long impulse responses, a block at a time. The response
+// is split into partitions of block frames so the work per block stays
+// bounded. Set up with WAV_convolver_init and released with
+// WAV_convolver_free.
+struct WAV_convolver {
+	struct WAV_fir_kernel **kernels;	// one per impulse response
+	uint16_t	num_irs;
+	uint16_t	num_channels;
+	uint32_t	block;		// partition size in frames
+	uint32_t	fill;		// frames of the current block seen so far
+	uint32_t	current;	// slot of the current block in the delay line
+	float		*state;		// input, past spectra and scratch of every channel
+};
+
+// One stage of a WAV_chain; which fields are used depends on the type
+struct WAV_chain_stage {
+	WAV_StageType	type;
+	float		value;		// gain: multiplier, clip: ceiling, DC removal: pole
+	struct WAV_biquad *biquad;	// biquad: the caller's filter
+	float		*state;		// DC removal: previous input and output per channel
+	WAV_FadeType	fade;
+	uint64_t	start;		// fade: first frame of the ramp
+	uint64_t	frames;		// fade: length of the ramp
+};
+
+// Stages applied in order in a single pass over the data: each block is
+// decoded to float once, run through every stage and quantized once. Set
+// up with WAV_chain_init and released with WAV_chain_free.
+struct WAV_chain {
+	struct WAV_chain_stage *stages;
+	uint16_t	num_stages;
+	uint16_t	num_channels;
+	uint32_t	sample_rate;
+	uint64_t	position;	// frames processed so far, for fades
+};
+
+// Kernel length of WAV_resampler_init when 0 is passed, in frames of the
+// lower of the two rates
+#define WAV_RESAMPLE_DEFAULT_LENGTH 128
+
+// Polyphase sample rate converter for a fixed pair of rates. The history of
+// each channel is kept between calls, so a long signal can be converted a
+// block at a time. Set up with WAV_resampler_init and released with
+// WAV_resampler_free.
+struct WAV_resampler {
+	uint16_t	num_channels;
+	uint32_t	in_rate;
+	uint32_t	out_rate;
+	uint32_t	up;		// out_rate / in_rate in lowest terms
+	uint32_t	down;
+	uint32_t	taps;		// input frames under the kernel, a multiple of 8
+	float		*coeffs;	// taps values for each of the up phases
+	float		*history;	// input frames still needed by later outputs, per channel
+	uint64_t	fill;		// frames in the history of each channel
+	uint64_t	position;	// first history frame of the next output
+	uint64_t	phase;		// phase of the next output
+	uint64_t	frames_in;	// frames passed in so far
+	uint64_t	frames_out;	// frames written so far
+};
+
+// Largest number of partials of WAV_write_multitone
+#define WAV_MAX_PARTIALS 512
+
+// A sine component of a multitone signal
+struct WAV_partial {
+	double	frequency;	// hertz
+	double	amplitude;	// linear, 1 is full scale
+	double	phase;		// radians at the first frame
 };
 
 /*
@@ -72,6 +361,28 @@ struct WAV_file {
  * ----------------------------------------
  */
 
+/**
+ * Set the number of threads used for passes over the waveform data such
+ * as peak and RMS scans, normalize and planar conversion. The calling
+ * thread counts as one of them. The data is split into ranges that do
+ * not depend on the thread count, so results are the same for any
+ * setting. Defaults to the number of online CPUs.
+ *
+ * @param num_threads the number of threads, 1 to stay on the calling
+ * 		thread or 0 for the number of online CPUs
+ * @return a WAV_State struct representing success or error of the operation.
+ * 		Error means fewer threads could be started; the pool keeps running
+ * 		with the ones that did.
+ */
+WAV_State WAV_set_num_threads(unsigned num_threads);
+
+/**
+ * Get the number of threads used for passes over the waveform data.
+ *
+ * @return the number of threads, including the calling thread
+ */
+unsigned WAV_get_num_threads(void);
+
 /**
  * Initialize a blank WAV_file struct. Does not
  * allocate data or write any waveform data.
@@ -108,7 +419,9 @@ void WAV_print_metadata(
 	);
 
 /**
- * Get the absolute max amplitude value of the waveform data
+ * Get the absolute max amplitude value of the waveform data. 8-bit
+ * samples are measured from their 128 midpoint, so every depth peaks
+ * at 2^(bits - 1). Returns 0 for IEEE float data.
  *
  * @param wav a pointer to the WAV_file struct
  * @return a 64 bit unsigned int representing the max amplitude
@@ -127,6 +440,43 @@ double WAV_get_max_db(
 		struct WAV_file *wav
 	);
 
+/**
+ * Get the RMS level of the waveform data in decibels relative to full
+ * scale, over all channels. IEEE float data is not supported.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @return a double representing the decible level
+ */
+double WAV_get_rms_db(
+		struct WAV_file *wav
+	);
+
+/**
+ * Get the per-channel peak, RMS, DC offset and clip count of the waveform
+ * data. They are computed in a single pass on first use and cached in
+ * wav->stats until the waveform data is changed, so repeated queries do
+ * not scan the data again. WAV_get_max_amp, WAV_get_max_db and
+ * WAV_get_rms_db use the same cache.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @return a pointer to wav->stats, or NULL if the waveform data could not
+ * 		be loaded or is not integer PCM
+ */
+const struct WAV_stats *WAV_get_stats(
+		struct WAV_file *wav
+	);
+
+/**
+ * Drop the cached statistics of the WAV_file struct. Every function of
+ * this library that changes the waveform data does this itself; call it
+ * after changing the buffer from WAV_get_data or wav->data.buff directly.
+ *
+ * @param wav a pointer to the WAV_file struct
+ */
+void WAV_invalidate_stats(
+		struct WAV_file *wav
+	);
+
 /**
  * Normalize the WAV_file struct's waveform data to a new
  * maximum decibel value
@@ -141,6 +491,26 @@ WAV_State WAV_normalize_max_db(
 		double 		db
 	);
 
+/**
+ * Change the level of the WAV_file struct's waveform data. The gain is
+ * applied in fixed point directly to the integer samples, which are
+ * rounded to nearest and saturated at the limits of the bit depth.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param gain a double representing the gain, as a multiplier or in
+ * 		decibels depending on unit
+ * @param unit WAV_GAIN_LINEAR or WAV_GAIN_DB
+ * @param dither WAV_DITHER_TPDF to add triangular dither before rounding,
+ * 		or WAV_DITHER_NONE
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_apply_gain(
+		struct WAV_file *wav,
+		double		gain,
+		WAV_GainUnit	unit,
+		WAV_Dither	dither
+	);
+
 /**
  * Write a sin wave to the waveform data of the WAV_file struct.
  * This will replace any existing waveform data.
@@ -178,61 +548,1250 @@ void WAV_apply_low_pass_filter(struct WAV_file *wav, float cutoff);
 void WAV_apply_high_pass_filter(struct WAV_file *wav, float cutoff);
 
 /**
- * Write a binaural wave to the waveform data of the WAV_file struct.
- * This will replace any existing waveform data.
+ * Allocate a WAV_planar struct with num_channels channels of
+ * frames samples each. Must be released with WAV_planar_free.
+ *
+ * @param planar a pointer to the WAV_planar struct
+ * @param num_channels the number of channels
+ * @param frames the number of samples in each channel
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_planar_alloc(
+		struct WAV_planar *planar,
+		uint16_t	num_channels,
+		uint64_t	frames
+	);
+
+/**
+ * Free the channels of a WAV_planar struct.
+ *
+ * @param planar a pointer to the WAV_planar struct
+ */
+void WAV_planar_free(struct WAV_planar *planar);
+
+/**
+ * Get the largest absolute sample value of a WAV_planar struct across
+ * all of its channels. NaN samples are ignored.
+ *
+ * @param planar a pointer to the WAV_planar struct
+ * @return a float representing the peak, 1.0f being full scale
+ */
+float WAV_planar_get_peak(const struct WAV_planar *planar);
+
+/**
+ * Convert the waveform data of the WAV_file struct to planar float32.
+ * 8-bit samples are unsigned, all other depths are signed; every depth
+ * is scaled to [-1, 1). The WAV_planar struct is allocated and must be
+ * released with WAV_planar_free.
  *
  * @param wav a pointer to the WAV_file struct
- * @param frequency1 a double representing the frequency of the binaural
- * 		wave in hertz for even sound channels
- * @param frequency2 a double representing the frequency of the binaural
- * 		wave in hertz for odd sound channels
- * @param duration a unsigned 32-bit integer representing the duration
- * 		of the binaural wave in seconds
- * @param db a double representing the max decibel level of the
- * 		binaural wave
+ * @param planar a pointer to the WAV_planar struct to fill
  * @return a WAV_State struct representing success or error of the operation
  */
-WAV_State WAV_write_binaural_wave(
-		struct WAV_file *wav,
-		const double 	frequency1,
-		const double 	frequency2,
-		const uint32_t 	duration,
-		float 		db 
+WAV_State WAV_to_planar(
+		struct WAV_file	  *wav,
+		struct WAV_planar *planar
 	);
 
 /**
- * Read the contents of an existing .wav file into a WAV_file struct
+ * Quantize planar float32 samples back into the waveform data of the
+ * WAV_file struct, using its fmt chunk. Samples are rounded to nearest
+ * and clamped to the range of the bit depth. This will replace any
+ * existing waveform data.
  *
  * @param wav a pointer to the WAV_file struct
- * @param file_name a pointer to a const char array representing the
- * 		file name
+ * @param planar a pointer to the WAV_planar struct to read from
  * @return a WAV_State struct representing success or error of the operation
  */
-WAV_State WAV_read_file(
-		struct WAV_file *wav,
-		const char 	*file_name
+WAV_State WAV_from_planar(
+		struct WAV_file		*wav,
+		const struct WAV_planar *planar
 	);
 
 /**
- * Write the contents of an existing WAV_file struct to a new .wav file
+ * Compute the coefficients of a single biquad section.
+ *
+ * @param section a pointer to the WAV_biquad_section struct to fill
+ * @param type the response of the section
+ * @param frequency the cutoff, centre or corner frequency in hertz,
+ * 		below half the sample rate
+ * @param q the quality factor; 0.7071 gives a Butterworth response for
+ * 		low and high pass sections
+ * @param gain_db the gain in decibels of peaking and shelf sections,
+ * 		ignored by the other types
+ * @param sample_rate the sample rate of the data to filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_biquad_design(
+		struct WAV_biquad_section *section,
+		WAV_BiquadType	type,
+		double		frequency,
+		double		q,
+		double		gain_db,
+		uint32_t	sample_rate
+	);
+
+/**
+ * Set up an empty biquad cascade for num_channels channels.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ * @param num_channels the number of channels of the data to filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_biquad_init(
+		struct WAV_biquad *filter,
+		uint16_t	num_channels
+	);
+
+/**
+ * Append a section to a biquad cascade. Its state starts at zero.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ * @param section a pointer to the coefficients of the section
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_biquad_add_section(
+		struct WAV_biquad *filter,
+		const struct WAV_biquad_section *section
+	);
+
+/**
+ * Append the sections of a Butterworth or Linkwitz-Riley low or high pass
+ * filter of any order to a biquad cascade.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ * @param type WAV_CASCADE_BUTTERWORTH or WAV_CASCADE_LINKWITZ_RILEY
+ * @param pass WAV_BIQUAD_LOW_PASS or WAV_BIQUAD_HIGH_PASS
+ * @param order the order of the filter; must be even for Linkwitz-Riley
+ * @param frequency the cutoff frequency in hertz
+ * @param sample_rate the sample rate of the data to filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_biquad_add_cascade(
+		struct WAV_biquad *filter,
+		WAV_CascadeType	type,
+		WAV_BiquadType	pass,
+		uint32_t	order,
+		double		frequency,
+		uint32_t	sample_rate
+	);
+
+/**
+ * Clear the state of every section, as if no data had been filtered.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ */
+void WAV_biquad_reset(struct WAV_biquad *filter);
+
+/**
+ * Free the sections and state of a biquad cascade.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ */
+void WAV_biquad_free(struct WAV_biquad *filter);
+
+/**
+ * Filter planar float32 data in place, continuing from the state left by
+ * the previous call.
+ *
+ * @param filter a pointer to the WAV_biquad struct
+ * @param planar a pointer to the WAV_planar struct, with as many channels
+ * 		as the filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_biquad_process(
+		struct WAV_biquad *filter,
+		struct WAV_planar *planar
+	);
+
+/**
+ * Apply a biquad cascade to the waveform data of the WAV_file struct.
  *
  * @param wav a pointer to the WAV_file struct
- * @param file_name a pointer to a const char array representing the
- * 		file name
+ * @param filter a pointer to the WAV_biquad struct, with as many channels
+ * 		as the file
  * @return a WAV_State struct representing success or error of the operation
  */
-WAV_State WAV_write_to_file(
-		struct WAV_file *wav,
-		const char	*file_name
+WAV_State WAV_apply_biquad(
+		struct WAV_file	  *wav,
+		struct WAV_biquad *filter
 	);
 
 /**
- * Free the allocated data in a WAV_file struct
+ * Design a linear phase low or high pass FIR filter as a Blackman
+ * windowed sinc, normalized to unity gain in the pass band.
+ *
+ * @param taps an array of num_taps floats to fill
+ * @param num_taps the length of the filter; must be odd. Longer filters
+ * 		give steeper transitions
+ * @param type WAV_FIR_LOW_PASS or WAV_FIR_HIGH_PASS
+ * @param cutoff the cutoff frequency in hertz, below half the sample rate
+ * @param sample_rate the sample rate of the data to filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_fir_design(
+		float		*taps,
+		uint32_t	num_taps,
+		WAV_FirType	type,
+		double		cutoff,
+		uint32_t	sample_rate
+	);
+
+/**
+ * Set up an FIR filter for num_channels channels from any taps. The
+ * output is causal: a linear phase filter delays the signal by
+ * (num_taps - 1) / 2 frames. The transformed taps are cached, so setting
+ * up another filter with the same taps does not transform them again.
+ *
+ * @param fir a pointer to the WAV_fir struct
+ * @param num_channels the number of channels of the data to filter
+ * @param taps the impulse response of the filter
+ * @param num_taps the number of taps, at most 16777216
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_fir_init(
+		struct WAV_fir	*fir,
+		uint16_t	num_channels,
+		const float	*taps,
+		uint32_t	num_taps
+	);
+
+/**
+ * Clear the state of every channel, as if no data had been filtered.
+ *
+ * @param fir a pointer to the WAV_fir struct
+ */
+void WAV_fir_reset(struct WAV_fir *fir);
+
+/**
+ * Free the state of an FIR filter and release its cached kernel.
+ *
+ * @param fir a pointer to the WAV_fir struct
+ */
+void WAV_fir_free(struct WAV_fir *fir);
+
+/**
+ * Filter planar float32 data in place, continuing from the state left by
+ * the previous call.
+ *
+ * @param fir a pointer to the WAV_fir struct
+ * @param planar a pointer to the WAV_planar struct, with as many channels
+ * 		as the filter
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_fir_process(
+		struct WAV_fir	  *fir,
+		struct WAV_planar *planar
+	);
+
+/**
+ * Apply an FIR filter to the waveform data of the WAV_file struct.
  *
  * @param wav a pointer to the WAV_file struct
+ * @param fir a pointer to the WAV_fir struct, with as many channels as
+ * 		the file
+ * @return a WAV_State struct representing success or error of the operation
  */
-void WAV_free(
-		struct WAV_file *wav
+WAV_State WAV_apply_fir(
+		struct WAV_file	*wav,
+		struct WAV_fir	*fir
+	);
+
+/**
+ * Set up a partitioned convolver for num_channels channels. Calls to
+ * WAV_convolver_process can pass any number of frames and get their
+ * output back with no added latency; passing block_frames frames per call
+ * gives the steadiest time per call. The transformed responses are cached
+ * like those of WAV_fir_init.
+ *
+ * @param conv a pointer to the WAV_convolver struct
+ * @param num_channels the number of channels of the data to convolve
+ * @param block_frames the partition size, a power of two from 16 to
+ * 		1048576; usually the block size of the caller
+ * @param irs the impulse responses, either one shared by every channel
+ * 		or one per channel
+ * @param num_irs 1 or num_channels
+ * @param ir_frames the length of each impulse response
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_convolver_init(
+		struct WAV_convolver *conv,
+		uint16_t	num_channels,
+		uint32_t	block_frames,
+		const float *const *irs,
+		uint16_t	num_irs,
+		uint32_t	ir_frames
+	);
+
+/**
+ * Clear the state of every channel, as if no data had been convolved.
+ *
+ * @param conv a pointer to the WAV_convolver struct
+ */
+void WAV_convolver_reset(struct WAV_convolver *conv);
+
+/**
+ * Free the state of a convolver and release its cached responses.
+ *
+ * @param conv a pointer to the WAV_convolver struct
+ */
+void WAV_convolver_free(struct WAV_convolver *conv);
+
+/**
+ * Convolve planar float32 data in place, continuing from the state left
+ * by the previous call.
+ *
+ * @param conv a pointer to the WAV_convolver struct
+ * @param planar a pointer to the WAV_planar struct, with as many channels
+ * 		as the convolver
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_convolver_process(
+		struct WAV_convolver *conv,
+		struct WAV_planar    *planar
+	);
+
+/**
+ * Convolve the waveform data of the WAV_file struct. The output keeps the
+ * length of the input, so the tail of the response past the end is cut.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param conv a pointer to the WAV_convolver struct, with as many
+ * 		channels as the file
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_apply_convolver(
+		struct WAV_file	     *wav,
+		struct WAV_convolver *conv
+	);
+
+/**
+ * Set up an empty effect chain.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param num_channels the number of channels of the data to process
+ * @param sample_rate the sample rate of the data to process
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_init(
+		struct WAV_chain *chain,
+		uint16_t	num_channels,
+		uint32_t	sample_rate
+	);
+
+/**
+ * Append a gain stage to an effect chain. Samples are not clipped, so a
+ * later stage can bring them back down.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param gain a double representing the gain, as a multiplier or in
+ * 		decibels depending on unit
+ * @param unit WAV_GAIN_LINEAR or WAV_GAIN_DB
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_add_gain(
+		struct WAV_chain *chain,
+		double		gain,
+		WAV_GainUnit	unit
+	);
+
+/**
+ * Append a biquad cascade to an effect chain. The chain only keeps a
+ * pointer, so the filter must outlive it.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param filter a pointer to the WAV_biquad struct, with as many channels
+ * 		as the chain
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_add_biquad(
+		struct WAV_chain  *chain,
+		struct WAV_biquad *filter
+	);
+
+/**
+ * Append a DC blocking stage, a first order high pass, to an effect chain.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param cutoff the cutoff frequency in hertz, typically 5 to 20
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_add_dc_removal(
+		struct WAV_chain *chain,
+		double		cutoff
+	);
+
+/**
+ * Append a hard clipping stage to an effect chain.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param ceiling_db the clipping level in decibels below full scale
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_add_clip(
+		struct WAV_chain *chain,
+		double		ceiling_db
+	);
+
+/**
+ * Append a linear fade to an effect chain. A fade in silences everything
+ * before the ramp, a fade out everything after it.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param fade WAV_FADE_IN or WAV_FADE_OUT
+ * @param start_frame the first frame of the ramp, counted from the first
+ * 		frame the chain processes
+ * @param frames the length of the ramp
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_add_fade(
+		struct WAV_chain *chain,
+		WAV_FadeType	fade,
+		uint64_t	start_frame,
+		uint64_t	frames
+	);
+
+/**
+ * Clear the state of every stage and rewind the frame position, as if no
+ * data had been processed.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ */
+void WAV_chain_reset(struct WAV_chain *chain);
+
+/**
+ * Free the stages of an effect chain. Biquad filters added to it are left
+ * to the caller.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ */
+void WAV_chain_free(struct WAV_chain *chain);
+
+/**
+ * Run an effect chain over planar float32 data in place, continuing from
+ * the state left by the previous call.
+ *
+ * @param chain a pointer to the WAV_chain struct
+ * @param planar a pointer to the WAV_planar struct, with as many channels
+ * 		as the chain
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_chain_process(
+		struct WAV_chain  *chain,
+		struct WAV_planar *planar
+	);
+
+/**
+ * Run an effect chain over the waveform data of the WAV_file struct in a
+ * single pass.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param chain a pointer to the WAV_chain struct, with as many channels
+ * 		as the file
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_apply_chain(
+		struct WAV_file	 *wav,
+		struct WAV_chain *chain
+	);
+
+/**
+ * Set up a sample rate converter between two rates. Any ratio works; the
+ * phase table has out_rate / in_rate in lowest terms phases, so rates with
+ * no large common divisor need more memory.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ * @param num_channels the number of channels to convert
+ * @param in_rate the sample rate of the input
+ * @param out_rate the sample rate of the output
+ * @param kernel_length the length of the Kaiser windowed sinc in frames of
+ * 		the lower rate, 16 to 1024, or 0 for WAV_RESAMPLE_DEFAULT_LENGTH.
+ * 		Longer kernels keep more of the band below the lower Nyquist
+ * 		frequency and cost proportionally more.
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_resampler_init(
+		struct WAV_resampler *rs,
+		uint16_t	num_channels,
+		uint32_t	in_rate,
+		uint32_t	out_rate,
+		uint32_t	kernel_length
+	);
+
+/**
+ * Get the most frames one call to WAV_resampler_process can write for
+ * an input of frames frames. WAV_resampler_flush writes at most
+ * WAV_resampler_max_output(rs, 0) frames.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ * @param frames the number of input frames
+ * @return the number of output frames to make room for
+ */
+uint64_t WAV_resampler_max_output(const struct WAV_resampler *rs, uint64_t frames);
+
+/**
+ * Convert a block of planar float32 data, continuing from the history left
+ * by the previous call. Outputs lag the input by half the kernel, so the
+ * last ones come out of WAV_resampler_flush.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ * @param in a pointer to the WAV_planar struct to convert
+ * @param out a pointer to a WAV_planar struct with room for at least
+ * 		WAV_resampler_max_output(rs, in->frames) frames
+ * @param out_frames set to the number of frames written to out
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_resampler_process(
+		struct WAV_resampler	*rs,
+		const struct WAV_planar	*in,
+		struct WAV_planar	*out,
+		uint64_t		*out_frames
+	);
+
+/**
+ * Write the outputs still held back at the end of the input, so that
+ * in_frames input frames give ceil(in_frames * out_rate / in_rate) output
+ * frames in total. Call WAV_resampler_reset before converting another
+ * signal.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ * @param out a pointer to a WAV_planar struct with room for at least
+ * 		WAV_resampler_max_output(rs, 0) frames
+ * @param out_frames set to the number of frames written to out
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_resampler_flush(
+		struct WAV_resampler *rs,
+		struct WAV_planar    *out,
+		uint64_t	     *out_frames
+	);
+
+/**
+ * Clear the history of every channel, as if no data had been converted.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ */
+void WAV_resampler_reset(struct WAV_resampler *rs);
+
+/**
+ * Free the phase table and history of a sample rate converter.
+ *
+ * @param rs a pointer to the WAV_resampler struct
+ */
+void WAV_resampler_free(struct WAV_resampler *rs);
+
+/**
+ * Convert the waveform data of the WAV_file struct to a new sample rate.
+ * The channels are converted in parallel, and the sample rate, byte rate
+ * and the data and RIFF sizes are updated to match.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param sample_rate the new sample rate
+ * @param kernel_length the length of the kernel in frames of the lower
+ * 		rate, or 0 for WAV_RESAMPLE_DEFAULT_LENGTH
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_resample(
+		struct WAV_file *wav,
+		uint32_t	sample_rate,
+		uint32_t	kernel_length
+	);
+
+/**
+ * Convert the waveform data of the WAV_file struct to a new bit depth and
+ * channel count in a single pass, updating the fmt chunk and the data and
+ * RIFF sizes. The data is rewritten in place when the new frames are no
+ * larger. Narrowing the bit depth rounds to nearest, saturating at full
+ * scale.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param bits_per_sample the new bit depth: 8, 16, 24 or 32
+ * @param num_channels the new number of channels
+ * @param matrix num_channels rows of wav->fmt.num_channels gains, so
+ * 		output channel o is the sum of matrix[o * in + i] times input
+ * 		channel i; or NULL for a standard mix: mono goes to both sides
+ * 		of stereo, quad, 5.1 and 7.1 fold down to stereo with the
+ * 		ITU-R BS.775 -3 dB gains and to mono as the average of that,
+ * 		and other layouts keep the channels they have in common
+ * @param dither WAV_DITHER_TPDF to add +-1 LSB of triangular noise of the
+ * 		new depth before rounding, or WAV_DITHER_NONE
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_convert_format(
+		struct WAV_file *wav,
+		uint16_t	bits_per_sample,
+		uint16_t	num_channels,
+		const float	*matrix,
+		WAV_Dither	dither
+	);
+
+/**
+ * Write a binaural wave to the waveform data of the WAV_file struct.
+ * This will replace any existing waveform data.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param frequency1 a double representing the frequency of the binaural
+ * 		wave in hertz for even sound channels
+ * @param frequency2 a double representing the frequency of the binaural
+ * 		wave in hertz for odd sound channels
+ * @param duration a unsigned 32-bit integer representing the duration
+ * 		of the binaural wave in seconds
+ * @param db a double representing the max decibel level of the
+ * 		binaural wave
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_binaural_wave(
+		struct WAV_file *wav,
+		const double 	frequency1,
+		const double 	frequency2,
+		const uint32_t 	duration,
+		float 		db 
+	);
+
+/**
+ * Write a multitone signal, the sum of up to WAV_MAX_PARTIALS sine
+ * partials, to every channel of the waveform data of the WAV_file struct.
+ * This will replace any existing waveform data. Samples beyond full scale
+ * are clipped, so the amplitudes should leave room for the crest factor
+ * of their phases.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param partials the frequency, amplitude and phase of each partial
+ * @param num_partials the number of partials, 1 to WAV_MAX_PARTIALS
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the gain in decibels applied to every amplitude, 0 or less
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_multitone(
+		struct WAV_file			*wav,
+		const struct WAV_partial	*partials,
+		uint16_t			num_partials,
+		double				duration,
+		float				db
+	);
+
+/**
+ * Write a sine wave of its own frequency to each channel of the waveform
+ * data of the WAV_file struct. This will replace any existing waveform
+ * data.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param frequencies the frequency in hertz of each channel, one per
+ * 		channel of the format
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the max decibel level of the waves
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_channel_tones(
+		struct WAV_file *wav,
+		const double	*frequencies,
+		double		duration,
+		float		db
+	);
+
+/**
+ * Write a sine sweep from start_frequency to end_frequency over the whole
+ * duration to every channel of the waveform data of the WAV_file struct.
+ * This will replace any existing waveform data.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param type the frequency law; log sweeps need frequencies above 0
+ * @param start_frequency the frequency at the first frame in hertz
+ * @param end_frequency the frequency at the end in hertz
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the max decibel level of the sweep
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_sweep(
+		struct WAV_file *wav,
+		WAV_SweepType	type,
+		double		start_frequency,
+		double		end_frequency,
+		double		duration,
+		float		db
+	);
+
+/**
+ * Write noise to every channel of the waveform data of the WAV_file
+ * struct. This will replace any existing waveform data. The noise is a
+ * pure function of the seed, the channel and the frame, so the same seed
+ * always gives the same samples, whatever the number of threads.
+ * Channels are independent of each other.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param type the spectrum of the noise
+ * @param seed the seed of the random number generator
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the RMS level in decibels relative to full scale, 0 or
+ * 		less; peaks beyond full scale are clipped
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_noise(
+		struct WAV_file *wav,
+		WAV_NoiseType	type,
+		uint64_t	seed,
+		double		duration,
+		float		db
+	);
+
+/**
+ * Read the contents of an existing .wav file into a WAV_file struct
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_read_file(
+		struct WAV_file *wav,
+		const char 	*file_name
+	);
+
+/**
+ * Map an existing .wav file into memory instead of reading it. The data
+ * buffer and every EXTRA_chunk buffer point straight into the mapping, so
+ * nothing is copied up front and only the pages that are touched get read.
+ * The mapping is released by WAV_free.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @param mode WAV_MAP_READ_ONLY for analysis, where an edit of the sound
+ * 		data first copies it to the heap, WAV_MAP_PRIVATE for
+ * 		copy-on-write edits, or WAV_MAP_SHARED to edit the file in place
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_open_mapped(
+		struct WAV_file *wav,
+		const char 	*file_name,
+		WAV_MapMode	mode
+	);
+
+/**
+ * Open an existing .wav file without reading any chunk payloads. Only the
+ * chunk headers and the fmt chunk are read; the offset and size of every
+ * chunk is recorded in wav->source.index. The data buffer and EXTRA_chunk
+ * buffers stay NULL until first accessed through WAV_get_data,
+ * WAV_get_chunk or any function that needs them. The file stays open
+ * until WAV_free.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_open_lazy(
+		struct WAV_file *wav,
+		const char 	*file_name
+	);
+
+/**
+ * Same as WAV_open_lazy, but opens the file for reading and writing so
+ * WAV_write_frames can update the sound data in place
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_open_lazy_rw(
+		struct WAV_file *wav,
+		const char 	*file_name
+	);
+
+/**
+ * Read a range of interleaved frames. Frames still on disk in a lazily
+ * opened file are read with a single pread at the offset of the data chunk
+ * without loading the rest of the file; otherwise they are copied from the
+ * waveform data in memory.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param first_frame index of the first frame to read
+ * @param count the maximum number of frames to read
+ * @param dst destination of at least count * fmt.block_align bytes
+ * @return the number of frames read; fewer than count at the end of
+ * 		the data, 0 on error
+ */
+uint64_t WAV_read_frames(
+		struct WAV_file *wav,
+		uint64_t	first_frame,
+		uint64_t	count,
+		unsigned char	*dst
+	);
+
+/**
+ * Overwrite a range of interleaved frames. Frames still on disk in a file
+ * opened with WAV_open_lazy_rw are written with a single pwrite; otherwise
+ * the waveform data in memory is updated. The data chunk never grows.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param first_frame index of the first frame to write
+ * @param count the number of frames to write
+ * @param src source of count * fmt.block_align bytes
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_frames(
+		struct WAV_file     *wav,
+		uint64_t	    first_frame,
+		uint64_t	    count,
+		const unsigned char *src
+	);
+
+/**
+ * Get the waveform data of a WAV_file struct, loading it first if the
+ * file was opened with WAV_open_lazy
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @return a pointer to wav->data.buff, or NULL if it could not be loaded
+ */
+unsigned char *WAV_get_data(
+		struct WAV_file *wav
+	);
+
+/**
+ * Find the first EXTRA_chunk with the given id, loading its payload first
+ * if the file was opened with WAV_open_lazy
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param id the four ascii letters of the chunk id, e.g. "LIST"
+ * @return a pointer to the EXTRA_chunk, or NULL if there is none or it
+ * 		could not be loaded
+ */
+struct EXTRA_chunk *WAV_get_chunk(
+		struct WAV_file *wav,
+		const char	*id
+	);
+
+/**
+ * Write the contents of an existing WAV_file struct to a new .wav file
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_to_file(
+		struct WAV_file *wav,
+		const char	*file_name
+	);
+
+/**
+ * Same as WAV_write_to_file, but bypasses the page cache with O_DIRECT.
+ * Page aligned runs of the waveform data are written straight from
+ * wav->data.buff; unaligned parts go through an aligned bounce buffer.
+ * Falls back to WAV_write_to_file where O_DIRECT is not supported.
+ *
+ * @param wav a pointer to the WAV_file struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_write_to_file_direct(
+		struct WAV_file *wav,
+		const char	*file_name
+	);
+
+/**
+ * Replace the payload of a chunk of an existing .wav file without rewriting
+ * the sound data. The chunk is rewritten in place when the new payload fits
+ * in its old space plus any JUNK chunk right after it, with the leftover
+ * turned into a JUNK chunk. Otherwise the old chunk becomes JUNK and the new
+ * one is appended to the end of the file, and the RIFF size is patched.
+ * Chunks that do not exist yet are appended. The fmt, data and ds64
+ * chunks cannot be updated this way.
+ *
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @param id the four ascii letters of the chunk id, e.g. "LIST"
+ * @param bytes the new payload of the chunk
+ * @param len the size of the new payload in bytes
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_update_chunk(
+		const char	    *file_name,
+		const char	    *id,
+		const unsigned char *bytes,
+		uint32_t	    len
+	);
+
+/**
+ * Free the allocated data in a WAV_file struct
+ *
+ * @param wav a pointer to the WAV_file struct
+ */
+void WAV_free(
+		struct WAV_file *wav
+	);
+
+/*
+ * ----------------------------------------
+ *
+ * 		WAV STREAM FUNCTIONS
+ *
+ * ----------------------------------------
+ */
+
+/**
+ * Open an existing .wav file for reading frames block by block.
+ * Stops parsing at the data chunk without reading any sound data.
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_open(
+		struct WAV_stream *stream,
+		const char 	  *file_name
+	);
+
+/**
+ * Create a new .wav file to be written frames block by block.
+ * The RIFF and data chunk sizes are patched when the stream is closed.
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @param file_name a pointer to a const char array representing the
+ * 		file name
+ * @param num_channels the number of audio channels
+ * @param sample_rate the number of samples per second
+ * @param bits_per_sample the number of bits per sample
+ * 		(should be a multiple of 8)
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_create(
+		struct WAV_stream *stream,
+		const char 	  *file_name,
+		const uint16_t    num_channels,
+		const uint32_t    sample_rate,
+		const uint16_t    bits_per_sample
+	);
+
+/**
+ * Read up to frames interleaved frames from a stream opened for reading
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @param buff destination of at least frames * fmt.block_align bytes
+ * @param frames the maximum number of frames to read
+ * @return the number of frames read; 0 at the end of the data chunk or on error
+ */
+uint64_t WAV_stream_read_frames(
+		struct WAV_stream *stream,
+		unsigned char     *buff,
+		uint64_t	  frames
+	);
+
+/**
+ * Append interleaved frames to a stream opened for writing
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @param buff source of frames * fmt.block_align bytes
+ * @param frames the number of frames to write
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_write_frames(
+		struct WAV_stream   *stream,
+		const unsigned char *buff,
+		uint64_t	    frames
+	);
+
+/**
+ * Move the read position of a stream opened for reading
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @param frame the index of the next frame to be read
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_seek(
+		struct WAV_stream *stream,
+		uint64_t	  frame
+	);
+
+/**
+ * Close a stream. Streams opened for writing get their RIFF and data
+ * chunk sizes patched first.
+ *
+ * @param stream a pointer to the WAV_stream struct
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_close(
+		struct WAV_stream *stream
+	);
+
+/**
+ * Operation applied in place to each block of interleaved frames by
+ * WAV_stream_process. Blocks are passed in file order from a single thread.
+ *
+ * @param buff the frames of the block
+ * @param frames the number of frames in the block
+ * @param fmt the format of the frames
+ * @param ctx the pointer passed to WAV_stream_process
+ */
+typedef void (*WAV_block_fn)(
+		unsigned char 		*buff,
+		uint64_t		frames,
+		const struct FMT_chunk	*fmt,
+		void			*ctx
+	);
+
+/**
+ * Apply an operation to every block of a .wav file. A reader thread fills
+ * blocks ahead of the operation and a writer thread drains the results, so
+ * disk I/O and processing overlap. The working buffer is split into
+ * WAV_PIPELINE_BLOCKS blocks.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write, or NULL to only read (for
+ * 		analysis operations)
+ * @param fn the operation applied to each block
+ * @param ctx passed through to fn
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_process(
+		const char	*in_file_name,
+		const char	*out_file_name,
+		WAV_block_fn	fn,
+		void		*ctx,
+		uint64_t	buffer_size
+	);
+
+/**
+ * Normalize a .wav file to a new maximum decibel value, writing the result
+ * to a new file. Uses two passes over the input and a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param db a double representing the new max decible level.
+ * 		If it is over 0.0f it will be set to 0.0f
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_normalize_max_db(
+		const char *in_file_name,
+		const char *out_file_name,
+		double	   db,
+		uint64_t   buffer_size
+	);
+
+/**
+ * Apply a low pass filter to a .wav file, writing the result to a new file
+ * using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param cutoff the cutoff frequency
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_low_pass_filter(
+		const char *in_file_name,
+		const char *out_file_name,
+		float	   cutoff,
+		uint64_t   buffer_size
+	);
+
+/**
+ * Apply a high pass filter to a .wav file, writing the result to a new file
+ * using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param cutoff the cutoff frequency
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_high_pass_filter(
+		const char *in_file_name,
+		const char *out_file_name,
+		float	   cutoff,
+		uint64_t   buffer_size
+	);
+
+/**
+ * Apply a biquad cascade to a .wav file, writing the result to a new file
+ * using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param filter a pointer to the WAV_biquad struct, with as many channels
+ * 		as the file
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_biquad(
+		const char	  *in_file_name,
+		const char	  *out_file_name,
+		struct WAV_biquad *filter,
+		uint64_t	  buffer_size
+	);
+
+/**
+ * Apply an FIR filter to a .wav file, writing the result to a new file
+ * using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param fir a pointer to the WAV_fir struct, with as many channels as
+ * 		the file
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_fir(
+		const char	*in_file_name,
+		const char	*out_file_name,
+		struct WAV_fir	*fir,
+		uint64_t	buffer_size
+	);
+
+/**
+ * Convolve a .wav file, writing the result to a new file using a fixed
+ * size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param conv a pointer to the WAV_convolver struct, with as many
+ * 		channels as the file
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_convolver(
+		const char	     *in_file_name,
+		const char	     *out_file_name,
+		struct WAV_convolver *conv,
+		uint64_t	     buffer_size
+	);
+
+/**
+ * Run an effect chain over a .wav file, writing the result to a new file
+ * using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param chain a pointer to the WAV_chain struct, with as many channels
+ * 		as the file
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_apply_chain(
+		const char	 *in_file_name,
+		const char	 *out_file_name,
+		struct WAV_chain *chain,
+		uint64_t	 buffer_size
+	);
+
+/**
+ * Convert a .wav file to a new sample rate, writing the result to a new
+ * file using a fixed size buffer.
+ *
+ * @param in_file_name the file to read
+ * @param out_file_name the file to write
+ * @param sample_rate the sample rate of the new file
+ * @param kernel_length the length of the kernel in frames of the lower
+ * 		rate, or 0 for WAV_RESAMPLE_DEFAULT_LENGTH
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_resample(
+		const char	*in_file_name,
+		const char	*out_file_name,
+		uint32_t	sample_rate,
+		uint32_t	kernel_length,
+		uint64_t	buffer_size
+	);
+
+/**
+ * Write a sin wave to a new .wav file using a fixed size buffer, so the
+ * length of the signal is not limited by memory. Each block of the buffer
+ * is rendered on the thread pool while earlier blocks are written, and the
+ * samples are the same as from WAV_write_sin_wave.
+ *
+ * @param file_name the file to write
+ * @param num_channels the number of channels, each playing the wave
+ * @param sample_rate the sample rate in hertz
+ * @param bits_per_sample the bit depth, 8, 16, 24 or 32
+ * @param frequency the frequency of the sin wave in hertz
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the max decibel level of the sin wave
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_write_sin_wave(
+		const char	*file_name,
+		uint16_t	num_channels,
+		uint32_t	sample_rate,
+		uint16_t	bits_per_sample,
+		double		frequency,
+		double		duration,
+		float		db,
+		uint64_t	buffer_size
+	);
+
+/**
+ * Write a binaural wave to a new .wav file using a fixed size buffer, as
+ * WAV_stream_write_sin_wave. Even channels play frequency1 and odd
+ * channels play frequency2.
+ *
+ * @param file_name the file to write
+ * @param num_channels the number of channels
+ * @param sample_rate the sample rate in hertz
+ * @param bits_per_sample the bit depth, 8, 16, 24 or 32
+ * @param frequency1 the frequency of the even channels in hertz
+ * @param frequency2 the frequency of the odd channels in hertz
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the max decibel level of the wave
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_write_binaural_wave(
+		const char	*file_name,
+		uint16_t	num_channels,
+		uint32_t	sample_rate,
+		uint16_t	bits_per_sample,
+		double		frequency1,
+		double		frequency2,
+		double		duration,
+		float		db,
+		uint64_t	buffer_size
+	);
+
+/**
+ * Write noise to a new .wav file using a fixed size buffer, as
+ * WAV_stream_write_sin_wave. The samples are the same as from
+ * WAV_write_noise with the same seed.
+ *
+ * @param file_name the file to write
+ * @param num_channels the number of channels
+ * @param sample_rate the sample rate in hertz
+ * @param bits_per_sample the bit depth, 8, 16, 24 or 32
+ * @param type the spectrum of the noise
+ * @param seed the seed of the random number generator
+ * @param duration the duration in seconds, rounded to the nearest frame
+ * @param db the RMS level in decibels relative to full scale, 0 or less
+ * @param buffer_size the working buffer in bytes, or 0 for
+ * 		WAV_STREAM_DEFAULT_BUFFER
+ * @return a WAV_State struct representing success or error of the operation
+ */
+WAV_State WAV_stream_write_noise(
+		const char	*file_name,
+		uint16_t	num_channels,
+		uint32_t	sample_rate,
+		uint16_t	bits_per_sample,
+		WAV_NoiseType	type,
+		uint64_t	seed,
+		double		duration,
+		float		db,
+		uint64_t	buffer_size
 	);
 
 #ifdef __cplusplus
@@ -1,18 +1,351 @@
+#define _GNU_SOURCE
+
 #include "WavReader.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Returns 1 if buff lives inside the file mapping of wav rather than on the heap
+static int is_mapped(const struct WAV_file *wav, const unsigned char *buff)
+{
+	return wav->source.map != NULL
+		&& buff >= wav->source.map
+		&& buff <  wav->source.map + wav->source.map_size;
+}
+
+// Release a chunk buffer of wav, leaving buffers owned by the file mapping alone
+static void free_buff(struct WAV_file *wav, unsigned char *buff)
+{
+	if (buff != NULL && !is_mapped(wav, buff)) free(buff);
+}
+
+// Record a chunk in the index of wav; the array grows by doubling
+static WAV_State index_chunk(struct WAV_file *wav, const unsigned char *id, uint64_t offset, uint64_t size)
+{
+	const uint32_t count = wav->source.index_count;
+
+	if ((count & (count - 1)) == 0) {
+		const uint32_t capacity = count == 0 ? 8 : count * 2;
+
+		if (count == 0 || count >= 8) {
+			struct WAV_chunk_info *index = (struct WAV_chunk_info*)realloc(
+					wav->source.index,
+					sizeof(struct WAV_chunk_info) * capacity
+				);
+
+			if (index == NULL) return Error;
+
+			wav->source.index = index;
+		}
+	}
+
+	struct WAV_chunk_info *info = &wav->source.index[count];
+
+	memcpy(info->id, id, sizeof(info->id));
+	info->offset = offset;
+	info->size = size;
 
-// Union to hold sample bytes and interpret "dynamically"
-union SampleUnion {
-	int8_t  i8;
-	int16_t i16;
-	int32_t i24;
-	int32_t i32;
+	wav->source.index_count++;
+
+	return Success;
+}
+
+/*
+ * Chunk arena
+ *
+ * Small requests are served from ARENA_BLOCK_SIZE blocks; a request larger
+ * than a quarter block gets a block of its own, linked behind the one being
+ * filled so that one keeps filling. Nothing is freed on its own: WAV_free
+ * releases every block at once.
+ */
+
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+#define ARENA_ALIGN		16
+
+struct WAV_arena_block {
+	struct WAV_arena_block	*next;
+	size_t			used;
+	size_t			size;
+	unsigned char		data[] __attribute__((aligned(ARENA_ALIGN)));
 };
 
+struct WAV_chunk_slot {
+	uint32_t		id;		// the four id bytes as a little endian integer
+	struct EXTRA_chunk	*first;		// NULL for an empty slot
+	struct EXTRA_chunk	*last;
+};
+
+static void *arena_alloc(struct WAV_chunk_arena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	struct WAV_arena_block *block = arena->blocks;
+
+	if (block != NULL && block->size - block->used >= size) {
+		void *ptr = block->data + block->used;
+		block->used += size;
+		return ptr;
+	}
+
+	const int own = size > ARENA_BLOCK_SIZE / 4;
+	const size_t capacity = own ? size : ARENA_BLOCK_SIZE;
+
+	struct WAV_arena_block *fresh = (struct WAV_arena_block*)malloc(sizeof(struct WAV_arena_block) + capacity);
+
+	if (fresh == NULL) {
+		perror("Could not alloc chunk arena block.\n");
+		return NULL;
+	}
+
+	fresh->size = capacity;
+	fresh->used = size;
+
+	if (own && block != NULL) {
+		fresh->next = block->next;
+		block->next = fresh;
+	} else {
+		fresh->next = block;
+		arena->blocks = fresh;
+	}
+
+	return fresh->data;
+}
+
+static void arena_release(struct WAV_chunk_arena *arena)
+{
+	while (arena->blocks != NULL) {
+		struct WAV_arena_block *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	memset(arena, 0, sizeof(*arena));
+}
+
+static uint32_t fourcc(const unsigned char *id)
+{
+	uint32_t val;
+	memcpy(&val, id, sizeof(val));
+	return val;
+}
+
+// The slot holding id, or the empty slot it would take. Linear probing from
+// a multiplicative hash; the table is never more than half full.
+static struct WAV_chunk_slot *chunk_slot(const struct WAV_chunk_arena *arena, uint32_t id)
+{
+	const uint32_t mask = arena->num_slots - 1;
+	const int shift = 32 - __builtin_ctz(arena->num_slots);
+
+	for (uint32_t i = (id * 0x9E3779B1u) >> shift; ; i = (i + 1) & mask) {
+		struct WAV_chunk_slot *slot = &arena->slots[i];
+
+		if (slot->first == NULL || slot->id == id) return slot;
+	}
+}
+
+// Make room for one more id, doubling the table once it is half full. The
+// old table stays in the arena until it is released.
+static WAV_State chunk_table_reserve(struct WAV_chunk_arena *arena)
+{
+	if (2 * (arena->num_ids + 1) <= arena->num_slots) return Success;
+
+	const struct WAV_chunk_slot *old = arena->slots;
+	const uint32_t old_count = arena->num_slots;
+	const uint32_t count = old_count > 0 ? old_count * 2 : 16;
+
+	struct WAV_chunk_slot *slots = (struct WAV_chunk_slot*)arena_alloc(arena, count * sizeof(struct WAV_chunk_slot));
+
+	if (slots == NULL) return Error;
+
+	memset(slots, 0, count * sizeof(struct WAV_chunk_slot));
+
+	arena->slots = slots;
+	arena->num_slots = count;
+
+	for (uint32_t i = 0; i < old_count; ++i) {
+		if (old[i].first != NULL) *chunk_slot(arena, old[i].id) = old[i];
+	}
+
+	return Success;
+}
+
+// First chunk of wav with the given id, or NULL
+static struct EXTRA_chunk *find_EXTRA_chunk(const struct WAV_file *wav, const unsigned char *id)
+{
+	if (wav->chunks.num_slots == 0) return NULL;
+
+	return chunk_slot(&wav->chunks, fourcc(id))->first;
+}
+
+// Append a new EXTRA_chunk to the list of wav and the chain of its id. buff
+// may be NULL for payloads that are loaded from offset in the source file later
+static struct EXTRA_chunk *append_EXTRA_chunk(
+		struct WAV_file *wav,
+		const unsigned char *chunk_id,
+		unsigned char *buff,
+		uint32_t size,
+		uint64_t offset)
+{
+	struct WAV_chunk_arena *arena = &wav->chunks;
+
+	if (chunk_table_reserve(arena) == Error) return NULL;
+
+	struct EXTRA_chunk *extra = (struct EXTRA_chunk*)arena_alloc(arena, sizeof(struct EXTRA_chunk));
+
+	if (extra == NULL) return NULL;
+
+	memcpy(extra->id, chunk_id, sizeof(extra->id));
+	extra->size = size;
+	extra->buff = buff;
+	extra->offset = offset;
+	extra->next = NULL;
+	extra->next_of_id = NULL;
+
+	if (arena->tail == NULL) {
+		wav->extra = extra;
+	} else {
+		arena->tail->next = extra;
+	}
+
+	arena->tail = extra;
+
+	struct WAV_chunk_slot *slot = chunk_slot(arena, fourcc(chunk_id));
+
+	if (slot->first == NULL) {
+		slot->id = fourcc(chunk_id);
+		slot->first = extra;
+		arena->num_ids++;
+	} else {
+		slot->last->next_of_id = extra;
+	}
+
+	slot->last = extra;
+
+	return extra;
+}
+
+// pread until size bytes arrive; payloads are read without going through
+// the stdio buffer of the source file so pwrites are always seen
+static WAV_State pread_full(int fd, unsigned char *buff, uint64_t size, uint64_t offset)
+{
+	while (size > 0) {
+		const ssize_t ret = pread(fd, buff, size, offset);
+
+		if (ret <= 0) return Error;
+
+		buff += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return Success;
+}
+
+static WAV_State pwrite_full(int fd, const unsigned char *buff, uint64_t size, uint64_t offset)
+{
+	while (size > 0) {
+		const ssize_t ret = pwrite(fd, buff, size, offset);
+
+		if (ret <= 0) return Error;
+
+		buff += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return Success;
+}
+
+// Read size bytes at offset of the source file into a new heap buffer
+static unsigned char *load_payload(struct WAV_file *wav, uint64_t offset, uint64_t size)
+{
+	if (wav->source.file == NULL) return NULL;
+
+	unsigned char *buff = (unsigned char*)malloc(size > 0 ? size : 1);
+
+	if (buff == NULL) {
+		perror("Could not alloc chunk buffer.\n");
+		return NULL;
+	}
+
+	if (pread_full(fileno(wav->source.file), buff, size, offset) == Error) {
+		perror("Could not read chunk from WAV file.\n");
+		free(buff);
+		return NULL;
+	}
+
+	return buff;
+}
+
+// Load the sound data of a lazily opened file on first use
+static WAV_State load_DATA_chunk(struct WAV_file *wav)
+{
+	if (wav->data.buff != NULL) return Success;
+	if (wav->source.file == NULL) return Error;
+
+	wav->data.buff = load_payload(wav, wav->source.data_offset, wav->data.size);
+
+	return wav->data.buff != NULL ? Success : Error;
+}
+
+// Make the loaded sound data of wav safe to change in place. Data mapped
+// read only is copied to the heap first, so edits stay in memory as with a
+// private mapping.
+static WAV_State writable_DATA_chunk(struct WAV_file *wav)
+{
+	if (!is_mapped(wav, wav->data.buff) || wav->source.map_mode != WAV_MAP_READ_ONLY) return Success;
+
+	unsigned char *buff = (unsigned char*)malloc(wav->data.size > 0 ? wav->data.size : 1);
+
+	if (buff == NULL) {
+		perror("Could not alloc sound data buffer.\n");
+		return Error;
+	}
+
+	memcpy(buff, wav->data.buff, wav->data.size);
+	wav->data.buff = buff;
+
+	return Success;
+}
+
+// Load the payload of an EXTRA_chunk of a lazily opened file on first use
+static WAV_State load_EXTRA_chunk(struct WAV_file *wav, struct EXTRA_chunk *extra)
+{
+	if (extra->buff != NULL) return Success;
+	if (wav->source.file == NULL) return Error;
+
+	unsigned char *buff = (unsigned char*)arena_alloc(&wav->chunks, extra->size > 0 ? extra->size : 1);
+
+	if (buff == NULL) return Error;
+
+	if (pread_full(fileno(wav->source.file), buff, extra->size, extra->offset) == Error) {
+		perror("Could not read chunk from WAV file.\n");
+		return Error;
+	}
+
+	extra->buff = buff;
+
+	return Success;
+}
+
 void WAV_init(
 		struct WAV_file *wav,
 		const uint16_t num_channels,
@@ -53,8 +386,8 @@ void WAV_init(
 void WAV_print(struct WAV_file *wav)
 {
 	printf("RIFF_CHUNK:\n");
-	printf("-- id: RIFF\n");
-	printf("-- size: %d\n", wav->riff.size);
+	printf("-- id: %.4s\n", wav->riff.id);
+	printf("-- size: %" PRIu64 "\n", wav->riff.size);
 	printf("-- format: WAVE\n");
 
 	printf("FMT_CHUNK:\n");
@@ -62,14 +395,14 @@ void WAV_print(struct WAV_file *wav)
 	printf("-- size: %u\n", wav->fmt.size);
 	printf("-- audio_format: %hu\n", wav->fmt.audio_format);
 	printf("-- num_channels: %hu\n", wav->fmt.num_channels);
-	printf("-- sample_rate: %hu\n", wav->fmt.sample_rate);
-	printf("-- byte_rate: %hu\n", wav->fmt.byte_rate);
+	printf("-- sample_rate: %u\n", wav->fmt.sample_rate);
+	printf("-- byte_rate: %u\n", wav->fmt.byte_rate);
 	printf("-- block_align: %hu\n", wav->fmt.block_align);
 	printf("-- bits_per_sample: %hu\n", wav->fmt.bits_per_sample);
 
 	printf("DATA_CHUNK\n");
 	printf("-- id: data\n");
-	printf("-- size: %d\n", wav->data.size);
+	printf("-- size: %" PRIu64 "\n", wav->data.size);
 
 	struct EXTRA_chunk *extra = wav->extra;
 
@@ -82,7 +415,7 @@ void WAV_print(struct WAV_file *wav)
 
 		printf("EXTRA_CHUNK:\n");
 		printf("-- id: %s\n", buff);
-		printf("-- size: %d\n", extra->size);
+		printf("-- size: %u\n", extra->size);
 
 		extra = extra->next;
 	}
@@ -92,16 +425,17 @@ void WAV_print_metadata(struct WAV_file *wav)
 {
 	int found = 0;
 
-	struct EXTRA_chunk *metadata_chunk = wav->extra;
+	struct EXTRA_chunk *metadata_chunk = find_EXTRA_chunk(wav, (const unsigned char*)"LIST");
 
 	while (metadata_chunk != NULL) {
-		if (memcmp(metadata_chunk->id,   "LIST", 4) == 0 &&
+		if (load_EXTRA_chunk(wav, metadata_chunk) == Success &&
+		    metadata_chunk->size >= 4 &&
 		    memcmp(metadata_chunk->buff, "INFO", 4) == 0) {
 			found = 1;
 			break;
 		}
 
-		metadata_chunk = metadata_chunk->next;
+		metadata_chunk = metadata_chunk->next_of_id;
 	}
 
 	if (found == 0) {
@@ -125,7 +459,7 @@ void WAV_print_metadata(struct WAV_file *wav)
 
 		if (info_id_sz % 2 == 1) info_id_sz++;	// make even
 
-		printf("-- data (size %d):\n\t", info_id_sz);
+		printf("-- data (size %u):\n\t", info_id_sz);
 
 		// Right now skip stuff like Traktors proprietary data
 		if (memcmp(&buff, "NITR", 4) == 0) {
@@ -133,7 +467,7 @@ void WAV_print_metadata(struct WAV_file *wav)
 			continue;
 		}
 
-		for (int i = 0; i < info_id_sz; ++i) {
+		for (uint32_t i = 0; i < info_id_sz; ++i) {
 			putchar(metadata_chunk->buff[byte_pos]);
 			byte_pos++;
 		}
@@ -144,789 +478,8775 @@ void WAV_print_metadata(struct WAV_file *wav)
 	printf("\n\n");
 }
 
-uint64_t WAV_get_max_amp(struct WAV_file *wav)
+/*
+ * Thread pool
+ *
+ * Stateless passes over the sound data are split into ranges of about
+ * POOL_RANGE_BYTES and handed out to worker threads owned by the library,
+ * with the calling thread taking ranges as well. The ranges do not depend on
+ * the number of threads and reductions combine the per-range results in
+ * range order, so every result is the same whatever the thread count.
+ */
+
+// Sized to stay in a core's L2 cache
+#define POOL_RANGE_BYTES (256 * 1024)
+
+typedef void (*pool_task_fn)(uint64_t index, void *ctx);
+
+struct thread_pool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		// broadcast when a job is posted or the workers must exit
+	pthread_cond_t	done;		// signalled when the last worker leaves a job
+	pthread_t	*threads;
+	unsigned	num_threads;	// workers plus the calling thread
+	int		started;
+	int		shutdown;
+	uint64_t	generation;	// bumped for every job
+	uint64_t	spawn_generation;	// generation the current workers were started at
+	unsigned	busy;		// workers that have not finished the current job
+
+	pool_task_fn	fn;
+	void		*ctx;
+	uint64_t	count;
+	atomic_uint_fast64_t next;	// next task index to hand out
+};
+
+static struct thread_pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+// Held for the whole of a job and while the workers are replaced
+static pthread_mutex_t pool_run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void pool_drain(void)
 {
-	const uint32_t bytes_per_sample = (wav->fmt.bits_per_sample / 8);
+	for (;;) {
+		const uint64_t index = atomic_fetch_add(&pool.next, 1);
+
+		if (index >= pool.count) return;
+
+		pool.fn(index, pool.ctx);
+	}
+}
 
-	int64_t max_amp = 0;
+static void *pool_worker(void *arg)
+{
+	(void)arg;
 
-	union SampleUnion sample;
-	sample.i32 = 0;
+	pthread_mutex_lock(&pool.lock);
 
-	for (int i = 0; i < ( wav->data.size / bytes_per_sample); ++i) {
-		memcpy(&sample, &wav->data.buff[i*bytes_per_sample], bytes_per_sample);
+	uint64_t seen = pool.spawn_generation;
 
-		int64_t t = 0;
-		switch (bytes_per_sample) {
-			case 1:
-				t = sample.i8;
-				break;
-			case 2:
-				t = sample.i16;
-				break;
-			case 3:
-				t = sample.i24;
-				break;
-			case 4:
-				t = sample.i32;
-				break;
+	for (;;) {
+		while (!pool.shutdown && pool.generation == seen) {
+			pthread_cond_wait(&pool.work, &pool.lock);
 		}
 
-		t = llabs(t);
-		if (t > max_amp) max_amp = t;
+		if (pool.shutdown) break;
+
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_drain();
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0) pthread_cond_signal(&pool.done);
 	}
 
-	return max_amp;
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
 }
 
-double WAV_get_max_db(struct WAV_file *wav)
+// Both of these expect pool_run_lock to be held
+static void pool_stop(void)
 {
-	if (wav == NULL) {
-		perror("Error: Cannot get max Db; wav is NULL.\n");
-		return -999.0f;
-	} else if (wav->data.buff == NULL) {
-		perror("Error: Cannot get max Db; wav music data is NULL.\n");
-		return -999.0f;
+	if (!pool.started) return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (unsigned i = 0; i + 1 < pool.num_threads; ++i) {
+		pthread_join(pool.threads[i], NULL);
 	}
-	
-	const int64_t max_amp = WAV_get_max_amp(wav);
 
-	return 20.0f * log10f((double)max_amp / (double)((1 << (wav->fmt.bits_per_sample-1))-1));
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.num_threads = 0;
+	pool.shutdown = 0;
+	pool.started = 0;
 }
 
-WAV_State WAV_normalize_max_db(struct WAV_file *wav, double db)
+static unsigned pool_default_threads(void)
 {
-	if (wav == NULL) return Error;
-	if (wav->data.buff == NULL || wav->data.size == 0) return Error;
-	if (db > 0.0f) db = 0.0f;
-
-	const uint64_t max_amp = WAV_get_max_amp(wav);
-	const int16_t new_max_amp = pow(10, db / 20.0) * (pow(2, wav->fmt.bits_per_sample - 1) - 1);
-	
-	const uint32_t bytes_per_sample = (wav->fmt.bits_per_sample / 8);
-
-	union SampleUnion sample;
-	sample.i32 = 0;
-
-	for (int i = 0; i < ( wav->data.size / bytes_per_sample); ++i) {
-		memcpy(&sample, &wav->data.buff[i*bytes_per_sample], bytes_per_sample);
-
-		int64_t t = 0;
-		switch (bytes_per_sample) {
-			case 1:
-				t = sample.i8;
-				break;
-			case 2:
-				t = sample.i16;
-				break;
-			case 3:
-				t = sample.i24;
-				break;
-			case 4:
-				t = sample.i32;
-				break;
-		}
-
-		const double p = (double)t / (double)max_amp;
-		t = new_max_amp * p;
-		
-		memcpy(&wav->data.buff[i*bytes_per_sample], &t, bytes_per_sample);
-	}
-	
-	return Success;
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (unsigned)cpus : 1;
 }
 
-WAV_State WAV_write_sin_wave(
-        struct WAV_file *wav,
-        const double freq,
-        const uint32_t duration,
-	float db)
+static void pool_start(unsigned num_threads)
 {
-	if (wav == NULL) {
-		return Error;
-	} else if (wav->data.buff != NULL || wav->data.size != 0) {
-		free(wav->data.buff);
-		wav->data.buff = NULL;
-		wav->data.size = 0;
-		wav->riff.size = 36;
-	}
+	if (num_threads == 0) num_threads = pool_default_threads();
 
-	if (db > 0.0f) db = 0.0f;
+	pool.spawn_generation = pool.generation;
+	pool.num_threads = 1;
+	pool.started = 1;
 
-	const uint32_t size =
-		(wav->fmt.bits_per_sample / 8) 
-		* wav->fmt.num_channels
-		* wav->fmt.sample_rate
-		* duration;
+	if (num_threads == 1) return;
 
-	wav->data.size = size;
-	wav->data.buff = (unsigned char*)malloc(sizeof(unsigned char) * size);
-	
-	if (wav->data.buff == NULL) return Error;
+	pool.threads = (pthread_t*)calloc(num_threads - 1, sizeof(pthread_t));
 
-	wav->riff.size = 36 + size;
+	if (pool.threads == NULL) return;
+
+	// Run with whatever could be started
+	while (pool.num_threads < num_threads) {
+		if (pthread_create(&pool.threads[pool.num_threads - 1], NULL, pool_worker, NULL) != 0) break;
+		pool.num_threads++;
+	}
+}
 
-	// -6Db amplitude by default
-	const double amp = pow(10, db / 20.0) * (pow(2, wav->fmt.bits_per_sample - 1) - 1);
-	const double sample_period = 1.0 / wav->fmt.sample_rate;
-	const double ang_freq = 2.0 * M_PI * freq;
-	const uint16_t bytes_per_sample = (wav->fmt.bits_per_sample / 8);
+// Run fn for every index in [0, count) and wait for all of them to finish
+static void pool_run(uint64_t count, pool_task_fn fn, void *ctx)
+{
+	// Single ranges, and jobs posted while another one is running, stay on the calling thread
+	if (count <= 1 || pthread_mutex_trylock(&pool_run_lock) != 0) {
+		for (uint64_t i = 0; i < count; ++i) fn(i, ctx);
+		return;
+	}
+
+	if (!pool.started) pool_start(0);
 
-    	// Loop for the number of samples
-    	for (uint32_t sample_index = 0;
-             sample_index < wav->data.size /  (wav->fmt.num_channels * bytes_per_sample);
-             sample_index++) {
+	if (pool.num_threads <= 1) {
+		pthread_mutex_unlock(&pool_run_lock);
 
-        	const double t = (double)sample_index * sample_period;
-        	const int16_t sample = (int16_t)(amp * sin(ang_freq * t));
+		for (uint64_t i = 0; i < count; ++i) fn(i, ctx);
+		return;
+	}
 
-        	// Loop for each channel
-        	for (uint16_t channel = 0; channel < wav->fmt.num_channels; ++channel) {
-            		const uint32_t channel_index =
-				sample_index * wav->fmt.num_channels + channel;
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.ctx = ctx;
+	pool.count = count;
+	atomic_store(&pool.next, 0);
+	pool.busy = pool.num_threads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
 
-            		// Calculate the byte offsets based on the bit depth and channel
-            		const uint32_t byte_offset = channel_index * bytes_per_sample;
+	pool_drain();
 
-            		// Write the sample bytes to the buffer based on the bit depth
-            		for (uint16_t byte = 0; byte < bytes_per_sample; ++byte) {
-                		wav->data.buff[byte_offset + byte] =
-					(sample >> (byte * 8)) & 0xFF;
-            		}
-        	}
-    	}
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy > 0) pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
 
-    return Success;
+	pthread_mutex_unlock(&pool_run_lock);
 }
 
-WAV_State WAV_write_binaural_wave(
-        struct WAV_file *wav,
-        const double freq1,
-        const double freq2,
-        const uint32_t duration,
-	float db)
+// Items of item_size bytes per range, never less than one
+static uint64_t pool_range_items(uint64_t item_size)
 {
-	if (wav == NULL) {
-		return Error;
-	} else if (wav->data.buff != NULL || wav->data.size != 0) {
-		free(wav->data.buff);
-		wav->data.buff = NULL;
-		wav->data.size = 0;
-		wav->riff.size = 36;
-	}
-
-	if (db > 0.0f) db = 0.0f;
+	const uint64_t items = POOL_RANGE_BYTES / (item_size > 0 ? item_size : 1);
+	return items > 0 ? items : 1;
+}
 
-	const uint32_t size =
-		(wav->fmt.bits_per_sample / 8) 
-		* wav->fmt.num_channels
-		* wav->fmt.sample_rate
-		* duration;
+static uint64_t pool_range_count(uint64_t items, uint64_t range_items)
+{
+	return (items + range_items - 1) / range_items;
+}
 
-	wav->data.size = size;
-	wav->data.buff = (unsigned char*)malloc(sizeof(unsigned char) * size);
-	
-	if (wav->data.buff == NULL) return Error;
+WAV_State WAV_set_num_threads(unsigned num_threads)
+{
+	pthread_mutex_lock(&pool_run_lock);
 
-	wav->riff.size = 36 + size;
+	pool_stop();
+	pool_start(num_threads);
 
-	// -6Db amplitude by default
-	const double amp = pow(10, db / 20.0) * (pow(2, wav->fmt.bits_per_sample - 1) - 1);
-	const double sample_period = 1.0 / wav->fmt.sample_rate;
-	const double ang_freq1 = 2.0 * M_PI * freq1;
-	const double ang_freq2 = 2.0 * M_PI * freq2;
-	const uint16_t bytes_per_sample = (wav->fmt.bits_per_sample / 8);
+	const WAV_State ret = (num_threads == 0 || pool.num_threads == num_threads) ? Success : Error;
 
- 	// Loop for the number of samples
-    	for (uint32_t sample_index = 0;
-             sample_index < wav->data.size /  (wav->fmt.num_channels * bytes_per_sample);
-             sample_index++) {
+	pthread_mutex_unlock(&pool_run_lock);
 
-        	const double t = (double)sample_index * sample_period;
-        	const int16_t sample1 = (int16_t)(amp * sin(ang_freq1 * t));
-        	const int16_t sample2 = (int16_t)(amp * sin(ang_freq2 * t));
+	return ret;
+}
 
-        	// Loop for each channel
-        	for (uint16_t channel = 0; channel < wav->fmt.num_channels; ++channel) {
-            		const uint32_t channel_index =
-				sample_index * wav->fmt.num_channels + channel;
+unsigned WAV_get_num_threads(void)
+{
+	pthread_mutex_lock(&pool_run_lock);
 
-            		// Calculate the byte offsets based on the bit depth and channel
-            		const uint32_t byte_offset = channel_index * bytes_per_sample;
+	// The pool is only started by the first job; report what it would start with
+	const unsigned num_threads = pool.started ? pool.num_threads : pool_default_threads();
 
-            		// Write the sample bytes to the buffer based on the bit depth
-            		for (uint16_t byte = 0; byte < bytes_per_sample; ++byte) {
-                		if (channel % 2 == 0) {
-                    			wav->data.buff[byte_offset + byte] =
-						(sample1 >> (byte * 8)) & 0xFF;
-                		} else {
-                    			wav->data.buff[byte_offset + byte] =
-						(sample2 >> (byte * 8)) & 0xFF;
-                		}
-            		}
-        	}
-    	}
+	pthread_mutex_unlock(&pool_run_lock);
 
-    return Success;
+	return num_threads;
 }
 
-static float uint8_to_float(uint8_t val) {
-    return val / 255.0f;
-}
+/*
+ * Sample kernels
+ *
+ * The peak and statistics loops are generated once per bit depth by
+ * DEFINE_SAMPLE_KERNELS, so every kernel has a fixed sample size and no
+ * per-sample branches; callers look the kernel up once by bytes per sample.
+ * 8-bit samples are unsigned around 128, every other depth is signed.
+ */
+
+typedef uint64_t (*max_amp_fn)(const unsigned char *buff, uint64_t samples);
+typedef float (*max_abs_float_fn)(const unsigned char *buff, uint64_t samples);
+
+// Running statistics of one channel over a range of frames
+struct stats_partial {
+	int64_t  max;
+	int64_t  min;
+	int64_t  sum;
+	double   sumsq;
+	uint64_t clip_count;
+};
+
+typedef void (*stats_fn)(
+		const unsigned char *buff,
+		uint64_t frames,
+		uint16_t num_channels,
+		struct stats_partial *partial
+	);
 
-static int8_t float_to_uint8(float val) {
-    return (uint8_t)fminf(fmaxf(val * 256.0f, 0.0f), 255.0f);
+static inline int32_t load_pcm8(const unsigned char *buff)
+{
+	return (int32_t)buff[0] - 128;
 }
 
-static float int16_to_float(int16_t val) {
-    return val / 32768.0f;
+static inline int32_t load_pcm16(const unsigned char *buff)
+{
+	int16_t val;
+	memcpy(&val, buff, 2);
+	return val;
 }
 
-static int16_t float_to_int16(float val) {
-    return (int16_t)fminf(fmaxf(val * 32768.0f, -32768.0f), 32767.0f);
+static inline int32_t load_pcm24(const unsigned char *buff)
+{
+	// Shift the three bytes to the top of the word, then back down to sign extend
+	return (int32_t)((uint32_t)buff[0] << 8 | (uint32_t)buff[1] << 16 | (uint32_t)buff[2] << 24) >> 8;
 }
 
-static float int24_to_float(int32_t val) {
-    return val / 8388608.0f;
+static inline int64_t load_pcm32(const unsigned char *buff)
+{
+	int32_t val;
+	memcpy(&val, buff, 4);
+	return val;
 }
 
-static int32_t float_to_int24(float val) {
-    return (int32_t)fminf(fmaxf(val * 8388608.0f, -8388608.0f), 8388607.0f);
+static inline void store_pcm8(unsigned char *buff, int64_t val)
+{
+	buff[0] = (val + 128) & 0xFF;
 }
 
-static float int32_to_float(int32_t val) {
-    return (float)val;
+static inline void store_pcm16(unsigned char *buff, int64_t val)
+{
+	const int16_t v = (int16_t)val;
+	memcpy(buff, &v, 2);
 }
 
-static int32_t float_to_int32(float val) {
-    return (int32_t)fminf(fmaxf(val, -2147483648.0f), 2147483647.0f);
+static inline void store_pcm24(unsigned char *buff, int64_t val)
+{
+	buff[0] = val & 0xFF;
+	buff[1] = (val >> 8) & 0xFF;
+	buff[2] = (val >> 16) & 0xFF;
 }
 
-void WAV_apply_low_pass_filter(struct WAV_file *wav, float cutoff)
+static inline void store_pcm32(unsigned char *buff, int64_t val)
 {
-	if (wav == NULL || wav->data.buff == NULL || wav->fmt.num_channels == 0) {
-		return;
+	const int32_t v = (int32_t)val;
+	memcpy(buff, &v, 4);
+}
+
+// TYPE is wide enough to hold the absolute value of any sample of BITS bits
+#define DEFINE_SAMPLE_KERNELS(BITS, TYPE)							\
+	static uint64_t max_amp_pcm##BITS(const unsigned char *buff, uint64_t samples)		\
+	{											\
+		TYPE max_amp = 0;								\
+												\
+		for (uint64_t i = 0; i < samples; ++i) {					\
+			TYPE t = load_pcm##BITS(&buff[i * (BITS / 8)]);				\
+			t = t < 0 ? -t : t;							\
+			max_amp = t > max_amp ? t : max_amp;					\
+		}										\
+												\
+		return (uint64_t)max_amp;							\
+	}											\
+												\
+	/* One fused pass per channel; a range of frames is small enough to stay	\
+	 * in cache while each channel takes its turn over it */			\
+	static void stats_pcm##BITS(								\
+			const unsigned char *buff,						\
+			uint64_t frames,							\
+			uint16_t num_channels,							\
+			struct stats_partial *partial)						\
+	{											\
+		const int64_t lo = -(INT64_C(1) << (BITS - 1));				\
+		const int64_t hi = (INT64_C(1) << (BITS - 1)) - 1;				\
+												\
+		for (uint16_t c = 0; c < num_channels; ++c) {					\
+			struct stats_partial p = {0};						\
+												\
+			for (uint64_t i = 0; i < frames; ++i) {					\
+				const int64_t t =						\
+					load_pcm##BITS(&buff[(i * num_channels + c) * (BITS / 8)]);\
+												\
+				p.max = t > p.max ? t : p.max;					\
+				p.min = t < p.min ? t : p.min;					\
+				p.sum += t;							\
+				p.sumsq += (double)(t * t);					\
+				p.clip_count += (t <= lo) | (t >= hi);				\
+			}									\
+												\
+			partial[c] = p;								\
+		}										\
 	}
 
-	float rc = 1.0f / (cutoff * 2 * M_PI);
-	float dt = 1.0f / (float)wav->fmt.sample_rate;
-	float alpha = dt / (rc + dt);
+DEFINE_SAMPLE_KERNELS(8,  int32_t)
+DEFINE_SAMPLE_KERNELS(16, int32_t)
+DEFINE_SAMPLE_KERNELS(24, int32_t)
+DEFINE_SAMPLE_KERNELS(32, int64_t)
 
-	uint32_t bytes_per_sample = wav->fmt.bits_per_sample / 8;
+// NaN never compares greater, so it is skipped exactly like max_ps does
+static float max_abs_float_scalar(const unsigned char *buff, uint64_t samples)
+{
+	float max_abs = 0.0f;
 
-	float *prev_vals = (float*)malloc(sizeof(float) * wav->fmt.num_channels);
+	for (uint64_t i = 0; i < samples; ++i) {
+		float val;
+		memcpy(&val, &buff[4 * i], 4);
 
-	if (prev_vals == NULL) {
-		return;
+		val = fabsf(val);
+		max_abs = val > max_abs ? val : max_abs;
 	}
 
-	memset(prev_vals, 0, sizeof(float) * wav->fmt.num_channels);
+	return max_abs;
+}
 
-    uint8_t val8 = 0;
-    int16_t val16 = 0;
-    int32_t val24 = 0;
-    int32_t val32 = 0;
+#if defined(__x86_64__) || defined(__i386__)
 
-	// For each channel we should get the first value and save it to the array of prev values
-	for (size_t i = 0; i < wav->fmt.num_channels; ++i) {
-		size_t buff_idx = bytes_per_sample * i;
-		
-		switch (bytes_per_sample) {
-			case 1:
-				val8 = 0;
-				memcpy(&val8, &wav->data.buff[buff_idx], 1);
-				prev_vals[i] = uint8_to_float(val8);
-				break;
-			case 2:
-				val16 = 0;
-				memcpy(&val16, &wav->data.buff[buff_idx], 2);
-				prev_vals[i] = int16_to_float(val16);
-				break;
-			case 3:
-				val24 = 0;
-				memcpy(&val24, &wav->data.buff[buff_idx], 3);
-				val24 &= 0xFFFFFF;
-				prev_vals[i] = int24_to_float(val24);
-				break;
-			case 4:
-				val32 = 0;
-				memcpy(&val32, &wav->data.buff[buff_idx], 4);
-				prev_vals[i] = int32_to_float(val32);
-				break;
-		}
-	}
-
-	for (size_t sample_index = 1;
-	     sample_index < wav->data.size / (wav->fmt.num_channels * bytes_per_sample);
-	     sample_index++) {
-
-		const size_t sample_byte_idx = sample_index * (bytes_per_sample * wav->fmt.num_channels);
-
-		for (uint16_t channel = 0; channel < wav->fmt.num_channels; ++channel) {
-			const size_t buff_idx =  sample_byte_idx + (bytes_per_sample * channel);
-			
-			float sample_val = 0.0f;
-			switch(bytes_per_sample) {
-				case 1:
-					val8 = 0;
-					memcpy(&val8, &wav->data.buff[buff_idx], 1);
-					sample_val = uint8_to_float(val8);
-					break;
-				case 2:
-					val16 = 0;
-					memcpy(&val16, &wav->data.buff[buff_idx], 2);
-					sample_val = int16_to_float(val16);
-					break;
-				case 3:
-					val24 = 0;
-					memcpy(&val24, &wav->data.buff[buff_idx], 3);
-					val24 &= 0xFFFFFF;
-					sample_val = int24_to_float(val24);
-					break;
-				case 4:
-					val32 = 0;
-					memcpy(&val32, &wav->data.buff[buff_idx], 4);
-					sample_val = int32_to_float(val32);
-					break;
-			}
+/*
+ * The integer SIMD kernels keep a running max and min of the signed samples
+ * and only take the absolute value once at the end, so the most negative
+ * sample of each depth needs no special case. Tails go to the scalar kernels.
+ */
 
-			const float filtered_val =
-				alpha
-				* sample_val + (1.0f - alpha) * prev_vals[channel];
-			
-			prev_vals[channel] = filtered_val;
-			
-			switch(bytes_per_sample) {
-				case 1:
-					val8 = float_to_uint8(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val8, 1);
-					break;
-				case 2:
-					val16 = float_to_int16(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val16, 2);
-					break;
-				case 3:
-					val24 = float_to_int24(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val24, 3);
-					break;
-				case 4:
-					val32 = float_to_int32(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val32, 4);
-					break;
-			}
-		}
-	}
+static inline uint64_t peak_of(int64_t max, int64_t min)
+{
+	return (uint64_t)(max > -min ? max : -min);
+}
 
-	free(prev_vals);
-	prev_vals = NULL;
+static inline uint64_t max_u64(uint64_t a, uint64_t b)
+{
+	return a > b ? a : b;
 }
 
-void WAV_apply_high_pass_filter(struct WAV_file *wav, float cutoff)
+// Emulated max/min of signed 32-bit lanes; SSE2 has no pmaxsd
+static inline __m128i max_epi32_sse2(__m128i a, __m128i b)
 {
-	if (wav == NULL || wav->data.buff == NULL || wav->fmt.num_channels == 0) {
-		return;
-	}
+	const __m128i gt = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
 
-	float rc = 1.0f / (cutoff * 2 * M_PI);
-	float dt = 1.0f / (float)wav->fmt.sample_rate;
-	float alpha = rc / (rc + dt);
+static inline __m128i min_epi32_sse2(__m128i a, __m128i b)
+{
+	const __m128i gt = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
 
-	uint32_t bytes_per_sample = wav->fmt.bits_per_sample / 8;
+static uint64_t max_amp_pcm8_sse2(const unsigned char *buff, uint64_t samples)
+{
+	__m128i vmax = _mm_set1_epi8((char)0x80);
+	__m128i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[i]);
+		vmax = _mm_max_epu8(vmax, v);
+		vmin = _mm_min_epu8(vmin, v);
+	}
+
+	uint8_t hi[16], lo[16];
+	_mm_storeu_si128((__m128i*)hi, vmax);
+	_mm_storeu_si128((__m128i*)lo, vmin);
+
+	int64_t max = 0, min = 0;
+	for (int l = 0; l < 16; ++l) {
+		max = hi[l] - 128 > max ? hi[l] - 128 : max;
+		min = lo[l] - 128 < min ? lo[l] - 128 : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm8(&buff[i], samples - i));
+}
+
+static uint64_t max_amp_pcm16_sse2(const unsigned char *buff, uint64_t samples)
+{
+	__m128i vmax = _mm_setzero_si128();
+	__m128i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[2 * i]);
+		vmax = _mm_max_epi16(vmax, v);
+		vmin = _mm_min_epi16(vmin, v);
+	}
+
+	int16_t hi[8], lo[8];
+	_mm_storeu_si128((__m128i*)hi, vmax);
+	_mm_storeu_si128((__m128i*)lo, vmin);
+
+	int64_t max = 0, min = 0;
+	for (int l = 0; l < 8; ++l) {
+		max = hi[l] > max ? hi[l] : max;
+		min = lo[l] < min ? lo[l] : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm16(&buff[2 * i], samples - i));
+}
+
+static uint64_t reduce_epi32_sse2(__m128i vmax, __m128i vmin)
+{
+	int32_t hi[4], lo[4];
+	_mm_storeu_si128((__m128i*)hi, vmax);
+	_mm_storeu_si128((__m128i*)lo, vmin);
+
+	int64_t max = 0, min = 0;
+	for (int l = 0; l < 4; ++l) {
+		max = hi[l] > max ? hi[l] : max;
+		min = lo[l] < min ? lo[l] : min;
+	}
+
+	return peak_of(max, min);
+}
+
+__attribute__((target("ssse3")))
+static uint64_t max_amp_pcm24_ssse3(const unsigned char *buff, uint64_t samples)
+{
+	const __m128i mask = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+
+	__m128i vmax = _mm_setzero_si128();
+	__m128i vmin = vmax;
+
+	// Each load reads 16 bytes for 12 bytes of samples, so stop 6 samples early
+	uint64_t i = 0;
+	for (; i + 6 <= samples; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[3 * i]);
+		const __m128i s = _mm_srai_epi32(_mm_shuffle_epi8(v, mask), 8);
+		vmax = max_epi32_sse2(vmax, s);
+		vmin = min_epi32_sse2(vmin, s);
+	}
+
+	return max_u64(reduce_epi32_sse2(vmax, vmin), max_amp_pcm24(&buff[3 * i], samples - i));
+}
+
+static uint64_t max_amp_pcm32_sse2(const unsigned char *buff, uint64_t samples)
+{
+	__m128i vmax = _mm_setzero_si128();
+	__m128i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[4 * i]);
+		vmax = max_epi32_sse2(vmax, v);
+		vmin = min_epi32_sse2(vmin, v);
+	}
+
+	return max_u64(reduce_epi32_sse2(vmax, vmin), max_amp_pcm32(&buff[4 * i], samples - i));
+}
+
+static float reduce_max_ps_sse2(__m128 vmax)
+{
+	float lanes[4];
+	_mm_storeu_ps(lanes, vmax);
+
+	float max_abs = 0.0f;
+	for (int l = 0; l < 4; ++l) max_abs = lanes[l] > max_abs ? lanes[l] : max_abs;
+
+	return max_abs;
+}
+
+static float max_abs_float_sse2(const unsigned char *buff, uint64_t samples)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 vmax = _mm_setzero_ps();
+
+	uint64_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		const __m128 v = _mm_andnot_ps(sign, _mm_loadu_ps((const float*)&buff[4 * i]));
+		vmax = _mm_max_ps(v, vmax);
+	}
+
+	const float tail = max_abs_float_scalar(&buff[4 * i], samples - i);
+	const float max_abs = reduce_max_ps_sse2(vmax);
+
+	return tail > max_abs ? tail : max_abs;
+}
+
+__attribute__((target("avx2")))
+static uint64_t max_amp_pcm8_avx2(const unsigned char *buff, uint64_t samples)
+{
+	__m256i vmax = _mm256_set1_epi8((char)0x80);
+	__m256i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 32 <= samples; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*)&buff[i]);
+		vmax = _mm256_max_epu8(vmax, v);
+		vmin = _mm256_min_epu8(vmin, v);
+	}
+
+	const __m128i hi = _mm_max_epu8(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+	const __m128i lo = _mm_min_epu8(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+
+	uint8_t h[16], l[16];
+	_mm_storeu_si128((__m128i*)h, hi);
+	_mm_storeu_si128((__m128i*)l, lo);
+
+	int64_t max = 0, min = 0;
+	for (int k = 0; k < 16; ++k) {
+		max = h[k] - 128 > max ? h[k] - 128 : max;
+		min = l[k] - 128 < min ? l[k] - 128 : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm8(&buff[i], samples - i));
+}
+
+__attribute__((target("avx2")))
+static uint64_t max_amp_pcm16_avx2(const unsigned char *buff, uint64_t samples)
+{
+	__m256i vmax = _mm256_setzero_si256();
+	__m256i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*)&buff[2 * i]);
+		vmax = _mm256_max_epi16(vmax, v);
+		vmin = _mm256_min_epi16(vmin, v);
+	}
+
+	const __m128i hi = _mm_max_epi16(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+	const __m128i lo = _mm_min_epi16(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+
+	int16_t h[8], l[8];
+	_mm_storeu_si128((__m128i*)h, hi);
+	_mm_storeu_si128((__m128i*)l, lo);
+
+	int64_t max = 0, min = 0;
+	for (int k = 0; k < 8; ++k) {
+		max = h[k] > max ? h[k] : max;
+		min = l[k] < min ? l[k] : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm16(&buff[2 * i], samples - i));
+}
+
+__attribute__((target("avx2")))
+static uint64_t reduce_epi32_avx2(__m256i vmax, __m256i vmin)
+{
+	const __m128i hi = _mm_max_epi32(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+	const __m128i lo = _mm_min_epi32(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+
+	return reduce_epi32_sse2(hi, lo);
+}
+
+__attribute__((target("avx2")))
+static uint64_t max_amp_pcm24_avx2(const unsigned char *buff, uint64_t samples)
+{
+	const __m256i mask = _mm256_setr_epi8(
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+			-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+		);
+
+	__m256i vmax = _mm256_setzero_si256();
+	__m256i vmin = vmax;
+
+	// The upper lane loads 16 bytes starting 12 bytes in, so stop 10 samples early
+	uint64_t i = 0;
+	for (; i + 10 <= samples; i += 8) {
+		const __m256i v = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&buff[3 * i])),
+				_mm_loadu_si128((const __m128i*)&buff[3 * i + 12]),
+				1
+			);
+		const __m256i s = _mm256_srai_epi32(_mm256_shuffle_epi8(v, mask), 8);
+		vmax = _mm256_max_epi32(vmax, s);
+		vmin = _mm256_min_epi32(vmin, s);
+	}
+
+	return max_u64(reduce_epi32_avx2(vmax, vmin), max_amp_pcm24(&buff[3 * i], samples - i));
+}
+
+__attribute__((target("avx2")))
+static uint64_t max_amp_pcm32_avx2(const unsigned char *buff, uint64_t samples)
+{
+	__m256i vmax = _mm256_setzero_si256();
+	__m256i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*)&buff[4 * i]);
+		vmax = _mm256_max_epi32(vmax, v);
+		vmin = _mm256_min_epi32(vmin, v);
+	}
+
+	return max_u64(reduce_epi32_avx2(vmax, vmin), max_amp_pcm32(&buff[4 * i], samples - i));
+}
+
+__attribute__((target("avx2")))
+static float max_abs_float_avx2(const unsigned char *buff, uint64_t samples)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 vmax = _mm256_setzero_ps();
+
+	uint64_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		const __m256 v = _mm256_andnot_ps(sign, _mm256_loadu_ps((const float*)&buff[4 * i]));
+		vmax = _mm256_max_ps(v, vmax);
+	}
+
+	const float tail = max_abs_float_scalar(&buff[4 * i], samples - i);
+	const float max_abs = reduce_max_ps_sse2(
+			_mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1))
+		);
+
+	return tail > max_abs ? tail : max_abs;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t max_amp_pcm8_avx512(const unsigned char *buff, uint64_t samples)
+{
+	__m512i vmax = _mm512_set1_epi8((char)0x80);
+	__m512i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 64 <= samples; i += 64) {
+		const __m512i v = _mm512_loadu_si512((const void*)&buff[i]);
+		vmax = _mm512_max_epu8(vmax, v);
+		vmin = _mm512_min_epu8(vmin, v);
+	}
+
+	uint8_t h[64], l[64];
+	_mm512_storeu_si512((void*)h, vmax);
+	_mm512_storeu_si512((void*)l, vmin);
+
+	int64_t max = 0, min = 0;
+	for (int k = 0; k < 64; ++k) {
+		max = h[k] - 128 > max ? h[k] - 128 : max;
+		min = l[k] - 128 < min ? l[k] - 128 : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm8_avx2(&buff[i], samples - i));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t max_amp_pcm16_avx512(const unsigned char *buff, uint64_t samples)
+{
+	__m512i vmax = _mm512_setzero_si512();
+	__m512i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 32 <= samples; i += 32) {
+		const __m512i v = _mm512_loadu_si512((const void*)&buff[2 * i]);
+		vmax = _mm512_max_epi16(vmax, v);
+		vmin = _mm512_min_epi16(vmin, v);
+	}
+
+	int16_t h[32], l[32];
+	_mm512_storeu_si512((void*)h, vmax);
+	_mm512_storeu_si512((void*)l, vmin);
+
+	int64_t max = 0, min = 0;
+	for (int k = 0; k < 32; ++k) {
+		max = h[k] > max ? h[k] : max;
+		min = l[k] < min ? l[k] : min;
+	}
+
+	return max_u64(peak_of(max, min), max_amp_pcm16_avx2(&buff[2 * i], samples - i));
+}
+
+// Masked loads read exactly 48 bytes, so the 24-bit kernel never reads past the samples
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t max_amp_pcm24_avx512(const unsigned char *buff, uint64_t samples)
+{
+	// Move each group of 12 bytes to the start of its own 128-bit lane
+	const __m512i spread = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+	const __m512i mask = _mm512_broadcast_i32x4(
+			_mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)
+		);
+
+	__m512i vmax = _mm512_setzero_si512();
+	__m512i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m512i v = _mm512_maskz_loadu_epi32(0x0FFF, (const void*)&buff[3 * i]);
+		const __m512i s = _mm512_srai_epi32(_mm512_shuffle_epi8(_mm512_permutexvar_epi32(spread, v), mask), 8);
+		vmax = _mm512_max_epi32(vmax, s);
+		vmin = _mm512_min_epi32(vmin, s);
+	}
+
+	const uint64_t peak = peak_of(_mm512_reduce_max_epi32(vmax), _mm512_reduce_min_epi32(vmin));
+
+	return max_u64(peak, max_amp_pcm24(&buff[3 * i], samples - i));
+}
+
+__attribute__((target("avx512f")))
+static uint64_t max_amp_pcm32_avx512(const unsigned char *buff, uint64_t samples)
+{
+	__m512i vmax = _mm512_setzero_si512();
+	__m512i vmin = vmax;
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m512i v = _mm512_loadu_si512((const void*)&buff[4 * i]);
+		vmax = _mm512_max_epi32(vmax, v);
+		vmin = _mm512_min_epi32(vmin, v);
+	}
+
+	const uint64_t peak = peak_of(_mm512_reduce_max_epi32(vmax), _mm512_reduce_min_epi32(vmin));
+
+	return max_u64(peak, max_amp_pcm32(&buff[4 * i], samples - i));
+}
+
+__attribute__((target("avx512f")))
+static float max_abs_float_avx512(const unsigned char *buff, uint64_t samples)
+{
+	__m512 vmax = _mm512_setzero_ps();
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m512 v = _mm512_abs_ps(_mm512_loadu_ps((const void*)&buff[4 * i]));
+		vmax = _mm512_max_ps(v, vmax);
+	}
+
+	const float tail = max_abs_float_scalar(&buff[4 * i], samples - i);
+	const float max_abs = _mm512_reduce_max_ps(vmax);
+
+	return tail > max_abs ? tail : max_abs;
+}
+
+#endif
+
+// Indexed by bytes per sample, resolved once by peak_init()
+static max_amp_fn max_amp_kernels[5];
+static max_abs_float_fn max_abs_float;
+
+static pthread_once_t peak_once = PTHREAD_ONCE_INIT;
+
+static void peak_init(void)
+{
+	max_amp_kernels[1] = max_amp_pcm8;
+	max_amp_kernels[2] = max_amp_pcm16;
+	max_amp_kernels[3] = max_amp_pcm24;
+	max_amp_kernels[4] = max_amp_pcm32;
+	max_abs_float = max_abs_float_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		max_amp_kernels[1] = max_amp_pcm8_sse2;
+		max_amp_kernels[2] = max_amp_pcm16_sse2;
+		max_amp_kernels[4] = max_amp_pcm32_sse2;
+		max_abs_float = max_abs_float_sse2;
+	}
+
+	if (__builtin_cpu_supports("ssse3")) {
+		max_amp_kernels[3] = max_amp_pcm24_ssse3;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		max_amp_kernels[1] = max_amp_pcm8_avx2;
+		max_amp_kernels[2] = max_amp_pcm16_avx2;
+		max_amp_kernels[3] = max_amp_pcm24_avx2;
+		max_amp_kernels[4] = max_amp_pcm32_avx2;
+		max_abs_float = max_abs_float_avx2;
+	}
+
+	// The 8 and 16-bit AVX-512 kernels hand their tails to the AVX2 ones
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+	    && __builtin_cpu_supports("avx2")) {
+		max_amp_kernels[1] = max_amp_pcm8_avx512;
+		max_amp_kernels[2] = max_amp_pcm16_avx512;
+		max_amp_kernels[3] = max_amp_pcm24_avx512;
+		max_amp_kernels[4] = max_amp_pcm32_avx512;
+		max_abs_float = max_abs_float_avx512;
+	}
+#endif
+}
+
+static const stats_fn stats_kernels[5] = {
+	NULL, stats_pcm8, stats_pcm16, stats_pcm24, stats_pcm32
+};
+
+// Integer PCM of 8, 16, 24 or 32 bits; IEEE float data is not
+static int is_int_pcm(const struct FMT_chunk *fmt)
+{
+	const uint32_t bytes_per_sample = fmt->bits_per_sample / 8;
+
+	return fmt->audio_format != WAV_FORMAT_IEEE_FLOAT
+		&& fmt->bits_per_sample % 8 == 0
+		&& bytes_per_sample >= 1 && bytes_per_sample <= 4;
+}
+
+static int is_float32(const struct FMT_chunk *fmt)
+{
+	return fmt->audio_format == WAV_FORMAT_IEEE_FLOAT && fmt->bits_per_sample == 32;
+}
+
+// Kernel for the sample size of fmt, NULL if it is not integer PCM
+static max_amp_fn max_amp_kernel(const struct FMT_chunk *fmt)
+{
+	if (!is_int_pcm(fmt)) return NULL;
+
+	pthread_once(&peak_once, peak_init);
+
+	return max_amp_kernels[fmt->bits_per_sample / 8];
+}
+
+static stats_fn stats_kernel(const struct FMT_chunk *fmt)
+{
+	if (!is_int_pcm(fmt)) return NULL;
+
+	return stats_kernels[fmt->bits_per_sample / 8];
+}
+
+static max_abs_float_fn max_abs_float_kernel(void)
+{
+	pthread_once(&peak_once, peak_init);
+
+	return max_abs_float;
+}
+
+// Per-range state of the parallel peak pass
+struct sample_job {
+	const unsigned char *buff;
+	uint64_t	samples;
+	uint64_t	range;		// samples per range
+	uint32_t	bytes_per_sample;
+
+	max_amp_fn	peak;
+	uint64_t	*peaks;		// one result per range
+};
+
+static uint64_t sample_job_range(const struct sample_job *job, uint64_t index, uint64_t *first)
+{
+	*first = index * job->range;
+	return job->samples - *first < job->range ? job->samples - *first : job->range;
+}
+
+static void peak_task(uint64_t index, void *ctx)
+{
+	struct sample_job *job = (struct sample_job*)ctx;
+	uint64_t first;
+	const uint64_t n = sample_job_range(job, index, &first);
+
+	job->peaks[index] = job->peak(&job->buff[first * job->bytes_per_sample], n);
+}
+
+static void sample_job_init(struct sample_job *job, const unsigned char *buff, uint64_t samples, uint32_t bytes_per_sample)
+{
+	memset(job, 0, sizeof(*job));
+
+	job->buff = buff;
+	job->samples = samples;
+	job->bytes_per_sample = bytes_per_sample;
+	job->range = pool_range_items(bytes_per_sample);
+}
+
+// Peak of samples samples at buff, scanned a range per task
+static uint64_t parallel_max_amp(max_amp_fn peak, const unsigned char *buff, uint64_t samples, uint32_t bytes_per_sample)
+{
+	struct sample_job job;
+	sample_job_init(&job, buff, samples, bytes_per_sample);
+
+	const uint64_t count = pool_range_count(samples, job.range);
+
+	job.peak = peak;
+	job.peaks = (uint64_t*)malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+
+	if (job.peaks == NULL) return peak(buff, samples);
+
+	pool_run(count, peak_task, &job);
+
+	uint64_t max_amp = 0;
+	for (uint64_t i = 0; i < count; ++i) max_amp = job.peaks[i] > max_amp ? job.peaks[i] : max_amp;
+
+	free(job.peaks);
+
+	return max_amp;
+}
+
+// Per-range state of the parallel statistics pass
+struct stats_job {
+	const unsigned char	*buff;
+	uint64_t		frames;
+	uint64_t		range;		// frames per range
+	uint16_t		num_channels;
+	uint16_t		block_align;
+	stats_fn		stats;
+	struct stats_partial	*partial;	// num_channels results per range
+};
+
+static void stats_task(uint64_t index, void *ctx)
+{
+	const struct stats_job *job = (const struct stats_job*)ctx;
+	const uint64_t first = index * job->range;
+	const uint64_t n = job->frames - first < job->range ? job->frames - first : job->range;
+
+	job->stats(&job->buff[first * job->block_align], n, job->num_channels, &job->partial[index * job->num_channels]);
+}
+
+// Fill wav->stats in one pass over the sound data; the per-range results are
+// combined in range order
+static WAV_State compute_stats(struct WAV_file *wav)
+{
+	const stats_fn stats = stats_kernel(&wav->fmt);
+	const uint16_t num_channels = wav->fmt.num_channels;
+
+	if (stats == NULL || num_channels == 0 || wav->fmt.block_align == 0) return Error;
+
+	struct stats_job job = {
+		.buff = wav->data.buff,
+		.frames = wav->data.size / wav->fmt.block_align,
+		.range = pool_range_items(wav->fmt.block_align),
+		.num_channels = num_channels,
+		.block_align = wav->fmt.block_align,
+		.stats = stats,
+	};
+
+	const uint64_t count = pool_range_count(job.frames, job.range);
+
+	if (wav->stats.channels == NULL || wav->stats.num_channels != num_channels) {
+		struct WAV_channel_stats *channels = (struct WAV_channel_stats*)realloc(
+				wav->stats.channels,
+				sizeof(struct WAV_channel_stats) * num_channels
+			);
+
+		if (channels == NULL) return Error;
+
+		wav->stats.channels = channels;
+		wav->stats.num_channels = num_channels;
+	}
+
+	job.partial = (struct stats_partial*)malloc(sizeof(struct stats_partial) * num_channels * (count > 0 ? count : 1));
+
+	if (job.partial == NULL) return Error;
+
+	pool_run(count, stats_task, &job);
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		struct stats_partial total = {0};
+
+		for (uint64_t i = 0; i < count; ++i) {
+			const struct stats_partial *p = &job.partial[i * num_channels + c];
+
+			total.max = p->max > total.max ? p->max : total.max;
+			total.min = p->min < total.min ? p->min : total.min;
+			total.sum += p->sum;
+			total.sumsq += p->sumsq;
+			total.clip_count += p->clip_count;
+		}
+
+		const double frames = job.frames > 0 ? (double)job.frames : 1.0;
+
+		wav->stats.channels[c] = (struct WAV_channel_stats) {
+			.peak = (uint64_t)(total.max > -total.min ? total.max : -total.min),
+			.rms = sqrt(total.sumsq / frames),
+			.dc_offset = (double)total.sum / frames,
+			.clip_count = total.clip_count,
+		};
+	}
+
+	free(job.partial);
+
+	wav->stats.peak = 0;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		if (wav->stats.channels[c].peak > wav->stats.peak) wav->stats.peak = wav->stats.channels[c].peak;
+	}
+
+	wav->stats.frames = job.frames;
+	wav->stats.peak_valid = 1;
+	wav->stats.valid = 1;
+
+	return Success;
+}
+
+const struct WAV_stats *WAV_get_stats(struct WAV_file *wav)
+{
+	if (wav == NULL) return NULL;
+	if (wav->stats.valid) return &wav->stats;
+	if (load_DATA_chunk(wav) == Error) return NULL;
+	if (compute_stats(wav) == Error) return NULL;
+
+	return &wav->stats;
+}
+
+void WAV_invalidate_stats(struct WAV_file *wav)
+{
+	if (wav == NULL) return;
+
+	wav->stats.valid = 0;
+	wav->stats.peak_valid = 0;
+}
+
+/*
+ * Gain
+ *
+ * A gain is turned into a Q-format multiplier once per call: each sample
+ * becomes (sample * mul + 2^(shift - 1)) >> shift, saturated to the bit
+ * depth, all in integer arithmetic on the packed PCM. Up to 24 bits the
+ * multiplier has 31 bits and the product fits 64 bits, so the SIMD kernels
+ * can keep it in 64-bit lanes; they are only used while the result is known
+ * to fit 32 bits and match the scalar kernels exactly. 32-bit samples take a
+ * 62-bit multiplier and a 128-bit product in the scalar kernel.
+ */
+
+// Up to 24 bits the shift never exceeds 32, so the SIMD kernels can take the
+// result from the low half of a logical 64-bit shift
+#define GAIN_MAX_SHIFT		32
+#define GAIN_MAX_SHIFT_WIDE	94
+
+struct gain_q {
+	int64_t  mul;
+	uint32_t shift;
+	int      dither;	// add TPDF noise of +-1 LSB before rounding
+	int      simd;		// set if sample * gain always fits 32 bits
+};
+
+typedef void (*gain_fn)(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q);
+
+static struct gain_q gain_q_of(double gain, uint32_t bits_per_sample, int dither)
+{
+	const int wide = bits_per_sample > 24;
+	const int mul_bits = wide ? 62 : 31;
+	const int max_shift = wide ? GAIN_MAX_SHIFT_WIDE : GAIN_MAX_SHIFT;
+
+	struct gain_q q = { .mul = 0, .shift = (uint32_t)max_shift, .dither = dither, .simd = !wide };
+
+	if (gain == 0.0 || !isfinite(gain)) return q;
+
+	int exp;
+	frexp(gain, &exp);
+
+	// Largest shift that keeps |mul| below 2^mul_bits
+	const int shift = mul_bits - exp;
+
+	q.shift = (uint32_t)(shift > max_shift ? max_shift : shift < 0 ? 0 : shift);
+
+	const double mul = ldexp(gain, (int)q.shift);
+	const double mul_max = ldexp(1.0, mul_bits) - 1.0;
+
+	q.mul = mul >= mul_max ? (int64_t)mul_max
+	      : mul <= -mul_max ? -(int64_t)mul_max
+	      : (int64_t)llround(mul);
+
+	// |sample| <= 2^(bits - 1), so the result fits 32 bits while |gain| < 2^(32 - bits)
+	q.simd = !wide && fabs(gain) < ldexp(1.0, 32 - (int)bits_per_sample);
+
+	return q;
+}
+
+// Counter-based hash, so the dither of a sample only depends on its index
+static inline uint64_t dither_hash(uint64_t index)
+{
+	uint64_t z = index + UINT64_C(0x9E3779B97F4A7C15);
+	z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return z ^ (z >> 31);
+}
+
+// Sum of two uniform values in [0, 2^shift), centred on zero
+static inline __int128 tpdf(uint64_t index, uint32_t shift)
+{
+	if (shift == 0) return 0;
+
+	const uint64_t r = dither_hash(index);
+	const uint64_t r1 = r & 0xFFFFFFFF;
+	const uint64_t r2 = r >> 32;
+
+	if (shift <= 32) {
+		return (__int128)((r1 >> (32 - shift)) + (r2 >> (32 - shift))) - ((__int128)1 << shift);
+	}
+
+	return ((__int128)(r1 + r2) - ((__int128)1 << 32)) << (shift - 32);
+}
+
+// ACC holds sample * mul; 64 bits up to 24-bit samples, 128 bits for 32-bit ones
+#define DEFINE_GAIN_KERNEL(BITS, ACC)								\
+	static void gain_pcm##BITS(								\
+			unsigned char *buff,							\
+			uint64_t samples,							\
+			uint64_t first_sample,							\
+			const struct gain_q *q)							\
+	{											\
+		const int64_t lo = -(INT64_C(1) << (BITS - 1));				\
+		const int64_t hi = (INT64_C(1) << (BITS - 1)) - 1;				\
+		const ACC round = q->shift > 0 ? (ACC)1 << (q->shift - 1) : 0;		\
+												\
+		for (uint64_t i = 0; i < samples; ++i) {					\
+			const ACC t = load_pcm##BITS(&buff[i * (BITS / 8)]);			\
+			const ACC d = q->dither ? (ACC)tpdf(first_sample + i, q->shift) : 0;	\
+												\
+			ACC y = (t * q->mul + round + d) >> q->shift;				\
+			y = y < lo ? lo : y;							\
+			y = y > hi ? hi : y;							\
+												\
+			store_pcm##BITS(&buff[i * (BITS / 8)], (int64_t)y);			\
+		}										\
+	}
+
+DEFINE_GAIN_KERNEL(8,  int64_t)
+DEFINE_GAIN_KERNEL(16, int64_t)
+DEFINE_GAIN_KERNEL(24, int64_t)
+DEFINE_GAIN_KERNEL(32, __int128)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// (x * mul + round) >> shift for four 32-bit lanes, clamped to [lo, hi]
+__attribute__((target("sse4.1")))
+static inline __m128i gain_epi32_sse41(__m128i x, __m128i mul, __m128i round, __m128i shift, __m128i lo, __m128i hi)
+{
+	const __m128i even = _mm_srl_epi64(_mm_add_epi64(_mm_mul_epi32(x, mul), round), shift);
+	const __m128i odd = _mm_srl_epi64(_mm_add_epi64(_mm_mul_epi32(_mm_srli_epi64(x, 32), mul), round), shift);
+	const __m128i y = _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xCC);
+
+	return _mm_min_epi32(_mm_max_epi32(y, lo), hi);
+}
+
+#define GAIN_SSE41_SETUP(BITS)									\
+	const __m128i mul = _mm_set1_epi64x(q->mul);						\
+	const __m128i round = _mm_set1_epi64x(q->shift > 0 ? INT64_C(1) << (q->shift - 1) : 0);\
+	const __m128i shift = _mm_cvtsi32_si128((int)q->shift);					\
+	const __m128i lo = _mm_set1_epi32((int32_t)-(INT64_C(1) << (BITS - 1)));		\
+	const __m128i hi = _mm_set1_epi32((int32_t)((INT64_C(1) << (BITS - 1)) - 1))
+
+__attribute__((target("sse4.1")))
+static void gain_pcm8_sse41(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_SSE41_SETUP(8);
+	const __m128i offset = _mm_set1_epi32(128);
+
+	uint64_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		int32_t packed;
+		memcpy(&packed, &buff[i], 4);
+
+		const __m128i x = _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)), offset);
+		const __m128i y = _mm_add_epi32(gain_epi32_sse41(x, mul, round, shift, lo, hi), offset);
+
+		packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(y, y), y));
+		memcpy(&buff[i], &packed, 4);
+	}
+
+	gain_pcm8(&buff[i], samples - i, first_sample + i, q);
+}
+
+__attribute__((target("sse4.1")))
+static void gain_pcm16_sse41(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_SSE41_SETUP(16);
+
+	uint64_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[2 * i]);
+
+		const __m128i a = gain_epi32_sse41(_mm_cvtepi16_epi32(v), mul, round, shift, lo, hi);
+		const __m128i b = gain_epi32_sse41(_mm_cvtepi16_epi32(_mm_srli_si128(v, 8)), mul, round, shift, lo, hi);
+
+		_mm_storeu_si128((__m128i*)&buff[2 * i], _mm_packs_epi32(a, b));
+	}
+
+	gain_pcm16(&buff[2 * i], samples - i, first_sample + i, q);
+}
+
+__attribute__((target("sse4.1")))
+static void gain_pcm24_sse41(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_SSE41_SETUP(24);
+	const __m128i unpack = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	// Each load reads 16 bytes for 12 bytes of samples, so stop 6 samples early
+	uint64_t i = 0;
+	for (; i + 6 <= samples; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&buff[3 * i]);
+		const __m128i x = _mm_srai_epi32(_mm_shuffle_epi8(v, unpack), 8);
+		const __m128i y = _mm_shuffle_epi8(gain_epi32_sse41(x, mul, round, shift, lo, hi), pack);
+
+		const int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(y, 8));
+
+		_mm_storel_epi64((__m128i*)&buff[3 * i], y);
+		memcpy(&buff[3 * i + 8], &tail, 4);
+	}
+
+	gain_pcm24(&buff[3 * i], samples - i, first_sample + i, q);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gain_epi32_avx2(__m256i x, __m256i mul, __m256i round, __m128i shift, __m256i lo, __m256i hi)
+{
+	const __m256i even = _mm256_srl_epi64(_mm256_add_epi64(_mm256_mul_epi32(x, mul), round), shift);
+	const __m256i odd = _mm256_srl_epi64(_mm256_add_epi64(_mm256_mul_epi32(_mm256_srli_epi64(x, 32), mul), round), shift);
+	const __m256i y = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+
+	return _mm256_min_epi32(_mm256_max_epi32(y, lo), hi);
+}
+
+#define GAIN_AVX2_SETUP(BITS)									\
+	const __m256i mul = _mm256_set1_epi64x(q->mul);						\
+	const __m256i round = _mm256_set1_epi64x(q->shift > 0 ? INT64_C(1) << (q->shift - 1) : 0);\
+	const __m128i shift = _mm_cvtsi32_si128((int)q->shift);					\
+	const __m256i lo = _mm256_set1_epi32((int32_t)-(INT64_C(1) << (BITS - 1)));		\
+	const __m256i hi = _mm256_set1_epi32((int32_t)((INT64_C(1) << (BITS - 1)) - 1))
+
+__attribute__((target("avx2")))
+static void gain_pcm8_avx2(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_AVX2_SETUP(8);
+	const __m256i offset = _mm256_set1_epi32(128);
+
+	uint64_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		const __m256i x = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&buff[i])), offset);
+		const __m256i y = _mm256_add_epi32(gain_epi32_avx2(x, mul, round, shift, lo, hi), offset);
+
+		const __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+		_mm_storel_epi64((__m128i*)&buff[i], _mm_packus_epi16(w, w));
+	}
+
+	gain_pcm8(&buff[i], samples - i, first_sample + i, q);
+}
+
+__attribute__((target("avx2")))
+static void gain_pcm16_avx2(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_AVX2_SETUP(16);
+
+	uint64_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		const __m256i a = gain_epi32_avx2(
+				_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&buff[2 * i])),
+				mul, round, shift, lo, hi
+			);
+		const __m256i b = gain_epi32_avx2(
+				_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&buff[2 * i + 16])),
+				mul, round, shift, lo, hi
+			);
+
+		// packs works per 128-bit lane; put the quarters back in order
+		const __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_si256((__m256i*)&buff[2 * i], v);
+	}
+
+	gain_pcm16_sse41(&buff[2 * i], samples - i, first_sample + i, q);
+}
+
+__attribute__((target("avx2")))
+static void gain_pcm24_avx2(unsigned char *buff, uint64_t samples, uint64_t first_sample, const struct gain_q *q)
+{
+	GAIN_AVX2_SETUP(24);
+	const __m256i unpack = _mm256_broadcastsi128_si256(
+			_mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)
+		);
+	const __m256i pack = _mm256_broadcastsi128_si256(
+			_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1)
+		);
+
+	// The upper lane loads 16 bytes starting 12 bytes in, so stop 10 samples early
+	uint64_t i = 0;
+	for (; i + 10 <= samples; i += 8) {
+		const __m256i v = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&buff[3 * i])),
+				_mm_loadu_si128((const __m128i*)&buff[3 * i + 12]),
+				1
+			);
+		const __m256i x = _mm256_srai_epi32(_mm256_shuffle_epi8(v, unpack), 8);
+		const __m256i y = _mm256_shuffle_epi8(gain_epi32_avx2(x, mul, round, shift, lo, hi), pack);
+
+		const __m128i y_lo = _mm256_castsi256_si128(y);
+		const __m128i y_hi = _mm256_extracti128_si256(y, 1);
+		const int32_t lo_tail = _mm_cvtsi128_si32(_mm_srli_si128(y_lo, 8));
+		const int32_t hi_tail = _mm_cvtsi128_si32(_mm_srli_si128(y_hi, 8));
+
+		_mm_storel_epi64((__m128i*)&buff[3 * i], y_lo);
+		memcpy(&buff[3 * i + 8], &lo_tail, 4);
+		_mm_storel_epi64((__m128i*)&buff[3 * i + 12], y_hi);
+		memcpy(&buff[3 * i + 20], &hi_tail, 4);
+	}
+
+	gain_pcm24_sse41(&buff[3 * i], samples - i, first_sample + i, q);
+}
+
+#endif
+
+// Indexed by bytes per sample; the SIMD kernels are resolved once by gain_init()
+static const gain_fn gain_kernels[5] = {
+	NULL, gain_pcm8, gain_pcm16, gain_pcm24, gain_pcm32
+};
+
+static gain_fn gain_simd_kernels[5];
+
+static pthread_once_t gain_once = PTHREAD_ONCE_INIT;
+
+static void gain_init(void)
+{
+	memcpy(gain_simd_kernels, gain_kernels, sizeof(gain_kernels));
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.1")) {
+		gain_simd_kernels[1] = gain_pcm8_sse41;
+		gain_simd_kernels[2] = gain_pcm16_sse41;
+		gain_simd_kernels[3] = gain_pcm24_sse41;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.1")) {
+		gain_simd_kernels[1] = gain_pcm8_avx2;
+		gain_simd_kernels[2] = gain_pcm16_avx2;
+		gain_simd_kernels[3] = gain_pcm24_avx2;
+	}
+#endif
+}
+
+// Dithered gains and gains that may overflow 32 bits use the scalar kernels
+static gain_fn gain_kernel(const struct FMT_chunk *fmt, const struct gain_q *q)
+{
+	if (!is_int_pcm(fmt)) return NULL;
+
+	pthread_once(&gain_once, gain_init);
+
+	const uint32_t bytes_per_sample = fmt->bits_per_sample / 8;
+
+	return q->simd && !q->dither ? gain_simd_kernels[bytes_per_sample] : gain_kernels[bytes_per_sample];
+}
+
+// Per-range state of the parallel gain pass
+struct gain_job {
+	unsigned char		*buff;
+	uint64_t		samples;
+	uint64_t		first_sample;	// index of buff[0] in the whole data, for the dither
+	uint64_t		range;		// samples per range
+	uint32_t		bytes_per_sample;
+	gain_fn			gain;
+	const struct gain_q	*q;
+};
+
+static void gain_task(uint64_t index, void *ctx)
+{
+	const struct gain_job *job = (const struct gain_job*)ctx;
+	const uint64_t first = index * job->range;
+	const uint64_t n = job->samples - first < job->range ? job->samples - first : job->range;
+
+	job->gain(&job->buff[first * job->bytes_per_sample], n, job->first_sample + first, job->q);
+}
+
+static void parallel_gain(
+		gain_fn gain,
+		const struct gain_q *q,
+		unsigned char *buff,
+		uint64_t samples,
+		uint64_t first_sample,
+		uint32_t bytes_per_sample)
+{
+	const struct gain_job job = {
+		.buff = buff,
+		.samples = samples,
+		.first_sample = first_sample,
+		.range = pool_range_items(bytes_per_sample),
+		.bytes_per_sample = bytes_per_sample,
+		.gain = gain,
+		.q = q,
+	};
+
+	pool_run(pool_range_count(samples, job.range), gain_task, (void*)&job);
+}
+
+WAV_State WAV_apply_gain(struct WAV_file *wav, double gain, WAV_GainUnit unit, WAV_Dither dither)
+{
+	if (wav == NULL || unit >= WAV_GAIN_NumUnits || dither >= WAV_DITHER_NumModes) return Error;
+	if (load_DATA_chunk(wav) == Error || writable_DATA_chunk(wav) == Error) return Error;
+
+	const double linear = unit == WAV_GAIN_DB ? pow(10.0, gain / 20.0) : gain;
+	const struct gain_q q = gain_q_of(linear, wav->fmt.bits_per_sample, dither == WAV_DITHER_TPDF);
+	const gain_fn kernel = gain_kernel(&wav->fmt, &q);
+
+	if (kernel == NULL) return Error;
+
+	const uint32_t bytes_per_sample = wav->fmt.bits_per_sample / 8;
+
+	parallel_gain(kernel, &q, wav->data.buff, wav->data.size / bytes_per_sample, 0, bytes_per_sample);
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+// Linear gain that brings max_amp to db below full scale
+static double normalize_gain(uint64_t max_amp, double db, uint32_t bits_per_sample)
+{
+	if (db > 0.0) db = 0.0;
+
+	const double new_max_amp = pow(10.0, db / 20.0) * (ldexp(1.0, (int)bits_per_sample - 1) - 1.0);
+
+	return new_max_amp / (double)max_amp;
+}
+
+uint64_t WAV_get_max_amp(struct WAV_file *wav)
+{
+	if (wav == NULL) return 0;
+	if (wav->stats.peak_valid) return wav->stats.peak;
+	if (load_DATA_chunk(wav) == Error) return 0;
+
+	const max_amp_fn max_amp = max_amp_kernel(&wav->fmt);
+
+	if (max_amp == NULL) return 0;
+
+	// The SIMD peak scan is cheaper than the full statistics pass, so only the peak is cached
+	const uint32_t bytes_per_sample = wav->fmt.bits_per_sample / 8;
+
+	wav->stats.peak = parallel_max_amp(max_amp, wav->data.buff, wav->data.size / bytes_per_sample, bytes_per_sample);
+	wav->stats.peak_valid = 1;
+
+	return wav->stats.peak;
+}
+
+double WAV_get_max_db(struct WAV_file *wav)
+{
+	if (wav == NULL) {
+		perror("Error: Cannot get max Db; wav is NULL.\n");
+		return -999.0f;
+	} else if (load_DATA_chunk(wav) == Error) {
+		perror("Error: Cannot get max Db; wav music data is NULL.\n");
+		return -999.0f;
+	}
+	
+	// Float samples are already relative to full scale
+	if (is_float32(&wav->fmt)) {
+		return 20.0f * log10f(max_abs_float_kernel()(wav->data.buff, wav->data.size / 4));
+	}
+
+	const int64_t max_amp = WAV_get_max_amp(wav);
+
+	return 20.0f * log10f((double)max_amp / (double)((1ULL << (wav->fmt.bits_per_sample-1))-1));
+}
+
+double WAV_get_rms_db(struct WAV_file *wav)
+{
+	if (wav == NULL || load_DATA_chunk(wav) == Error) {
+		perror("Error: Cannot get RMS Db; wav music data is NULL.\n");
+		return -999.0f;
+	}
+
+	const struct WAV_stats *stats = WAV_get_stats(wav);
+
+	if (stats == NULL || stats->frames == 0) return -999.0f;
+
+	double sumsq = 0.0;
+
+	for (uint16_t c = 0; c < stats->num_channels; ++c) {
+		sumsq += stats->channels[c].rms * stats->channels[c].rms;
+	}
+
+	const double rms = sqrt(sumsq / (double)stats->num_channels);
+
+	return 20.0f * log10(rms / (double)((1ULL << (wav->fmt.bits_per_sample-1))-1));
+}
+
+WAV_State WAV_normalize_max_db(struct WAV_file *wav, double db)
+{
+	if (wav == NULL) return Error;
+	if (wav->data.size == 0 || load_DATA_chunk(wav) == Error) return Error;
+	if (!is_int_pcm(&wav->fmt) || writable_DATA_chunk(wav) == Error) return Error;
+
+	const uint64_t max_amp = WAV_get_max_amp(wav);
+
+	// Silence stays silence
+	if (max_amp == 0) return Success;
+
+	return WAV_apply_gain(wav, normalize_gain(max_amp, db, wav->fmt.bits_per_sample), WAV_GAIN_LINEAR, WAV_DITHER_NONE);
+}
+
+/*
+ * Tone generation
+ *
+ * Sines come from a quadrature oscillator advanced a block at a time. The
+ * phasor (cos, sin) at the start of each block is computed from the
+ * absolute frame index, and frame k of the block rotates it by a
+ * precomputed (cos wk, sin wk), so a sample costs two multiplies and an
+ * add, rounding error never builds up past one block, and any block can be
+ * generated without the ones before it. Samples are rounded straight to the
+ * target bit depth and written to every channel of their frame.
+ */
+
+#define TONE_BLOCK_FRAMES 1024
+
+struct tone {
+	double		amp;		// peak in sample units
+	double		freq;
+	uint32_t	sample_rate;
+	double		*rotation;	// cos of the advance over k frames for k < TONE_BLOCK_FRAMES, then sin
+};
+
+typedef void (*tone_block_fn)(const double *rotation, double c0, double s0, int32_t *out, uint32_t n);
+
+typedef void (*tone_store_fn)(
+		const int32_t *const *tones,
+		uint16_t num_tones,
+		uint16_t num_channels,
+		unsigned char *dst,
+		uint32_t frames
+	);
+
+// c0 and s0 are the phasor at the start of the block scaled by the amplitude
+static void tone_block_scalar(const double *rotation, double c0, double s0, int32_t *out, uint32_t n)
+{
+	const double *cos_k = rotation;
+	const double *sin_k = &rotation[TONE_BLOCK_FRAMES];
+
+	for (uint32_t k = 0; k < n; ++k) out[k] = (int32_t)lrint(s0 * cos_k[k] + c0 * sin_k[k]);
+}
+
+// Channel c of each frame takes tone c % num_tones
+#define DEFINE_TONE_STORE(BITS)									\
+	static void tone_store_pcm##BITS(							\
+			const int32_t *const *tones,						\
+			uint16_t num_tones,							\
+			uint16_t num_channels,							\
+			unsigned char *dst,							\
+			uint32_t frames)							\
+	{											\
+		for (uint32_t f = 0; f < frames; ++f) {						\
+			for (uint16_t c = 0, t = 0; c < num_channels; ++c) {			\
+				store_pcm##BITS(dst, tones[t][f]);				\
+				dst += BITS / 8;						\
+				t = t + 1 == num_tones ? 0 : t + 1;				\
+			}									\
+		}										\
+	}
+
+DEFINE_TONE_STORE(8)
+DEFINE_TONE_STORE(16)
+DEFINE_TONE_STORE(24)
+DEFINE_TONE_STORE(32)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void tone_block_sse2(const double *rotation, double c0, double s0, int32_t *out, uint32_t n)
+{
+	const double *cos_k = rotation;
+	const double *sin_k = &rotation[TONE_BLOCK_FRAMES];
+	const __m128d c = _mm_set1_pd(c0);
+	const __m128d s = _mm_set1_pd(s0);
+
+	uint32_t k = 0;
+	for (; k + 2 <= n; k += 2) {
+		const __m128d y = _mm_add_pd(_mm_mul_pd(s, _mm_loadu_pd(&cos_k[k])), _mm_mul_pd(c, _mm_loadu_pd(&sin_k[k])));
+		_mm_storel_epi64((__m128i*)&out[k], _mm_cvtpd_epi32(y));
+	}
+
+	tone_block_scalar(&rotation[k], c0, s0, &out[k], n - k);
+}
+
+__attribute__((target("avx")))
+static void tone_block_avx(const double *rotation, double c0, double s0, int32_t *out, uint32_t n)
+{
+	const double *cos_k = rotation;
+	const double *sin_k = &rotation[TONE_BLOCK_FRAMES];
+	const __m256d c = _mm256_set1_pd(c0);
+	const __m256d s = _mm256_set1_pd(s0);
+
+	uint32_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		const __m256d y = _mm256_add_pd(_mm256_mul_pd(s, _mm256_loadu_pd(&cos_k[k])), _mm256_mul_pd(c, _mm256_loadu_pd(&sin_k[k])));
+		_mm_storeu_si128((__m128i*)&out[k], _mm256_cvtpd_epi32(y));
+	}
+
+	tone_block_scalar(&rotation[k], c0, s0, &out[k], n - k);
+}
+
+// Mono and stereo 16-bit frames, eight at a time
+__attribute__((target("sse2")))
+static void tone_store_pcm16_sse2(
+		const int32_t *const *tones,
+		uint16_t num_tones,
+		uint16_t num_channels,
+		unsigned char *dst,
+		uint32_t frames)
+{
+	if (num_channels > 2) {
+		tone_store_pcm16(tones, num_tones, num_channels, dst, frames);
+		return;
+	}
+
+	const int32_t *left = tones[0];
+	const int32_t *right = tones[num_tones > 1 ? 1 : 0];
+
+	uint32_t f = 0;
+	for (; f + 8 <= frames; f += 8) {
+		const __m128i l = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)&left[f]),
+						  _mm_loadu_si128((const __m128i*)&left[f + 4]));
+
+		if (num_channels == 1) {
+			_mm_storeu_si128((__m128i*)&dst[2 * f], l);
+			continue;
+		}
+
+		const __m128i r = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)&right[f]),
+						  _mm_loadu_si128((const __m128i*)&right[f + 4]));
+
+		_mm_storeu_si128((__m128i*)&dst[4 * f], _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i*)&dst[4 * f + 16], _mm_unpackhi_epi16(l, r));
+	}
+
+	const int32_t *rest[2] = { &left[f], &right[f] };
+	tone_store_pcm16(rest, num_channels, num_channels, &dst[f * 2 * num_channels], frames - f);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static void tone_block_neon(const double *rotation, double c0, double s0, int32_t *out, uint32_t n)
+{
+	const double *cos_k = rotation;
+	const double *sin_k = &rotation[TONE_BLOCK_FRAMES];
+	const float64x2_t c = vdupq_n_f64(c0);
+	const float64x2_t s = vdupq_n_f64(s0);
+
+	uint32_t k = 0;
+	for (; k + 2 <= n; k += 2) {
+		const float64x2_t y = vaddq_f64(vmulq_f64(s, vld1q_f64(&cos_k[k])), vmulq_f64(c, vld1q_f64(&sin_k[k])));
+		vst1_s32(&out[k], vmovn_s64(vcvtnq_s64_f64(y)));
+	}
+
+	tone_block_scalar(&rotation[k], c0, s0, &out[k], n - k);
+}
+
+#endif
+
+// Kernels resolved once by tone_init()
+static struct {
+	tone_block_fn	block;
+	tone_store_fn	store[5];	// indexed by bytes per sample
+} tone_kernels = {
+	tone_block_scalar,
+	{ NULL, tone_store_pcm8, tone_store_pcm16, tone_store_pcm24, tone_store_pcm32 },
+};
+
+static pthread_once_t tone_once = PTHREAD_ONCE_INIT;
+
+static void tone_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		tone_kernels.block = tone_block_sse2;
+		tone_kernels.store[2] = tone_store_pcm16_sse2;
+	}
+
+	if (__builtin_cpu_supports("avx")) tone_kernels.block = tone_block_avx;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	tone_kernels.block = tone_block_neon;
+#endif
+}
+
+static WAV_State tone_setup(struct tone *tone, double freq, double amp, uint32_t sample_rate)
+{
+	tone->amp = amp;
+	tone->freq = freq;
+	tone->sample_rate = sample_rate;
+	tone->rotation = (double*)malloc(2 * TONE_BLOCK_FRAMES * sizeof(double));
+
+	if (tone->rotation == NULL) return Error;
+
+	const double cycles = freq / sample_rate;
+
+	for (uint32_t k = 0; k < TONE_BLOCK_FRAMES; ++k) {
+		const double turns = k * cycles;
+		const double w = 2.0 * M_PI * (turns - floor(turns));
+
+		tone->rotation[k] = cos(w);
+		tone->rotation[TONE_BLOCK_FRAMES + k] = sin(w);
+	}
+
+	return Success;
+}
+
+struct tone_set {
+	struct tone	tones[2];
+	uint16_t	num_tones;
+};
+
+// Write frames of the tones starting at frame first, a block at a time
+static void tone_render(
+		const void *signal,
+		const struct FMT_chunk *fmt,
+		unsigned char *dst,
+		uint64_t first,
+		uint64_t frames)
+{
+	const struct tone *tones = ((const struct tone_set*)signal)->tones;
+	const uint16_t num_tones = ((const struct tone_set*)signal)->num_tones;
+
+	int32_t samples[2][TONE_BLOCK_FRAMES];
+	const int32_t *rows[2] = { samples[0], samples[1] };
+	const tone_store_fn store = tone_kernels.store[fmt->bits_per_sample / 8];
+
+	for (uint64_t done = 0; done < frames; done += TONE_BLOCK_FRAMES) {
+		const uint64_t frame = first + done;
+		const uint32_t n = frames - done < TONE_BLOCK_FRAMES ? (uint32_t)(frames - done) : TONE_BLOCK_FRAMES;
+
+		for (uint16_t t = 0; t < num_tones; ++t) {
+			// Whole turns are dropped in extended precision, so the phase
+			// stays exact hours into the signal
+			const long double turns = (long double)frame * tones[t].freq / tones[t].sample_rate;
+			const double w = 2.0 * M_PI * (double)(turns - floorl(turns));
+
+			tone_kernels.block(tones[t].rotation, tones[t].amp * cos(w), tones[t].amp * sin(w), samples[t], n);
+		}
+
+		store(rows, num_tones, fmt->num_channels, &dst[done * fmt->block_align], n);
+	}
+}
+
+// Renders frames of a signal from frame first, a multiple of TONE_BLOCK_FRAMES
+typedef void (*signal_render_fn)(
+		const void *signal,
+		const struct FMT_chunk *fmt,
+		unsigned char *dst,
+		uint64_t first,
+		uint64_t frames
+	);
+
+struct render_job {
+	signal_render_fn	render;
+	const void		*signal;
+	const struct FMT_chunk	*fmt;
+	unsigned char		*dst;
+	uint64_t		first;		// frame of the signal at dst
+	uint64_t		frames;
+	uint64_t		range;		// frames per range, whole blocks
+};
+
+static void render_task(uint64_t index, void *ctx)
+{
+	const struct render_job *job = (const struct render_job*)ctx;
+	const uint64_t start = index * job->range;
+	const uint64_t n = job->frames - start < job->range ? job->frames - start : job->range;
+
+	job->render(job->signal, job->fmt, &job->dst[start * job->fmt->block_align], job->first + start, n);
+}
+
+// Render frames from first, a multiple of TONE_BLOCK_FRAMES, on the thread
+// pool. Ranges are whole blocks, so the output is the same as one serial pass.
+static void render_parallel(
+		signal_render_fn render,
+		const void *signal,
+		const struct FMT_chunk *fmt,
+		unsigned char *dst,
+		uint64_t first,
+		uint64_t frames)
+{
+	const uint64_t items = pool_range_items(fmt->block_align);
+
+	const struct render_job job = {
+		.render = render,
+		.signal = signal,
+		.fmt = fmt,
+		.dst = dst,
+		.first = first,
+		.frames = frames,
+		.range = (items + TONE_BLOCK_FRAMES - 1) / TONE_BLOCK_FRAMES * TONE_BLOCK_FRAMES,
+	};
+
+	pool_run(pool_range_count(frames, job.range), render_task, (void*)&job);
+}
+
+static void tones_free(struct tone_set *set)
+{
+	for (uint16_t t = 0; t < set->num_tones; ++t) free(set->tones[t].rotation);
+}
+
+// Set up num_tones tones at db below full scale of fmt
+static WAV_State tones_setup(struct tone_set *set, const double *freqs, uint16_t num_tones, const struct FMT_chunk *fmt, float db)
+{
+	pthread_once(&tone_once, tone_init);
+
+	if (db > 0.0f) db = 0.0f;
+
+	const double amp = pow(10, db / 20.0) * (pow(2, fmt->bits_per_sample - 1) - 1);
+
+	for (set->num_tones = 0; set->num_tones < num_tones; ++set->num_tones) {
+		if (tone_setup(&set->tones[set->num_tones], freqs[set->num_tones], amp, fmt->sample_rate) == Error) {
+			tones_free(set);
+			return Error;
+		}
+	}
+
+	return Success;
+}
+
+
+// Replace the waveform data with room for frames frames, which the caller
+// fills. Only integer PCM can be generated.
+// Most frames of fmt in one signal, so that its data and headers stay
+// addressable by a signed 64-bit file offset
+static uint64_t max_signal_frames(const struct FMT_chunk *fmt)
+{
+	return fmt->block_align > 0 ? (uint64_t)(INT64_MAX - 1024) / fmt->block_align : 0;
+}
+
+// Frames of fmt in duration seconds, rounded to the nearest; Error when
+// they are more than one signal can hold
+static WAV_State duration_frames(double duration, const struct FMT_chunk *fmt, uint64_t *frames)
+{
+	const double count = duration * fmt->sample_rate;
+
+	if (!(duration >= 0.0) || !(count <= (double)max_signal_frames(fmt))) return Error;
+
+	*frames = (uint64_t)llround(count);
+
+	return *frames <= max_signal_frames(fmt) ? Success : Error;
+}
+
+static WAV_State reset_signal(struct WAV_file *wav, uint64_t frames)
+{
+	if (wav == NULL) {
+		return Error;
+	} else if (wav->data.buff != NULL || wav->data.size != 0) {
+		free_buff(wav, wav->data.buff);
+		wav->data.buff = NULL;
+		wav->data.size = 0;
+		wav->riff.size = 36;
+	}
+
+	WAV_invalidate_stats(wav);
+
+	if (wav->fmt.num_channels == 0 || !is_int_pcm(&wav->fmt) || frames > max_signal_frames(&wav->fmt)) {
+		return Error;
+	}
+
+	const uint64_t size = frames * wav->fmt.block_align;
+
+	wav->data.buff = (unsigned char*)malloc(size > 0 ? size : 1);
+
+	if (wav->data.buff == NULL) return Error;
+
+	wav->data.size = size;
+	wav->riff.size = 36 + size;
+
+	return Success;
+}
+
+// Replace the waveform data with duration seconds of the tones, at db below
+// full scale; channel c plays tone c % num_tones
+static WAV_State write_tones(struct WAV_file *wav, const double *freqs, uint16_t num_tones, uint32_t duration, float db)
+{
+	if (wav == NULL) return Error;
+
+	const uint64_t frames = (uint64_t)wav->fmt.sample_rate * duration;
+
+	if (reset_signal(wav, frames) == Error) return Error;
+
+	struct tone_set set;
+
+	if (tones_setup(&set, freqs, num_tones, &wav->fmt, db) == Error) return Error;
+
+	render_parallel(tone_render, &set, &wav->fmt, wav->data.buff, 0, frames);
+	tones_free(&set);
+
+	return Success;
+}
+
+WAV_State WAV_write_sin_wave(
+        struct WAV_file *wav,
+        const double freq,
+        const uint32_t duration,
+	float db)
+{
+	return write_tones(wav, &freq, 1, duration, db);
+}
+
+WAV_State WAV_write_binaural_wave(
+        struct WAV_file *wav,
+        const double freq1,
+        const double freq2,
+        const uint32_t duration,
+	float db)
+{
+	const double freqs[2] = { freq1, freq2 };
+
+	return write_tones(wav, freqs, 2, duration, db);
+}
+
+/*
+ * Multitone banks and sweeps
+ *
+ * A block of TONE_BLOCK_FRAMES is cut into GEN_CHUNKS chunks, each started
+ * from an exact phase, and an oscillator runs its chunks side by side, one
+ * per SIMD lane. Within a chunk the phasor of a partial is rotated by its
+ * step each frame. A sweep's step is itself rotated, twice over, following
+ * the cubic Taylor expansion of its phase about the chunk start, which is
+ * exact for linear sweeps and within a micro radian for a log sweep from
+ * 20Hz to 20kHz in one second. Partials are summed in order into a double buffer
+ * laid out [frame in chunk][chunk], then rounded and clipped to each
+ * channel the voice plays on. The lanes never mix, so every kernel gives
+ * the same samples.
+ */
+
+#define GEN_CHUNK_FRAMES 32
+#define GEN_CHUNKS (TONE_BLOCK_FRAMES / GEN_CHUNK_FRAMES)
+
+struct gen_partial {
+	double	amp;				// peak in sample units
+	double	cycles;				// per frame
+	double	phase;				// turns at frame 0
+	double	step[2];			// cos, sin of the advance over a frame
+	double	chunk[2][GEN_CHUNKS];		// cos, sin of the advance to the start of each chunk
+};
+
+// Phasor state of a sweep at the start of each chunk, as cos then sin
+struct gen_sweep_chunks {
+	double	z[2][GEN_CHUNKS];		// the sample phasor, scaled by the amplitude
+	double	r[2][GEN_CHUNKS];		// its rotation over the next frame
+	double	q[2][GEN_CHUNKS];		// the rotation of r
+	double	u[2][GEN_CHUNKS];		// the rotation of q
+};
+
+enum {
+	GEN_BANK = 0,
+	GEN_SWEEP,
+};
+
+struct gen_voice {
+	int			type;
+	struct gen_partial	*partials;	// GEN_BANK
+	uint16_t		num_partials;
+	WAV_SweepType	sweep;		// GEN_SWEEP
+	double			amp;
+	double			start;		// hertz
+	double			end;
+	double			rate;		// log sweeps: growth of the frequency per second
+	double			length;		// seconds
+	uint32_t		sample_rate;
+};
+
+// Channel c plays voice c % num_voices
+struct generator {
+	struct gen_voice	*voices;
+	uint16_t		num_voices;
+	double			peak;		// clip level in sample units
+};
+
+// Add a partial, whose phasor at the block start scaled by its amplitude
+// is (c0, s0), to acc
+typedef void (*gen_bank_fn)(const struct gen_partial *p, double c0, double s0, double *acc);
+
+typedef void (*gen_sweep_fn)(const struct gen_sweep_chunks *chunks, double *acc);
+
+static void gen_bank_scalar(const struct gen_partial *p, double c0, double s0, double *acc)
+{
+	for (uint32_t j = 0; j < GEN_CHUNKS; ++j) {
+		double c = c0 * p->chunk[0][j] - s0 * p->chunk[1][j];
+		double s = s0 * p->chunk[0][j] + c0 * p->chunk[1][j];
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			acc[k * GEN_CHUNKS + j] += s;
+
+			const double next = c * p->step[0] - s * p->step[1];
+			s = s * p->step[0] + c * p->step[1];
+			c = next;
+		}
+	}
+}
+
+static void gen_sweep_scalar(const struct gen_sweep_chunks *chunks, double *acc)
+{
+	for (uint32_t j = 0; j < GEN_CHUNKS; ++j) {
+		double zc = chunks->z[0][j], zs = chunks->z[1][j];
+		double rc = chunks->r[0][j], rs = chunks->r[1][j];
+		double qc = chunks->q[0][j], qs = chunks->q[1][j];
+		const double uc = chunks->u[0][j], us = chunks->u[1][j];
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			acc[k * GEN_CHUNKS + j] = zs;
+
+			double next = zc * rc - zs * rs;
+			zs = zs * rc + zc * rs;
+			zc = next;
+
+			next = rc * qc - rs * qs;
+			rs = rs * qc + rc * qs;
+			rc = next;
+
+			next = qc * uc - qs * us;
+			qs = qs * uc + qc * us;
+			qc = next;
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void gen_bank_sse2(const struct gen_partial *p, double c0, double s0, double *acc)
+{
+	const __m128d c0v = _mm_set1_pd(c0);
+	const __m128d s0v = _mm_set1_pd(s0);
+	const __m128d sc = _mm_set1_pd(p->step[0]);
+	const __m128d ss = _mm_set1_pd(p->step[1]);
+
+	for (uint32_t j = 0; j < GEN_CHUNKS; j += 2) {
+		const __m128d cc = _mm_loadu_pd(&p->chunk[0][j]);
+		const __m128d cs = _mm_loadu_pd(&p->chunk[1][j]);
+		__m128d c = _mm_sub_pd(_mm_mul_pd(c0v, cc), _mm_mul_pd(s0v, cs));
+		__m128d s = _mm_add_pd(_mm_mul_pd(s0v, cc), _mm_mul_pd(c0v, cs));
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			double *a = &acc[k * GEN_CHUNKS + j];
+			_mm_storeu_pd(a, _mm_add_pd(_mm_loadu_pd(a), s));
+
+			const __m128d next = _mm_sub_pd(_mm_mul_pd(c, sc), _mm_mul_pd(s, ss));
+			s = _mm_add_pd(_mm_mul_pd(s, sc), _mm_mul_pd(c, ss));
+			c = next;
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void gen_sweep_sse2(const struct gen_sweep_chunks *chunks, double *acc)
+{
+	for (uint32_t j = 0; j < GEN_CHUNKS; j += 2) {
+		__m128d zc = _mm_loadu_pd(&chunks->z[0][j]), zs = _mm_loadu_pd(&chunks->z[1][j]);
+		__m128d rc = _mm_loadu_pd(&chunks->r[0][j]), rs = _mm_loadu_pd(&chunks->r[1][j]);
+		__m128d qc = _mm_loadu_pd(&chunks->q[0][j]), qs = _mm_loadu_pd(&chunks->q[1][j]);
+		const __m128d uc = _mm_loadu_pd(&chunks->u[0][j]), us = _mm_loadu_pd(&chunks->u[1][j]);
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			_mm_storeu_pd(&acc[k * GEN_CHUNKS + j], zs);
+
+			__m128d next = _mm_sub_pd(_mm_mul_pd(zc, rc), _mm_mul_pd(zs, rs));
+			zs = _mm_add_pd(_mm_mul_pd(zs, rc), _mm_mul_pd(zc, rs));
+			zc = next;
+
+			next = _mm_sub_pd(_mm_mul_pd(rc, qc), _mm_mul_pd(rs, qs));
+			rs = _mm_add_pd(_mm_mul_pd(rs, qc), _mm_mul_pd(rc, qs));
+			rc = next;
+
+			next = _mm_sub_pd(_mm_mul_pd(qc, uc), _mm_mul_pd(qs, us));
+			qs = _mm_add_pd(_mm_mul_pd(qs, uc), _mm_mul_pd(qc, us));
+			qc = next;
+		}
+	}
+}
+
+// Two vectors of chunks at a time, to hide the latency of the rotation
+__attribute__((target("avx")))
+static void gen_bank_avx(const struct gen_partial *p, double c0, double s0, double *acc)
+{
+	const __m256d c0v = _mm256_set1_pd(c0);
+	const __m256d s0v = _mm256_set1_pd(s0);
+	const __m256d sc = _mm256_set1_pd(p->step[0]);
+	const __m256d ss = _mm256_set1_pd(p->step[1]);
+
+	for (uint32_t j = 0; j < GEN_CHUNKS; j += 8) {
+		const __m256d cc0 = _mm256_loadu_pd(&p->chunk[0][j]);
+		const __m256d cs0 = _mm256_loadu_pd(&p->chunk[1][j]);
+		const __m256d cc1 = _mm256_loadu_pd(&p->chunk[0][j + 4]);
+		const __m256d cs1 = _mm256_loadu_pd(&p->chunk[1][j + 4]);
+		__m256d c_0 = _mm256_sub_pd(_mm256_mul_pd(c0v, cc0), _mm256_mul_pd(s0v, cs0));
+		__m256d s_0 = _mm256_add_pd(_mm256_mul_pd(s0v, cc0), _mm256_mul_pd(c0v, cs0));
+		__m256d c_1 = _mm256_sub_pd(_mm256_mul_pd(c0v, cc1), _mm256_mul_pd(s0v, cs1));
+		__m256d s_1 = _mm256_add_pd(_mm256_mul_pd(s0v, cc1), _mm256_mul_pd(c0v, cs1));
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			double *a = &acc[k * GEN_CHUNKS + j];
+			_mm256_storeu_pd(a, _mm256_add_pd(_mm256_loadu_pd(a), s_0));
+			_mm256_storeu_pd(a + 4, _mm256_add_pd(_mm256_loadu_pd(a + 4), s_1));
+
+			const __m256d next0 = _mm256_sub_pd(_mm256_mul_pd(c_0, sc), _mm256_mul_pd(s_0, ss));
+			const __m256d next1 = _mm256_sub_pd(_mm256_mul_pd(c_1, sc), _mm256_mul_pd(s_1, ss));
+			s_0 = _mm256_add_pd(_mm256_mul_pd(s_0, sc), _mm256_mul_pd(c_0, ss));
+			s_1 = _mm256_add_pd(_mm256_mul_pd(s_1, sc), _mm256_mul_pd(c_1, ss));
+			c_0 = next0;
+			c_1 = next1;
+		}
+	}
+}
+
+__attribute__((target("avx")))
+static void gen_sweep_avx(const struct gen_sweep_chunks *chunks, double *acc)
+{
+	for (uint32_t j = 0; j < GEN_CHUNKS; j += 4) {
+		__m256d zc = _mm256_loadu_pd(&chunks->z[0][j]), zs = _mm256_loadu_pd(&chunks->z[1][j]);
+		__m256d rc = _mm256_loadu_pd(&chunks->r[0][j]), rs = _mm256_loadu_pd(&chunks->r[1][j]);
+		__m256d qc = _mm256_loadu_pd(&chunks->q[0][j]), qs = _mm256_loadu_pd(&chunks->q[1][j]);
+		const __m256d uc = _mm256_loadu_pd(&chunks->u[0][j]), us = _mm256_loadu_pd(&chunks->u[1][j]);
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			_mm256_storeu_pd(&acc[k * GEN_CHUNKS + j], zs);
+
+			__m256d next = _mm256_sub_pd(_mm256_mul_pd(zc, rc), _mm256_mul_pd(zs, rs));
+			zs = _mm256_add_pd(_mm256_mul_pd(zs, rc), _mm256_mul_pd(zc, rs));
+			zc = next;
+
+			next = _mm256_sub_pd(_mm256_mul_pd(rc, qc), _mm256_mul_pd(rs, qs));
+			rs = _mm256_add_pd(_mm256_mul_pd(rs, qc), _mm256_mul_pd(rc, qs));
+			rc = next;
+
+			next = _mm256_sub_pd(_mm256_mul_pd(qc, uc), _mm256_mul_pd(qs, us));
+			qs = _mm256_add_pd(_mm256_mul_pd(qs, uc), _mm256_mul_pd(qc, us));
+			qc = next;
+		}
+	}
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static void gen_bank_neon(const struct gen_partial *p, double c0, double s0, double *acc)
+{
+	const float64x2_t c0v = vdupq_n_f64(c0);
+	const float64x2_t s0v = vdupq_n_f64(s0);
+	const float64x2_t sc = vdupq_n_f64(p->step[0]);
+	const float64x2_t ss = vdupq_n_f64(p->step[1]);
+
+	for (uint32_t j = 0; j < GEN_CHUNKS; j += 2) {
+		const float64x2_t cc = vld1q_f64(&p->chunk[0][j]);
+		const float64x2_t cs = vld1q_f64(&p->chunk[1][j]);
+		float64x2_t c = vsubq_f64(vmulq_f64(c0v, cc), vmulq_f64(s0v, cs));
+		float64x2_t s = vaddq_f64(vmulq_f64(s0v, cc), vmulq_f64(c0v, cs));
+
+		for (uint32_t k = 0; k < GEN_CHUNK_FRAMES; ++k) {
+			double *a = &acc[k * GEN_CHUNKS + j];
+			vst1q_f64(a, vaddq_f64(vld1q_f64(a), s));
+
+			const float64x2_t next = vsubq_f64(vmulq_f64(c, sc), vmulq_f64(s, ss));
+			s = vaddq_f64(vmulq_f64(s, sc), vmulq_f64(c, ss));
+			c = next;
+		}
+	}
+}
+
+#endif
+
+// Round and clip a block of a voice to one channel, block_align bytes apart
+#define DEFINE_GEN_STORE(BITS)									\
+	static void gen_store_pcm##BITS(							\
+			const double *acc,							\
+			double peak,								\
+			unsigned char *dst,							\
+			uint16_t block_align,							\
+			uint32_t frames)							\
+	{											\
+		for (uint32_t f = 0; f < frames; ++f) {						\
+			double x = acc[(f % GEN_CHUNK_FRAMES) * GEN_CHUNKS + f / GEN_CHUNK_FRAMES];\
+			x = x > peak ? peak : (x < -peak ? -peak : x);				\
+			store_pcm##BITS(&dst[f * block_align], (int32_t)lrint(x));		\
+		}										\
+	}
+
+DEFINE_GEN_STORE(8)
+DEFINE_GEN_STORE(16)
+DEFINE_GEN_STORE(24)
+DEFINE_GEN_STORE(32)
+
+typedef void (*gen_store_fn)(const double *acc, double peak, unsigned char *dst, uint16_t block_align, uint32_t frames);
+
+// Kernels resolved once by gen_init()
+static struct {
+	gen_bank_fn	bank;
+	gen_sweep_fn	sweep;
+	gen_store_fn	store[5];	// indexed by bytes per sample
+} gen_kernels = {
+	gen_bank_scalar,
+	gen_sweep_scalar,
+	{ NULL, gen_store_pcm8, gen_store_pcm16, gen_store_pcm24, gen_store_pcm32 },
+};
+
+static pthread_once_t gen_once = PTHREAD_ONCE_INIT;
+
+static void gen_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		gen_kernels.bank = gen_bank_sse2;
+		gen_kernels.sweep = gen_sweep_sse2;
+	}
+
+	if (__builtin_cpu_supports("avx")) {
+		gen_kernels.bank = gen_bank_avx;
+		gen_kernels.sweep = gen_sweep_avx;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	gen_kernels.bank = gen_bank_neon;
+#endif
+}
+
+static void gen_partial_setup(struct gen_partial *p, const struct WAV_partial *partial, double scale, uint32_t sample_rate)
+{
+	p->amp = partial->amplitude * scale;
+	p->cycles = partial->frequency / sample_rate;
+	p->phase = partial->phase / (2.0 * M_PI);
+	p->phase -= floor(p->phase);
+
+	const double w = 2.0 * M_PI * (p->cycles - floor(p->cycles));
+
+	p->step[0] = cos(w);
+	p->step[1] = sin(w);
+
+	for (uint32_t j = 0; j < GEN_CHUNKS; ++j) {
+		const double turns = (double)j * GEN_CHUNK_FRAMES * p->cycles;
+		const double a = 2.0 * M_PI * (turns - floor(turns));
+
+		p->chunk[0][j] = cos(a);
+		p->chunk[1][j] = sin(a);
+	}
+}
+
+// Frequency in hertz and phase in turns of a sweep at t seconds
+static void gen_sweep_at(const struct gen_voice *v, long double t, double *freq, long double *turns)
+{
+	if (v->sweep == WAV_SWEEP_LOG && v->rate != 0.0) {
+		const long double grow = expm1l(v->rate * t);
+
+		*freq = (double)(v->start * (1.0L + grow));
+		*turns = v->start / v->rate * grow;
+	} else {
+		const long double slope = v->length > 0.0 ? (v->end - v->start) / v->length : 0.0;
+
+		*freq = (double)(v->start + slope * t);
+		*turns = v->start * t + 0.5L * slope * t * t;
+	}
+}
+
+// The phasor of a sweep at the start of each chunk of the block at frame,
+// with the rotations that follow its phase through the chunk
+static void gen_sweep_setup(const struct gen_voice *v, uint64_t frame, struct gen_sweep_chunks *chunks)
+{
+	const double fs = v->sample_rate;
+	const double slope = v->sweep == WAV_SWEEP_LOG ? 0.0 : (v->length > 0.0 ? (v->end - v->start) / v->length : 0.0);
+
+	for (uint32_t j = 0; j < GEN_CHUNKS; ++j) {
+		const long double t = (long double)(frame + (uint64_t)j * GEN_CHUNK_FRAMES) / fs;
+
+		double freq;
+		long double turns;
+		gen_sweep_at(v, t, &freq, &turns);
+
+		// Derivatives of the frequency in hertz per second
+		const double d1 = v->sweep == WAV_SWEEP_LOG ? v->rate * freq : slope;
+		const double d2 = v->sweep == WAV_SWEEP_LOG ? v->rate * v->rate * freq : 0.0;
+
+		// Phase over the chunk: a k + b k^2 + c k^3 radians after frame k
+		const double a = 2.0 * M_PI * freq / fs;
+		const double b = M_PI * d1 / (fs * fs);
+		const double c = M_PI * d2 / (3.0 * fs * fs * fs);
+
+		const double w = 2.0 * M_PI * (double)(turns - floorl(turns));
+
+		chunks->z[0][j] = v->amp * cos(w);
+		chunks->z[1][j] = v->amp * sin(w);
+		chunks->r[0][j] = cos(a + b + c);
+		chunks->r[1][j] = sin(a + b + c);
+		chunks->q[0][j] = cos(2.0 * b + 6.0 * c);
+		chunks->q[1][j] = sin(2.0 * b + 6.0 * c);
+		chunks->u[0][j] = cos(6.0 * c);
+		chunks->u[1][j] = sin(6.0 * c);
+	}
+}
+
+// Write frames of the voices starting at frame first, a block at a time
+static void gen_render(
+		const void *signal,
+		const struct FMT_chunk *fmt,
+		unsigned char *dst,
+		uint64_t first,
+		uint64_t frames)
+{
+	const struct generator *gen = (const struct generator*)signal;
+	const uint16_t bytes = fmt->bits_per_sample / 8;
+	const gen_store_fn store = gen_kernels.store[bytes];
+
+	double acc[TONE_BLOCK_FRAMES] __attribute__((aligned(32)));
+	struct gen_sweep_chunks chunks;
+
+	for (uint64_t done = 0; done < frames; done += TONE_BLOCK_FRAMES) {
+		const uint64_t frame = first + done;
+		const uint32_t n = frames - done < TONE_BLOCK_FRAMES ? (uint32_t)(frames - done) : TONE_BLOCK_FRAMES;
+
+		for (uint16_t v = 0; v < gen->num_voices; ++v) {
+			const struct gen_voice *voice = &gen->voices[v];
+
+			if (voice->type == GEN_SWEEP) {
+				gen_sweep_setup(voice, frame, &chunks);
+				gen_kernels.sweep(&chunks, acc);
+			} else {
+				memset(acc, 0, sizeof(acc));
+
+				for (uint16_t i = 0; i < voice->num_partials; ++i) {
+					const struct gen_partial *p = &voice->partials[i];
+
+					// Whole turns are dropped in extended precision, as for tones
+					const long double turns = (long double)frame * p->cycles + p->phase;
+					const double w = 2.0 * M_PI * (double)(turns - floorl(turns));
+
+					gen_kernels.bank(p, p->amp * cos(w), p->amp * sin(w), acc);
+				}
+			}
+
+			for (uint16_t c = v; c < fmt->num_channels; c += gen->num_voices) {
+				store(acc, gen->peak, &dst[done * fmt->block_align + c * bytes], fmt->block_align, n);
+			}
+		}
+	}
+}
+
+static void gen_free(struct generator *gen)
+{
+	for (uint16_t v = 0; v < gen->num_voices; ++v) free(gen->voices[v].partials);
+	free(gen->voices);
+}
+
+// Full scale of fmt lowered by db
+static double gen_scale(const struct FMT_chunk *fmt, float db)
+{
+	if (db > 0.0f) db = 0.0f;
+
+	return pow(10, db / 20.0) * (pow(2, fmt->bits_per_sample - 1) - 1);
+}
+
+// Replace the waveform data with duration seconds of the voices of gen,
+// which is freed
+static WAV_State write_generator(struct WAV_file *wav, struct generator *gen, double duration)
+{
+	WAV_State ret = Error;
+	uint64_t frames;
+
+	if (wav != NULL && duration_frames(duration, &wav->fmt, &frames) == Success) {
+		if (reset_signal(wav, frames) == Success) {
+			pthread_once(&gen_once, gen_init);
+
+			gen->peak = pow(2, wav->fmt.bits_per_sample - 1) - 1;
+			render_parallel(gen_render, gen, &wav->fmt, wav->data.buff, 0, frames);
+			ret = Success;
+		}
+	}
+
+	gen_free(gen);
+
+	return ret;
+}
+
+WAV_State WAV_write_multitone(
+		struct WAV_file *wav,
+		const struct WAV_partial *partials,
+		uint16_t num_partials,
+		double duration,
+		float db)
+{
+	if (wav == NULL || partials == NULL || num_partials == 0 || num_partials > WAV_MAX_PARTIALS
+	    || wav->fmt.sample_rate == 0 || !is_int_pcm(&wav->fmt)) {
+		return Error;
+	}
+
+	for (uint16_t i = 0; i < num_partials; ++i) {
+		if (!isfinite(partials[i].frequency) || partials[i].frequency < 0.0
+		    || !isfinite(partials[i].amplitude) || !isfinite(partials[i].phase)) {
+			return Error;
+		}
+	}
+
+	struct generator gen = { NULL, 0, 0.0 };
+
+	gen.voices = (struct gen_voice*)calloc(1, sizeof(struct gen_voice));
+	if (gen.voices == NULL) return Error;
+	gen.num_voices = 1;
+
+	struct gen_voice *voice = &gen.voices[0];
+
+	voice->type = GEN_BANK;
+	voice->partials = (struct gen_partial*)malloc(num_partials * sizeof(struct gen_partial));
+
+	if (voice->partials == NULL) {
+		gen_free(&gen);
+		return Error;
+	}
+
+	voice->num_partials = num_partials;
+
+	const double scale = gen_scale(&wav->fmt, db);
+
+	for (uint16_t i = 0; i < num_partials; ++i) {
+		gen_partial_setup(&voice->partials[i], &partials[i], scale, wav->fmt.sample_rate);
+	}
+
+	return write_generator(wav, &gen, duration);
+}
+
+WAV_State WAV_write_channel_tones(
+		struct WAV_file *wav,
+		const double *frequencies,
+		double duration,
+		float db)
+{
+	if (wav == NULL || frequencies == NULL || wav->fmt.num_channels == 0
+	    || wav->fmt.sample_rate == 0 || !is_int_pcm(&wav->fmt)) {
+		return Error;
+	}
+
+	const uint16_t num_channels = wav->fmt.num_channels;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		if (!isfinite(frequencies[c]) || frequencies[c] < 0.0) return Error;
+	}
+
+	struct generator gen = { NULL, 0, 0.0 };
+
+	gen.voices = (struct gen_voice*)calloc(num_channels, sizeof(struct gen_voice));
+	if (gen.voices == NULL) return Error;
+
+	const double scale = gen_scale(&wav->fmt, db);
+
+	for (; gen.num_voices < num_channels; ++gen.num_voices) {
+		struct gen_voice *voice = &gen.voices[gen.num_voices];
+		const struct WAV_partial partial = { frequencies[gen.num_voices], 1.0, 0.0 };
+
+		voice->type = GEN_BANK;
+		voice->partials = (struct gen_partial*)malloc(sizeof(struct gen_partial));
+
+		if (voice->partials == NULL) {
+			gen_free(&gen);
+			return Error;
+		}
+
+		voice->num_partials = 1;
+		gen_partial_setup(voice->partials, &partial, scale, wav->fmt.sample_rate);
+	}
+
+	return write_generator(wav, &gen, duration);
+}
+
+WAV_State WAV_write_sweep(
+		struct WAV_file *wav,
+		WAV_SweepType type,
+		double start_frequency,
+		double end_frequency,
+		double duration,
+		float db)
+{
+	if (wav == NULL || type >= WAV_SWEEP_NumTypes || wav->fmt.sample_rate == 0 || !is_int_pcm(&wav->fmt)
+	    || !isfinite(start_frequency) || !isfinite(end_frequency) || !isfinite(duration)
+	    || start_frequency < 0.0 || end_frequency < 0.0) {
+		return Error;
+	} else if (type == WAV_SWEEP_LOG && (start_frequency <= 0.0 || end_frequency <= 0.0)) {
+		return Error;
+	}
+
+	struct generator gen = { NULL, 0, 0.0 };
+
+	gen.voices = (struct gen_voice*)calloc(1, sizeof(struct gen_voice));
+	if (gen.voices == NULL) return Error;
+	gen.num_voices = 1;
+
+	struct gen_voice *voice = &gen.voices[0];
+
+	voice->type = GEN_SWEEP;
+	voice->sweep = type;
+	voice->amp = gen_scale(&wav->fmt, db);
+	voice->start = start_frequency;
+	voice->end = end_frequency;
+	voice->length = duration;
+	voice->rate = type == WAV_SWEEP_LOG && duration > 0.0 ? log(end_frequency / start_frequency) / duration : 0.0;
+	voice->sample_rate = wav->fmt.sample_rate;
+
+	return write_generator(wav, &gen, duration);
+}
+
+/*
+ * Noise generators
+ *
+ * Every random word is drawn from Philox4x32-10, a counter based generator:
+ * the key is the seed and the counter names the word, so any frame range
+ * of any channel is generated on its own and the thread pool gives the
+ * same noise as a serial run. Pink noise is the Voss-McCartney sum of a
+ * white row and NOISE_ROWS held rows, row i taking a new value every 2^i
+ * frames, half a period out of step with the row below so one row changes
+ * per frame. A row's value at a frame is the word counting its updates,
+ * so no state is carried between blocks. Brown noise weights row i by
+ * 2^(i/2), giving each octave twice the power of the one above.
+ */
+
+#define NOISE_ROWS	16
+#define PHILOX_ROUNDS	10
+#define PHILOX_M0	0xD2511F53u
+#define PHILOX_M1	0xCD9E8D57u
+#define PHILOX_W0	0x9E3779B9u
+#define PHILOX_W1	0xBB67AE85u
+
+struct noise {
+	WAV_NoiseType	type;
+	uint32_t	key[2];
+	double		weight[NOISE_ROWS + 1];	// row 0 is white
+	double		scale;			// sample units per unit of the weighted sum
+	double		peak;			// clip level in sample units
+};
+
+// Write the 4 words of each of count counters from counter, for row and
+// channel, to out
+typedef void (*noise_draw_fn)(
+		uint64_t counter,
+		uint32_t row,
+		uint32_t channel,
+		const uint32_t *key,
+		uint32_t *out,
+		uint32_t count
+	);
+
+// Scale, clip and round n sums to samples
+typedef void (*noise_round_fn)(const double *acc, double scale, double peak, int32_t *out, uint32_t n);
+
+static void noise_draw_scalar(uint64_t counter, uint32_t row, uint32_t channel, const uint32_t *key, uint32_t *out, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t x0 = (uint32_t)(counter + i), x1 = (uint32_t)((counter + i) >> 32), x2 = row, x3 = channel;
+		uint32_t k0 = key[0], k1 = key[1];
+
+		for (int r = 0; r < PHILOX_ROUNDS; ++r) {
+			const uint64_t p0 = (uint64_t)PHILOX_M0 * x0;
+			const uint64_t p1 = (uint64_t)PHILOX_M1 * x2;
+
+			x0 = (uint32_t)(p1 >> 32) ^ x1 ^ k0;
+			x1 = (uint32_t)p1;
+			x2 = (uint32_t)(p0 >> 32) ^ x3 ^ k1;
+			x3 = (uint32_t)p0;
+
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+
+		out[4 * i] = x0;
+		out[4 * i + 1] = x1;
+		out[4 * i + 2] = x2;
+		out[4 * i + 3] = x3;
+	}
+}
+
+static void noise_round_scalar(const double *acc, double scale, double peak, int32_t *out, uint32_t n)
+{
+	for (uint32_t f = 0; f < n; ++f) {
+		double x = acc[f] * scale;
+		x = x > peak ? peak : (x < -peak ? -peak : x);
+		out[f] = (int32_t)lrint(x);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Low and high halves of the 32x32 bit products of each lane of a and m
+__attribute__((target("sse2")))
+static inline void philox_mul_sse2(__m128i a, __m128i m, __m128i *lo, __m128i *hi)
+{
+	const __m128i even = _mm_mul_epu32(a, m);
+	const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+	const __m128i low = _mm_set1_epi64x(0xFFFFFFFF);
+
+	*lo = _mm_or_si128(_mm_and_si128(even, low), _mm_slli_epi64(odd, 32));
+	*hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low, odd));
+}
+
+// Four counters at a time, one per lane
+__attribute__((target("sse2")))
+static void noise_draw_sse2(uint64_t counter, uint32_t row, uint32_t channel, const uint32_t *key, uint32_t *out, uint32_t count)
+{
+	const __m128i m0 = _mm_set1_epi32((int)PHILOX_M0);
+	const __m128i m1 = _mm_set1_epi32((int)PHILOX_M1);
+
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32_t lo[4], hi[4];
+		for (int l = 0; l < 4; ++l) {
+			lo[l] = (uint32_t)(counter + i + l);
+			hi[l] = (uint32_t)((counter + i + l) >> 32);
+		}
+
+		__m128i x0 = _mm_loadu_si128((const __m128i*)lo);
+		__m128i x1 = _mm_loadu_si128((const __m128i*)hi);
+		__m128i x2 = _mm_set1_epi32((int)row);
+		__m128i x3 = _mm_set1_epi32((int)channel);
+		__m128i k0 = _mm_set1_epi32((int)key[0]);
+		__m128i k1 = _mm_set1_epi32((int)key[1]);
+
+		for (int r = 0; r < PHILOX_ROUNDS; ++r) {
+			__m128i lo0, hi0, lo1, hi1;
+			philox_mul_sse2(x0, m0, &lo0, &hi0);
+			philox_mul_sse2(x2, m1, &lo1, &hi1);
+
+			x0 = _mm_xor_si128(_mm_xor_si128(hi1, x1), k0);
+			x1 = lo1;
+			x2 = _mm_xor_si128(_mm_xor_si128(hi0, x3), k1);
+			x3 = lo0;
+
+			k0 = _mm_add_epi32(k0, _mm_set1_epi32((int)PHILOX_W0));
+			k1 = _mm_add_epi32(k1, _mm_set1_epi32((int)PHILOX_W1));
+		}
+
+		// Lanes are counters; store each counter's words together
+		const __m128i t0 = _mm_unpacklo_epi32(x0, x1);
+		const __m128i t1 = _mm_unpackhi_epi32(x0, x1);
+		const __m128i t2 = _mm_unpacklo_epi32(x2, x3);
+		const __m128i t3 = _mm_unpackhi_epi32(x2, x3);
+
+		_mm_storeu_si128((__m128i*)&out[4 * i], _mm_unpacklo_epi64(t0, t2));
+		_mm_storeu_si128((__m128i*)&out[4 * i + 4], _mm_unpackhi_epi64(t0, t2));
+		_mm_storeu_si128((__m128i*)&out[4 * i + 8], _mm_unpacklo_epi64(t1, t3));
+		_mm_storeu_si128((__m128i*)&out[4 * i + 12], _mm_unpackhi_epi64(t1, t3));
+	}
+
+	noise_draw_scalar(counter + i, row, channel, key, &out[4 * i], count - i);
+}
+
+__attribute__((target("avx2")))
+static inline void philox_mul_avx2(__m256i a, __m256i m, __m256i *lo, __m256i *hi)
+{
+	const __m256i even = _mm256_mul_epu32(a, m);
+	const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+	const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+
+	*lo = _mm256_or_si256(_mm256_and_si256(even, low), _mm256_slli_epi64(odd, 32));
+	*hi = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_andnot_si256(low, odd));
+}
+
+__attribute__((target("avx2")))
+static void noise_draw_avx2(uint64_t counter, uint32_t row, uint32_t channel, const uint32_t *key, uint32_t *out, uint32_t count)
+{
+	const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+	const __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint32_t lo[8], hi[8];
+		for (int l = 0; l < 8; ++l) {
+			lo[l] = (uint32_t)(counter + i + l);
+			hi[l] = (uint32_t)((counter + i + l) >> 32);
+		}
+
+		__m256i x0 = _mm256_loadu_si256((const __m256i*)lo);
+		__m256i x1 = _mm256_loadu_si256((const __m256i*)hi);
+		__m256i x2 = _mm256_set1_epi32((int)row);
+		__m256i x3 = _mm256_set1_epi32((int)channel);
+		__m256i k0 = _mm256_set1_epi32((int)key[0]);
+		__m256i k1 = _mm256_set1_epi32((int)key[1]);
+
+		for (int r = 0; r < PHILOX_ROUNDS; ++r) {
+			__m256i lo0, hi0, lo1, hi1;
+			philox_mul_avx2(x0, m0, &lo0, &hi0);
+			philox_mul_avx2(x2, m1, &lo1, &hi1);
+
+			x0 = _mm256_xor_si256(_mm256_xor_si256(hi1, x1), k0);
+			x1 = lo1;
+			x2 = _mm256_xor_si256(_mm256_xor_si256(hi0, x3), k1);
+			x3 = lo0;
+
+			k0 = _mm256_add_epi32(k0, _mm256_set1_epi32((int)PHILOX_W0));
+			k1 = _mm256_add_epi32(k1, _mm256_set1_epi32((int)PHILOX_W1));
+		}
+
+		// As for SSE2 within each half, which holds counters 0-3 and 4-7
+		const __m256i t0 = _mm256_unpacklo_epi32(x0, x1);
+		const __m256i t1 = _mm256_unpackhi_epi32(x0, x1);
+		const __m256i t2 = _mm256_unpacklo_epi32(x2, x3);
+		const __m256i t3 = _mm256_unpackhi_epi32(x2, x3);
+		const __m256i c04 = _mm256_unpacklo_epi64(t0, t2);
+		const __m256i c15 = _mm256_unpackhi_epi64(t0, t2);
+		const __m256i c26 = _mm256_unpacklo_epi64(t1, t3);
+		const __m256i c37 = _mm256_unpackhi_epi64(t1, t3);
+
+		_mm256_storeu_si256((__m256i*)&out[4 * i], _mm256_permute2x128_si256(c04, c15, 0x20));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 8], _mm256_permute2x128_si256(c26, c37, 0x20));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 16], _mm256_permute2x128_si256(c04, c15, 0x31));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 24], _mm256_permute2x128_si256(c26, c37, 0x31));
+	}
+
+	noise_draw_scalar(counter + i, row, channel, key, &out[4 * i], count - i);
+}
+
+__attribute__((target("sse2")))
+static void noise_round_sse2(const double *acc, double scale, double peak, int32_t *out, uint32_t n)
+{
+	const __m128d s = _mm_set1_pd(scale);
+	const __m128d hi = _mm_set1_pd(peak);
+	const __m128d lo = _mm_set1_pd(-peak);
+
+	uint32_t f = 0;
+	for (; f + 2 <= n; f += 2) {
+		const __m128d x = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(&acc[f]), s), lo), hi);
+		_mm_storel_epi64((__m128i*)&out[f], _mm_cvtpd_epi32(x));
+	}
+
+	noise_round_scalar(&acc[f], scale, peak, &out[f], n - f);
+}
+
+__attribute__((target("avx")))
+static void noise_round_avx(const double *acc, double scale, double peak, int32_t *out, uint32_t n)
+{
+	const __m256d s = _mm256_set1_pd(scale);
+	const __m256d hi = _mm256_set1_pd(peak);
+	const __m256d lo = _mm256_set1_pd(-peak);
+
+	uint32_t f = 0;
+	for (; f + 4 <= n; f += 4) {
+		const __m256d x = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(_mm256_loadu_pd(&acc[f]), s), lo), hi);
+		_mm_storeu_si128((__m128i*)&out[f], _mm256_cvtpd_epi32(x));
+	}
+
+	noise_round_scalar(&acc[f], scale, peak, &out[f], n - f);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static void noise_round_neon(const double *acc, double scale, double peak, int32_t *out, uint32_t n)
+{
+	const float64x2_t s = vdupq_n_f64(scale);
+	const float64x2_t hi = vdupq_n_f64(peak);
+	const float64x2_t lo = vdupq_n_f64(-peak);
+
+	uint32_t f = 0;
+	for (; f + 2 <= n; f += 2) {
+		const float64x2_t x = vminq_f64(vmaxq_f64(vmulq_f64(vld1q_f64(&acc[f]), s), lo), hi);
+		vst1_s32(&out[f], vmovn_s64(vcvtnq_s64_f64(x)));
+	}
+
+	noise_round_scalar(&acc[f], scale, peak, &out[f], n - f);
+}
+
+#endif
+
+// Write samples to one channel, block_align bytes apart
+#define DEFINE_NOISE_STORE(BITS)								\
+	static void noise_store_pcm##BITS(							\
+			const int32_t *samples,							\
+			unsigned char *dst,							\
+			uint16_t block_align,							\
+			uint32_t frames)							\
+	{											\
+		for (uint32_t f = 0; f < frames; ++f) {						\
+			store_pcm##BITS(&dst[f * block_align], samples[f]);			\
+		}										\
+	}
+
+DEFINE_NOISE_STORE(8)
+DEFINE_NOISE_STORE(16)
+DEFINE_NOISE_STORE(24)
+DEFINE_NOISE_STORE(32)
+
+typedef void (*noise_store_fn)(const int32_t *samples, unsigned char *dst, uint16_t block_align, uint32_t frames);
+
+// Kernels resolved once by noise_init()
+static struct {
+	noise_draw_fn	draw;
+	noise_round_fn	round;
+	noise_store_fn	store[5];	// indexed by bytes per sample
+} noise_kernels = {
+	noise_draw_scalar,
+	noise_round_scalar,
+	{ NULL, noise_store_pcm8, noise_store_pcm16, noise_store_pcm24, noise_store_pcm32 },
+};
+
+static pthread_once_t noise_once = PTHREAD_ONCE_INIT;
+
+static void noise_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		noise_kernels.draw = noise_draw_sse2;
+		noise_kernels.round = noise_round_sse2;
+	}
+
+	if (__builtin_cpu_supports("avx")) noise_kernels.round = noise_round_avx;
+	if (__builtin_cpu_supports("avx2")) noise_kernels.draw = noise_draw_avx2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	noise_kernels.round = noise_round_neon;
+#endif
+}
+
+// The weighted sum of the rows of channel over n frames from first, a
+// multiple of TONE_BLOCK_FRAMES
+static void noise_block(const struct noise *noise, uint16_t channel, uint64_t first, uint32_t n, double *acc, uint32_t *words)
+{
+	noise_kernels.draw(first / 4, 0, channel, noise->key, words, (n + 3) / 4);
+
+	for (uint32_t f = 0; f < n; ++f) acc[f] = noise->weight[0] * (double)(int32_t)words[f];
+
+	if (noise->type == WAV_NOISE_WHITE) return;
+
+	for (uint32_t i = 1; i <= NOISE_ROWS; ++i) {
+		const uint64_t half = (uint64_t)1 << (i - 1);
+
+		// Word m of the row holds its value after m updates
+		const uint64_t m_first = (first + half) >> i;
+		const uint64_t m_last = (first + n - 1 + half) >> i;
+		const uint64_t counter = m_first / 4;
+
+		noise_kernels.draw(counter, i, channel, noise->key, words, (uint32_t)(m_last / 4 - counter + 1));
+
+		for (uint64_t m = m_first, f = 0; f < n; ++m) {
+			const double v = noise->weight[i] * (double)(int32_t)words[m - 4 * counter];
+			const uint64_t end = (m + 1) * (2 * half) - half - first;
+
+			for (const uint64_t stop = end < n ? end : n; f < stop; ++f) acc[f] += v;
+		}
+	}
+}
+
+// Write frames of the noise starting at frame first, a block at a time
+static void noise_render(
+		const void *signal,
+		const struct FMT_chunk *fmt,
+		unsigned char *dst,
+		uint64_t first,
+		uint64_t frames)
+{
+	const struct noise *noise = (const struct noise*)signal;
+	const uint16_t bytes = fmt->bits_per_sample / 8;
+	const noise_store_fn store = noise_kernels.store[bytes];
+
+	double acc[TONE_BLOCK_FRAMES];
+	uint32_t words[TONE_BLOCK_FRAMES + 8];
+	int32_t samples[TONE_BLOCK_FRAMES];
+
+	for (uint64_t done = 0; done < frames; done += TONE_BLOCK_FRAMES) {
+		const uint32_t n = frames - done < TONE_BLOCK_FRAMES ? (uint32_t)(frames - done) : TONE_BLOCK_FRAMES;
+
+		for (uint16_t c = 0; c < fmt->num_channels; ++c) {
+			noise_block(noise, c, first + done, n, acc, words);
+			noise_kernels.round(acc, noise->scale, noise->peak, samples, n);
+			store(samples, &dst[done * fmt->block_align + c * bytes], fmt->block_align, n);
+		}
+	}
+}
+
+// Noise of type at an RMS level of db relative to full scale of fmt
+static WAV_State noise_setup(struct noise *noise, WAV_NoiseType type, uint64_t seed, const struct FMT_chunk *fmt, float db)
+{
+	if (type < 0 || type >= WAV_NOISE_NumTypes) return Error;
+
+	pthread_once(&noise_once, noise_init);
+
+	if (db > 0.0f) db = 0.0f;
+
+	noise->type = type;
+	noise->key[0] = (uint32_t)seed;
+	noise->key[1] = (uint32_t)(seed >> 32);
+	noise->peak = pow(2, fmt->bits_per_sample - 1) - 1;
+
+	double power = 0.0;
+
+	for (uint32_t i = 0; i <= NOISE_ROWS; ++i) {
+		noise->weight[i] = type == WAV_NOISE_BROWN ? pow(2, i / 2.0) : 1.0;
+		if (type != WAV_NOISE_WHITE || i == 0) power += noise->weight[i] * noise->weight[i];
+	}
+
+	// A word is uniform on [-2^31, 2^31), with a power of 2^62 / 3
+	noise->scale = pow(10, db / 20.0) * noise->peak / sqrt(power * 0x1p62 / 3.0);
+
+	return Success;
+}
+
+WAV_State WAV_write_noise(
+		struct WAV_file *wav,
+		WAV_NoiseType type,
+		uint64_t seed,
+		double duration,
+		float db)
+{
+	uint64_t frames;
+	struct noise noise;
+
+	if (wav == NULL || !is_int_pcm(&wav->fmt)
+	    || duration_frames(duration, &wav->fmt, &frames) == Error
+	    || noise_setup(&noise, type, seed, &wav->fmt, db) == Error
+	    || reset_signal(wav, frames) == Error) {
+		return Error;
+	}
+
+	render_parallel(noise_render, &noise, &wav->fmt, wav->data.buff, 0, frames);
+
+	return Success;
+}
+
+/*
+ * Sample conversion kernels
+ *
+ * PCM samples are converted to and from float32 in [-1, 1). 8-bit samples are
+ * unsigned with an offset of 128, all other depths are signed. Every depth has
+ * a scalar kernel plus SSE2/SSSE3/AVX2 or NEON kernels that are picked once at
+ * runtime and give bit-identical results: scaling is by a power of two and
+ * quantizing clamps, then rounds to nearest even in every variant.
+ */
+
+typedef void (*to_float_fn)(const unsigned char *src, float *dst, uint64_t n);
+typedef void (*from_float_fn)(const float *src, unsigned char *dst, uint64_t n);
+
+// Indexed by bytes per sample
+static const float pcm_to_float_scale[5] = {
+	0.0f, 1.0f / 128.0f, 1.0f / 32768.0f, 1.0f / 8388608.0f, 1.0f / 2147483648.0f
+};
+
+static const float pcm_full_scale[5] = {
+	0.0f, 128.0f, 32768.0f, 8388608.0f, 2147483648.0f
+};
+
+static const float pcm_min[5] = {
+	0.0f, -128.0f, -32768.0f, -8388608.0f, -2147483648.0f
+};
+
+// 2147483647 has no float representation; 2147483520 is the largest float below 2^31
+static const float pcm_max[5] = {
+	0.0f, 127.0f, 32767.0f, 8388607.0f, 2147483520.0f
+};
+
+// Scale and clamp like max_ps/min_ps do, so NaN ends up at the minimum
+static inline int32_t quantize(float val, uint32_t bytes_per_sample)
+{
+	float q = val * pcm_full_scale[bytes_per_sample];
+	q = q > pcm_min[bytes_per_sample] ? q : pcm_min[bytes_per_sample];
+	q = q < pcm_max[bytes_per_sample] ? q : pcm_max[bytes_per_sample];
+	return (int32_t)lrintf(q);
+}
+
+static inline int32_t load_s24(const unsigned char *src)
+{
+	// Shift the three bytes to the top of the word, then back down to sign extend
+	return (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 24) >> 8;
+}
+
+static inline void store_s24(unsigned char *dst, int32_t val)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = (val >> 8) & 0xFF;
+	dst[2] = (val >> 16) & 0xFF;
+}
+
+static void u8_to_float_scalar(const unsigned char *src, float *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) dst[i] = (float)((int32_t)src[i] - 128) * pcm_to_float_scale[1];
+}
+
+static void s16_to_float_scalar(const unsigned char *src, float *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		int16_t val;
+		memcpy(&val, &src[2 * i], 2);
+		dst[i] = (float)val * pcm_to_float_scale[2];
+	}
+}
+
+static void s24_to_float_scalar(const unsigned char *src, float *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) dst[i] = (float)load_s24(&src[3 * i]) * pcm_to_float_scale[3];
+}
+
+static void s32_to_float_scalar(const unsigned char *src, float *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		int32_t val;
+		memcpy(&val, &src[4 * i], 4);
+		dst[i] = (float)val * pcm_to_float_scale[4];
+	}
+}
+
+static void float_to_u8_scalar(const float *src, unsigned char *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) dst[i] = (uint8_t)(quantize(src[i], 1) + 128);
+}
+
+static void float_to_s16_scalar(const float *src, unsigned char *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		const int16_t val = quantize(src[i], 2);
+		memcpy(&dst[2 * i], &val, 2);
+	}
+}
+
+static void float_to_s24_scalar(const float *src, unsigned char *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) store_s24(&dst[3 * i], quantize(src[i], 3));
+}
+
+static void float_to_s32_scalar(const float *src, unsigned char *dst, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		const int32_t val = quantize(src[i], 4);
+		memcpy(&dst[4 * i], &val, 4);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Clamp and round four scaled samples the same way quantize() does
+static inline __m128i quantize_sse2(__m128 val, uint32_t bytes_per_sample)
+{
+	__m128 q = _mm_mul_ps(val, _mm_set1_ps(pcm_full_scale[bytes_per_sample]));
+	q = _mm_max_ps(q, _mm_set1_ps(pcm_min[bytes_per_sample]));
+	q = _mm_min_ps(q, _mm_set1_ps(pcm_max[bytes_per_sample]));
+	return _mm_cvtps_epi32(q);
+}
+
+static void u8_to_float_sse2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m128 scale = _mm_set1_ps(pcm_to_float_scale[1]);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i offset = _mm_set1_epi16(128);
+
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&src[i]);
+		const __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), offset);
+		const __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), offset);
+
+		_mm_storeu_ps(&dst[i],      _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)), scale));
+		_mm_storeu_ps(&dst[i + 4],  _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)), scale));
+		_mm_storeu_ps(&dst[i + 8],  _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)), scale));
+		_mm_storeu_ps(&dst[i + 12], _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)), scale));
+	}
+
+	u8_to_float_scalar(&src[i], &dst[i], n - i);
+}
+
+static void s16_to_float_sse2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m128 scale = _mm_set1_ps(pcm_to_float_scale[2]);
+
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&src[2 * i]);
+
+		_mm_storeu_ps(&dst[i],     _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale));
+		_mm_storeu_ps(&dst[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale));
+	}
+
+	s16_to_float_scalar(&src[2 * i], &dst[i], n - i);
+}
+
+// Spread four packed 24-bit samples into the top three bytes of each 32-bit lane
+#define S24_UNPACK_MASK _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)
+
+// Gather the low three bytes of each 32-bit lane into 12 packed bytes
+#define S24_PACK_MASK _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1)
+
+__attribute__((target("ssse3")))
+static void s24_to_float_ssse3(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m128 scale = _mm_set1_ps(pcm_to_float_scale[3]);
+	const __m128i mask = S24_UNPACK_MASK;
+
+	// Each load reads 16 bytes for 12 bytes of samples, so stop 6 samples early
+	uint64_t i = 0;
+	for (; i + 6 <= n; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&src[3 * i]);
+		const __m128i s = _mm_srai_epi32(_mm_shuffle_epi8(v, mask), 8);
+
+		_mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(s), scale));
+	}
+
+	s24_to_float_scalar(&src[3 * i], &dst[i], n - i);
+}
+
+static void s32_to_float_sse2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m128 scale = _mm_set1_ps(pcm_to_float_scale[4]);
+
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)&src[4 * i]);
+		_mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+	}
+
+	s32_to_float_scalar(&src[4 * i], &dst[i], n - i);
+}
+
+static void float_to_u8_sse2(const float *src, unsigned char *dst, uint64_t n)
+{
+	const __m128i offset = _mm_set1_epi16(128);
+
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i a = quantize_sse2(_mm_loadu_ps(&src[i]), 1);
+		const __m128i b = quantize_sse2(_mm_loadu_ps(&src[i + 4]), 1);
+		const __m128i c = quantize_sse2(_mm_loadu_ps(&src[i + 8]), 1);
+		const __m128i d = quantize_sse2(_mm_loadu_ps(&src[i + 12]), 1);
+
+		const __m128i lo = _mm_add_epi16(_mm_packs_epi32(a, b), offset);
+		const __m128i hi = _mm_add_epi16(_mm_packs_epi32(c, d), offset);
+
+		_mm_storeu_si128((__m128i*)&dst[i], _mm_packus_epi16(lo, hi));
+	}
+
+	float_to_u8_scalar(&src[i], &dst[i], n - i);
+}
+
+static void float_to_s16_sse2(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i a = quantize_sse2(_mm_loadu_ps(&src[i]), 2);
+		const __m128i b = quantize_sse2(_mm_loadu_ps(&src[i + 4]), 2);
+
+		_mm_storeu_si128((__m128i*)&dst[2 * i], _mm_packs_epi32(a, b));
+	}
+
+	float_to_s16_scalar(&src[i], &dst[2 * i], n - i);
+}
+
+__attribute__((target("ssse3")))
+static void float_to_s24_ssse3(const float *src, unsigned char *dst, uint64_t n)
+{
+	const __m128i mask = S24_PACK_MASK;
+
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i v = _mm_shuffle_epi8(quantize_sse2(_mm_loadu_ps(&src[i]), 3), mask);
+		const int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+
+		_mm_storel_epi64((__m128i*)&dst[3 * i], v);
+		memcpy(&dst[3 * i + 8], &tail, 4);
+	}
+
+	float_to_s24_scalar(&src[i], &dst[3 * i], n - i);
+}
+
+static void float_to_s32_sse2(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i*)&dst[4 * i], quantize_sse2(_mm_loadu_ps(&src[i]), 4));
+	}
+
+	float_to_s32_scalar(&src[i], &dst[4 * i], n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize_avx2(__m256 val, uint32_t bytes_per_sample)
+{
+	__m256 q = _mm256_mul_ps(val, _mm256_set1_ps(pcm_full_scale[bytes_per_sample]));
+	q = _mm256_max_ps(q, _mm256_set1_ps(pcm_min[bytes_per_sample]));
+	q = _mm256_min_ps(q, _mm256_set1_ps(pcm_max[bytes_per_sample]));
+	return _mm256_cvtps_epi32(q);
+}
+
+__attribute__((target("avx2")))
+static void u8_to_float_avx2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m256 scale = _mm256_set1_ps(pcm_to_float_scale[1]);
+	const __m256i offset = _mm256_set1_epi32(128);
+
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&src[i]));
+		_mm256_storeu_ps(&dst[i], _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(v, offset)), scale));
+	}
+
+	u8_to_float_scalar(&src[i], &dst[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void s16_to_float_avx2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m256 scale = _mm256_set1_ps(pcm_to_float_scale[2]);
+
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&src[2 * i]));
+		_mm256_storeu_ps(&dst[i], _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+
+	s16_to_float_scalar(&src[2 * i], &dst[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void s24_to_float_avx2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m256 scale = _mm256_set1_ps(pcm_to_float_scale[3]);
+	const __m256i mask = _mm256_broadcastsi128_si256(S24_UNPACK_MASK);
+
+	// The upper lane loads 16 bytes starting 12 bytes in, so stop 10 samples early
+	uint64_t i = 0;
+	for (; i + 10 <= n; i += 8) {
+		const __m256i v = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&src[3 * i])),
+				_mm_loadu_si128((const __m128i*)&src[3 * i + 12]),
+				1
+			);
+		const __m256i s = _mm256_srai_epi32(_mm256_shuffle_epi8(v, mask), 8);
+
+		_mm256_storeu_ps(&dst[i], _mm256_mul_ps(_mm256_cvtepi32_ps(s), scale));
+	}
+
+	s24_to_float_ssse3(&src[3 * i], &dst[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void s32_to_float_avx2(const unsigned char *src, float *dst, uint64_t n)
+{
+	const __m256 scale = _mm256_set1_ps(pcm_to_float_scale[4]);
+
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*)&src[4 * i]);
+		_mm256_storeu_ps(&dst[i], _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+
+	s32_to_float_scalar(&src[4 * i], &dst[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m256i a = quantize_avx2(_mm256_loadu_ps(&src[i]), 2);
+		const __m256i b = quantize_avx2(_mm256_loadu_ps(&src[i + 8]), 2);
+
+		// packs works per 128-bit lane; put the quarters back in order
+		const __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_si256((__m256i*)&dst[2 * i], v);
+	}
+
+	float_to_s16_sse2(&src[i], &dst[2 * i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s24_avx2(const float *src, unsigned char *dst, uint64_t n)
+{
+	const __m256i mask = _mm256_broadcastsi128_si256(S24_PACK_MASK);
+
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_shuffle_epi8(quantize_avx2(_mm256_loadu_ps(&src[i]), 3), mask);
+		const __m128i lo = _mm256_castsi256_si128(v);
+		const __m128i hi = _mm256_extracti128_si256(v, 1);
+
+		const int32_t lo_tail = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+		const int32_t hi_tail = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+
+		_mm_storel_epi64((__m128i*)&dst[3 * i], lo);
+		memcpy(&dst[3 * i + 8], &lo_tail, 4);
+		_mm_storel_epi64((__m128i*)&dst[3 * i + 12], hi);
+		memcpy(&dst[3 * i + 20], &hi_tail, 4);
+	}
+
+	float_to_s24_ssse3(&src[i], &dst[3 * i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s32_avx2(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i*)&dst[4 * i], quantize_avx2(_mm256_loadu_ps(&src[i]), 4));
+	}
+
+	float_to_s32_scalar(&src[i], &dst[4 * i], n - i);
+}
+
+// Split interleaved stereo into two channels, four frames at a time
+static uint64_t deinterleave_stereo_simd(const float *src, float *left, float *right, uint64_t frames)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 a = _mm_loadu_ps(&src[2 * i]);
+		const __m128 b = _mm_loadu_ps(&src[2 * i + 4]);
+
+		_mm_storeu_ps(&left[i],  _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(&right[i], _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+
+	return i;
+}
+
+static uint64_t interleave_stereo_simd(const float *left, const float *right, float *dst, uint64_t frames)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 l = _mm_loadu_ps(&left[i]);
+		const __m128 r = _mm_loadu_ps(&right[i]);
+
+		_mm_storeu_ps(&dst[2 * i],     _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(&dst[2 * i + 4], _mm_unpackhi_ps(l, r));
+	}
+
+	return i;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+// maxnm/minnm pick the number over NaN, matching quantize()
+static inline int32x4_t quantize_neon(float32x4_t val, uint32_t bytes_per_sample)
+{
+	float32x4_t q = vmulq_n_f32(val, pcm_full_scale[bytes_per_sample]);
+	q = vmaxnmq_f32(q, vdupq_n_f32(pcm_min[bytes_per_sample]));
+	q = vminnmq_f32(q, vdupq_n_f32(pcm_max[bytes_per_sample]));
+	return vcvtnq_s32_f32(q);
+}
+
+static void s16_to_float_neon(const unsigned char *src, float *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(&src[2 * i]));
+
+		vst1q_f32(&dst[i],     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), pcm_to_float_scale[2]));
+		vst1q_f32(&dst[i + 4], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), pcm_to_float_scale[2]));
+	}
+
+	s16_to_float_scalar(&src[2 * i], &dst[i], n - i);
+}
+
+// vld3 splits 8 packed 24-bit samples into their low, middle and high bytes
+static void s24_to_float_neon(const unsigned char *src, float *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const uint8x8x3_t b = vld3_u8(&src[3 * i]);
+
+		const uint16x8_t lo = vorrq_u16(vmovl_u8(b.val[0]), vshll_n_u8(b.val[1], 8));
+		const int16x8_t hi = vmovl_s8(vreinterpret_s8_u8(b.val[2]));
+
+		const int32x4_t s0 = vorrq_s32(
+				vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(lo))),
+				vshlq_n_s32(vmovl_s16(vget_low_s16(hi)), 16)
+			);
+		const int32x4_t s1 = vorrq_s32(
+				vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(lo))),
+				vshlq_n_s32(vmovl_s16(vget_high_s16(hi)), 16)
+			);
+
+		vst1q_f32(&dst[i],     vmulq_n_f32(vcvtq_f32_s32(s0), pcm_to_float_scale[3]));
+		vst1q_f32(&dst[i + 4], vmulq_n_f32(vcvtq_f32_s32(s1), pcm_to_float_scale[3]));
+	}
+
+	s24_to_float_scalar(&src[3 * i], &dst[i], n - i);
+}
+
+static void float_to_s16_neon(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const int16x8_t v = vcombine_s16(
+				vqmovn_s32(quantize_neon(vld1q_f32(&src[i]), 2)),
+				vqmovn_s32(quantize_neon(vld1q_f32(&src[i + 4]), 2))
+			);
+
+		vst1q_u8(&dst[2 * i], vreinterpretq_u8_s16(v));
+	}
+
+	float_to_s16_scalar(&src[i], &dst[2 * i], n - i);
+}
+
+// vst3 interleaves the low, middle and high bytes of 8 samples back into 24 bytes
+static void float_to_s24_neon(const float *src, unsigned char *dst, uint64_t n)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const int32x4_t s0 = quantize_neon(vld1q_f32(&src[i]), 3);
+		const int32x4_t s1 = quantize_neon(vld1q_f32(&src[i + 4]), 3);
+
+		const uint16x8_t lo = vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(s0)), vmovn_u32(vreinterpretq_u32_s32(s1)));
+		const uint16x8_t hi = vcombine_u16(
+				vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(s0, 16))),
+				vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(s1, 16)))
+			);
+
+		uint8x8x3_t b;
+		b.val[0] = vmovn_u16(lo);
+		b.val[1] = vshrn_n_u16(lo, 8);
+		b.val[2] = vmovn_u16(hi);
+
+		vst3_u8(&dst[3 * i], b);
+	}
+
+	float_to_s24_scalar(&src[i], &dst[3 * i], n - i);
+}
+
+static uint64_t deinterleave_stereo_simd(const float *src, float *left, float *right, uint64_t frames)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		const float32x4x2_t v = vld2q_f32(&src[2 * i]);
+
+		vst1q_f32(&left[i], v.val[0]);
+		vst1q_f32(&right[i], v.val[1]);
+	}
+
+	return i;
+}
+
+static uint64_t interleave_stereo_simd(const float *left, const float *right, float *dst, uint64_t frames)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		float32x4x2_t v;
+		v.val[0] = vld1q_f32(&left[i]);
+		v.val[1] = vld1q_f32(&right[i]);
+
+		vst2q_f32(&dst[2 * i], v);
+	}
+
+	return i;
+}
+
+#else
+
+static uint64_t deinterleave_stereo_simd(const float *src, float *left, float *right, uint64_t frames)
+{
+	(void)src; (void)left; (void)right; (void)frames;
+	return 0;
+}
+
+static uint64_t interleave_stereo_simd(const float *left, const float *right, float *dst, uint64_t frames)
+{
+	(void)left; (void)right; (void)dst; (void)frames;
+	return 0;
+}
+
+#endif
+
+// Conversion kernels for each bytes per sample, resolved once by convert_init()
+static to_float_fn   to_float_kernels[5];
+static from_float_fn from_float_kernels[5];
+
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+
+static void convert_init(void)
+{
+	to_float_kernels[1] = u8_to_float_scalar;
+	to_float_kernels[2] = s16_to_float_scalar;
+	to_float_kernels[3] = s24_to_float_scalar;
+	to_float_kernels[4] = s32_to_float_scalar;
+
+	from_float_kernels[1] = float_to_u8_scalar;
+	from_float_kernels[2] = float_to_s16_scalar;
+	from_float_kernels[3] = float_to_s24_scalar;
+	from_float_kernels[4] = float_to_s32_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		to_float_kernels[1] = u8_to_float_sse2;
+		to_float_kernels[2] = s16_to_float_sse2;
+		to_float_kernels[4] = s32_to_float_sse2;
+
+		from_float_kernels[1] = float_to_u8_sse2;
+		from_float_kernels[2] = float_to_s16_sse2;
+		from_float_kernels[4] = float_to_s32_sse2;
+	}
+
+	if (__builtin_cpu_supports("ssse3")) {
+		to_float_kernels[3] = s24_to_float_ssse3;
+		from_float_kernels[3] = float_to_s24_ssse3;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		to_float_kernels[1] = u8_to_float_avx2;
+		to_float_kernels[2] = s16_to_float_avx2;
+		to_float_kernels[3] = s24_to_float_avx2;
+		to_float_kernels[4] = s32_to_float_avx2;
+
+		from_float_kernels[2] = float_to_s16_avx2;
+		from_float_kernels[3] = float_to_s24_avx2;
+		from_float_kernels[4] = float_to_s32_avx2;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	to_float_kernels[2] = s16_to_float_neon;
+	to_float_kernels[3] = s24_to_float_neon;
+
+	from_float_kernels[2] = float_to_s16_neon;
+	from_float_kernels[3] = float_to_s24_neon;
+#endif
+}
+
+// Interleaved samples converted per step of decode_frames/encode_frames
+#define CONVERT_CHUNK 4096
+
+// Convert frames interleaved PCM frames from src into the planar channels
+// dst[c][dst_frame ...]
+static void decode_frames(
+		const unsigned char *src,
+		const struct FMT_chunk *fmt,
+		uint64_t frames,
+		float *const *dst,
+		uint64_t dst_frame)
+{
+	pthread_once(&convert_once, convert_init);
+
+	const uint32_t bytes_per_sample = fmt->bits_per_sample / 8;
+	const uint16_t num_channels = fmt->num_channels;
+	const to_float_fn to_float = to_float_kernels[bytes_per_sample];
+
+	if (num_channels == 1) {
+		to_float(src, &dst[0][dst_frame], frames);
+		return;
+	}
+
+	float tmp[CONVERT_CHUNK];
+	const uint64_t step = num_channels <= CONVERT_CHUNK ? CONVERT_CHUNK / num_channels : 0;
+
+	for (uint64_t done = 0; done < frames; ) {
+		if (step == 0) {
+			// More channels than fit the scratch buffer; convert sample by sample
+			for (uint16_t c = 0; c < num_channels; ++c) {
+				to_float(&src[(done * num_channels + c) * bytes_per_sample], &dst[c][dst_frame + done], 1);
+			}
+			done++;
+			continue;
+		}
+
+		const uint64_t n = frames - done < step ? frames - done : step;
+
+		to_float(&src[done * num_channels * bytes_per_sample], tmp, n * num_channels);
+
+		uint64_t i = 0;
+
+		if (num_channels == 2) {
+			i = deinterleave_stereo_simd(tmp, &dst[0][dst_frame + done], &dst[1][dst_frame + done], n);
+		}
+
+		for (uint16_t c = 0; c < num_channels; ++c) {
+			float *out = &dst[c][dst_frame + done];
+
+			for (uint64_t f = i; f < n; ++f) out[f] = tmp[f * num_channels + c];
+		}
+
+		done += n;
+	}
+}
+
+// Quantize frames frames of the planar channels src[c][src_frame ...] into
+// interleaved PCM at dst
+static void encode_frames(
+		const float *const *src,
+		uint64_t src_frame,
+		const struct FMT_chunk *fmt,
+		uint64_t frames,
+		unsigned char *dst)
+{
+	pthread_once(&convert_once, convert_init);
+
+	const uint32_t bytes_per_sample = fmt->bits_per_sample / 8;
+	const uint16_t num_channels = fmt->num_channels;
+	const from_float_fn from_float = from_float_kernels[bytes_per_sample];
+
+	if (num_channels == 1) {
+		from_float(&src[0][src_frame], dst, frames);
+		return;
+	}
+
+	float tmp[CONVERT_CHUNK];
+	const uint64_t step = num_channels <= CONVERT_CHUNK ? CONVERT_CHUNK / num_channels : 0;
+
+	for (uint64_t done = 0; done < frames; ) {
+		if (step == 0) {
+			for (uint16_t c = 0; c < num_channels; ++c) {
+				from_float(&src[c][src_frame + done], &dst[(done * num_channels + c) * bytes_per_sample], 1);
+			}
+			done++;
+			continue;
+		}
+
+		const uint64_t n = frames - done < step ? frames - done : step;
+
+		uint64_t i = 0;
+
+		if (num_channels == 2) {
+			i = interleave_stereo_simd(&src[0][src_frame + done], &src[1][src_frame + done], tmp, n);
+		}
+
+		for (uint16_t c = 0; c < num_channels; ++c) {
+			const float *in = &src[c][src_frame + done];
+
+			for (uint64_t f = i; f < n; ++f) tmp[f * num_channels + c] = in[f];
+		}
+
+		from_float(tmp, &dst[done * num_channels * bytes_per_sample], n * num_channels);
+
+		done += n;
+	}
+}
+
+// The planar paths step through frames of num_channels packed samples, so
+// block_align must agree with them
+static int valid_pcm_format(const struct FMT_chunk *fmt)
+{
+	return fmt->num_channels > 0 && is_int_pcm(fmt)
+		&& fmt->block_align == (uint32_t)fmt->num_channels * (fmt->bits_per_sample / 8);
+}
+
+WAV_State WAV_planar_alloc(struct WAV_planar *planar, uint16_t num_channels, uint64_t frames)
+{
+	if (planar == NULL || num_channels == 0) return Error;
+
+	memset(planar, 0, sizeof(*planar));
+
+	planar->channels = (float**)calloc(num_channels, sizeof(float*));
+
+	if (planar->channels == NULL) return Error;
+
+	planar->num_channels = num_channels;
+	planar->frames = frames;
+
+	// Round each channel up to whole cache lines so SIMD loops can run past the end
+	const uint64_t size = ((frames * sizeof(float) + WAV_PLANAR_ALIGN - 1) / WAV_PLANAR_ALIGN) * WAV_PLANAR_ALIGN;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		if (posix_memalign((void**)&planar->channels[c], WAV_PLANAR_ALIGN, size > 0 ? size : WAV_PLANAR_ALIGN) != 0) {
+			planar->channels[c] = NULL;
+			WAV_planar_free(planar);
+			return Error;
+		}
+	}
+
+	return Success;
+}
+
+void WAV_planar_free(struct WAV_planar *planar)
+{
+	if (planar == NULL || planar->channels == NULL) return;
+
+	for (uint16_t c = 0; c < planar->num_channels; ++c) {
+		free(planar->channels[c]);
+	}
+
+	free(planar->channels);
+	planar->channels = NULL;
+	planar->num_channels = 0;
+	planar->frames = 0;
+}
+
+float WAV_planar_get_peak(const struct WAV_planar *planar)
+{
+	if (planar == NULL || planar->channels == NULL) return 0.0f;
+
+	const max_abs_float_fn max_abs = max_abs_float_kernel();
+
+	float peak = 0.0f;
+
+	for (uint16_t c = 0; c < planar->num_channels; ++c) {
+		const float channel_peak = max_abs((const unsigned char*)planar->channels[c], planar->frames);
+		peak = channel_peak > peak ? channel_peak : peak;
+	}
+
+	return peak;
+}
+
+// Per-range state of the parallel conversion between interleaved and planar samples
+struct convert_job {
+	unsigned char		*buff;
+	const struct FMT_chunk	*fmt;
+	float *const		*channels;
+	uint64_t		frames;
+	uint64_t		range;	// frames per range
+};
+
+static void decode_task(uint64_t index, void *ctx)
+{
+	const struct convert_job *job = (const struct convert_job*)ctx;
+	const uint64_t first = index * job->range;
+	const uint64_t n = job->frames - first < job->range ? job->frames - first : job->range;
+
+	decode_frames(&job->buff[first * job->fmt->block_align], job->fmt, n, job->channels, first);
+}
+
+static void encode_task(uint64_t index, void *ctx)
+{
+	const struct convert_job *job = (const struct convert_job*)ctx;
+	const uint64_t first = index * job->range;
+	const uint64_t n = job->frames - first < job->range ? job->frames - first : job->range;
+
+	encode_frames((const float *const *)job->channels, first, job->fmt, n, &job->buff[first * job->fmt->block_align]);
+}
+
+static void parallel_convert(
+		pool_task_fn task,
+		unsigned char *buff,
+		const struct FMT_chunk *fmt,
+		float *const *channels,
+		uint64_t frames)
+{
+	const struct convert_job job = {
+		.buff = buff,
+		.fmt = fmt,
+		.channels = channels,
+		.frames = frames,
+		.range = pool_range_items(fmt->block_align),
+	};
+
+	pool_run(pool_range_count(frames, job.range), task, (void*)&job);
+}
+
+WAV_State WAV_to_planar(struct WAV_file *wav, struct WAV_planar *planar)
+{
+	if (wav == NULL || planar == NULL || !valid_pcm_format(&wav->fmt)) return Error;
+	if (load_DATA_chunk(wav) == Error && wav->data.size > 0) return Error;
+
+	const uint64_t frames = wav->data.size / wav->fmt.block_align;
+
+	if (WAV_planar_alloc(planar, wav->fmt.num_channels, frames) == Error) return Error;
+
+	parallel_convert(decode_task, wav->data.buff, &wav->fmt, planar->channels, frames);
+
+	return Success;
+}
+
+WAV_State WAV_from_planar(struct WAV_file *wav, const struct WAV_planar *planar)
+{
+	if (wav == NULL || planar == NULL || !valid_pcm_format(&wav->fmt)) return Error;
+	if (planar->num_channels != wav->fmt.num_channels) return Error;
+
+	const uint64_t size = planar->frames * wav->fmt.block_align;
+
+	// Reuse the waveform data when it already has the right size
+	if (wav->data.buff != NULL && wav->data.size == size) {
+		if (writable_DATA_chunk(wav) == Error) return Error;
+	} else {
+		unsigned char *buff = (unsigned char*)malloc(size > 0 ? size : 1);
+
+		if (buff == NULL) return Error;
+
+		free_buff(wav, wav->data.buff);
+		wav->riff.size = wav->riff.size - wav->data.size + size;
+		wav->data.buff = buff;
+		wav->data.size = size;
+	}
+
+	parallel_convert(encode_task, wav->data.buff, &wav->fmt, planar->channels, planar->frames);
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+// Operation on a block of planar float frames
+typedef void (*planar_block_fn)(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx);
+
+// Frames decoded to float at a time by process_planar; small enough to stay in cache
+#define DSP_BLOCK_FRAMES 1024
+
+// Decode buff up to max_block_frames at a time, run fn on the planar floats
+// and quantize the result back in place
+static WAV_State process_planar_blocks(
+		unsigned char *buff,
+		uint64_t frames,
+		const struct FMT_chunk *fmt,
+		uint64_t max_block_frames,
+		planar_block_fn fn,
+		void *ctx)
+{
+	struct WAV_planar block;
+
+	const uint64_t block_frames = frames < max_block_frames ? frames : max_block_frames;
+
+	if (WAV_planar_alloc(&block, fmt->num_channels, block_frames) == Error) return Error;
+
+	for (uint64_t done = 0; done < frames; done += block_frames) {
+		const uint64_t n = frames - done < block_frames ? frames - done : block_frames;
+		unsigned char *pos = &buff[done * fmt->block_align];
+
+		decode_frames(pos, fmt, n, block.channels, 0);
+		fn(block.channels, fmt->num_channels, n, ctx);
+		encode_frames((const float *const *)block.channels, 0, fmt, n, pos);
+	}
+
+	WAV_planar_free(&block);
+
+	return Success;
+}
+
+// process_planar_blocks with cache-sized blocks
+static WAV_State process_planar(
+		unsigned char *buff,
+		uint64_t frames,
+		const struct FMT_chunk *fmt,
+		planar_block_fn fn,
+		void *ctx)
+{
+	return process_planar_blocks(buff, frames, fmt, DSP_BLOCK_FRAMES, fn, ctx);
+}
+
+// Per-channel state of the one-pole filters, carried from one block of frames to the next
+struct pass_filter {
+	float    alpha;
+	float    *prev_vals;
+	float    *prev_filtered_vals;
+	uint16_t num_channels;
+	int      primed;	// set once the first frame has seeded the previous values
+	planar_block_fn kernel;	// low or high pass kernel for num_channels
+};
+
+static void pass_filter_free(struct pass_filter *filter)
+{
+	free(filter->prev_vals);
+	filter->prev_vals = NULL;
+
+	free(filter->prev_filtered_vals);
+	filter->prev_filtered_vals = NULL;
+}
+
+// The very first frame only seeds the previous values and is left untouched
+static uint64_t pass_filter_prime(struct pass_filter *filter, float *const *channels)
+{
+	if (filter->primed) return 0;
+
+	for (uint16_t c = 0; c < filter->num_channels; ++c) {
+		filter->prev_vals[c] = channels[c][0];
+		filter->prev_filtered_vals[c] = channels[c][0];
+	}
+
+	filter->primed = 1;
+
+	return 1;
+}
+
+static void low_pass_planar(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	struct pass_filter *filter = (struct pass_filter*)ctx;
+
+	if (frames == 0) return;
+
+	const uint64_t first = pass_filter_prime(filter, channels);
+	const float alpha = filter->alpha;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		float *samples = channels[c];
+		float prev = filter->prev_vals[c];
+
+		for (uint64_t i = first; i < frames; ++i) {
+			prev = alpha * samples[i] + (1.0f - alpha) * prev;
+			samples[i] = prev;
+		}
+
+		filter->prev_vals[c] = prev;
+	}
+}
+
+static void high_pass_planar(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	struct pass_filter *filter = (struct pass_filter*)ctx;
+
+	if (frames == 0) return;
+
+	const uint64_t first = pass_filter_prime(filter, channels);
+	const float alpha = filter->alpha;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		float *samples = channels[c];
+		float prev = filter->prev_vals[c];
+		float prev_filtered = filter->prev_filtered_vals[c];
+
+		for (uint64_t i = first; i < frames; ++i) {
+			const float sample = samples[i];
+
+			prev_filtered = alpha * (prev_filtered + sample - prev);
+			prev = sample;
+			samples[i] = prev_filtered;
+		}
+
+		filter->prev_vals[c] = prev;
+		filter->prev_filtered_vals[c] = prev_filtered;
+	}
+}
+
+// Filter kernels for a fixed channel count. The state of every channel stays
+// in registers and the channels are stepped together a frame at a time, so
+// their recurrences overlap instead of running one after the other.
+#define DEFINE_PASS_FILTER_KERNELS(CHANNELS)							\
+	static void low_pass_planar_##CHANNELS(							\
+			float *const *channels,							\
+			uint16_t num_channels,							\
+			uint64_t frames,							\
+			void *ctx)								\
+	{											\
+		struct pass_filter *filter = (struct pass_filter*)ctx;				\
+		(void)num_channels;								\
+												\
+		if (frames == 0) return;							\
+												\
+		const uint64_t first = pass_filter_prime(filter, channels);			\
+		const float alpha = filter->alpha;						\
+												\
+		float prev[CHANNELS];								\
+		for (int c = 0; c < CHANNELS; ++c) prev[c] = filter->prev_vals[c];		\
+												\
+		for (uint64_t i = first; i < frames; ++i) {					\
+			for (int c = 0; c < CHANNELS; ++c) {					\
+				prev[c] = alpha * channels[c][i] + (1.0f - alpha) * prev[c];	\
+				channels[c][i] = prev[c];					\
+			}									\
+		}										\
+												\
+		for (int c = 0; c < CHANNELS; ++c) filter->prev_vals[c] = prev[c];		\
+	}											\
+												\
+	static void high_pass_planar_##CHANNELS(						\
+			float *const *channels,							\
+			uint16_t num_channels,							\
+			uint64_t frames,							\
+			void *ctx)								\
+	{											\
+		struct pass_filter *filter = (struct pass_filter*)ctx;				\
+		(void)num_channels;								\
+												\
+		if (frames == 0) return;							\
+												\
+		const uint64_t first = pass_filter_prime(filter, channels);			\
+		const float alpha = filter->alpha;						\
+												\
+		float prev[CHANNELS];								\
+		float prev_filtered[CHANNELS];							\
+		for (int c = 0; c < CHANNELS; ++c) {						\
+			prev[c] = filter->prev_vals[c];						\
+			prev_filtered[c] = filter->prev_filtered_vals[c];			\
+		}										\
+												\
+		for (uint64_t i = first; i < frames; ++i) {					\
+			for (int c = 0; c < CHANNELS; ++c) {					\
+				const float sample = channels[c][i];				\
+												\
+				prev_filtered[c] = alpha * (prev_filtered[c] + sample - prev[c]);\
+				prev[c] = sample;						\
+				channels[c][i] = prev_filtered[c];				\
+			}									\
+		}										\
+												\
+		for (int c = 0; c < CHANNELS; ++c) {						\
+			filter->prev_vals[c] = prev[c];						\
+			filter->prev_filtered_vals[c] = prev_filtered[c];			\
+		}										\
+	}
+
+DEFINE_PASS_FILTER_KERNELS(1)
+DEFINE_PASS_FILTER_KERNELS(2)
+
+// Indexed by high pass, then by channel count with 0 for any count above 2
+static const planar_block_fn pass_filter_kernels[2][3] = {
+	{ low_pass_planar,  low_pass_planar_1,  low_pass_planar_2 },
+	{ high_pass_planar, high_pass_planar_1, high_pass_planar_2 },
+};
+
+static WAV_State pass_filter_init(
+		struct pass_filter *filter,
+		const struct FMT_chunk *fmt,
+		float alpha,
+		int high_pass)
+{
+	filter->alpha = alpha;
+	filter->num_channels = fmt->num_channels;
+	filter->primed = 0;
+	filter->kernel = pass_filter_kernels[high_pass != 0][fmt->num_channels <= 2 ? fmt->num_channels : 0];
+
+	filter->prev_vals = (float*)calloc(fmt->num_channels, sizeof(float));
+	filter->prev_filtered_vals = (float*)calloc(fmt->num_channels, sizeof(float));
+
+	if (filter->prev_vals == NULL || filter->prev_filtered_vals == NULL) {
+		free(filter->prev_vals);
+		free(filter->prev_filtered_vals);
+		return Error;
+	}
+
+	return Success;
+}
+
+static void pass_filter_block(struct pass_filter *filter, unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt)
+{
+	process_planar(buff, frames, fmt, filter->kernel, filter);
+}
+
+static float low_pass_alpha(float cutoff, uint32_t sample_rate)
+{
+	float rc = 1.0f / (cutoff * 2 * M_PI);
+	float dt = 1.0f / (float)sample_rate;
+	return dt / (rc + dt);
+}
+
+static float high_pass_alpha(float cutoff, uint32_t sample_rate)
+{
+	float rc = 1.0f / (cutoff * 2 * M_PI);
+	float dt = 1.0f / (float)sample_rate;
+	return rc / (rc + dt);
+}
+
+void WAV_apply_low_pass_filter(struct WAV_file *wav, float cutoff)
+{
+	if (wav == NULL || load_DATA_chunk(wav) == Error || !valid_pcm_format(&wav->fmt)
+	    || writable_DATA_chunk(wav) == Error) {
+		return;
+	}
+
+	struct pass_filter filter;
+
+	if (!pass_filter_init(&filter, &wav->fmt, low_pass_alpha(cutoff, wav->fmt.sample_rate), 0)) {
+		return;
+	}
+
+	pass_filter_block(&filter, wav->data.buff, wav->data.size / wav->fmt.block_align, &wav->fmt);
+	WAV_invalidate_stats(wav);
+
+	pass_filter_free(&filter);
+}
+
+void WAV_apply_high_pass_filter(struct WAV_file *wav, float cutoff)
+{
+	if (wav == NULL || load_DATA_chunk(wav) == Error || !valid_pcm_format(&wav->fmt)
+	    || writable_DATA_chunk(wav) == Error) {
+		return;
+	}
+
+	struct pass_filter filter;
+
+	if (!pass_filter_init(&filter, &wav->fmt, high_pass_alpha(cutoff, wav->fmt.sample_rate), 1)) {
+		return;
+	}
+
+	pass_filter_block(&filter, wav->data.buff, wav->data.size / wav->fmt.block_align, &wav->fmt);
+	WAV_invalidate_stats(wav);
+
+	pass_filter_free(&filter);
+}
+
+/*
+ * Biquad filters
+ *
+ * A WAV_biquad is a cascade of second order sections run in transposed
+ * direct form II on planar float data. Channels are filtered in groups of
+ * four (SSE, NEON) or eight (AVX) lanes: a block of frames of the group is
+ * interleaved into a small buffer so one vector holds the same frame of
+ * every channel, and each section then steps through the block with its
+ * state in registers. Groups are independent and run on the thread pool.
+ * Every kernel does the same float operations in the same order, so the
+ * output does not depend on the CPU or on how channels are grouped.
+ */
+
+// Channels of the widest kernel; the state of each section is padded to it
+#define BIQUAD_MAX_LANES 8
+
+// Frames interleaved per step of a group kernel
+#define BIQUAD_BLOCK_FRAMES 256
+
+// Filter channels [first_channel, first_channel + count) of a group
+typedef void (*biquad_group_fn)(
+		const struct WAV_biquad *filter,
+		float *const *channels,
+		uint16_t first_channel,
+		uint16_t count,
+		uint64_t frames);
+
+// One channel at a time, for machines without a vector kernel and for a
+// single channel left over after the groups
+static void biquad_channel(const struct WAV_biquad *filter, float *samples, uint16_t channel, uint64_t frames)
+{
+	for (uint64_t done = 0; done < frames; done += BIQUAD_BLOCK_FRAMES) {
+		const uint64_t n = frames - done < BIQUAD_BLOCK_FRAMES ? frames - done : BIQUAD_BLOCK_FRAMES;
+		float *block = &samples[done];
+
+		for (uint16_t s = 0; s < filter->num_sections; ++s) {
+			const float *k = &filter->coeffs[5 * s];
+			float *z = &filter->state[2 * s * filter->stride + channel];
+
+			float z1 = z[0];
+			float z2 = z[filter->stride];
+
+			for (uint64_t i = 0; i < n; ++i) {
+				const float x = block[i];
+				const float y = k[0] * x + z1;
+
+				z1 = (k[1] * x - k[3] * y) + z2;
+				z2 = k[2] * x - k[4] * y;
+				block[i] = y;
+			}
+
+			z[0] = z1;
+			z[filter->stride] = z2;
+		}
+	}
+}
+
+// Group kernel for LANES channels. Channels past count are filled with
+// silence and their state, which lives in the padding, stays at zero.
+#define DEFINE_BIQUAD_GROUP_KERNEL(NAME, ATTR, LANES, VEC, LOAD, STORE, SET1, ADD, SUB, MUL)	\
+	ATTR static void NAME(									\
+			const struct WAV_biquad *filter,					\
+			float *const *channels,							\
+			uint16_t first_channel,							\
+			uint16_t count,								\
+			uint64_t frames)							\
+	{											\
+		float block[BIQUAD_BLOCK_FRAMES * LANES] __attribute__((aligned(32)));		\
+												\
+		for (uint64_t done = 0; done < frames; done += BIQUAD_BLOCK_FRAMES) {		\
+			const uint64_t n = frames - done < BIQUAD_BLOCK_FRAMES			\
+				? frames - done : BIQUAD_BLOCK_FRAMES;				\
+												\
+			for (uint16_t l = 0; l < LANES; ++l) {					\
+				const float *src = l < count ? &channels[first_channel + l][done] : NULL;\
+				for (uint64_t i = 0; i < n; ++i) {				\
+					block[i * LANES + l] = src != NULL ? src[i] : 0.0f;	\
+				}								\
+			}									\
+												\
+			for (uint16_t s = 0; s < filter->num_sections; ++s) {			\
+				const float *k = &filter->coeffs[5 * s];			\
+				float *z = &filter->state[2 * s * filter->stride + first_channel];\
+												\
+				const VEC b0 = SET1(k[0]);					\
+				const VEC b1 = SET1(k[1]);					\
+				const VEC b2 = SET1(k[2]);					\
+				const VEC a1 = SET1(k[3]);					\
+				const VEC a2 = SET1(k[4]);					\
+												\
+				VEC z1 = LOAD(z);						\
+				VEC z2 = LOAD(z + filter->stride);				\
+												\
+				for (uint64_t i = 0; i < n; ++i) {				\
+					const VEC x = LOAD(&block[i * LANES]);			\
+					const VEC y = ADD(MUL(b0, x), z1);			\
+												\
+					z1 = ADD(SUB(MUL(b1, x), MUL(a1, y)), z2);		\
+					z2 = SUB(MUL(b2, x), MUL(a2, y));			\
+					STORE(&block[i * LANES], y);				\
+				}								\
+												\
+				STORE(z, z1);							\
+				STORE(z + filter->stride, z2);					\
+			}									\
+												\
+			for (uint16_t l = 0; l < count; ++l) {					\
+				float *dst = &channels[first_channel + l][done];		\
+				for (uint64_t i = 0; i < n; ++i) dst[i] = block[i * LANES + l];	\
+			}									\
+		}										\
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Plain multiplies and adds only: with FMA contraction the AVX kernel would
+// round differently from the SSE and scalar ones
+DEFINE_BIQUAD_GROUP_KERNEL(biquad_group_sse, __attribute__((target("sse"))), 4, __m128,
+		_mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps)
+DEFINE_BIQUAD_GROUP_KERNEL(biquad_group_avx, __attribute__((target("avx"))), 8, __m256,
+		_mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps)
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+DEFINE_BIQUAD_GROUP_KERNEL(biquad_group_neon, , 4, float32x4_t,
+		vld1q_f32, vst1q_f32, vdupq_n_f32, vaddq_f32, vsubq_f32, vmulq_f32)
+
+#endif
+
+// Group kernels resolved once by biquad_init(); NULL where there is none
+static struct {
+	biquad_group_fn wide;		// wide_lanes channels
+	uint16_t	wide_lanes;
+	biquad_group_fn narrow;		// 4 channels
+} biquad_kernels;
+
+static pthread_once_t biquad_once = PTHREAD_ONCE_INIT;
+
+static void biquad_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse")) {
+		biquad_kernels.narrow = biquad_group_sse;
+		biquad_kernels.wide = biquad_group_sse;
+		biquad_kernels.wide_lanes = 4;
+	}
+
+	if (__builtin_cpu_supports("avx")) {
+		biquad_kernels.wide = biquad_group_avx;
+		biquad_kernels.wide_lanes = 8;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	biquad_kernels.narrow = biquad_group_neon;
+	biquad_kernels.wide = biquad_group_neon;
+	biquad_kernels.wide_lanes = 4;
+#endif
+}
+
+struct biquad_job {
+	const struct WAV_biquad	*filter;
+	float *const		*channels;
+	uint64_t		frames;
+};
+
+// Full groups of wide_lanes channels, then one group for whatever is left
+static uint64_t biquad_group_count(uint16_t num_channels)
+{
+	if (biquad_kernels.wide == NULL) return num_channels;
+
+	return (num_channels + biquad_kernels.wide_lanes - 1) / biquad_kernels.wide_lanes;
+}
+
+static void biquad_task(uint64_t index, void *ctx)
+{
+	const struct biquad_job *job = (const struct biquad_job*)ctx;
+	const struct WAV_biquad *filter = job->filter;
+
+#if defined(__x86_64__) || defined(__i386__)
+	// Decaying tails would otherwise end up in denormals, which are many
+	// times slower; MXCSR is per thread, so set flush-to-zero here
+	const unsigned int csr = _mm_getcsr();
+	_mm_setcsr(csr | 0x8040);
+#endif
+
+	if (biquad_kernels.wide == NULL) {
+		biquad_channel(filter, job->channels[index], (uint16_t)index, job->frames);
+	} else {
+		const uint16_t lanes = biquad_kernels.wide_lanes;
+		const uint16_t first = (uint16_t)(index * lanes);
+		const uint16_t count = filter->num_channels - first < lanes ? filter->num_channels - first : lanes;
+
+		if (count == 1) {
+			biquad_channel(filter, job->channels[first], first, job->frames);
+		} else if (count <= 4) {
+			biquad_kernels.narrow(filter, job->channels, first, count, job->frames);
+		} else {
+			biquad_kernels.wide(filter, job->channels, first, count, job->frames);
+		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_setcsr(csr);
+#endif
+}
+
+static void biquad_run(const struct WAV_biquad *filter, float *const *channels, uint64_t frames)
+{
+	if (filter->num_sections == 0 || frames == 0) return;
+
+	pthread_once(&biquad_once, biquad_init);
+
+	const struct biquad_job job = {
+		.filter = filter,
+		.channels = channels,
+		.frames = frames,
+	};
+
+	pool_run(biquad_group_count(filter->num_channels), biquad_task, (void*)&job);
+}
+
+static void biquad_planar_block(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	(void)num_channels;
+	biquad_run((const struct WAV_biquad*)ctx, channels, frames);
+}
+
+static int valid_biquad_frequency(double frequency, uint32_t sample_rate)
+{
+	return sample_rate > 0 && frequency > 0.0 && frequency < sample_rate / 2.0;
+}
+
+WAV_State WAV_biquad_design(
+		struct WAV_biquad_section *section,
+		WAV_BiquadType type,
+		double frequency,
+		double q,
+		double gain_db,
+		uint32_t sample_rate)
+{
+	if (section == NULL || type >= WAV_BIQUAD_NumTypes || !(q > 0.0)
+	    || !valid_biquad_frequency(frequency, sample_rate)) {
+		return Error;
+	}
+
+	// Robert Bristow-Johnson's Audio EQ Cookbook
+	const double w0 = 2.0 * M_PI * frequency / sample_rate;
+	const double cos_w0 = cos(w0);
+	const double alpha = sin(w0) / (2.0 * q);
+	const double a = pow(10.0, gain_db / 40.0);
+	const double shelf = 2.0 * sqrt(a) * alpha;
+
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (type) {
+	case WAV_BIQUAD_LOW_PASS:
+		b0 = (1.0 - cos_w0) / 2.0;
+		b1 = 1.0 - cos_w0;
+		b2 = b0;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+	case WAV_BIQUAD_HIGH_PASS:
+		b0 = (1.0 + cos_w0) / 2.0;
+		b1 = -(1.0 + cos_w0);
+		b2 = b0;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+	case WAV_BIQUAD_BAND_PASS:
+		b0 = alpha;
+		b1 = 0.0;
+		b2 = -alpha;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+	case WAV_BIQUAD_NOTCH:
+		b0 = 1.0;
+		b1 = -2.0 * cos_w0;
+		b2 = 1.0;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+	case WAV_BIQUAD_PEAKING:
+		b0 = 1.0 + alpha * a;
+		b1 = -2.0 * cos_w0;
+		b2 = 1.0 - alpha * a;
+		a0 = 1.0 + alpha / a;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha / a;
+		break;
+	case WAV_BIQUAD_LOW_SHELF:
+		b0 = a * ((a + 1.0) - (a - 1.0) * cos_w0 + shelf);
+		b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cos_w0);
+		b2 = a * ((a + 1.0) - (a - 1.0) * cos_w0 - shelf);
+		a0 = (a + 1.0) + (a - 1.0) * cos_w0 + shelf;
+		a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cos_w0);
+		a2 = (a + 1.0) + (a - 1.0) * cos_w0 - shelf;
+		break;
+	default:
+		b0 = a * ((a + 1.0) + (a - 1.0) * cos_w0 + shelf);
+		b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cos_w0);
+		b2 = a * ((a + 1.0) + (a - 1.0) * cos_w0 - shelf);
+		a0 = (a + 1.0) - (a - 1.0) * cos_w0 + shelf;
+		a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cos_w0);
+		a2 = (a + 1.0) - (a - 1.0) * cos_w0 - shelf;
+		break;
+	}
+
+	section->b0 = b0 / a0;
+	section->b1 = b1 / a0;
+	section->b2 = b2 / a0;
+	section->a1 = a1 / a0;
+	section->a2 = a2 / a0;
+
+	return Success;
+}
+
+// First order low or high pass from the bilinear transform, for the real
+// pole of odd order Butterworth filters
+static void biquad_first_order(struct WAV_biquad_section *section, int high_pass, double frequency, uint32_t sample_rate)
+{
+	const double k = tan(M_PI * frequency / sample_rate);
+
+	section->b0 = high_pass ? 1.0 / (1.0 + k) : k / (1.0 + k);
+	section->b1 = high_pass ? -section->b0 : section->b0;
+	section->b2 = 0.0;
+	section->a1 = (k - 1.0) / (k + 1.0);
+	section->a2 = 0.0;
+}
+
+WAV_State WAV_biquad_init(struct WAV_biquad *filter, uint16_t num_channels)
+{
+	if (filter == NULL || num_channels == 0) return Error;
+
+	memset(filter, 0, sizeof(*filter));
+
+	filter->num_channels = num_channels;
+	filter->stride = (num_channels + BIQUAD_MAX_LANES - 1) / BIQUAD_MAX_LANES * BIQUAD_MAX_LANES;
+
+	return Success;
+}
+
+WAV_State WAV_biquad_add_section(struct WAV_biquad *filter, const struct WAV_biquad_section *section)
+{
+	if (filter == NULL || section == NULL || filter->num_channels == 0 || filter->num_sections == UINT16_MAX) {
+		return Error;
+	}
+
+	const uint32_t n = filter->num_sections + 1u;
+
+	struct WAV_biquad_section *sections = (struct WAV_biquad_section*)realloc(filter->sections, n * sizeof(*sections));
+	if (sections == NULL) return Error;
+	filter->sections = sections;
+
+	float *coeffs = (float*)realloc(filter->coeffs, 5 * n * sizeof(float));
+	if (coeffs == NULL) return Error;
+	filter->coeffs = coeffs;
+
+	float *state = (float*)realloc(filter->state, 2 * n * filter->stride * sizeof(float));
+	if (state == NULL) return Error;
+	filter->state = state;
+
+	sections[n - 1] = *section;
+
+	coeffs[5 * (n - 1) + 0] = (float)section->b0;
+	coeffs[5 * (n - 1) + 1] = (float)section->b1;
+	coeffs[5 * (n - 1) + 2] = (float)section->b2;
+	coeffs[5 * (n - 1) + 3] = (float)section->a1;
+	coeffs[5 * (n - 1) + 4] = (float)section->a2;
+
+	memset(&state[2 * (n - 1) * filter->stride], 0, 2 * filter->stride * sizeof(float));
+
+	filter->num_sections = (uint16_t)n;
+
+	return Success;
+}
+
+// Butterworth sections of the given order: the real pole first for odd
+// orders, then the pole pairs by increasing Q
+static WAV_State biquad_add_butterworth(
+		struct WAV_biquad *filter,
+		int high_pass,
+		uint32_t order,
+		double frequency,
+		uint32_t sample_rate)
+{
+	struct WAV_biquad_section section;
+
+	if (order % 2 == 1) {
+		biquad_first_order(&section, high_pass, frequency, sample_rate);
+		if (WAV_biquad_add_section(filter, &section) == Error) return Error;
+	}
+
+	for (uint32_t k = 1; k <= order / 2; ++k) {
+		const double angle = (2.0 * k - 1.0 + order % 2) * M_PI / (2.0 * order);
+		const double q = 1.0 / (2.0 * cos(angle));
+
+		if (WAV_biquad_design(
+				&section,
+				high_pass ? WAV_BIQUAD_HIGH_PASS : WAV_BIQUAD_LOW_PASS,
+				frequency,
+				q,
+				0.0,
+				sample_rate) == Error
+		    || WAV_biquad_add_section(filter, &section) == Error) {
+			return Error;
+		}
+	}
+
+	return Success;
+}
+
+WAV_State WAV_biquad_add_cascade(
+		struct WAV_biquad *filter,
+		WAV_CascadeType type,
+		WAV_BiquadType pass,
+		uint32_t order,
+		double frequency,
+		uint32_t sample_rate)
+{
+	if (filter == NULL || type >= WAV_CASCADE_NumTypes || order == 0
+	    || (pass != WAV_BIQUAD_LOW_PASS && pass != WAV_BIQUAD_HIGH_PASS)
+	    || !valid_biquad_frequency(frequency, sample_rate)) {
+		return Error;
+	}
+
+	const int high_pass = pass == WAV_BIQUAD_HIGH_PASS;
+
+	if (type == WAV_CASCADE_BUTTERWORTH) {
+		return biquad_add_butterworth(filter, high_pass, order, frequency, sample_rate);
+	}
+
+	// Linkwitz-Riley: a Butterworth filter of half the order, twice
+	if (order % 2 == 1) return Error;
+
+	if (biquad_add_butterworth(filter, high_pass, order / 2, frequency, sample_rate) == Error) return Error;
+
+	return biquad_add_butterworth(filter, high_pass, order / 2, frequency, sample_rate);
+}
+
+void WAV_biquad_reset(struct WAV_biquad *filter)
+{
+	if (filter == NULL || filter->state == NULL) return;
+
+	memset(filter->state, 0, 2 * (size_t)filter->num_sections * filter->stride * sizeof(float));
+}
+
+void WAV_biquad_free(struct WAV_biquad *filter)
+{
+	if (filter == NULL) return;
+
+	free(filter->sections);
+	free(filter->coeffs);
+	free(filter->state);
+
+	filter->sections = NULL;
+	filter->coeffs = NULL;
+	filter->state = NULL;
+	filter->num_sections = 0;
+}
+
+WAV_State WAV_biquad_process(struct WAV_biquad *filter, struct WAV_planar *planar)
+{
+	if (filter == NULL || planar == NULL || planar->num_channels != filter->num_channels) return Error;
+
+	biquad_run(filter, planar->channels, planar->frames);
+
+	return Success;
+}
+
+WAV_State WAV_apply_biquad(struct WAV_file *wav, struct WAV_biquad *filter)
+{
+	if (wav == NULL || filter == NULL || load_DATA_chunk(wav) == Error || !valid_pcm_format(&wav->fmt)
+	    || wav->fmt.num_channels != filter->num_channels || writable_DATA_chunk(wav) == Error) {
+		return Error;
+	}
+
+	if (process_planar(
+			wav->data.buff,
+			wav->data.size / wav->fmt.block_align,
+			&wav->fmt,
+			biquad_planar_block,
+			filter) == Error) {
+		return Error;
+	}
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+/*
+ * FFT
+ *
+ * Real FFTs of power of two sizes n, computed as a complex FFT of size
+ * m = n / 2 over the even and odd samples followed by a split step. The
+ * complex FFT works on separate real and imaginary arrays, decimating in
+ * frequency with radix-4 stages and one radix-2 stage when log2(m) is odd,
+ * then undoing the bit reversal. Radix-4 stages with at least as many
+ * butterflies per block as vector lanes run in SIMD kernels.
+ *
+ * Spectra hold the m + 1 bins from DC to Nyquist in re[] and im[]. The
+ * inverse transform is not normalized and returns m times the signal.
+ */
+
+struct fft_plan {
+	uint32_t	n;		// real size
+	uint32_t	m;		// complex size, n / 2
+	float		*twiddles;	// W^j, W^2j, W^3j of every radix-4 stage, largest stage first
+	uint32_t	*swaps;		// index pairs exchanged by the bit reversal
+	uint32_t	num_swaps;
+	float		*split_re;	// e^(-2 pi i k / n) for k in [0, m / 2]
+	float		*split_im;
+	struct fft_plan *next;
+};
+
+typedef void (*fft_radix4_fn)(float *re, float *im, uint32_t m, uint32_t q, const float *twiddles);
+typedef void (*fft_mul_fn)(float *re, float *im, const float *h_re, const float *h_im, uint32_t bins);
+typedef void (*fft_mac_fn)(
+		float *acc_re,
+		float *acc_im,
+		const float *x_re,
+		const float *x_im,
+		const float *h_re,
+		const float *h_im,
+		uint32_t bins);
+
+#define FFT_SCALAR_LOAD(p)		(*(p))
+#define FFT_SCALAR_STORE(p, v)		(*(p) = (v))
+#define FFT_SCALAR_ADD(a, b)		((a) + (b))
+#define FFT_SCALAR_SUB(a, b)		((a) - (b))
+#define FFT_SCALAR_MUL(a, b)		((a) * (b))
+
+// One radix-4 stage over blocks of 4q points, the product of two spectra
+// and its accumulation into a third, for LANES butterflies or bins at a time
+#define DEFINE_FFT_KERNELS(SUFFIX, ATTR, LANES, VEC, LOAD, STORE, ADD, SUB, MUL)		\
+	ATTR static void fft_radix4_##SUFFIX(							\
+			float *re,								\
+			float *im,								\
+			uint32_t m,								\
+			uint32_t q,								\
+			const float *twiddles)							\
+	{											\
+		const float *w1r = twiddles;							\
+		const float *w1i = &twiddles[q];						\
+		const float *w2r = &twiddles[2 * q];						\
+		const float *w2i = &twiddles[3 * q];						\
+		const float *w3r = &twiddles[4 * q];						\
+		const float *w3i = &twiddles[5 * q];						\
+												\
+		for (uint32_t b = 0; b < m; b += 4 * q) {					\
+			for (uint32_t j = 0; j < q; j += LANES) {				\
+				const uint32_t p0 = b + j, p1 = p0 + q, p2 = p1 + q, p3 = p2 + q;\
+												\
+				const VEC a0r = LOAD(&re[p0]), a0i = LOAD(&im[p0]);		\
+				const VEC a1r = LOAD(&re[p1]), a1i = LOAD(&im[p1]);		\
+				const VEC a2r = LOAD(&re[p2]), a2i = LOAD(&im[p2]);		\
+				const VEC a3r = LOAD(&re[p3]), a3i = LOAD(&im[p3]);		\
+												\
+				const VEC t0r = ADD(a0r, a2r), t0i = ADD(a0i, a2i);		\
+				const VEC t1r = SUB(a0r, a2r), t1i = SUB(a0i, a2i);		\
+				const VEC t2r = ADD(a1r, a3r), t2i = ADD(a1i, a3i);		\
+				const VEC dr = SUB(a1r, a3r), di = SUB(a1i, a3i);		\
+												\
+				/* t1 -+ i (a1 - a3) */						\
+				const VEC y1r = SUB(t0r, t2r), y1i = SUB(t0i, t2i);		\
+				const VEC y2r = ADD(t1r, di), y2i = SUB(t1i, dr);		\
+				const VEC y3r = SUB(t1r, di), y3i = ADD(t1i, dr);		\
+												\
+				const VEC c1r = LOAD(&w1r[j]), c1i = LOAD(&w1i[j]);		\
+				const VEC c2r = LOAD(&w2r[j]), c2i = LOAD(&w2i[j]);		\
+				const VEC c3r = LOAD(&w3r[j]), c3i = LOAD(&w3i[j]);		\
+												\
+				STORE(&re[p0], ADD(t0r, t2r));					\
+				STORE(&im[p0], ADD(t0i, t2i));					\
+				STORE(&re[p1], SUB(MUL(y1r, c2r), MUL(y1i, c2i)));		\
+				STORE(&im[p1], ADD(MUL(y1r, c2i), MUL(y1i, c2r)));		\
+				STORE(&re[p2], SUB(MUL(y2r, c1r), MUL(y2i, c1i)));		\
+				STORE(&im[p2], ADD(MUL(y2r, c1i), MUL(y2i, c1r)));		\
+				STORE(&re[p3], SUB(MUL(y3r, c3r), MUL(y3i, c3i)));		\
+				STORE(&im[p3], ADD(MUL(y3r, c3i), MUL(y3i, c3r)));		\
+			}									\
+		}										\
+	}											\
+												\
+	ATTR static void fft_mul_##SUFFIX(							\
+			float *re,								\
+			float *im,								\
+			const float *h_re,							\
+			const float *h_im,							\
+			uint32_t bins)								\
+	{											\
+		uint32_t k = 0;									\
+		for (; k + LANES <= bins; k += LANES) {						\
+			const VEC xr = LOAD(&re[k]), xi = LOAD(&im[k]);			\
+			const VEC hr = LOAD(&h_re[k]), hi = LOAD(&h_im[k]);			\
+												\
+			STORE(&re[k], SUB(MUL(xr, hr), MUL(xi, hi)));				\
+			STORE(&im[k], ADD(MUL(xr, hi), MUL(xi, hr)));				\
+		}										\
+		for (; k < bins; ++k) {								\
+			const float xr = re[k], xi = im[k];					\
+												\
+			re[k] = xr * h_re[k] - xi * h_im[k];					\
+			im[k] = xr * h_im[k] + xi * h_re[k];					\
+		}										\
+	}											\
+												\
+	ATTR static void fft_mac_##SUFFIX(							\
+			float *acc_re,								\
+			float *acc_im,								\
+			const float *x_re,							\
+			const float *x_im,							\
+			const float *h_re,							\
+			const float *h_im,							\
+			uint32_t bins)								\
+	{											\
+		uint32_t k = 0;									\
+		for (; k + LANES <= bins; k += LANES) {						\
+			const VEC xr = LOAD(&x_re[k]), xi = LOAD(&x_im[k]);			\
+			const VEC hr = LOAD(&h_re[k]), hi = LOAD(&h_im[k]);			\
+												\
+			STORE(&acc_re[k], ADD(LOAD(&acc_re[k]), SUB(MUL(xr, hr), MUL(xi, hi))));\
+			STORE(&acc_im[k], ADD(LOAD(&acc_im[k]), ADD(MUL(xr, hi), MUL(xi, hr))));\
+		}										\
+		for (; k < bins; ++k) {								\
+			acc_re[k] += x_re[k] * h_re[k] - x_im[k] * h_im[k];			\
+			acc_im[k] += x_re[k] * h_im[k] + x_im[k] * h_re[k];			\
+		}										\
+	}
+
+DEFINE_FFT_KERNELS(scalar, , 1, float,
+		FFT_SCALAR_LOAD, FFT_SCALAR_STORE, FFT_SCALAR_ADD, FFT_SCALAR_SUB, FFT_SCALAR_MUL)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+DEFINE_FFT_KERNELS(sse, __attribute__((target("sse"))), 4, __m128,
+		_mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps)
+DEFINE_FFT_KERNELS(avx, __attribute__((target("avx"))), 8, __m256,
+		_mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps)
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+DEFINE_FFT_KERNELS(neon, , 4, float32x4_t,
+		vld1q_f32, vst1q_f32, vaddq_f32, vsubq_f32, vmulq_f32)
+
+#endif
+
+// Kernels resolved once by fft_init()
+static struct {
+	fft_radix4_fn	radix4;
+	fft_mul_fn	mul;
+	fft_mac_fn	mac;
+	uint32_t	lanes;
+} fft_kernels = { fft_radix4_scalar, fft_mul_scalar, fft_mac_scalar, 1 };
+
+static pthread_once_t fft_once = PTHREAD_ONCE_INIT;
+
+static void fft_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse")) {
+		fft_kernels.radix4 = fft_radix4_sse;
+		fft_kernels.mul = fft_mul_sse;
+		fft_kernels.mac = fft_mac_sse;
+		fft_kernels.lanes = 4;
+	}
+
+	if (__builtin_cpu_supports("avx")) {
+		fft_kernels.radix4 = fft_radix4_avx;
+		fft_kernels.mul = fft_mul_avx;
+		fft_kernels.mac = fft_mac_avx;
+		fft_kernels.lanes = 8;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	fft_kernels.radix4 = fft_radix4_neon;
+	fft_kernels.mul = fft_mul_neon;
+	fft_kernels.mac = fft_mac_neon;
+	fft_kernels.lanes = 4;
+#endif
+}
+
+// Plans are built once per size and kept for the life of the process
+static struct fft_plan *fft_plans;
+static pthread_mutex_t fft_plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fft_plan_free(struct fft_plan *plan)
+{
+	free(plan->twiddles);
+	free(plan->swaps);
+	free(plan->split_re);
+	free(plan->split_im);
+	free(plan);
+}
+
+static struct fft_plan *fft_plan_build(uint32_t n)
+{
+	struct fft_plan *plan = (struct fft_plan*)calloc(1, sizeof(*plan));
+	if (plan == NULL) return NULL;
+
+	const uint32_t m = n / 2;
+
+	plan->n = n;
+	plan->m = m;
+	plan->twiddles = (float*)malloc(2 * (size_t)m * sizeof(float));
+	plan->swaps = (uint32_t*)malloc((size_t)m * sizeof(uint32_t));
+	plan->split_re = (float*)malloc((m / 2 + 1) * sizeof(float));
+	plan->split_im = (float*)malloc((m / 2 + 1) * sizeof(float));
+
+	if (plan->twiddles == NULL || plan->swaps == NULL || plan->split_re == NULL || plan->split_im == NULL) {
+		fft_plan_free(plan);
+		return NULL;
+	}
+
+	float *tw = plan->twiddles;
+
+	for (uint32_t q = m / 4; q >= 1 && 4 * q <= m; q /= 4) {
+		for (uint32_t j = 0; j < q; ++j) {
+			for (uint32_t p = 1; p <= 3; ++p) {
+				const double angle = -2.0 * M_PI * p * j / (4.0 * q);
+
+				tw[(2 * p - 2) * q + j] = (float)cos(angle);
+				tw[(2 * p - 1) * q + j] = (float)sin(angle);
+			}
+		}
+
+		tw += 6 * q;
+	}
+
+	uint32_t bits = 0;
+	while ((1u << bits) < m) bits++;
+
+	for (uint32_t i = 0; i < m; ++i) {
+		uint32_t r = 0;
+		for (uint32_t b = 0; b < bits; ++b) r |= ((i >> b) & 1u) << (bits - 1 - b);
+
+		if (i < r) {
+			plan->swaps[2 * plan->num_swaps] = i;
+			plan->swaps[2 * plan->num_swaps + 1] = r;
+			plan->num_swaps++;
+		}
+	}
+
+	for (uint32_t k = 0; k <= m / 2; ++k) {
+		plan->split_re[k] = (float)cos(2.0 * M_PI * k / n);
+		plan->split_im[k] = (float)-sin(2.0 * M_PI * k / n);
+	}
+
+	return plan;
+}
+
+// n must be a power of two, at least 8
+static const struct fft_plan *fft_plan_get(uint32_t n)
+{
+	pthread_once(&fft_once, fft_init);
+	pthread_mutex_lock(&fft_plans_lock);
+
+	struct fft_plan *plan = fft_plans;
+	while (plan != NULL && plan->n != n) plan = plan->next;
+
+	if (plan == NULL && (plan = fft_plan_build(n)) != NULL) {
+		plan->next = fft_plans;
+		fft_plans = plan;
+	}
+
+	pthread_mutex_unlock(&fft_plans_lock);
+
+	return plan;
+}
+
+// Forward complex FFT of size m in place, output in natural order
+static void fft_complex(const struct fft_plan *plan, float *re, float *im)
+{
+	const uint32_t m = plan->m;
+	const float *tw = plan->twiddles;
+
+	uint32_t q = m / 4;
+
+	for (; q >= 1 && 4 * q <= m; q /= 4) {
+		if (q >= fft_kernels.lanes) {
+			fft_kernels.radix4(re, im, m, q, tw);
+		} else {
+			fft_radix4_scalar(re, im, m, q, tw);
+		}
+
+		tw += 6 * q;
+	}
+
+	// log2(m) odd: a last radix-2 stage over pairs
+	if ((m & 0x55555555u) == 0) {
+		for (uint32_t b = 0; b < m; b += 2) {
+			const float ar = re[b], ai = im[b];
+
+			re[b] = ar + re[b + 1];
+			im[b] = ai + im[b + 1];
+			re[b + 1] = ar - re[b + 1];
+			im[b + 1] = ai - im[b + 1];
+		}
+	}
+
+	for (uint32_t s = 0; s < plan->num_swaps; ++s) {
+		const uint32_t i = plan->swaps[2 * s];
+		const uint32_t j = plan->swaps[2 * s + 1];
+		const float r = re[i], t = im[i];
+
+		re[i] = re[j];
+		im[i] = im[j];
+		re[j] = r;
+		im[j] = t;
+	}
+}
+
+// Spectrum of the n real samples of x into re[0..m] and im[0..m]
+static void fft_real_forward(const struct fft_plan *plan, const float *x, float *re, float *im)
+{
+	const uint32_t m = plan->m;
+
+	for (uint32_t k = 0; k < m; ++k) {
+		re[k] = x[2 * k];
+		im[k] = x[2 * k + 1];
+	}
+
+	fft_complex(plan, re, im);
+
+	const float r0 = re[0], i0 = im[0];
+
+	re[0] = r0 + i0;
+	im[0] = 0.0f;
+	re[m] = r0 - i0;
+	im[m] = 0.0f;
+
+	// Split the spectra of the even and odd samples, bins k and m - k together
+	for (uint32_t k = 1; k <= m / 2; ++k) {
+		const float ar = re[k], ai = im[k];
+		const float br = re[m - k], bi = im[m - k];
+
+		const float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+		const float odd_r = 0.5f * (ai + bi), odd_i = -0.5f * (ar - br);
+
+		const float tr = odd_r * plan->split_re[k] - odd_i * plan->split_im[k];
+		const float ti = odd_r * plan->split_im[k] + odd_i * plan->split_re[k];
+
+		re[k] = er + tr;
+		im[k] = ei + ti;
+		re[m - k] = er - tr;
+		im[m - k] = -(ei - ti);
+	}
+}
+
+// m times the n real samples of the spectrum in re[0..m] and im[0..m] into
+// x; the spectrum is overwritten
+static void fft_real_inverse(const struct fft_plan *plan, float *re, float *im, float *x)
+{
+	const uint32_t m = plan->m;
+
+	const float x0 = re[0], xm = re[m];
+
+	re[0] = 0.5f * (x0 + xm);
+	im[0] = 0.5f * (x0 - xm);
+
+	for (uint32_t k = 1; k <= m / 2; ++k) {
+		const float ar = re[k], ai = im[k];
+		const float br = re[m - k], bi = im[m - k];
+
+		const float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+		const float dr = 0.5f * (ar - br), di = 0.5f * (ai + bi);
+
+		// (a - conj(b)) / 2 times the conjugate twiddle
+		const float odd_r = dr * plan->split_re[k] + di * plan->split_im[k];
+		const float odd_i = di * plan->split_re[k] - dr * plan->split_im[k];
+
+		// Z[k] = E + i O and Z[m - k] = conj(E) + i conj(O)
+		re[k] = er - odd_i;
+		im[k] = ei + odd_r;
+		re[m - k] = er + odd_i;
+		im[m - k] = odd_r - ei;
+	}
+
+	// Inverse transform as a forward one with real and imaginary parts swapped
+	fft_complex(plan, im, re);
+
+	for (uint32_t k = 0; k < m; ++k) {
+		x[2 * k] = re[k];
+		x[2 * k + 1] = im[k];
+	}
+}
+
+/*
+ * FIR filters
+ *
+ * Overlap-add convolution: each chunk of up to block frames is zero padded
+ * to the FFT size n, multiplied with the spectrum of the taps and
+ * transformed back; the last num_taps - 1 outputs carry over into the
+ * following chunks. Chunks can be any size up to block, so calls of any
+ * length are filtered exactly with no added latency.
+ *
+ * Transformed taps are cached by FFT size and tap values, so filters built
+ * from the same taps share one kernel and only the first pays for the
+ * transform. A kernel splits its taps into partitions of n / 2 taps, each
+ * transformed on its own; FIR filters pick n so there is a single one.
+ */
+
+// Largest filter; keeps the FFT size within 32 bits
+#define FIR_MAX_TAPS (1u << 24)
+
+// Smallest FFT size used
+#define FIR_MIN_FFT 64
+
+// Kernels no filter uses that stay cached for the next one
+#define FIR_CACHE_MAX 16
+
+struct WAV_fir_kernel {
+	const struct fft_plan	*plan;
+	uint32_t		num_taps;
+	uint32_t		num_partitions;
+	uint32_t		block;		// largest FIR chunk per transform, n - num_taps + 1
+	uint64_t		hash;
+	float			*taps;		// copy of the taps, the cache key with the size
+	float			*h_re;		// spectrum of each partition divided by m, m + 1 bins apart
+	float			*h_im;
+	unsigned		refs;		// filters using the kernel
+	struct WAV_fir_kernel	*next;
+};
+
+static struct WAV_fir_kernel *fir_cache;
+static pthread_mutex_t fir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t fir_hash(const float *taps, uint32_t num_taps)
+{
+	const unsigned char *bytes = (const unsigned char*)taps;
+	uint64_t hash = UINT64_C(0xCBF29CE484222325);
+
+	for (uint64_t i = 0; i < (uint64_t)num_taps * sizeof(float); ++i) {
+		hash = (hash ^ bytes[i]) * UINT64_C(0x100000001B3);
+	}
+
+	return hash;
+}
+
+// FFT size for num_taps: four times the taps, so each transform yields
+// about three times as many outputs as there are taps
+static uint32_t fir_fft_size(uint32_t num_taps)
+{
+	uint32_t n = FIR_MIN_FFT;
+	while (n < 4 * (uint64_t)num_taps) n *= 2;
+	return n;
+}
+
+static void fir_kernel_free(struct WAV_fir_kernel *kernel)
+{
+	free(kernel->taps);
+	free(kernel->h_re);
+	free(kernel->h_im);
+	free(kernel);
+}
+
+static struct WAV_fir_kernel *fir_kernel_build(const float *taps, uint32_t num_taps, uint32_t n, uint64_t hash)
+{
+	const struct fft_plan *plan = fft_plan_get(n);
+	if (plan == NULL) return NULL;
+
+	struct WAV_fir_kernel *kernel = (struct WAV_fir_kernel*)calloc(1, sizeof(*kernel));
+	if (kernel == NULL) return NULL;
+
+	const uint32_t m = plan->m;
+	const uint32_t partitions = (num_taps + m - 1) / m;
+
+	kernel->plan = plan;
+	kernel->num_taps = num_taps;
+	kernel->num_partitions = partitions;
+	kernel->block = n > num_taps ? n - num_taps + 1 : 1;
+	kernel->hash = hash;
+	kernel->taps = (float*)malloc((size_t)num_taps * sizeof(float));
+	kernel->h_re = (float*)malloc((size_t)partitions * (m + 1) * sizeof(float));
+	kernel->h_im = (float*)malloc((size_t)partitions * (m + 1) * sizeof(float));
+
+	float *padded = (float*)calloc(n, sizeof(float));
+
+	if (kernel->taps == NULL || kernel->h_re == NULL || kernel->h_im == NULL || padded == NULL) {
+		free(padded);
+		fir_kernel_free(kernel);
+		return NULL;
+	}
+
+	memcpy(kernel->taps, taps, (size_t)num_taps * sizeof(float));
+
+	for (uint32_t p = 0; p < partitions; ++p) {
+		const uint32_t first = p * m;
+		const uint32_t count = num_taps - first < m ? num_taps - first : m;
+
+		float *h_re = &kernel->h_re[(size_t)p * (m + 1)];
+		float *h_im = &kernel->h_im[(size_t)p * (m + 1)];
+
+		memcpy(padded, &taps[first], (size_t)count * sizeof(float));
+		memset(&padded[count], 0, (size_t)(n - count) * sizeof(float));
+
+		fft_real_forward(plan, padded, h_re, h_im);
+
+		// Folds the 1 / m of the inverse transform into the kernel
+		for (uint32_t k = 0; k <= m; ++k) {
+			h_re[k] /= (float)m;
+			h_im[k] /= (float)m;
+		}
+	}
+
+	free(padded);
+
+	return kernel;
+}
+
+// Drop the oldest unused kernels past FIR_CACHE_MAX; expects fir_cache_lock
+static void fir_cache_trim(void)
+{
+	unsigned unused = 0;
+
+	for (struct WAV_fir_kernel **link = &fir_cache; *link != NULL;) {
+		struct WAV_fir_kernel *kernel = *link;
+
+		if (kernel->refs == 0 && ++unused > FIR_CACHE_MAX) {
+			*link = kernel->next;
+			fir_kernel_free(kernel);
+		} else {
+			link = &kernel->next;
+		}
+	}
+}
+
+// Kernel for taps transformed with FFT size n, from the cache when possible
+static struct WAV_fir_kernel *fir_kernel_get(const float *taps, uint32_t num_taps, uint32_t n)
+{
+	const uint64_t hash = fir_hash(taps, num_taps);
+
+	pthread_mutex_lock(&fir_cache_lock);
+
+	struct WAV_fir_kernel **link = &fir_cache;
+
+	while (*link != NULL) {
+		struct WAV_fir_kernel *kernel = *link;
+
+		if (kernel->plan->n == n && kernel->num_taps == num_taps && kernel->hash == hash
+		    && memcmp(kernel->taps, taps, (size_t)num_taps * sizeof(float)) == 0) {
+			break;
+		}
+
+		link = &kernel->next;
+	}
+
+	struct WAV_fir_kernel *kernel = *link;
+
+	if (kernel != NULL) {
+		// Most recently used first
+		*link = kernel->next;
+	} else {
+		kernel = fir_kernel_build(taps, num_taps, n, hash);
+	}
+
+	if (kernel != NULL) {
+		kernel->next = fir_cache;
+		fir_cache = kernel;
+		kernel->refs++;
+	}
+
+	pthread_mutex_unlock(&fir_cache_lock);
+
+	return kernel;
+}
+
+static void fir_kernel_release(struct WAV_fir_kernel *kernel)
+{
+	pthread_mutex_lock(&fir_cache_lock);
+
+	kernel->refs--;
+	fir_cache_trim();
+
+	pthread_mutex_unlock(&fir_cache_lock);
+}
+
+// Floats of scratch per channel: the time domain block and the spectrum
+static uint64_t fir_work_size(const struct WAV_fir_kernel *kernel)
+{
+	return kernel->plan->n + 2 * ((uint64_t)kernel->plan->m + 1);
+}
+
+// Filter one chunk of at most block samples of a channel in place
+static void fir_chunk(const struct WAV_fir *fir, uint16_t channel, float *samples, uint64_t count)
+{
+	const struct WAV_fir_kernel *kernel = fir->kernel;
+	const struct fft_plan *plan = kernel->plan;
+	const uint32_t overlap = kernel->num_taps - 1;
+
+	float *buff = &fir->work[channel * fir_work_size(kernel)];
+	float *re = &buff[plan->n];
+	float *im = &re[plan->m + 1];
+	float *tail = &fir->tail[(uint64_t)channel * overlap];
+
+	memcpy(buff, samples, count * sizeof(float));
+	memset(&buff[count], 0, (plan->n - count) * sizeof(float));
+
+	fft_real_forward(plan, buff, re, im);
+	fft_kernels.mul(re, im, kernel->h_re, kernel->h_im, plan->m + 1);
+	fft_real_inverse(plan, re, im, buff);
+
+	for (uint64_t i = 0; i < count; ++i) {
+		samples[i] = buff[i] + (i < overlap ? tail[i] : 0.0f);
+	}
+
+	// What is left of the old tail moves up by count, plus the new overlap
+	for (uint64_t i = 0; i < overlap; ++i) {
+		tail[i] = (i + count < overlap ? tail[i + count] : 0.0f) + buff[count + i];
+	}
+}
+
+struct fir_job {
+	const struct WAV_fir	*fir;
+	float *const		*channels;
+	uint64_t		frames;
+};
+
+static void fir_task(uint64_t index, void *ctx)
+{
+	const struct fir_job *job = (const struct fir_job*)ctx;
+	const uint32_t block = job->fir->kernel->block;
+	float *samples = job->channels[index];
+
+	for (uint64_t done = 0; done < job->frames; done += block) {
+		const uint64_t n = job->frames - done < block ? job->frames - done : block;
+
+		fir_chunk(job->fir, (uint16_t)index, &samples[done], n);
+	}
+}
+
+static void fir_run(const struct WAV_fir *fir, float *const *channels, uint64_t frames)
+{
+	if (frames == 0) return;
+
+	const struct fir_job job = {
+		.fir = fir,
+		.channels = channels,
+		.frames = frames,
+	};
+
+	pool_run(fir->num_channels, fir_task, (void*)&job);
+}
+
+static void fir_planar_block(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	(void)num_channels;
+	fir_run((const struct WAV_fir*)ctx, channels, frames);
+}
+
+WAV_State WAV_fir_design(
+		float *taps,
+		uint32_t num_taps,
+		WAV_FirType type,
+		double cutoff,
+		uint32_t sample_rate)
+{
+	if (taps == NULL || num_taps == 0 || num_taps % 2 == 0 || type >= WAV_FIR_NumTypes
+	    || sample_rate == 0 || !(cutoff > 0.0) || !(cutoff < sample_rate / 2.0)) {
+		return Error;
+	}
+
+	const double fc = cutoff / sample_rate;
+	const double middle = (num_taps - 1) / 2.0;
+
+	double sum = 0.0;
+	double *h = (double*)malloc((size_t)num_taps * sizeof(double));
+	if (h == NULL) return Error;
+
+	// Blackman windowed sinc
+	for (uint32_t i = 0; i < num_taps; ++i) {
+		const double t = i - middle;
+		const double sinc = t == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * t) / (M_PI * t);
+		const double phase = num_taps > 1 ? 2.0 * M_PI * i / (num_taps - 1) : 0.0;
+		const double window = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2.0 * phase);
+
+		h[i] = sinc * window;
+		sum += h[i];
+	}
+
+	// Unity gain at DC; the high pass is the low pass subtracted from an impulse
+	for (uint32_t i = 0; i < num_taps; ++i) {
+		const double lp = h[i] / sum;
+		taps[i] = (float)(type == WAV_FIR_HIGH_PASS ? (i == num_taps / 2) - lp : lp);
+	}
+
+	free(h);
+
+	return Success;
+}
+
+WAV_State WAV_fir_init(
+		struct WAV_fir *fir,
+		uint16_t num_channels,
+		const float *taps,
+		uint32_t num_taps)
+{
+	if (fir == NULL || taps == NULL || num_channels == 0 || num_taps == 0 || num_taps > FIR_MAX_TAPS) {
+		return Error;
+	}
+
+	memset(fir, 0, sizeof(*fir));
+
+	fir->kernel = fir_kernel_get(taps, num_taps, fir_fft_size(num_taps));
+	if (fir->kernel == NULL) return Error;
+
+	fir->num_channels = num_channels;
+	fir->num_taps = num_taps;
+
+	fir->tail = (float*)calloc((size_t)num_channels * (num_taps - 1) + 1, sizeof(float));
+	fir->work = (float*)malloc((size_t)num_channels * fir_work_size(fir->kernel) * sizeof(float));
+
+	if (fir->tail == NULL || fir->work == NULL) {
+		WAV_fir_free(fir);
+		return Error;
+	}
+
+	return Success;
+}
+
+void WAV_fir_reset(struct WAV_fir *fir)
+{
+	if (fir == NULL || fir->tail == NULL) return;
+
+	memset(fir->tail, 0, (size_t)fir->num_channels * (fir->num_taps - 1) * sizeof(float));
+}
+
+void WAV_fir_free(struct WAV_fir *fir)
+{
+	if (fir == NULL) return;
+
+	if (fir->kernel != NULL) fir_kernel_release(fir->kernel);
+
+	free(fir->tail);
+	free(fir->work);
+
+	fir->kernel = NULL;
+	fir->tail = NULL;
+	fir->work = NULL;
+}
+
+WAV_State WAV_fir_process(struct WAV_fir *fir, struct WAV_planar *planar)
+{
+	if (fir == NULL || fir->kernel == NULL || planar == NULL || planar->num_channels != fir->num_channels) {
+		return Error;
+	}
+
+	fir_run(fir, planar->channels, planar->frames);
+
+	return Success;
+}
+
+WAV_State WAV_apply_fir(struct WAV_file *wav, struct WAV_fir *fir)
+{
+	if (wav == NULL || fir == NULL || fir->kernel == NULL || load_DATA_chunk(wav) == Error
+	    || !valid_pcm_format(&wav->fmt) || wav->fmt.num_channels != fir->num_channels
+	    || writable_DATA_chunk(wav) == Error) {
+		return Error;
+	}
+
+	// Whole transforms per decoded block
+	if (process_planar_blocks(
+			wav->data.buff,
+			wav->data.size / wav->fmt.block_align,
+			&wav->fmt,
+			fir->kernel->block,
+			fir_planar_block,
+			fir) == Error) {
+		return Error;
+	}
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+/*
+ * Partitioned convolution
+ *
+ * Uniformly partitioned overlap-save: the impulse response is cut into
+ * partitions of block frames, each transformed with FFT size 2 * block.
+ * The spectra of the last num_partitions input blocks are kept in a ring,
+ * the frequency domain delay line. When a block starts, the products of
+ * the older blocks with partitions 1 and up are summed once; every call
+ * then only transforms the current block, adds its product with
+ * partition 0 and transforms back. Calls can be any length and outputs
+ * come out with no latency beyond the call itself, while the work per
+ * block stays bounded whatever the length of the response.
+ */
+
+#define CONVOLVER_MIN_BLOCK 16
+#define CONVOLVER_MAX_BLOCK (1u << 20)
+
+// Floats of state per channel: the input window of two blocks, the delay
+// line and accumulated spectrum, and the scratch of one transform
+static uint64_t convolver_stride(const struct WAV_convolver *conv)
+{
+	const uint64_t bins = (uint64_t)conv->block + 1;
+
+	return 2 * (uint64_t)conv->block
+		+ 2 * bins * conv->kernels[0]->num_partitions
+		+ 4 * bins
+		+ 2 * (uint64_t)conv->block;
+}
+
+// Advance one channel past frames samples, filtering them in place
+static void convolver_channel(const struct WAV_convolver *conv, uint16_t channel, float *samples, uint64_t frames)
+{
+	const struct WAV_fir_kernel *kernel = conv->kernels[channel % conv->num_irs];
+	const struct fft_plan *plan = kernel->plan;
+	const uint32_t block = conv->block;
+	const uint32_t bins = block + 1;
+	const uint32_t partitions = kernel->num_partitions;
+
+	float *window = &conv->state[channel * convolver_stride(conv)];
+	float *fdl_re = &window[2 * block];
+	float *fdl_im = &fdl_re[(size_t)partitions * bins];
+	float *acc_re = &fdl_im[(size_t)partitions * bins];
+	float *acc_im = &acc_re[bins];
+	float *y_re = &acc_im[bins];
+	float *y_im = &y_re[bins];
+	float *out = &y_im[bins];
+
+	uint32_t fill = conv->fill;
+	uint32_t current = conv->current;
+
+	for (uint64_t done = 0; done < frames;) {
+		const uint32_t count = frames - done < block - fill ? (uint32_t)(frames - done) : block - fill;
+
+		// The rest of the block is still zero, which does not change the
+		// outputs that are already known
+		memcpy(&window[block + fill], &samples[done], count * sizeof(float));
+
+		float *x_re = &fdl_re[(size_t)current * bins];
+		float *x_im = &fdl_im[(size_t)current * bins];
+
+		fft_real_forward(plan, window, x_re, x_im);
+
+		memcpy(y_re, acc_re, bins * sizeof(float));
+		memcpy(y_im, acc_im, bins * sizeof(float));
+		fft_kernels.mac(y_re, y_im, x_re, x_im, kernel->h_re, kernel->h_im, bins);
+
+		fft_real_inverse(plan, y_re, y_im, out);
+
+		memcpy(&samples[done], &out[block + fill], count * sizeof(float));
+
+		fill += count;
+		done += count;
+
+		if (fill < block) break;
+
+		// Block complete: slide the window and sum the older blocks for the next one
+		memcpy(window, &window[block], block * sizeof(float));
+		memset(&window[block], 0, block * sizeof(float));
+
+		fill = 0;
+		current = current + 1 < partitions ? current + 1 : 0;
+
+		memset(acc_re, 0, bins * sizeof(float));
+		memset(acc_im, 0, bins * sizeof(float));
+
+		for (uint32_t p = 1; p < partitions; ++p) {
+			const uint32_t slot = current >= p ? current - p : current + partitions - p;
+
+			fft_kernels.mac(
+					acc_re,
+					acc_im,
+					&fdl_re[(size_t)slot * bins],
+					&fdl_im[(size_t)slot * bins],
+					&kernel->h_re[(size_t)p * bins],
+					&kernel->h_im[(size_t)p * bins],
+					bins
+				);
+		}
+	}
+}
+
+struct convolver_job {
+	const struct WAV_convolver *conv;
+	float *const		*channels;
+	uint64_t		frames;
+};
+
+static void convolver_task(uint64_t index, void *ctx)
+{
+	const struct convolver_job *job = (const struct convolver_job*)ctx;
+
+	convolver_channel(job->conv, (uint16_t)index, job->channels[index], job->frames);
+}
+
+static void convolver_run(struct WAV_convolver *conv, float *const *channels, uint64_t frames)
+{
+	if (frames == 0) return;
+
+	const struct convolver_job job = {
+		.conv = conv,
+		.channels = channels,
+		.frames = frames,
+	};
+
+	pool_run(conv->num_channels, convolver_task, (void*)&job);
+
+	// Every channel moved through the same frames
+	const uint64_t blocks = (conv->fill + frames) / conv->block;
+
+	conv->fill = (uint32_t)((conv->fill + frames) % conv->block);
+	conv->current = (uint32_t)((conv->current + blocks) % conv->kernels[0]->num_partitions);
+}
+
+static void convolver_planar_block(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	(void)num_channels;
+	convolver_run((struct WAV_convolver*)ctx, channels, frames);
+}
+
+WAV_State WAV_convolver_init(
+		struct WAV_convolver *conv,
+		uint16_t num_channels,
+		uint32_t block_frames,
+		const float *const *irs,
+		uint16_t num_irs,
+		uint32_t ir_frames)
+{
+	if (conv == NULL || irs == NULL || num_channels == 0 || num_irs == 0 || ir_frames == 0
+	    || (num_irs != 1 && num_irs != num_channels)
+	    || block_frames < CONVOLVER_MIN_BLOCK || block_frames > CONVOLVER_MAX_BLOCK
+	    || (block_frames & (block_frames - 1)) != 0) {
+		return Error;
+	}
+
+	memset(conv, 0, sizeof(*conv));
+
+	conv->num_channels = num_channels;
+	conv->block = block_frames;
+	conv->kernels = (struct WAV_fir_kernel**)calloc(num_irs, sizeof(struct WAV_fir_kernel*));
+
+	if (conv->kernels == NULL) return Error;
+
+	for (uint16_t i = 0; i < num_irs; ++i) {
+		if (irs[i] == NULL || (conv->kernels[i] = fir_kernel_get(irs[i], ir_frames, 2 * block_frames)) == NULL) {
+			WAV_convolver_free(conv);
+			return Error;
+		}
+
+		conv->num_irs = i + 1;
+	}
+
+	const size_t state_size = (size_t)num_channels * convolver_stride(conv) * sizeof(float);
+
+	conv->state = (float*)malloc(state_size);
+
+	if (conv->state == NULL) {
+		WAV_convolver_free(conv);
+		return Error;
+	}
+
+	// Written rather than calloc'd so every page is faulted in here, not
+	// during the first pass through the delay line
+	memset(conv->state, 0, state_size);
+
+	return Success;
+}
+
+void WAV_convolver_reset(struct WAV_convolver *conv)
+{
+	if (conv == NULL || conv->state == NULL) return;
+
+	memset(conv->state, 0, (size_t)conv->num_channels * convolver_stride(conv) * sizeof(float));
+
+	conv->fill = 0;
+	conv->current = 0;
+}
+
+void WAV_convolver_free(struct WAV_convolver *conv)
+{
+	if (conv == NULL) return;
+
+	for (uint16_t i = 0; i < conv->num_irs; ++i) fir_kernel_release(conv->kernels[i]);
+
+	free(conv->kernels);
+	free(conv->state);
+
+	conv->kernels = NULL;
+	conv->state = NULL;
+	conv->num_irs = 0;
+}
+
+WAV_State WAV_convolver_process(struct WAV_convolver *conv, struct WAV_planar *planar)
+{
+	if (conv == NULL || conv->state == NULL || planar == NULL || planar->num_channels != conv->num_channels) {
+		return Error;
+	}
+
+	convolver_run(conv, planar->channels, planar->frames);
+
+	return Success;
+}
+
+WAV_State WAV_apply_convolver(struct WAV_file *wav, struct WAV_convolver *conv)
+{
+	if (wav == NULL || conv == NULL || conv->state == NULL || load_DATA_chunk(wav) == Error
+	    || !valid_pcm_format(&wav->fmt) || wav->fmt.num_channels != conv->num_channels
+	    || writable_DATA_chunk(wav) == Error) {
+		return Error;
+	}
+
+	if (process_planar(
+			wav->data.buff,
+			wav->data.size / wav->fmt.block_align,
+			&wav->fmt,
+			convolver_planar_block,
+			conv) == Error) {
+		return Error;
+	}
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+/*
+ * Effect chains
+ *
+ * A WAV_chain runs its stages one after the other on each decoded block of
+ * planar floats, so a chain of any length reads and writes the sound data
+ * once and only quantizes at the end.
+ */
+
+static WAV_State chain_add(struct WAV_chain *chain, const struct WAV_chain_stage *stage)
+{
+	if (chain == NULL || chain->num_channels == 0 || chain->num_stages == UINT16_MAX) return Error;
+
+	struct WAV_chain_stage *stages = (struct WAV_chain_stage*)realloc(
+			chain->stages,
+			(chain->num_stages + 1u) * sizeof(*stages)
+		);
+
+	if (stages == NULL) return Error;
+
+	chain->stages = stages;
+	chain->stages[chain->num_stages++] = *stage;
+
+	return Success;
+}
+
+static void chain_gain(float *const *channels, uint16_t num_channels, uint64_t frames, float gain)
+{
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		float *samples = channels[c];
+		for (uint64_t i = 0; i < frames; ++i) samples[i] *= gain;
+	}
+}
+
+static void chain_clip(float *const *channels, uint16_t num_channels, uint64_t frames, float ceiling)
+{
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		float *samples = channels[c];
+
+		for (uint64_t i = 0; i < frames; ++i) {
+			const float x = samples[i];
+			samples[i] = x > ceiling ? ceiling : x < -ceiling ? -ceiling : x;
+		}
+	}
+}
+
+// y[n] = x[n] - x[n-1] + pole * y[n-1]
+static void chain_dc_removal(
+		float *const *channels,
+		uint16_t num_channels,
+		uint64_t frames,
+		const struct WAV_chain_stage *stage)
+{
+	const float pole = stage->value;
+
+	for (uint16_t c = 0; c < num_channels; ++c) {
+		float *samples = channels[c];
+		float prev = stage->state[2 * c];
+		float prev_out = stage->state[2 * c + 1];
+
+		for (uint64_t i = 0; i < frames; ++i) {
+			const float x = samples[i];
+
+			prev_out = x - prev + pole * prev_out;
+			prev = x;
+			samples[i] = prev_out;
+		}
+
+		stage->state[2 * c] = prev;
+		stage->state[2 * c + 1] = prev_out;
+	}
+}
+
+// Linear ramp over [start, start + frames) of the chain's frame position
+static void chain_fade(
+		float *const *channels,
+		uint16_t num_channels,
+		uint64_t frames,
+		uint64_t position,
+		const struct WAV_chain_stage *stage)
+{
+	const uint64_t end = stage->start + stage->frames;
+
+	// Blocks wholly before or after the ramp are either left alone or silenced
+	if (position + frames <= stage->start || position >= end) {
+		const int before = position + frames <= stage->start;
+
+		if (before != (stage->fade == WAV_FADE_IN)) return;
+
+		for (uint16_t c = 0; c < num_channels; ++c) memset(channels[c], 0, frames * sizeof(float));
+		return;
+	}
+
+	for (uint64_t i = 0; i < frames; ++i) {
+		const uint64_t p = position + i;
+		const float t = p < stage->start ? 0.0f
+			: p >= end ? 1.0f
+			: (float)(p - stage->start) / (float)stage->frames;
+		const float gain = stage->fade == WAV_FADE_IN ? t : 1.0f - t;
+
+		for (uint16_t c = 0; c < num_channels; ++c) channels[c][i] *= gain;
+	}
+}
+
+static void chain_run(struct WAV_chain *chain, float *const *channels, uint64_t frames)
+{
+	const uint16_t num_channels = chain->num_channels;
+
+	for (uint16_t s = 0; s < chain->num_stages; ++s) {
+		const struct WAV_chain_stage *stage = &chain->stages[s];
+
+		switch (stage->type) {
+		case WAV_STAGE_GAIN:
+			chain_gain(channels, num_channels, frames, stage->value);
+			break;
+		case WAV_STAGE_BIQUAD:
+			biquad_run(stage->biquad, channels, frames);
+			break;
+		case WAV_STAGE_DC_REMOVAL:
+			chain_dc_removal(channels, num_channels, frames, stage);
+			break;
+		case WAV_STAGE_CLIP:
+			chain_clip(channels, num_channels, frames, stage->value);
+			break;
+		case WAV_STAGE_FADE:
+			chain_fade(channels, num_channels, frames, chain->position, stage);
+			break;
+		default:
+			break;
+		}
+	}
+
+	chain->position += frames;
+}
+
+static void chain_planar_block(float *const *channels, uint16_t num_channels, uint64_t frames, void *ctx)
+{
+	(void)num_channels;
+	chain_run((struct WAV_chain*)ctx, channels, frames);
+}
+
+WAV_State WAV_chain_init(struct WAV_chain *chain, uint16_t num_channels, uint32_t sample_rate)
+{
+	if (chain == NULL || num_channels == 0 || sample_rate == 0) return Error;
+
+	memset(chain, 0, sizeof(*chain));
+
+	chain->num_channels = num_channels;
+	chain->sample_rate = sample_rate;
+
+	return Success;
+}
+
+WAV_State WAV_chain_add_gain(struct WAV_chain *chain, double gain, WAV_GainUnit unit)
+{
+	if (unit >= WAV_GAIN_NumUnits) return Error;
+
+	const struct WAV_chain_stage stage = {
+		.type = WAV_STAGE_GAIN,
+		.value = (float)(unit == WAV_GAIN_DB ? pow(10.0, gain / 20.0) : gain),
+	};
+
+	return chain_add(chain, &stage);
+}
+
+WAV_State WAV_chain_add_biquad(struct WAV_chain *chain, struct WAV_biquad *filter)
+{
+	if (chain == NULL || filter == NULL || filter->num_channels != chain->num_channels) return Error;
+
+	const struct WAV_chain_stage stage = {
+		.type = WAV_STAGE_BIQUAD,
+		.biquad = filter,
+	};
+
+	return chain_add(chain, &stage);
+}
+
+WAV_State WAV_chain_add_dc_removal(struct WAV_chain *chain, double cutoff)
+{
+	if (chain == NULL || !valid_biquad_frequency(cutoff, chain->sample_rate)) return Error;
+
+	struct WAV_chain_stage stage = {
+		.type = WAV_STAGE_DC_REMOVAL,
+		.value = (float)exp(-2.0 * M_PI * cutoff / chain->sample_rate),
+	};
+
+	stage.state = (float*)calloc(2 * (size_t)chain->num_channels, sizeof(float));
+	if (stage.state == NULL) return Error;
+
+	if (chain_add(chain, &stage) == Error) {
+		free(stage.state);
+		return Error;
+	}
+
+	return Success;
+}
+
+WAV_State WAV_chain_add_clip(struct WAV_chain *chain, double ceiling_db)
+{
+	const struct WAV_chain_stage stage = {
+		.type = WAV_STAGE_CLIP,
+		.value = (float)pow(10.0, ceiling_db / 20.0),
+	};
+
+	return chain_add(chain, &stage);
+}
+
+WAV_State WAV_chain_add_fade(struct WAV_chain *chain, WAV_FadeType fade, uint64_t start_frame, uint64_t frames)
+{
+	if (fade >= WAV_FADE_NumTypes || frames == 0) return Error;
+
+	const struct WAV_chain_stage stage = {
+		.type = WAV_STAGE_FADE,
+		.fade = fade,
+		.start = start_frame,
+		.frames = frames,
+	};
+
+	return chain_add(chain, &stage);
+}
+
+void WAV_chain_reset(struct WAV_chain *chain)
+{
+	if (chain == NULL) return;
+
+	for (uint16_t s = 0; s < chain->num_stages; ++s) {
+		struct WAV_chain_stage *stage = &chain->stages[s];
+
+		if (stage->type == WAV_STAGE_BIQUAD) WAV_biquad_reset(stage->biquad);
+		if (stage->state != NULL) memset(stage->state, 0, 2 * (size_t)chain->num_channels * sizeof(float));
+	}
+
+	chain->position = 0;
+}
+
+void WAV_chain_free(struct WAV_chain *chain)
+{
+	if (chain == NULL) return;
+
+	for (uint16_t s = 0; s < chain->num_stages; ++s) free(chain->stages[s].state);
+
+	free(chain->stages);
+
+	chain->stages = NULL;
+	chain->num_stages = 0;
+}
+
+WAV_State WAV_chain_process(struct WAV_chain *chain, struct WAV_planar *planar)
+{
+	if (chain == NULL || planar == NULL || planar->num_channels != chain->num_channels) return Error;
+
+	chain_run(chain, planar->channels, planar->frames);
+
+	return Success;
+}
+
+WAV_State WAV_apply_chain(struct WAV_file *wav, struct WAV_chain *chain)
+{
+	if (wav == NULL || chain == NULL || load_DATA_chunk(wav) == Error || !valid_pcm_format(&wav->fmt)
+	    || wav->fmt.num_channels != chain->num_channels || writable_DATA_chunk(wav) == Error) {
+		return Error;
+	}
+
+	if (process_planar(
+			wav->data.buff,
+			wav->data.size / wav->fmt.block_align,
+			&wav->fmt,
+			chain_planar_block,
+			chain) == Error) {
+		return Error;
+	}
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+/*
+ * Sample rate conversion
+ *
+ * Polyphase resampling by out_rate / in_rate reduced to up / down. Output
+ * frame n sits at input time n * down / up, so its fractional position
+ * (n * down) % up picks one of up precomputed phases of a Kaiser windowed
+ * sinc, and the frame is the dot product of that phase with the input
+ * frames around it. The cutoff sits below the Nyquist frequency of the
+ * lower rate, so when downsampling the kernel spans more input frames.
+ */
+
+#define RESAMPLE_MIN_LENGTH 16
+#define RESAMPLE_MAX_LENGTH 1024
+
+// Largest phase table, in floats
+#define RESAMPLE_MAX_TABLE (1u << 24)
+
+// Input frames added to the history of a channel at a time
+#define RESAMPLE_CHUNK 4096
+
+// Stopband attenuation of the kernel, in decibels
+#define RESAMPLE_ATTENUATION 100.0
+
+typedef float (*resample_dot_fn)(const float *taps, const float *x, uint32_t count);
+
+// count is a multiple of 8. Eight running sums are reduced in the same
+// order as the vector kernels, so every kernel gives the same result.
+static float resample_dot_scalar(const float *taps, const float *x, uint32_t count)
+{
+	float acc[8] = { 0.0f };
+
+	for (uint32_t k = 0; k < count; k += 8) {
+		for (uint32_t l = 0; l < 8; ++l) acc[l] += taps[k + l] * x[k + l];
+	}
+
+	const float s0 = acc[0] + acc[4], s1 = acc[1] + acc[5];
+	const float s2 = acc[2] + acc[6], s3 = acc[3] + acc[7];
+
+	return (s0 + s2) + (s1 + s3);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse")))
+static float resample_dot_sse(const float *taps, const float *x, uint32_t count)
+{
+	__m128 lo = _mm_setzero_ps();
+	__m128 hi = _mm_setzero_ps();
+
+	for (uint32_t k = 0; k < count; k += 8) {
+		lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(&taps[k]), _mm_loadu_ps(&x[k])));
+		hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(&taps[k + 4]), _mm_loadu_ps(&x[k + 4])));
+	}
+
+	const __m128 s = _mm_add_ps(lo, hi);
+	const __m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+
+	return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+}
+
+__attribute__((target("avx")))
+static float resample_dot_avx(const float *taps, const float *x, uint32_t count)
+{
+	__m256 acc = _mm256_setzero_ps();
+
+	for (uint32_t k = 0; k < count; k += 8) {
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(&taps[k]), _mm256_loadu_ps(&x[k])));
+	}
+
+	const __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	const __m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+
+	return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static float resample_dot_neon(const float *taps, const float *x, uint32_t count)
+{
+	float32x4_t lo = vdupq_n_f32(0.0f);
+	float32x4_t hi = vdupq_n_f32(0.0f);
+
+	for (uint32_t k = 0; k < count; k += 8) {
+		lo = vaddq_f32(lo, vmulq_f32(vld1q_f32(&taps[k]), vld1q_f32(&x[k])));
+		hi = vaddq_f32(hi, vmulq_f32(vld1q_f32(&taps[k + 4]), vld1q_f32(&x[k + 4])));
+	}
+
+	const float32x4_t s = vaddq_f32(lo, hi);
+	const float32x2_t t = vadd_f32(vget_low_f32(s), vget_high_f32(s));
+
+	return vget_lane_f32(t, 0) + vget_lane_f32(t, 1);
+}
+
+#endif
+
+// Kernel resolved once by resample_init()
+static resample_dot_fn resample_dot = resample_dot_scalar;
+
+static pthread_once_t resample_once = PTHREAD_ONCE_INIT;
+
+static void resample_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse")) resample_dot = resample_dot_sse;
+	if (__builtin_cpu_supports("avx")) resample_dot = resample_dot_avx;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	resample_dot = resample_dot_neon;
+#endif
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b)
+{
+	while (b != 0) {
+		const uint64_t r = a % b;
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+// Zeroth order modified Bessel function of the first kind
+static double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 64 && term > sum * 1e-17; ++k) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+// Fill the phase table: phase p weighs the taps input frames from
+// taps / 2 - 1 before to taps / 2 after the position of its outputs
+static void resample_design(struct WAV_resampler *rs, uint32_t length)
+{
+	const double ratio = rs->up < rs->down ? (double)rs->up / rs->down : 1.0;
+
+	// Kaiser's estimate of the transition width for the length at the lower
+	// rate, with the stopband starting at its Nyquist frequency
+	const double transition = (RESAMPLE_ATTENUATION - 7.95) / (14.36 * length);
+	const double fc = (0.5 - transition / 2.0) * ratio;
+	const double beta = 0.1102 * (RESAMPLE_ATTENUATION - 8.7);
+	const double half = rs->taps / 2.0;
+	const double i0_beta = bessel_i0(beta);
+
+	for (uint32_t p = 0; p < rs->up; ++p) {
+		float *coeffs = &rs->coeffs[(uint64_t)p * rs->taps];
+		double sum = 0.0;
+
+		for (uint32_t w = 0; w < rs->taps; ++w) {
+			const double t = (double)p / rs->up + half - 1.0 - w;
+			const double x = t / half;
+			const double sinc = t == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * t) / (M_PI * t);
+			const double window = x * x < 1.0 ? bessel_i0(beta * sqrt(1.0 - x * x)) / i0_beta : 0.0;
+
+			coeffs[w] = (float)(sinc * window);
+			sum += sinc * window;
+		}
+
+		// Unity gain at DC for every phase, so no phase adds ripple
+		for (uint32_t w = 0; w < rs->taps; ++w) coeffs[w] = (float)(coeffs[w] / sum);
+	}
+}
+
+static uint64_t resample_stride(const struct WAV_resampler *rs)
+{
+	return (uint64_t)rs->taps + RESAMPLE_CHUNK;
+}
+
+// Where every channel stands in its history; all channels move together
+struct resample_cursor {
+	uint64_t	fill;
+	uint64_t	position;
+	uint64_t	phase;
+};
+
+// Feed frames of in, or zeros when in is NULL, through the history of one
+// channel and write at most max_out outputs; returns the number written
+static uint64_t resample_channel(
+		const struct WAV_resampler *rs,
+		float *history,
+		struct resample_cursor *cur,
+		const float *in,
+		uint64_t frames,
+		float *out,
+		uint64_t max_out)
+{
+	const uint32_t taps = rs->taps;
+	const uint64_t capacity = resample_stride(rs);
+
+	uint64_t written = 0;
+
+	while (1) {
+		const uint64_t n = frames < capacity - cur->fill ? frames : capacity - cur->fill;
+
+		if (in != NULL) {
+			memcpy(&history[cur->fill], in, n * sizeof(float));
+			in += n;
+		} else {
+			memset(&history[cur->fill], 0, n * sizeof(float));
+		}
+
+		frames -= n;
+		cur->fill += n;
+
+		while (written < max_out && cur->position + taps <= cur->fill) {
+			out[written++] = resample_dot(&rs->coeffs[cur->phase * taps], &history[cur->position], taps);
+
+			cur->phase += rs->down;
+			cur->position += cur->phase / rs->up;
+			cur->phase %= rs->up;
+		}
+
+		// Drop the frames no later output reaches
+		const uint64_t drop = cur->position < cur->fill ? cur->position : cur->fill;
+
+		memmove(history, &history[drop], (cur->fill - drop) * sizeof(float));
+		cur->fill -= drop;
+		cur->position -= drop;
+
+		if (frames == 0 || written == max_out) return written;
+	}
+}
+
+struct resample_job {
+	const struct WAV_resampler *rs;
+	const float *const	*in;	// NULL to feed zeros
+	uint64_t		frames;
+	float *const		*out;
+	uint64_t		out_first;
+	uint64_t		max_out;
+	struct resample_cursor	start;
+	struct resample_cursor	end;
+	uint64_t		written;
+};
+
+static void resample_task(uint64_t index, void *ctx)
+{
+	struct resample_job *job = (struct resample_job*)ctx;
+	struct resample_cursor cur = job->start;
+
+	const uint64_t written = resample_channel(
+			job->rs,
+			&job->rs->history[index * resample_stride(job->rs)],
+			&cur,
+			job->in != NULL ? job->in[index] : NULL,
+			job->frames,
+			&job->out[index][job->out_first],
+			job->max_out
+		);
+
+	// Every channel ends in the same place
+	if (index == 0) {
+		job->end = cur;
+		job->written = written;
+	}
+}
+
+// Run frames of every channel through the converter, writing the outputs
+// from out_first on; returns the number of frames written to each channel
+static uint64_t resample_run(
+		struct WAV_resampler *rs,
+		const float *const *in,
+		uint64_t frames,
+		float *const *out,
+		uint64_t out_first,
+		uint64_t max_out)
+{
+	pthread_once(&resample_once, resample_init);
+
+	struct resample_job job = {
+		.rs = rs,
+		.in = in,
+		.frames = frames,
+		.out = out,
+		.out_first = out_first,
+		.max_out = max_out,
+		.start = { rs->fill, rs->position, rs->phase },
+	};
+
+	pool_run(rs->num_channels, resample_task, (void*)&job);
+
+	rs->fill = job.end.fill;
+	rs->position = job.end.position;
+	rs->phase = job.end.phase;
+	rs->frames_out += job.written;
+
+	if (in != NULL) rs->frames_in += frames;
+
+	return job.written;
+}
+
+// Pad the input with zeros until every output it makes has been written
+static uint64_t resample_flush(struct WAV_resampler *rs, float *const *out, uint64_t out_first)
+{
+	const uint64_t total = (rs->frames_in * rs->up + rs->down - 1) / rs->down;
+
+	if (rs->frames_out >= total) return 0;
+
+	return resample_run(rs, NULL, rs->taps / 2, out, out_first, total - rs->frames_out);
+}
+
+WAV_State WAV_resampler_init(
+		struct WAV_resampler *rs,
+		uint16_t num_channels,
+		uint32_t in_rate,
+		uint32_t out_rate,
+		uint32_t kernel_length)
+{
+	if (kernel_length == 0) kernel_length = WAV_RESAMPLE_DEFAULT_LENGTH;
+
+	if (rs == NULL || num_channels == 0 || in_rate == 0 || out_rate == 0
+	    || kernel_length < RESAMPLE_MIN_LENGTH || kernel_length > RESAMPLE_MAX_LENGTH) {
+		return Error;
+	}
+
+	memset(rs, 0, sizeof(*rs));
+
+	const uint64_t divisor = gcd_u64(in_rate, out_rate);
+	const uint64_t up = out_rate / divisor;
+	const uint64_t down = in_rate / divisor;
+
+	// Input frames under the kernel, rounded up for the 8 wide dot products
+	const uint64_t span = up < down ? (kernel_length * down + up - 1) / up : kernel_length;
+	const uint64_t taps = (span + 7) & ~(uint64_t)7;
+
+	if (taps * up > RESAMPLE_MAX_TABLE) {
+		fprintf(stderr, "Cannot resample %u to %u hz: the phase table would be too large\n", in_rate, out_rate);
+		return Error;
+	}
+
+	rs->num_channels = num_channels;
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->up = (uint32_t)up;
+	rs->down = (uint32_t)down;
+	rs->taps = (uint32_t)taps;
+
+	if (posix_memalign((void**)&rs->coeffs, WAV_PLANAR_ALIGN, taps * up * sizeof(float)) != 0) {
+		rs->coeffs = NULL;
+		return Error;
+	}
+
+	rs->history = (float*)malloc((size_t)num_channels * resample_stride(rs) * sizeof(float));
+
+	if (rs->history == NULL) {
+		WAV_resampler_free(rs);
+		return Error;
+	}
+
+	resample_design(rs, kernel_length);
+	WAV_resampler_reset(rs);
+
+	return Success;
+}
+
+uint64_t WAV_resampler_max_output(const struct WAV_resampler *rs, uint64_t frames)
+{
+	if (rs == NULL || rs->down == 0) return 0;
+
+	// Less than taps frames are ever held back between calls
+	return ((frames + rs->taps) * rs->up) / rs->down + 1;
+}
+
+void WAV_resampler_reset(struct WAV_resampler *rs)
+{
+	if (rs == NULL || rs->history == NULL) return;
+
+	// The first output is centred on the first input frame, with zeros before it
+	rs->fill = rs->taps / 2 - 1;
+	rs->position = 0;
+	rs->phase = 0;
+	rs->frames_in = 0;
+	rs->frames_out = 0;
+
+	for (uint16_t c = 0; c < rs->num_channels; ++c) {
+		memset(&rs->history[c * resample_stride(rs)], 0, rs->fill * sizeof(float));
+	}
+}
+
+void WAV_resampler_free(struct WAV_resampler *rs)
+{
+	if (rs == NULL) return;
+
+	free(rs->coeffs);
+	free(rs->history);
+
+	rs->coeffs = NULL;
+	rs->history = NULL;
+}
+
+WAV_State WAV_resampler_process(
+		struct WAV_resampler *rs,
+		const struct WAV_planar *in,
+		struct WAV_planar *out,
+		uint64_t *out_frames)
+{
+	if (rs == NULL || rs->history == NULL || in == NULL || out == NULL || out_frames == NULL
+	    || in->num_channels != rs->num_channels || out->num_channels != rs->num_channels
+	    || out->frames < WAV_resampler_max_output(rs, in->frames)) {
+		return Error;
+	}
+
+	*out_frames = resample_run(rs, (const float *const *)in->channels, in->frames, out->channels, 0, UINT64_MAX);
+
+	return Success;
+}
+
+WAV_State WAV_resampler_flush(struct WAV_resampler *rs, struct WAV_planar *out, uint64_t *out_frames)
+{
+	if (rs == NULL || rs->history == NULL || out == NULL || out_frames == NULL
+	    || out->num_channels != rs->num_channels || out->frames < WAV_resampler_max_output(rs, 0)) {
+		return Error;
+	}
+
+	*out_frames = resample_flush(rs, out->channels, 0);
+
+	return Success;
+}
+
+WAV_State WAV_resample(struct WAV_file *wav, uint32_t sample_rate, uint32_t kernel_length)
+{
+	if (wav == NULL || !valid_pcm_format(&wav->fmt) || sample_rate == 0) return Error;
+	if (sample_rate == wav->fmt.sample_rate) return Success;
+
+	struct WAV_resampler rs;
+
+	if (WAV_resampler_init(&rs, wav->fmt.num_channels, wav->fmt.sample_rate, sample_rate, kernel_length) == Error) {
+		return Error;
+	}
+
+	struct WAV_planar in, out;
+
+	if (WAV_to_planar(wav, &in) == Error) {
+		WAV_resampler_free(&rs);
+		return Error;
+	}
+
+	const uint64_t frames = (in.frames * rs.up + rs.down - 1) / rs.down;
+
+	if (WAV_planar_alloc(&out, wav->fmt.num_channels, frames) == Error) {
+		WAV_planar_free(&in);
+		WAV_resampler_free(&rs);
+		return Error;
+	}
+
+	const uint64_t written = resample_run(&rs, (const float *const *)in.channels, in.frames, out.channels, 0, frames);
+
+	resample_flush(&rs, out.channels, written);
+
+	WAV_planar_free(&in);
+	WAV_resampler_free(&rs);
+
+	const WAV_State ret = WAV_from_planar(wav, &out);
+
+	if (ret == Success) {
+		wav->fmt.sample_rate = sample_rate;
+		wav->fmt.byte_rate = sample_rate * wav->fmt.block_align;
+	}
+
+	WAV_planar_free(&out);
+
+	return ret;
+}
+
+/*
+ * Format conversion
+ *
+ * WAV_convert_format rewrites the waveform data at a new bit depth and
+ * channel count in one pass. When only the bit depth changes, samples are
+ * requantized in integer arithmetic: widening shifts them up exactly and
+ * narrowing rounds to nearest, after TPDF dither if asked for. A new channel
+ * count, or any matrix, mixes each block in float instead. When the new
+ * frames are no larger the data is rewritten in place front to back, since
+ * every output frame lands at or before the input frame it came from.
+ */
+
+typedef void (*requantize_fn)(
+		const unsigned char *src,
+		unsigned char *dst,
+		uint64_t samples,
+		uint64_t first_sample,
+		int dither
+	);
+
+// Narrowing rounds half up and saturates; the dither is +-1 LSB of OUT bits
+#define DEFINE_REQUANTIZE_KERNEL(IN, OUT)							\
+	static void requantize_##IN##_##OUT(							\
+			const unsigned char *src,						\
+			unsigned char *dst,							\
+			uint64_t samples,							\
+			uint64_t first_sample,							\
+			int dither)								\
+	{											\
+		const int down = IN > OUT ? IN - OUT : 0;					\
+		const int up = OUT > IN ? OUT - IN : 0;						\
+		const int64_t round = (INT64_C(1) << down) >> 1;				\
+		const int64_t hi = (INT64_C(1) << (OUT - 1)) - 1;				\
+												\
+		for (uint64_t i = 0; i < samples; ++i) {					\
+			int64_t x = load_pcm##IN(&src[i * (IN / 8)]);				\
+												\
+			if (down > 0) {								\
+				const int64_t d = dither ? (int64_t)tpdf(first_sample + i, down) : 0;\
+												\
+				x = (x + round + d) >> down;					\
+				x = x > hi ? hi : x < -hi - 1 ? -hi - 1 : x;			\
+			} else {								\
+				x *= INT64_C(1) << up;						\
+			}									\
+												\
+			store_pcm##OUT(&dst[i * (OUT / 8)], x);					\
+		}										\
+	}
+
+DEFINE_REQUANTIZE_KERNEL(8, 16)
+DEFINE_REQUANTIZE_KERNEL(8, 24)
+DEFINE_REQUANTIZE_KERNEL(8, 32)
+DEFINE_REQUANTIZE_KERNEL(16, 8)
+DEFINE_REQUANTIZE_KERNEL(16, 24)
+DEFINE_REQUANTIZE_KERNEL(16, 32)
+DEFINE_REQUANTIZE_KERNEL(24, 8)
+DEFINE_REQUANTIZE_KERNEL(24, 16)
+DEFINE_REQUANTIZE_KERNEL(24, 32)
+DEFINE_REQUANTIZE_KERNEL(32, 8)
+DEFINE_REQUANTIZE_KERNEL(32, 16)
+DEFINE_REQUANTIZE_KERNEL(32, 24)
+
+// Indexed by bytes per sample in, then out
+static requantize_fn requantize_kernels[5][5] = {
+	{ NULL },
+	{ NULL, NULL, requantize_8_16, requantize_8_24, requantize_8_32 },
+	{ NULL, requantize_16_8, NULL, requantize_16_24, requantize_16_32 },
+	{ NULL, requantize_24_8, requantize_24_16, NULL, requantize_24_32 },
+	{ NULL, requantize_32_8, requantize_32_16, requantize_32_24, NULL },
+};
+
+// Same table for undithered conversions, with the SIMD kernels filled in
+static requantize_fn requantize_simd_kernels[5][5];
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Four samples sign extended to 32-bit lanes
+__attribute__((target("sse4.1")))
+static inline __m128i requantize_load_16(const unsigned char *src)
+{
+	return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)src));
+}
+
+// Reads 16 bytes for the 12 of the samples
+__attribute__((target("sse4.1")))
+static inline __m128i requantize_load_24(const unsigned char *src)
+{
+	return _mm_srai_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), S24_UNPACK_MASK), 8);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i requantize_load_32(const unsigned char *src)
+{
+	return _mm_loadu_si128((const __m128i*)src);
+}
+
+// Lanes already fit 16 bits, except 32768 after rounding up, which packs saturates
+__attribute__((target("sse4.1")))
+static inline void requantize_store_16(unsigned char *dst, __m128i v)
+{
+	_mm_storel_epi64((__m128i*)dst, _mm_packs_epi32(v, v));
+}
+
+__attribute__((target("sse4.1")))
+static inline void requantize_store_24(unsigned char *dst, __m128i v)
+{
+	const __m128i packed = _mm_shuffle_epi8(v, S24_PACK_MASK);
+	const int32_t last = _mm_extract_epi32(packed, 2);
+
+	_mm_storel_epi64((__m128i*)dst, packed);
+	memcpy(&dst[8], &last, 4);
+}
+
+__attribute__((target("sse4.1")))
+static inline void requantize_store_32(unsigned char *dst, __m128i v)
+{
+	_mm_storeu_si128((__m128i*)dst, v);
+}
+
+// Rounding as (x >> down) + bit down - 1 of x cannot overflow 32 bits
+#define DEFINE_REQUANTIZE_SSE41_KERNEL(IN, OUT)							\
+	__attribute__((target("sse4.1")))							\
+	static void requantize_##IN##_##OUT##_sse41(						\
+			const unsigned char *src,						\
+			unsigned char *dst,							\
+			uint64_t samples,							\
+			uint64_t first_sample,							\
+			int dither)								\
+	{											\
+		const int down = IN > OUT ? IN - OUT : 0;					\
+		const int up = OUT > IN ? OUT - IN : 0;						\
+		const __m128i one = _mm_set1_epi32(1);						\
+		const __m128i hi = _mm_set1_epi32((int32_t)((INT64_C(1) << (OUT - 1)) - 1));	\
+												\
+		uint64_t i = 0;									\
+		for (; i + 6 <= samples; i += 4) {						\
+			__m128i x = requantize_load_##IN(&src[i * (IN / 8)]);			\
+												\
+			if (down > 0) {								\
+				const __m128i bit = _mm_and_si128(_mm_srai_epi32(x, down - 1), one);\
+				x = _mm_min_epi32(_mm_add_epi32(_mm_srai_epi32(x, down), bit), hi);\
+			} else {								\
+				x = _mm_slli_epi32(x, up);					\
+			}									\
+												\
+			requantize_store_##OUT(&dst[i * (OUT / 8)], x);				\
+		}										\
+												\
+		requantize_##IN##_##OUT(&src[i * (IN / 8)], &dst[i * (OUT / 8)],		\
+				samples - i, first_sample + i, dither);				\
+	}
+
+DEFINE_REQUANTIZE_SSE41_KERNEL(16, 24)
+DEFINE_REQUANTIZE_SSE41_KERNEL(16, 32)
+DEFINE_REQUANTIZE_SSE41_KERNEL(24, 16)
+DEFINE_REQUANTIZE_SSE41_KERNEL(24, 32)
+DEFINE_REQUANTIZE_SSE41_KERNEL(32, 16)
+DEFINE_REQUANTIZE_SSE41_KERNEL(32, 24)
+
+#endif
+
+typedef void (*mix_fn)(float *dst, const float *src, float gain, uint64_t n);
+
+// mix_set writes gain * src to dst, mix_add adds it
+#define DEFINE_MIX_KERNELS(SUFFIX, ATTR, LANES, VEC, LOAD, STORE, SET1, ADD, MUL)		\
+	ATTR static void mix_set_##SUFFIX(float *dst, const float *src, float gain, uint64_t n)\
+	{											\
+		const VEC g = SET1(gain);							\
+		uint64_t k = 0;									\
+		for (; k + LANES <= n; k += LANES) STORE(&dst[k], MUL(LOAD(&src[k]), g));	\
+		for (; k < n; ++k) dst[k] = src[k] * gain;					\
+	}											\
+												\
+	ATTR static void mix_add_##SUFFIX(float *dst, const float *src, float gain, uint64_t n)\
+	{											\
+		const VEC g = SET1(gain);							\
+		uint64_t k = 0;									\
+		for (; k + LANES <= n; k += LANES) {						\
+			STORE(&dst[k], ADD(LOAD(&dst[k]), MUL(LOAD(&src[k]), g)));		\
+		}										\
+		for (; k < n; ++k) dst[k] += src[k] * gain;					\
+	}
+
+#define MIX_SCALAR_SET1(x)	(x)
+
+DEFINE_MIX_KERNELS(scalar, , 1, float,
+		FFT_SCALAR_LOAD, FFT_SCALAR_STORE, MIX_SCALAR_SET1, FFT_SCALAR_ADD, FFT_SCALAR_MUL)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+DEFINE_MIX_KERNELS(sse, __attribute__((target("sse"))), 4, __m128,
+		_mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_mul_ps)
+DEFINE_MIX_KERNELS(avx, __attribute__((target("avx"))), 8, __m256,
+		_mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps)
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+DEFINE_MIX_KERNELS(neon, , 4, float32x4_t,
+		vld1q_f32, vst1q_f32, vdupq_n_f32, vaddq_f32, vmulq_f32)
+
+#endif
+
+// Kernels resolved once by format_init()
+static struct {
+	mix_fn	set;
+	mix_fn	add;
+} mix_kernels = { mix_set_scalar, mix_add_scalar };
+
+static pthread_once_t format_once = PTHREAD_ONCE_INIT;
+
+static void format_init(void)
+{
+	memcpy(requantize_simd_kernels, requantize_kernels, sizeof(requantize_kernels));
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.1")) {
+		requantize_simd_kernels[2][3] = requantize_16_24_sse41;
+		requantize_simd_kernels[2][4] = requantize_16_32_sse41;
+		requantize_simd_kernels[3][2] = requantize_24_16_sse41;
+		requantize_simd_kernels[3][4] = requantize_24_32_sse41;
+		requantize_simd_kernels[4][2] = requantize_32_16_sse41;
+		requantize_simd_kernels[4][3] = requantize_32_24_sse41;
+	}
+
+	if (__builtin_cpu_supports("sse")) {
+		mix_kernels.set = mix_set_sse;
+		mix_kernels.add = mix_add_sse;
+	}
+
+	if (__builtin_cpu_supports("avx")) {
+		mix_kernels.set = mix_set_avx;
+		mix_kernels.add = mix_add_avx;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	mix_kernels.set = mix_set_neon;
+	mix_kernels.add = mix_add_neon;
+#endif
+}
+
+// Standard mix of in channels to out channels, out rows of in gains. Mono
+// goes to both sides of stereo, or to the centre of wider layouts; stereo,
+// quad, 5.1 and 7.1 fold down to stereo as in ITU-R BS.775 and to mono as
+// the average of that. Other layouts keep the channels they have in common.
+static void default_mix_matrix(float *matrix, uint16_t in, uint16_t out)
+{
+	const float c = (float)M_SQRT1_2;
+
+	memset(matrix, 0, (size_t)in * out * sizeof(float));
+
+	if (in == 1 && out >= 2) {
+		if (out == 2) {
+			matrix[0] = matrix[1] = 1.0f;
+		} else {
+			matrix[2 * in] = 1.0f;
+		}
+		return;
+	}
+
+	// Stereo folds of quad (FL FR BL BR), 5.1 (FL FR FC LFE BL BR) and
+	// 7.1 (FL FR FC LFE BL BR SL SR); the LFE is dropped
+	float stereo[2][8] = {{ 0.0f }};
+
+	switch (in) {
+	case 2:
+		stereo[0][0] = stereo[1][1] = 1.0f;
+		break;
+	case 4:
+		stereo[0][0] = stereo[1][1] = 1.0f;
+		stereo[0][2] = stereo[1][3] = c;
+		break;
+	case 6:
+	case 8:
+		stereo[0][0] = stereo[1][1] = 1.0f;
+		stereo[0][2] = stereo[1][2] = c;
+		stereo[0][4] = stereo[1][5] = c;
+		if (in == 8) stereo[0][6] = stereo[1][7] = c;
+		break;
+	default:
+		for (uint16_t o = 0; o < out && o < in; ++o) matrix[(size_t)o * in + o] = 1.0f;
+		return;
+	}
+
+	if (out == 2) {
+		for (uint16_t i = 0; i < in; ++i) {
+			matrix[i] = stereo[0][i];
+			matrix[in + i] = stereo[1][i];
+		}
+	} else if (out == 1) {
+		for (uint16_t i = 0; i < in; ++i) matrix[i] = 0.5f * (stereo[0][i] + stereo[1][i]);
+	} else {
+		for (uint16_t o = 0; o < out && o < in; ++o) matrix[(size_t)o * in + o] = 1.0f;
+	}
+}
+
+struct format_job {
+	const unsigned char	*src;
+	unsigned char		*dst;
+	const struct FMT_chunk	*in;
+	const struct FMT_chunk	*out;
+	const float		*matrix;	// NULL to requantize only
+	requantize_fn		requantize;
+	int			dither;
+	uint64_t		frames;
+	uint64_t		range;		// frames per range
+	int			failed;
+};
+
+// Mix frames starting at first a block at a time through planar scratch
+static WAV_State mix_frames(const struct format_job *job, uint64_t first, uint64_t frames)
+{
+	const uint16_t in_channels = job->in->num_channels;
+	const uint16_t out_channels = job->out->num_channels;
+	const float lsb = pcm_to_float_scale[job->out->bits_per_sample / 8];
+
+	struct WAV_planar in, out;
+
+	if (WAV_planar_alloc(&in, in_channels, DSP_BLOCK_FRAMES) == Error) return Error;
+
+	if (WAV_planar_alloc(&out, out_channels, DSP_BLOCK_FRAMES) == Error) {
+		WAV_planar_free(&in);
+		return Error;
+	}
+
+	for (uint64_t done = 0; done < frames; done += DSP_BLOCK_FRAMES) {
+		const uint64_t frame = first + done;
+		const uint64_t n = frames - done < DSP_BLOCK_FRAMES ? frames - done : DSP_BLOCK_FRAMES;
+
+		decode_frames(&job->src[frame * job->in->block_align], job->in, n, in.channels, 0);
+
+		for (uint16_t o = 0; o < out_channels; ++o) {
+			const float *row = &job->matrix[(size_t)o * in_channels];
+			float *dst = out.channels[o];
+			int written = 0;
+
+			for (uint16_t i = 0; i < in_channels; ++i) {
+				if (row[i] == 0.0f) continue;
+
+				(written ? mix_kernels.add : mix_kernels.set)(dst, in.channels[i], row[i], n);
+				written = 1;
+			}
+
+			if (!written) memset(dst, 0, n * sizeof(float));
+
+			if (job->dither) {
+				for (uint64_t k = 0; k < n; ++k) {
+					const uint64_t r = dither_hash((frame + k) * out_channels + o);
+					const float u = (float)((r & 0xFFFFFFFF) + (r >> 32)) * 0x1p-32f - 1.0f;
+
+					dst[k] += u * lsb;
+				}
+			}
+		}
+
+		encode_frames((const float *const *)out.channels, 0, job->out, n, &job->dst[frame * job->out->block_align]);
+	}
+
+	WAV_planar_free(&in);
+	WAV_planar_free(&out);
+
+	return Success;
+}
+
+static WAV_State format_frames(const struct format_job *job, uint64_t first, uint64_t frames)
+{
+	if (job->matrix != NULL) return mix_frames(job, first, frames);
+
+	const uint64_t samples_per_frame = job->in->num_channels;
+
+	job->requantize(
+			&job->src[first * job->in->block_align],
+			&job->dst[first * job->out->block_align],
+			frames * samples_per_frame,
+			first * samples_per_frame,
+			job->dither
+		);
+
+	return Success;
+}
+
+static void format_task(uint64_t index, void *ctx)
+{
+	struct format_job *job = (struct format_job*)ctx;
+	const uint64_t first = index * job->range;
+	const uint64_t n = job->frames - first < job->range ? job->frames - first : job->range;
+
+	if (format_frames(job, first, n) == Error) job->failed = 1;
+}
+
+WAV_State WAV_convert_format(
+		struct WAV_file *wav,
+		uint16_t bits_per_sample,
+		uint16_t num_channels,
+		const float *matrix,
+		WAV_Dither dither)
+{
+	if (wav == NULL || num_channels == 0 || dither >= WAV_DITHER_NumModes
+	    || !valid_pcm_format(&wav->fmt) || load_DATA_chunk(wav) == Error) {
+		return Error;
+	}
+
+	struct FMT_chunk out = wav->fmt;
+
+	out.audio_format = WAV_FORMAT_PCM;
+	out.size = 16;
+	out.num_channels = num_channels;
+	out.bits_per_sample = bits_per_sample;
+	out.block_align = num_channels * (bits_per_sample / 8);
+	out.byte_rate = out.sample_rate * out.block_align;
+
+	if (!valid_pcm_format(&out)) return Error;
+
+	const uint16_t in_channels = wav->fmt.num_channels;
+	const int requantize = matrix == NULL && num_channels == in_channels;
+
+	if (requantize && bits_per_sample == wav->fmt.bits_per_sample) return Success;
+
+	float *mix = NULL;
+
+	if (!requantize) {
+		mix = (float*)malloc((size_t)in_channels * num_channels * sizeof(float));
+		if (mix == NULL) return Error;
+
+		if (matrix != NULL) {
+			memcpy(mix, matrix, (size_t)in_channels * num_channels * sizeof(float));
+		} else {
+			default_mix_matrix(mix, in_channels, num_channels);
+		}
+	}
+
+	pthread_once(&format_once, format_init);
+
+	const uint64_t frames = wav->data.size / wav->fmt.block_align;
+	const uint64_t size = frames * out.block_align;
+	const uint32_t in_bytes = wav->fmt.bits_per_sample / 8;
+	const uint32_t out_bytes = bits_per_sample / 8;
+
+	// Writing front to back only overwrites frames already read while frames
+	// do not grow; the file mapping itself is never written to
+	const int in_place = out.block_align <= wav->fmt.block_align && !is_mapped(wav, wav->data.buff);
+	unsigned char *dst = in_place ? wav->data.buff : (unsigned char*)malloc(size > 0 ? size : 1);
+
+	if (dst == NULL) {
+		free(mix);
+		return Error;
+	}
+
+	struct format_job job = {
+		.src = wav->data.buff,
+		.dst = dst,
+		.in = &wav->fmt,
+		.out = &out,
+		.matrix = mix,
+		.requantize = dither == WAV_DITHER_TPDF
+			? requantize_kernels[in_bytes][out_bytes]
+			: requantize_simd_kernels[in_bytes][out_bytes],
+		.dither = dither == WAV_DITHER_TPDF,
+		.frames = frames,
+		.range = pool_range_items(wav->fmt.block_align),
+	};
+
+	if (in_place) {
+		if (format_frames(&job, 0, frames) == Error) job.failed = 1;
+	} else {
+		pool_run(pool_range_count(frames, job.range), format_task, (void*)&job);
+	}
+
+	free(mix);
+
+	// Scratch is allocated before any frame is written, so a failed pass left the data as it was
+	if (job.failed) {
+		if (!in_place) free(dst);
+		return Error;
+	}
+
+	if (in_place) {
+		unsigned char *shrunk = (unsigned char*)realloc(dst, size > 0 ? size : 1);
+		if (shrunk != NULL) dst = shrunk;
+	} else {
+		free_buff(wav, wav->data.buff);
+	}
+
+	wav->riff.size = wav->riff.size - wav->data.size + size;
+	wav->data.buff = dst;
+	wav->data.size = size;
+	wav->fmt = out;
+
+	WAV_invalidate_stats(wav);
+
+	return Success;
+}
+
+// Returns 1 if the RIFF header of wav says the real sizes live in a ds64 chunk
+static int is_rf64(const struct WAV_file *wav)
+{
+	return memcmp(wav->riff.id, "RF64", 4) == 0 || memcmp(wav->riff.id, "BW64", 4) == 0;
+}
+
+// Walks the chunk headers of a WAV file read through a FILE or a mapping.
+// Every parser steps with walk_next(), so all of them take the data size of
+// RF64 files from the ds64 chunk and bound each chunk by the file the same way.
+struct chunk_walker {
+	FILE			*file;		// NULL when walking map
+	const unsigned char	*map;
+	uint64_t		file_size;
+	uint64_t		pos;		// offset of the next chunk header
+	int			failed;		// a chunk did not fit in the file
+};
+
+// Copy size bytes at offset of the walked file; the caller keeps them inside it
+static WAV_State walk_read(struct chunk_walker *walker, uint64_t offset, void *dst, size_t size)
+{
+	if (walker->map != NULL) {
+		memcpy(dst, walker->map + offset, size);
+		return Success;
+	}
+
+	if (fseeko(walker->file, offset, SEEK_SET) != 0 || fread(dst, size, 1, walker->file) != 1) {
+		return Error;
+	}
+
+	return Success;
+}
+
+// Read the RIFF header at the start of the walk into wav
+static WAV_State walk_RIFF_header(struct chunk_walker *walker, struct WAV_file *wav)
+{
+	unsigned char header[12];
+	uint32_t size = 0;
+
+	if (walker->file_size < sizeof(header) || walk_read(walker, 0, header, sizeof(header)) == Error) {
+		return Error;
+	}
+
+	memcpy(wav->riff.id, header, sizeof(wav->riff.id));
+	memcpy(&size, header + 4, sizeof(size));
+	memcpy(wav->riff.format, header + 8, sizeof(wav->riff.format));
+
+	wav->riff.size = size;
+	walker->pos = sizeof(header);
+
+	if (memcmp(wav->riff.id, "RIFF", 4) != 0 && memcmp(wav->riff.id, "RIFX", 4) != 0 && !is_rf64(wav)) {
+		return Error;
+	}
+
+	if (memcmp(wav->riff.format, "WAVE", sizeof(wav->riff.format)) != 0) {
+		return Error;
+	}
+
+	return Success;
+}
+
+static WAV_State walk_file(struct chunk_walker *walker, struct WAV_file *wav, FILE *file)
+{
+	struct stat st;
+
+	*walker = (struct chunk_walker) {0};
+	walker->file = file;
+
+	if (fstat(fileno(file), &st) != 0) return Error;
+
+	walker->file_size = st.st_size;
+
+	return walk_RIFF_header(walker, wav);
+}
+
+static WAV_State walk_map(struct chunk_walker *walker, struct WAV_file *wav, const unsigned char *map, uint64_t size)
+{
+	*walker = (struct chunk_walker) {0};
+	walker->map = map;
+	walker->file_size = size;
+
+	return walk_RIFF_header(walker, wav);
+}
+
+// Step to the next chunk, giving its id and the offset and size of its
+// payload. A ds64 chunk is parsed on the way. Returns Error at the end of the
+// file, or when the chunk runs past it, which also sets walker->failed.
+static WAV_State walk_next(struct chunk_walker *walker, struct WAV_file *wav, unsigned char *id, uint64_t *offset, uint64_t *size)
+{
+	if (walker->failed || walker->pos > walker->file_size || walker->file_size - walker->pos < 8) {
+		return Error;
+	}
+
+	unsigned char header[8];
+	uint32_t chunk_size = 0;
+
+	if (walk_read(walker, walker->pos, header, sizeof(header)) == Error) {
+		walker->failed = 1;
+		return Error;
+	}
+
+	memcpy(id, header, 4);
+	memcpy(&chunk_size, header + 4, sizeof(chunk_size));
+
+	*offset = walker->pos + sizeof(header);
+	*size = chunk_size;
+
+	// RF64 files keep the real size of the data chunk in the ds64 chunk
+	if (memcmp(id, "data", 4) == 0 && chunk_size == WAV_RIFF_MAX_SIZE && is_rf64(wav)) {
+		*size = wav->data.size;
+	}
+
+	if (*size > walker->file_size - *offset) {
+		perror("WAV chunk runs past the end of the file.\n");
+		walker->failed = 1;
+		return Error;
+	}
+
+	if (memcmp(id, "ds64", 4) == 0) {
+		unsigned char sizes[16];
+
+		if (*size < sizeof(sizes) || walk_read(walker, *offset, sizes, sizeof(sizes)) == Error) {
+			walker->failed = 1;
+			return Error;
+		}
+
+		memcpy(&wav->riff.size, sizes, sizeof(wav->riff.size));
+		memcpy(&wav->data.size, sizes + 8, sizeof(wav->data.size));
+	}
+
+	// Chunks are word aligned; odd sized payloads are followed by a pad byte
+	walker->pos = *offset + *size + (*size & 1);
+
+	return Success;
+}
+
+// Read the 16 bytes of PCM format fields of a fmt chunk
+static WAV_State walk_FMT_chunk(struct chunk_walker *walker, struct WAV_file *wav, uint64_t offset, uint64_t size)
+{
+	unsigned char fields[16];
+
+	if (size < sizeof(fields) || walk_read(walker, offset, fields, sizeof(fields)) == Error) {
+		return Error;
+	}
+
+	memcpy(wav->fmt.id, "fmt ", sizeof(wav->fmt.id));
+	wav->fmt.size = size;
+
+	memcpy(&wav->fmt.audio_format, fields, sizeof(wav->fmt.audio_format));
+	memcpy(&wav->fmt.num_channels, fields + 2, sizeof(wav->fmt.num_channels));
+	memcpy(&wav->fmt.sample_rate, fields + 4, sizeof(wav->fmt.sample_rate));
+	memcpy(&wav->fmt.byte_rate, fields + 8, sizeof(wav->fmt.byte_rate));
+	memcpy(&wav->fmt.block_align, fields + 12, sizeof(wav->fmt.block_align));
+	memcpy(&wav->fmt.bits_per_sample, fields + 14, sizeof(wav->fmt.bits_per_sample));
+
+	return Success;
+}
+
+static WAV_State read_DATA_chunk(struct WAV_file *wav, struct chunk_walker *walker, uint64_t offset, uint64_t size)
+{
+	memcpy(wav->data.id, "data", sizeof(wav->data.id));
+	wav->data.size = size;
+	wav->source.data_offset = offset;
+
+	if (index_chunk(wav, wav->data.id, offset, size) == Error) {
+		return Error;
+	}
+
+	wav->data.buff = (unsigned char*)malloc(sizeof(unsigned char) * (size > 0 ? size : 1));
+
+	if (wav->data.buff == NULL ) {
+		perror("Could not alloc wav data buffer.\n");
+		return Error;
+	}
+
+	if (size > 0 && walk_read(walker, offset, wav->data.buff, size) == Error) {
+		perror("Could not write to wav data buffer.\n");
+		free(wav->data.buff);	
+		wav->data.buff = NULL;
+		return Error;
+	}
+
+	return Success;
+}
+
+static WAV_State read_EXTRA_chunk(struct WAV_file *wav, struct chunk_walker *walker, unsigned char* chunk_id, uint64_t offset, uint64_t size)
+{
+	// Read the payload straight into the chunk arena; on error it stays
+	// there until WAV_free
+	unsigned char *buff = (unsigned char*)arena_alloc(&wav->chunks, size > 0 ? size : 1);
+
+	if (buff == NULL) {
+		return Error;
+	}
+
+	if (size > 0 && walk_read(walker, offset, buff, size) == Error) {
+		return Error;
+	}
+
+	if (append_EXTRA_chunk(wav, chunk_id, buff, size, offset) == NULL ||
+	    index_chunk(wav, chunk_id, offset, size) == Error) {
+		return Error;
+	}
+
+	return Success;
+}
+
+WAV_State WAV_read_file(struct WAV_file *wav, const char *file_name)
+{
+	if (file_name == NULL) return Error;
+
+	FILE *file = fopen(file_name, "rb");
+
+	if (file == NULL) {
+		perror("Failed to open file for read.\n");
+		return Error;
+	}
+
+	struct chunk_walker walker;
+
+	if (walk_file(&walker, wav, file) == Error) {
+		perror("Not a WAV file.\n");
+		fclose(file);
+		return Error;
+	}
+
+	unsigned char id[4] = {0};
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	WAV_State state = Success;
+
+	while (state == Success && walk_next(&walker, wav, id, &offset, &size) == Success) {
+		if (memcmp(id, "fmt ", sizeof(id)) == 0) {
+			state = walk_FMT_chunk(&walker, wav, offset, size);
+			if (state == Success) state = index_chunk(wav, wav->fmt.id, offset, size);
+		}
+		else if (memcmp(id, "data", sizeof(id)) == 0) {
+			state = read_DATA_chunk(wav, &walker, offset, size);
+		}
+		else if (memcmp(id, "ds64", sizeof(id)) != 0) {
+			state = read_EXTRA_chunk(wav, &walker, id, offset, size);
+		}
+	}
+
+	if (ferror(file)) {
+		perror("I/O error when parsing WAV file.\n");
+		fclose(file);
+		return Error;
+	} else if (state == Error || walker.failed) {
+		perror("Did not parse entire WAV file.\n");
+		fclose(file);
+		return Error;
+	}
+
+	fclose(file);
+	
+	return Success;
+}
+
+WAV_State WAV_open_mapped(struct WAV_file *wav, const char *file_name, WAV_MapMode mode)
+{
+	if (wav == NULL || file_name == NULL) return Error;
+	if (mode >= WAV_MAP_NumModes) return Error;
+
+	const int fd = open(file_name, mode == WAV_MAP_SHARED ? O_RDWR : O_RDONLY);
+
+	if (fd < 0) {
+		perror("Failed to open file for mapping.\n");
+		return Error;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size < 12) {
+		perror("File is too small to be a WAV file.\n");
+		close(fd);
+		return Error;
+	}
+
+	const int prot  = mode == WAV_MAP_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+	const int flags = mode == WAV_MAP_PRIVATE   ? MAP_PRIVATE : MAP_SHARED;
+
+	unsigned char *map = (unsigned char*)mmap(NULL, st.st_size, prot, flags, fd, 0);
+
+	// The mapping keeps its own reference to the file
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("Failed to map WAV file.\n");
+		return Error;
+	}
+
+	*wav = (struct WAV_file) {0};
+
+	wav->source.map = map;
+	wav->source.map_size = st.st_size;
+	wav->source.map_mode = mode;
+
+	const uint64_t file_size = st.st_size;
+
+	struct chunk_walker walker;
+
+	if (walk_map(&walker, wav, map, file_size) == Error) {
+		WAV_free(wav);
+		return Error;
+	}
+
+	unsigned char id[4] = {0};
+	uint64_t pos = 0;
+	uint64_t size = 0;
+
+	// Walk the chunk headers; payloads are referenced in place, never copied
+	while (walk_next(&walker, wav, id, &pos, &size) == Success) {
+		if (memcmp(id, "fmt ", 4) == 0) {
+			if (walk_FMT_chunk(&walker, wav, pos, size) == Error) {
+				WAV_free(wav);
+				return Error;
+			}
+		}
+		else if (memcmp(id, "data", 4) == 0) {
+			memcpy(wav->data.id, "data", sizeof(wav->data.id));
+			wav->data.size = size;
+			wav->data.buff = map + pos;
+			wav->source.data_offset = pos;
+
+			// Analysis passes read the samples front to back
+			madvise(map + (pos & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1)),
+				size + (pos & (sysconf(_SC_PAGESIZE) - 1)),
+				MADV_SEQUENTIAL);
+		}
+		else if (memcmp(id, "ds64", 4) != 0 && append_EXTRA_chunk(wav, id, map + pos, size, pos) == NULL) {
+			WAV_free(wav);
+			return Error;
+		}
+
+		if (index_chunk(wav, id, pos, size) == Error) {
+			WAV_free(wav);
+			return Error;
+		}
+	}
+
+	if (walker.failed) {
+		WAV_free(wav);
+		return Error;
+	}
+
+	return Success;
+}
+
+static WAV_State open_lazy(struct WAV_file *wav, const char *file_name, int writable)
+{
+	if (wav == NULL || file_name == NULL) return Error;
+
+	*wav = (struct WAV_file) {0};
+
+	FILE *file = fopen(file_name, writable ? "r+b" : "rb");
+
+	if (file == NULL) {
+		perror("Failed to open file for read.\n");
+		return Error;
+	}
+
+	wav->source.file = file;
+	wav->source.writable = writable;
+
+	struct chunk_walker walker;
+
+	if (walk_file(&walker, wav, file) == Error) {
+		perror("Not a WAV file.\n");
+		WAV_free(wav);
+		return Error;
+	}
+
+	unsigned char id[4] = {0};
+	uint64_t offset = 0;
+	uint64_t size = 0;
+
+	// Walk the chunk headers, reading no payload except fmt and ds64
+	while (walk_next(&walker, wav, id, &offset, &size) == Success) {
+		if (memcmp(id, "fmt ", 4) == 0) {
+			if (walk_FMT_chunk(&walker, wav, offset, size) == Error) {
+				WAV_free(wav);
+				return Error;
+			}
+		}
+		else if (memcmp(id, "data", 4) == 0) {
+			memcpy(wav->data.id, "data", sizeof(wav->data.id));
+			wav->data.size = size;
+			wav->source.data_offset = offset;
+		}
+		else if (memcmp(id, "ds64", 4) != 0 && append_EXTRA_chunk(wav, id, NULL, size, offset) == NULL) {
+			WAV_free(wav);
+			return Error;
+		}
+
+		if (index_chunk(wav, id, offset, size) == Error) {
+			WAV_free(wav);
+			return Error;
+		}
+	}
+
+	if (ferror(file)) {
+		perror("I/O error when parsing WAV file.\n");
+		WAV_free(wav);
+		return Error;
+	}
+
+	if (walker.failed) {
+		WAV_free(wav);
+		return Error;
+	}
+
+	return Success;
+}
+
+WAV_State WAV_open_lazy(struct WAV_file *wav, const char *file_name)
+{
+	return open_lazy(wav, file_name, 0);
+}
+
+WAV_State WAV_open_lazy_rw(struct WAV_file *wav, const char *file_name)
+{
+	return open_lazy(wav, file_name, 1);
+}
+
+uint64_t WAV_read_frames(struct WAV_file *wav, uint64_t first_frame, uint64_t count, unsigned char *dst)
+{
+	if (wav == NULL || dst == NULL || wav->fmt.block_align == 0) return 0;
+
+	const uint64_t block_align = wav->fmt.block_align;
+	const uint64_t frames = wav->data.size / block_align;
+
+	if (first_frame >= frames) return 0;
+	if (count > frames - first_frame) count = frames - first_frame;
+
+	const uint64_t offset = first_frame * block_align;
+	const uint64_t size = count * block_align;
+
+	if (wav->data.buff != NULL) {
+		memcpy(dst, &wav->data.buff[offset], size);
+		return count;
+	}
+
+	if (wav->source.file == NULL) return 0;
+
+	if (pread_full(fileno(wav->source.file), dst, size, wav->source.data_offset + offset) == Error) {
+		perror("Could not read frames from WAV file.\n");
+		return 0;
+	}
+
+	return count;
+}
+
+WAV_State WAV_write_frames(struct WAV_file *wav, uint64_t first_frame, uint64_t count, const unsigned char *src)
+{
+	if (wav == NULL || src == NULL || wav->fmt.block_align == 0) return Error;
+
+	const uint64_t block_align = wav->fmt.block_align;
+	const uint64_t frames = wav->data.size / block_align;
+
+	if (first_frame > frames || count > frames - first_frame) return Error;
+
+	const uint64_t offset = first_frame * block_align;
+	const uint64_t size = count * block_align;
+
+	WAV_invalidate_stats(wav);
+
+	if (wav->data.buff != NULL) {
+		if (writable_DATA_chunk(wav) == Error) return Error;
+
+		memcpy(&wav->data.buff[offset], src, size);
+		return Success;
+	}
+
+	if (wav->source.file == NULL || !wav->source.writable) return Error;
+
+	if (pwrite_full(fileno(wav->source.file), src, size, wav->source.data_offset + offset) == Error) {
+		perror("Could not write frames to WAV file.\n");
+		return Error;
+	}
+
+	return Success;
+}
+
+unsigned char *WAV_get_data(struct WAV_file *wav)
+{
+	if (wav == NULL || load_DATA_chunk(wav) == Error) return NULL;
+
+	return wav->data.buff;
+}
+
+struct EXTRA_chunk *WAV_get_chunk(struct WAV_file *wav, const char *id)
+{
+	if (wav == NULL || id == NULL) return NULL;
+
+	struct EXTRA_chunk *extra = find_EXTRA_chunk(wav, (const unsigned char*)id);
+
+	if (extra == NULL) return NULL;
+
+	return load_EXTRA_chunk(wav, extra) == Success ? extra : NULL;
+}
+
+// Payload of the ds64 chunk: RIFF size, data size, sample count and an empty size table
+#define DS64_SIZE 28
+
+// Longest header written in front of the sound data:
+// RIFF (12) + ds64 or JUNK (8 + DS64_SIZE) + fmt (8 + 16) + data chunk header (8)
+#define WAV_HEADER_SIZE (12 + 8 + DS64_SIZE + 24 + 8)
+
+static void put_u16(unsigned char *dst, uint16_t val) { memcpy(dst, &val, sizeof(val)); }
+static void put_u32(unsigned char *dst, uint32_t val) { memcpy(dst, &val, sizeof(val)); }
+static void put_u64(unsigned char *dst, uint64_t val) { memcpy(dst, &val, sizeof(val)); }
+
+// Size of everything following the RIFF size field once wav is written out,
+// with or without the 36 byte ds64/JUNK chunk in front of the fmt chunk
+static uint64_t riff_size_of(const struct WAV_file *wav, int with_ds64)
+{
+	uint64_t size = 4 + (8 + 16) + 8 + wav->data.size + (wav->data.size & 1);
+
+	if (with_ds64) size += 8 + DS64_SIZE;
+
+	for (struct EXTRA_chunk *extra = wav->extra; extra != NULL; extra = extra->next) {
+		size += 8 + (uint64_t)extra->size + (extra->size & 1);
+	}
+
+	return size;
+}
+
+// Serialize the RIFF, ds64, fmt and data chunk headers of wav into dst, which
+// must hold WAV_HEADER_SIZE bytes. The file becomes RF64 when wav->riff.size
+// does not fit in 32 bits; reserve_ds64 keeps a JUNK chunk in place of the ds64
+// chunk for plain RIFF files so a stream can still grow into RF64.
+// Returns the number of bytes written.
+static uint64_t pack_header(unsigned char *dst, const struct WAV_file *wav, int reserve_ds64)
+{
+	const int rf64 = wav->riff.size > WAV_RIFF_MAX_SIZE || wav->data.size > WAV_RIFF_MAX_SIZE;
+
+	unsigned char *pos = dst;
+
+	memcpy(pos, rf64 ? "RF64" : "RIFF", 4);
+	put_u32(pos + 4, rf64 ? WAV_RIFF_MAX_SIZE : (uint32_t)wav->riff.size);
+	memcpy(pos + 8, "WAVE", 4);
+	pos += 12;
+
+	if (rf64 || reserve_ds64) {
+		memcpy(pos, rf64 ? "ds64" : "JUNK", 4);
+		put_u32(pos + 4, DS64_SIZE);
+		memset(pos + 8, 0, DS64_SIZE);
+
+		if (rf64) {
+			const uint64_t frames = wav->fmt.block_align != 0
+				? wav->data.size / wav->fmt.block_align
+				: 0;
+
+			put_u64(pos + 8, wav->riff.size);
+			put_u64(pos + 16, wav->data.size);
+			put_u64(pos + 24, frames);
+		}
+
+		pos += 8 + DS64_SIZE;
+	}
+
+	memcpy(pos, "fmt ", 4);
+	put_u32(pos + 4, 16);
+	put_u16(pos + 8, wav->fmt.audio_format);
+	put_u16(pos + 10, wav->fmt.num_channels);
+	put_u32(pos + 12, wav->fmt.sample_rate);
+	put_u32(pos + 16, wav->fmt.byte_rate);
+	put_u16(pos + 20, wav->fmt.block_align);
+	put_u16(pos + 22, wav->fmt.bits_per_sample);
+	pos += 24;
+
+	memcpy(pos, "data", 4);
+	put_u32(pos + 4, rf64 ? WAV_RIFF_MAX_SIZE : (uint32_t)wav->data.size);
+	pos += 8;
+
+	return pos - dst;
+}
+
+// Gathers the pieces of a file into iovecs and sends them with as few writev
+// calls as possible. Chunk headers are copied into the small scratch buffer;
+// payloads are referenced in place and never copied.
+#define WRITEV_BATCH 64
+
+struct writev_sink {
+	int		fd;
+	struct iovec	iov[WRITEV_BATCH];
+	int		count;
+	unsigned char	scratch[WRITEV_BATCH * 8 + WAV_HEADER_SIZE];
+	uint64_t	scratch_used;
+};
+
+static WAV_State writev_flush(struct writev_sink *sink)
+{
+	struct iovec *iov = sink->iov;
+	int count = sink->count;
+
+	while (count > 0) {
+		ssize_t ret = writev(sink->fd, iov, count);
+
+		if (ret < 0) return Error;
+
+		// Skip over what was written; writes of more than ~2 GiB come back short
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (unsigned char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	sink->count = 0;
+	sink->scratch_used = 0;
+
+	return Success;
+}
+
+static WAV_State writev_add(struct writev_sink *sink, const unsigned char *buff, uint64_t size, int copy)
+{
+	if (size == 0) return Success;
+
+	if (sink->count == WRITEV_BATCH ||
+	    (copy && sink->scratch_used + size > sizeof(sink->scratch))) {
+		if (writev_flush(sink) == Error) return Error;
+	}
+
+	if (copy) {
+		memcpy(&sink->scratch[sink->scratch_used], buff, size);
+		buff = &sink->scratch[sink->scratch_used];
+		sink->scratch_used += size;
+	}
+
+	sink->iov[sink->count].iov_base = (void*)buff;
+	sink->iov[sink->count].iov_len = size;
+	sink->count++;
+
+	return Success;
+}
+
+// Alignment and bounce buffer size of O_DIRECT writes
+#define DIRECT_ALIGN 4096
+#define DIRECT_BLOCK (4 << 20)
+
+// Sends the pieces of a file with O_DIRECT. Page aligned runs of a payload that
+// start at an aligned file offset are written straight from the payload;
+// everything else goes through an aligned bounce buffer.
+struct direct_sink {
+	int		fd;
+	unsigned char	*block;
+	uint64_t	used;
+	uint64_t	size;	// logical size of the file so far
+};
+
+static WAV_State direct_write(int fd, const unsigned char *buff, uint64_t size)
+{
+	while (size > 0) {
+		const ssize_t ret = write(fd, buff, size);
+
+		if (ret <= 0) return Error;
+
+		buff += ret;
+		size -= ret;
+	}
+
+	return Success;
+}
+
+static WAV_State direct_add(struct direct_sink *sink, const unsigned char *buff, uint64_t size, int copy)
+{
+	(void)copy;
+
+	sink->size += size;
+
+	while (size > 0) {
+		if (sink->used == 0 && ((uintptr_t)buff % DIRECT_ALIGN) == 0 && size >= DIRECT_ALIGN) {
+			uint64_t run = size & ~(uint64_t)(DIRECT_ALIGN - 1);
+			if (run > (1u << 30)) run = 1u << 30;
+
+			if (direct_write(sink->fd, buff, run) == Error) return Error;
+
+			buff += run;
+			size -= run;
+			continue;
+		}
+
+		uint64_t n = DIRECT_BLOCK - sink->used;
+		if (n > size) n = size;
+
+		memcpy(&sink->block[sink->used], buff, n);
+		sink->used += n;
+		buff += n;
+		size -= n;
+
+		if (sink->used == DIRECT_BLOCK) {
+			if (direct_write(sink->fd, sink->block, DIRECT_BLOCK) == Error) return Error;
+			sink->used = 0;
+		}
+	}
+
+	return Success;
+}
+
+// Write the last partial block padded to the alignment, then cut the file back
+static WAV_State direct_finish(struct direct_sink *sink)
+{
+	if (sink->used > 0) {
+		const uint64_t aligned = (sink->used + DIRECT_ALIGN - 1) & ~(uint64_t)(DIRECT_ALIGN - 1);
+
+		memset(&sink->block[sink->used], 0, aligned - sink->used);
+
+		if (direct_write(sink->fd, sink->block, aligned) == Error) return Error;
+
+		sink->used = 0;
+	}
+
+	return ftruncate(sink->fd, sink->size) == 0 ? Success : Error;
+}
+
+typedef WAV_State (*write_sink_fn)(void *sink, const unsigned char *buff, uint64_t size, int copy);
+
+// Hand every piece of wav, in file order, to add. Pieces with copy set are
+// short-lived chunk headers that the sink must copy.
+static WAV_State emit_file(struct WAV_file *wav, write_sink_fn add, void *sink)
+{
+	// Switch to RF64 only when the file does not fit a 32-bit RIFF size
+	wav->riff.size = riff_size_of(wav, 0);
+	if (wav->riff.size > WAV_RIFF_MAX_SIZE) wav->riff.size = riff_size_of(wav, 1);
+
+	unsigned char header[WAV_HEADER_SIZE];
+	const uint64_t header_size = pack_header(header, wav, 0);
+
+	const unsigned char pad = 0;
+
+	if (add(sink, header, header_size, 1) == Error ||
+	    add(sink, wav->data.buff, wav->data.size, 0) == Error ||
+	    ((wav->data.size & 1) && add(sink, &pad, 1, 1) == Error)) {
+		perror("Failed to write sound data\n");
+		return Error;
+	}
+
+	for (struct EXTRA_chunk *extra = wav->extra; extra != NULL; extra = extra->next) {
+		unsigned char chunk_header[8];
+		memcpy(chunk_header, extra->id, 4);
+		put_u32(chunk_header + 4, extra->size);
+
+		if (add(sink, chunk_header, sizeof(chunk_header), 1) == Error ||
+		    add(sink, extra->buff, extra->size, 0) == Error ||
+		    ((extra->size & 1) && add(sink, &pad, 1, 1) == Error)) {
+			perror("Failed to write an EXTRA chunk\n");
+			return Error;
+		}
+	}
+
+	return Success;
+}
+
+static WAV_State writev_sink_add(void *sink, const unsigned char *buff, uint64_t size, int copy)
+{
+	return writev_add((struct writev_sink*)sink, buff, size, copy);
+}
+
+static WAV_State direct_sink_add(void *sink, const unsigned char *buff, uint64_t size, int copy)
+{
+	return direct_add((struct direct_sink*)sink, buff, size, copy);
+}
+
+// Lazily opened files need every payload in memory before writing
+static WAV_State load_all_chunks(struct WAV_file *wav)
+{
+	if (load_DATA_chunk(wav) == Error && wav->data.size > 0) return Error;
+
+	for (struct EXTRA_chunk *extra = wav->extra; extra != NULL; extra = extra->next) {
+		if (load_EXTRA_chunk(wav, extra) == Error && extra->size > 0) return Error;
+	}
+
+	return Success;
+}
+
+WAV_State WAV_write_to_file(
+        struct WAV_file* wav,
+        const char* file_name)
+{
+	if (wav == NULL) return Error;
+	if (file_name == NULL) return Error;
+
+	if (load_all_chunks(wav) == Error) return Error;
+
+	struct writev_sink sink;
+	sink.count = 0;
+	sink.scratch_used = 0;
+	sink.fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (sink.fd < 0) {
+		perror("File opening failed\n");
+		return Error;
+	}
+
+	if (emit_file(wav, writev_sink_add, &sink) == Error || writev_flush(&sink) == Error) {
+		perror("Failed to write WAV file\n");
+		close(sink.fd);
+		return Error;
+	}
+
+	if (close(sink.fd) != 0) return Error;
+
+	return Success;
+}
+
+WAV_State WAV_write_to_file_direct(
+        struct WAV_file* wav,
+        const char* file_name)
+{
+	if (wav == NULL) return Error;
+	if (file_name == NULL) return Error;
+
+	if (load_all_chunks(wav) == Error) return Error;
+
+	struct direct_sink sink = {0};
+	sink.fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+
+	// Not every file system supports O_DIRECT
+	if (sink.fd < 0 && errno == EINVAL) return WAV_write_to_file(wav, file_name);
+
+	if (sink.fd < 0) {
+		perror("File opening failed\n");
+		return Error;
+	}
+
+	if (posix_memalign((void**)&sink.block, DIRECT_ALIGN, DIRECT_BLOCK) != 0) {
+		close(sink.fd);
+		return Error;
+	}
+
+	WAV_State ret = Success;
+
+	if (emit_file(wav, direct_sink_add, &sink) == Error || direct_finish(&sink) == Error) {
+		perror("Failed to write WAV file\n");
+		ret = Error;
+	}
+
+	free(sink.block);
+
+	if (close(sink.fd) != 0) ret = Error;
+
+	return ret;
+}
+
+// Write a whole chunk, header, payload and pad byte, with one pwritev at offset
+static WAV_State pwrite_chunk(
+		int fd,
+		uint64_t offset,
+		const unsigned char *id,
+		const unsigned char *bytes,
+		uint32_t len)
+{
+	unsigned char chunk_header[8];
+	unsigned char pad = 0;
+
+	memcpy(chunk_header, id, 4);
+	put_u32(chunk_header + 4, len);
+
+	struct iovec iov[3] = {
+		{ .iov_base = chunk_header,   .iov_len = sizeof(chunk_header) },
+		{ .iov_base = (void*)bytes,   .iov_len = len },
+		{ .iov_base = &pad,	      .iov_len = len & 1 },
+	};
+
+	const ssize_t total = sizeof(chunk_header) + (uint64_t)len + (len & 1);
+
+	return pwritev(fd, iov, 3, offset) == total ? Success : Error;
+}
+
+// Turn the chunk whose payload starts at offset into a JUNK chunk of size bytes
+static WAV_State pwrite_junk(int fd, uint64_t offset, uint64_t size)
+{
+	unsigned char chunk_header[8];
+
+	memcpy(chunk_header, "JUNK", 4);
+	put_u32(chunk_header + 4, size);
+
+	return pwrite_full(fd, chunk_header, sizeof(chunk_header), offset - 8);
+}
+
+// Point the RIFF (or ds64) size at a new end of file
+static WAV_State patch_riff_size(struct WAV_file *wav, int fd, uint64_t end)
+{
+	unsigned char size[8];
+	const uint64_t riff_size = end - 8;
+
+	if (is_rf64(wav)) {
+		for (uint32_t i = 0; i < wav->source.index_count; ++i) {
+			if (memcmp(wav->source.index[i].id, "ds64", 4) != 0) continue;
+
+			put_u64(size, riff_size);
+			return pwrite_full(fd, size, 8, wav->source.index[i].offset);
+		}
+
+		return Error;
+	}
+
+	// A plain RIFF file has no room for a 64-bit size
+	if (riff_size > WAV_RIFF_MAX_SIZE) return Error;
+
+	put_u32(size, riff_size);
+
+	return pwrite_full(fd, size, 4, 4);
+}
+
+static uint64_t chunk_end(const struct WAV_chunk_info *info)
+{
+	return info->offset + info->size + (info->size & 1);
+}
+
+WAV_State WAV_update_chunk(
+		const char *file_name,
+		const char *id,
+		const unsigned char *bytes,
+		uint32_t len)
+{
+	if (file_name == NULL || id == NULL || (bytes == NULL && len > 0)) return Error;
+
+	if (memcmp(id, "fmt ", 4) == 0 || memcmp(id, "data", 4) == 0 || memcmp(id, "ds64", 4) == 0) {
+		return Error;
+	}
+
+	struct WAV_file wav;
+
+	if (WAV_open_lazy_rw(&wav, file_name) == Error) return Error;
+
+	const int fd = fileno(wav.source.file);
+	const struct WAV_chunk_info *index = wav.source.index;
+	const uint32_t count = wav.source.index_count;
+
+	if (count == 0) {
+		WAV_free(&wav);
+		return Error;
+	}
+
+	const uint64_t file_end = chunk_end(&index[count - 1]);
+	const uint64_t needed = (uint64_t)len + (len & 1);
+
+	uint32_t found = count;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (memcmp(index[i].id, id, 4) == 0) {
+			found = i;
+			break;
+		}
+	}
+
+	WAV_State ret = Error;
+
+	if (found == count) {
+		// New chunk: append it
+		ret = pwrite_chunk(fd, file_end, (const unsigned char*)id, bytes, len);
+		if (ret == Success) ret = patch_riff_size(&wav, fd, file_end + 8 + needed);
+	}
+	else if (found == count - 1) {
+		// Last chunk: rewrite it where it is and move the end of the file
+		const uint64_t header = index[found].offset - 8;
+		const uint64_t end = index[found].offset + needed;
+
+		ret = pwrite_chunk(fd, header, (const unsigned char*)id, bytes, len);
+		if (ret == Success && end < file_end && ftruncate(fd, end) != 0) ret = Error;
+		if (ret == Success) ret = patch_riff_size(&wav, fd, end);
+	}
+	else {
+		// Slack: the old payload plus a JUNK chunk directly following it
+		uint64_t slot = chunk_end(&index[found]) - index[found].offset;
+		const struct WAV_chunk_info *next = &index[found + 1];
+
+		if (memcmp(next->id, "JUNK", 4) == 0 && next->offset - 8 == chunk_end(&index[found])) {
+			slot += 8 + (chunk_end(next) - next->offset);
+		}
+
+		const uint64_t header = index[found].offset - 8;
+
+		if (needed == slot || needed + 8 <= slot) {
+			ret = pwrite_chunk(fd, header, (const unsigned char*)id, bytes, len);
+
+			// Fill the rest of the slot so the following chunks stay where they are
+			if (ret == Success && needed < slot) {
+				ret = pwrite_junk(fd, index[found].offset + needed + 8, slot - needed - 8);
+			}
+		}
+		else {
+			// Does not fit: retire the old chunk and append the new one
+			ret = pwrite_junk(fd, index[found].offset, index[found].size);
+			if (ret == Success) ret = pwrite_chunk(fd, file_end, (const unsigned char*)id, bytes, len);
+			if (ret == Success) ret = patch_riff_size(&wav, fd, file_end + 8 + needed);
+		}
+	}
+
+	if (ret == Error) perror("Failed to update WAV chunk\n");
+
+	WAV_free(&wav);
+
+	return ret;
+}
+
+void WAV_free(struct WAV_file *wav) {
+    if (wav == NULL) return;
+
+    if (wav->data.buff != NULL) {
+	free_buff(wav, wav->data.buff);
+	wav->data.buff = NULL;
+	wav->riff.size -= wav->data.size;
+	wav->data.size = 0;
+    }
+
+    // Every chunk header and loaded payload lives in the arena; mapped
+    // payloads belong to the mapping
+    arena_release(&wav->chunks);
+    wav->extra = NULL;
+
+    if (wav->source.map != NULL) {
+	munmap(wav->source.map, wav->source.map_size);
+	wav->source.map = NULL;
+	wav->source.map_size = 0;
+    }
+
+    if (wav->source.file != NULL) {
+	fclose(wav->source.file);
+	wav->source.file = NULL;
+    }
+
+    free(wav->source.index);
+    wav->source.index = NULL;
+    wav->source.index_count = 0;
+
+    free(wav->stats.channels);
+    memset(&wav->stats, 0, sizeof(wav->stats));
+}
+
+WAV_State WAV_stream_open(struct WAV_stream *stream, const char *file_name)
+{
+	if (stream == NULL || file_name == NULL) return Error;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->mode = WAV_STREAM_READ;
+
+	stream->file = fopen(file_name, "rb");
+
+	if (stream->file == NULL) {
+		perror("Failed to open file for read.\n");
+		return Error;
+	}
+
+	struct WAV_file *wav = &stream->wav;
+	struct chunk_walker walker;
+
+	if (walk_file(&walker, wav, stream->file) == Error) {
+		perror("Not a WAV file.\n");
+		fclose(stream->file);
+		stream->file = NULL;
+		return Error;
+	}
+
+	unsigned char id[4] = {0};
+	uint64_t offset = 0;
+	uint64_t size = 0;
+
+	// Walk the chunk headers up to the start of the sound data
+	while (1) {
+		if (walk_next(&walker, wav, id, &offset, &size) == Error) {
+			if (!walker.failed) perror("No data chunk found in WAV file.\n");
+			fclose(stream->file);
+			stream->file = NULL;
+			return Error;
+		}
+
+		if (memcmp(id, "data", 4) == 0) {
+			memcpy(wav->data.id, "data", sizeof(wav->data.id));
+			wav->data.size = size;
+			break;
+		}
+
+		if (memcmp(id, "fmt ", 4) == 0 && walk_FMT_chunk(&walker, wav, offset, size) == Error) {
+			fclose(stream->file);
+			stream->file = NULL;
+			return Error;
+		}
+	}
+
+	if (fseeko(stream->file, offset, SEEK_SET) != 0) {
+		fclose(stream->file);
+		stream->file = NULL;
+		return Error;
+	}
+
+	if (wav->fmt.block_align == 0) {
+		perror("WAV file has no fmt chunk before its data chunk.\n");
+		fclose(stream->file);
+		stream->file = NULL;
+		return Error;
+	}
+
+	stream->data_offset = offset;
+	stream->frames = wav->data.size / wav->fmt.block_align;
+	stream->position = 0;
+
+	return Success;
+}
+
+WAV_State WAV_stream_create(
+		struct WAV_stream *stream,
+		const char *file_name,
+		const uint16_t num_channels,
+		const uint32_t sample_rate,
+		const uint16_t bits_per_sample)
+{
+	if (stream == NULL || file_name == NULL) return Error;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->mode = WAV_STREAM_WRITE;
+
+	WAV_init(&stream->wav, num_channels, sample_rate, bits_per_sample);
+
+	if (stream->wav.fmt.block_align == 0) return Error;
+
+	stream->file = fopen(file_name, "wb");
+
+	if (stream->file == NULL) {
+		perror("Failed to open file for write.\n");
+		return Error;
+	}
+
+	unsigned char header[WAV_HEADER_SIZE];
+
+	// Sizes are placeholders until WAV_stream_close, which may turn the JUNK chunk into ds64
+	const uint64_t header_size = pack_header(header, &stream->wav, 1);
+
+	if (fwrite(header, header_size, 1, stream->file) != 1) {
+		perror("Failed to write WAV header\n");
+		fclose(stream->file);
+		stream->file = NULL;
+		return Error;
+	}
+
+	stream->data_offset = ftello(stream->file);
+
+	return Success;
+}
+
+uint64_t WAV_stream_read_frames(struct WAV_stream *stream, unsigned char *buff, uint64_t frames)
+{
+	if (stream == NULL || stream->file == NULL || buff == NULL) return 0;
+	if (stream->mode != WAV_STREAM_READ) return 0;
+
+	if (frames > stream->frames - stream->position) {
+		frames = stream->frames - stream->position;
+	}
+
+	const uint16_t block_align = stream->wav.fmt.block_align;
+	const uint64_t read = fread(buff, block_align, frames, stream->file);
+
+	stream->position += read;
+
+	return read;
+}
+
+WAV_State WAV_stream_write_frames(struct WAV_stream *stream, const unsigned char *buff, uint64_t frames)
+{
+	if (stream == NULL || stream->file == NULL || buff == NULL) return Error;
+	if (stream->mode != WAV_STREAM_WRITE) return Error;
+
+	const uint16_t block_align = stream->wav.fmt.block_align;
+
+	if (fwrite(buff, block_align, frames, stream->file) != frames) {
+		perror("Failed to write sound data\n");
+		return Error;
+	}
+
+	stream->frames += frames;
+
+	return Success;
+}
+
+WAV_State WAV_stream_seek(struct WAV_stream *stream, uint64_t frame)
+{
+	if (stream == NULL || stream->file == NULL) return Error;
+	if (stream->mode != WAV_STREAM_READ || frame > stream->frames) return Error;
+
+	const uint64_t offset = stream->data_offset + frame * stream->wav.fmt.block_align;
+
+	if (fseeko(stream->file, offset, SEEK_SET) != 0) return Error;
+
+	stream->position = frame;
+
+	return Success;
+}
+
+WAV_State WAV_stream_close(struct WAV_stream *stream)
+{
+	if (stream == NULL || stream->file == NULL) return Error;
+
+	WAV_State ret = Success;
+
+	if (stream->mode == WAV_STREAM_WRITE) {
+		struct WAV_file *wav = &stream->wav;
+
+		wav->data.size = stream->frames * wav->fmt.block_align;
+		wav->riff.size = riff_size_of(wav, 1);
+
+		const unsigned char pad = 0;
+
+		if ((wav->data.size & 1) && fwrite(&pad, 1, 1, stream->file) != 1) ret = Error;
+
+		unsigned char header[WAV_HEADER_SIZE];
+		const uint64_t header_size = pack_header(header, wav, 1);
+
+		// Patch the sizes now that the length of the sound data is known
+		if (fseeko(stream->file, 0, SEEK_SET) != 0 ||
+		    fwrite(header, header_size, 1, stream->file) != 1) {
+			perror("Failed to patch WAV header\n");
+			ret = Error;
+		}
+	}
+
+	if (fclose(stream->file) != 0) ret = Error;
+
+	stream->file = NULL;
+
+	return ret;
+}
+
+// Frames per pipeline block so that all WAV_PIPELINE_BLOCKS blocks fit in buffer_size bytes
+static uint64_t stream_block_frames(const struct WAV_stream *stream, uint64_t buffer_size)
+{
+	if (buffer_size == 0) buffer_size = WAV_STREAM_DEFAULT_BUFFER;
+
+	const uint64_t frames = buffer_size / ((uint64_t)WAV_PIPELINE_BLOCKS * stream->wav.fmt.block_align);
+
+	return frames > 0 ? frames : 1;
+}
+
+// States a pipeline block cycles through: the reader fills FREE blocks,
+// the worker processes READ blocks and the writer drains DONE blocks.
+// END marks the block after the last one and stops every stage.
+enum {
+	BLOCK_FREE = 0,
+	BLOCK_READ,
+	BLOCK_DONE,
+	BLOCK_END,
+};
+
+struct pipeline_block {
+	unsigned char	*buff;
+	uint64_t	frames;
+	int		state;
+};
+
+// A ring of blocks shared by the reader thread, the worker (the calling
+// thread) and the writer thread. Each stage walks the ring in order, so the
+// ring doubles as the bounded queue between stages.
+struct pipeline {
+	struct pipeline_block	blocks[WAV_PIPELINE_BLOCKS];
+	uint64_t		block_frames;
+	struct WAV_stream	*in;
+	struct WAV_stream	*out;	// NULL for analysis passes
+	int			failed;
+	pthread_mutex_t		lock;
+	pthread_cond_t		changed;
+};
+
+static void pipeline_set(struct pipeline *pipe, struct pipeline_block *block, int state)
+{
+	pthread_mutex_lock(&pipe->lock);
+	block->state = state;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void pipeline_fail(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->failed = 1;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+}
 
-	float *prev_vals = (float*)malloc(sizeof(float) * wav->fmt.num_channels);
+// Wait until block is in state or END; returns -1 once any stage has failed
+static int pipeline_wait(struct pipeline *pipe, struct pipeline_block *block, int state)
+{
+	pthread_mutex_lock(&pipe->lock);
 
-	if (prev_vals == NULL) {
-		return;
+	while (!pipe->failed && block->state != state && block->state != BLOCK_END) {
+		pthread_cond_wait(&pipe->changed, &pipe->lock);
 	}
 
-	memset(prev_vals, 0, sizeof(float) * wav->fmt.num_channels);
+	const int ret = pipe->failed ? -1 : block->state;
 
-	float *prev_filtered_vals = (float*)malloc(sizeof(float) * wav->fmt.num_channels);
+	pthread_mutex_unlock(&pipe->lock);
 
-	if (prev_filtered_vals == NULL) {
-		return;
-	}
+	return ret;
+}
 
-	memset(prev_filtered_vals, 0, sizeof(float) * wav->fmt.num_channels);
-    
-    uint8_t val8 = 0;
-    int16_t val16 = 0;
-    int32_t val24 = 0;
-    int32_t val32 = 0;
+static void *pipeline_reader(void *arg)
+{
+	struct pipeline *pipe = (struct pipeline*)arg;
 
-	// For each channel we should get the first value and save it to the array of prev values
-	for (size_t i = 0; i < wav->fmt.num_channels; ++i) {
-		size_t buff_idx = bytes_per_sample * i;
-		
-		switch (bytes_per_sample) {
-			case 1:
-				val8 = 0;
-				memcpy(&val8, &wav->data.buff[buff_idx], 1);
-				prev_vals[i] = uint8_to_float(val8);
-				prev_filtered_vals[i] = uint8_to_float(val8);
-				break;
-			case 2:
-				val16 = 0;
-				memcpy(&val16, &wav->data.buff[buff_idx], 2);
-				prev_vals[i] = int16_to_float(val16);
-				prev_filtered_vals[i] = int16_to_float(val16);
-				break;
-			case 3:
-				val24 = 0;
-				memcpy(&val24, &wav->data.buff[buff_idx], 3);
-				val24 &= 0xFFFFFF;
-				prev_vals[i] = int24_to_float(val24);
-				prev_filtered_vals[i] = int24_to_float(val24);
-				break;
-			case 4:
-				val32 = 0;
-				memcpy(&val32, &wav->data.buff[buff_idx], 4);
-				prev_vals[i] = int32_to_float(val32);
-				prev_filtered_vals[i] = int32_to_float(val32);
-				break;
-		}
-	}
-
-	for (size_t sample_index = 1;
-	     sample_index < wav->data.size / (wav->fmt.num_channels * bytes_per_sample);
-	     sample_index++) {
-
-		const size_t sample_byte_idx = sample_index * (bytes_per_sample * wav->fmt.num_channels);
-
-		for (uint16_t channel = 0; channel < wav->fmt.num_channels; ++channel) {
-			const size_t buff_idx =  sample_byte_idx + (bytes_per_sample * channel);
-			
-			float sample_val = 0.0f;
-			switch(bytes_per_sample) {
-				case 1:
-					val8 = 0;
-					memcpy(&val8, &wav->data.buff[buff_idx], 1);
-					sample_val = uint8_to_float(val8);
-					break;
-				case 2:
-					val16 = 0;
-					memcpy(&val16, &wav->data.buff[buff_idx], 2);
-					sample_val = int16_to_float(val16);
-					break;
-				case 3:
-					val24 = 0;
-					memcpy(&val24, &wav->data.buff[buff_idx], 3);
-					val24 &= 0xFFFFFF;
-					sample_val = int24_to_float(val24);
-					break;
-				case 4:
-					val32 = 0;
-					memcpy(&val32, &wav->data.buff[buff_idx], 4);
-					sample_val = int32_to_float(val32);
-					break;
-			}
+	for (uint64_t i = 0; ; ++i) {
+		struct pipeline_block *block = &pipe->blocks[i % WAV_PIPELINE_BLOCKS];
+
+		if (pipeline_wait(pipe, block, BLOCK_FREE) != BLOCK_FREE) return NULL;
 
-			const float filtered_val =
-				alpha
-				* (prev_filtered_vals[channel] + sample_val - prev_vals[channel]);
-			
-			prev_filtered_vals[channel] = filtered_val;
-			prev_vals[channel] = sample_val;
-			
-			switch(bytes_per_sample) {
-				case 1:
-					val8 = float_to_uint8(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val8, 1);
-					break;
-				case 2:
-					val16 = float_to_int16(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val16, 2);
-					break;
-				case 3:
-					val24 = float_to_int24(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val24, 3);
-					break;
-				case 4:
-					val32 = float_to_int32(filtered_val);
-					memcpy(&wav->data.buff[buff_idx], &val32, 4);
-					break;
+		block->frames = WAV_stream_read_frames(pipe->in, block->buff, pipe->block_frames);
+
+		if (block->frames == 0) {
+			if (pipe->in->position != pipe->in->frames) {
+				pipeline_fail(pipe);
 			}
+
+			pipeline_set(pipe, block, BLOCK_END);
+			return NULL;
 		}
+
+		pipeline_set(pipe, block, BLOCK_READ);
 	}
+}
+
+static void *pipeline_writer(void *arg)
+{
+	struct pipeline *pipe = (struct pipeline*)arg;
 
-	free(prev_vals);
-	prev_vals = NULL;
+	for (uint64_t i = 0; ; ++i) {
+		struct pipeline_block *block = &pipe->blocks[i % WAV_PIPELINE_BLOCKS];
 
-	free(prev_filtered_vals);
-	prev_filtered_vals = NULL;
+		if (pipeline_wait(pipe, block, BLOCK_DONE) != BLOCK_DONE) return NULL;
+
+		if (WAV_stream_write_frames(pipe->out, block->buff, block->frames) == Error) {
+			pipeline_fail(pipe);
+			return NULL;
+		}
+
+		pipeline_set(pipe, block, BLOCK_FREE);
+	}
 }
 
-static WAV_State read_RIFF_chunk(struct WAV_file *wav, FILE *file, unsigned char* id)
+// Run fn over every block of in, from the start, overlapping the reads,
+// the processing and, when out_file_name is not NULL, the writes
+static WAV_State stream_transform(
+		struct WAV_stream *in,
+		const char *out_file_name,
+		uint64_t buffer_size,
+		WAV_block_fn fn,
+		void *ctx)
 {
-	memcpy(wav->riff.id, id, sizeof(wav->riff.id));
-	fread(&wav->riff.size, sizeof(wav->riff.size), 1, file);
-	fread(&wav->riff.format, sizeof(wav->riff.format), 1, file);
+	const struct FMT_chunk *fmt = &in->wav.fmt;
 
-	if (memcmp(&wav->riff.format, "WAVE", sizeof(wav->riff.format)) != 0) {
-		fclose(file);
-		return Error;
+	struct pipeline pipe;
+	memset(&pipe, 0, sizeof(pipe));
+
+	pipe.block_frames = stream_block_frames(in, buffer_size);
+	pipe.in = in;
+
+	for (int i = 0; i < WAV_PIPELINE_BLOCKS; ++i) {
+		pipe.blocks[i].buff = (unsigned char*)malloc(pipe.block_frames * fmt->block_align);
+
+		if (pipe.blocks[i].buff == NULL) {
+			for (int j = 0; j < i; ++j) free(pipe.blocks[j].buff);
+			return Error;
+		}
 	}
 
-	return Success;
-	
+	struct WAV_stream out;
+
+	WAV_State ret = WAV_stream_seek(in, 0);
+
+	if (ret == Success && out_file_name != NULL) {
+		ret = WAV_stream_create(&out, out_file_name, fmt->num_channels,
+					fmt->sample_rate, fmt->bits_per_sample);
+		pipe.out = &out;
+	}
+
+	pthread_t reader, writer;
+	int reader_started = 0;
+	int writer_started = 0;
+
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.changed, NULL);
+
+	if (ret == Success) {
+		reader_started = pthread_create(&reader, NULL, pipeline_reader, &pipe) == 0;
+		if (pipe.out != NULL) writer_started = pthread_create(&writer, NULL, pipeline_writer, &pipe) == 0;
+
+		if (!reader_started || (pipe.out != NULL && !writer_started)) pipeline_fail(&pipe);
+	}
+
+	// Worker stage
+	for (uint64_t i = 0; ret == Success; ++i) {
+		struct pipeline_block *block = &pipe.blocks[i % WAV_PIPELINE_BLOCKS];
+
+		if (pipeline_wait(&pipe, block, BLOCK_READ) != BLOCK_READ) break;
+
+		fn(block->buff, block->frames, fmt, ctx);
+
+		pipeline_set(&pipe, block, pipe.out != NULL ? BLOCK_DONE : BLOCK_FREE);
+	}
+
+	if (reader_started) pthread_join(reader, NULL);
+	if (writer_started) pthread_join(writer, NULL);
+
+	if (pipe.failed) ret = Error;
+
+	if (pipe.out != NULL && WAV_stream_close(&out) == Error) ret = Error;
+
+	pthread_cond_destroy(&pipe.changed);
+	pthread_mutex_destroy(&pipe.lock);
+
+	for (int i = 0; i < WAV_PIPELINE_BLOCKS; ++i) free(pipe.blocks[i].buff);
+
+	return ret;
 }
 
-static WAV_State read_FMT_chunk(struct WAV_file *wav, FILE *file)
+WAV_State WAV_stream_process(
+		const char *in_file_name,
+		const char *out_file_name,
+		WAV_block_fn fn,
+		void *ctx,
+		uint64_t buffer_size)
 {
-	memcpy(wav->fmt.id, "fmt ", sizeof(wav->fmt.id));
-	fread(&wav->fmt.size, sizeof(wav->fmt.size), 1, file);
-	fread(&wav->fmt.audio_format, sizeof(wav->fmt.audio_format), 1, file);
-	fread(&wav->fmt.num_channels, sizeof(wav->fmt.num_channels), 1, file);
-	fread(&wav->fmt.sample_rate, sizeof(wav->fmt.sample_rate), 1, file);
-	fread(&wav->fmt.byte_rate, sizeof(wav->fmt.byte_rate), 1, file);
-	fread(&wav->fmt.block_align, sizeof(wav->fmt.block_align), 1, file);
-	fread(&wav->fmt.bits_per_sample, sizeof(wav->fmt.bits_per_sample), 1, file);
+	if (fn == NULL) return Error;
 
-	return Success;
+	struct WAV_stream in;
+
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const WAV_State ret = stream_transform(&in, out_file_name, buffer_size, fn, ctx);
+
+	WAV_stream_close(&in);
+
+	return ret;
 }
 
-static WAV_State read_DATA_chunk(struct WAV_file *wav, FILE *file)
+struct stream_scale_ctx {
+	max_amp_fn    peak;
+	uint64_t      max_amp;
+	struct gain_q q;
+	gain_fn       gain;
+	uint64_t      position;	// samples rescaled so far
+};
+
+static void stream_scale_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
 {
-	memcpy(wav->data.id, "data", sizeof(wav->data.id));
-	fread(&wav->data.size, sizeof(wav->data.size), 1, file);
+	struct stream_scale_ctx *scale = (struct stream_scale_ctx*)ctx;
+	const uint64_t samples = frames * fmt->num_channels;
 
-	wav->data.buff = (unsigned char*)malloc(sizeof(unsigned char) * wav->data.size);
+	parallel_gain(scale->gain, &scale->q, buff, samples, scale->position, fmt->bits_per_sample / 8);
+	scale->position += samples;
+}
 
-	if (wav->data.buff == NULL ) {
-		perror("Could not alloc wav data buffer.\n");
-		fclose(file);
+static void stream_peak_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	struct stream_scale_ctx *scale = (struct stream_scale_ctx*)ctx;
+
+	const uint64_t max_amp = parallel_max_amp(scale->peak, buff, frames * fmt->num_channels, fmt->bits_per_sample / 8);
+	if (max_amp > scale->max_amp) scale->max_amp = max_amp;
+}
+
+static void stream_copy_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	(void)buff; (void)frames; (void)fmt; (void)ctx;
+}
+
+WAV_State WAV_stream_normalize_max_db(
+		const char *in_file_name,
+		const char *out_file_name,
+		double db,
+		uint64_t buffer_size)
+{
+	struct WAV_stream in;
+
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	if (db > 0.0f) db = 0.0f;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+
+	// First pass: find the peak
+	struct stream_scale_ctx scale = {0};
+
+	scale.peak = max_amp_kernel(fmt);
+
+	if (scale.peak == NULL
+	    || stream_transform(&in, NULL, buffer_size, stream_peak_block, &scale) == Error) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	if (fread(wav->data.buff, wav->data.size, 1, file) != 1) {
-		perror("Could not write to wav data buffer.\n");
-		fclose(file);
-		free(wav->data.buff);	
-		return Error;
+	if (scale.max_amp > 0) {
+		scale.q = gain_q_of(normalize_gain(scale.max_amp, db, fmt->bits_per_sample), fmt->bits_per_sample, 0);
+		scale.gain = gain_kernel(fmt, &scale.q);
 	}
-	
-	return Success;
+
+	// Second pass: rescale, silence is copied as is
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			scale.max_amp == 0 ? stream_copy_block : stream_scale_block,
+			&scale
+		);
+
+	WAV_stream_close(&in);
+
+	return ret;
 }
 
-static WAV_State read_EXTRA_chunk(struct WAV_file *wav, FILE *file, unsigned char* chunk_id)
+static void stream_pass_filter_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
 {
+	pass_filter_block((struct pass_filter*)ctx, buff, frames, fmt);
+}
 
-	// Copy data into new EXTRA_chunk struct to be appended to list of EXTRA chunks
-	struct EXTRA_chunk *extra = (struct EXTRA_chunk*)malloc(sizeof(struct EXTRA_chunk));
+static WAV_State stream_pass_filter(
+		const char *in_file_name,
+		const char *out_file_name,
+		float cutoff,
+		uint64_t buffer_size,
+		int high_pass)
+{
+	struct WAV_stream in;
 
-	if (extra == NULL) {
-		return Error;
-	}
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
 
-	memcpy(extra->id, chunk_id, sizeof(extra->id));
+	const struct FMT_chunk *fmt = &in.wav.fmt;
 
-	if (fread(&extra->size, sizeof(extra->size), 1, file) != 1) {
-		free(extra);
-		return Error;
-	}
+	const float alpha = high_pass
+		? high_pass_alpha(cutoff, fmt->sample_rate)
+		: low_pass_alpha(cutoff, fmt->sample_rate);
 
-	extra->buff = (unsigned char*)malloc(extra->size);
+	struct pass_filter filter;
 
-	if (extra->buff == NULL) {
-		free(extra);
+	if (!valid_pcm_format(fmt) || !pass_filter_init(&filter, fmt, alpha, high_pass)) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	if (fread(extra->buff, extra->size, 1, file) != 1) {
-		free(extra->buff);
-		free(extra);
-		return Error;
-	}
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			stream_pass_filter_block,
+			&filter
+		);
 
-	extra->next = NULL;
+	pass_filter_free(&filter);
+	WAV_stream_close(&in);
 
-	// Set new EXTRA_chunk to last node in list
-	
-	if (wav->extra == NULL) {
-		wav->extra = extra;
-		return Success;
-	}
+	return ret;
+}
 
-	struct EXTRA_chunk *curr = wav->extra;
-	while (curr->next != NULL) {
-		curr = curr->next;
-	}
+WAV_State WAV_stream_apply_low_pass_filter(
+		const char *in_file_name,
+		const char *out_file_name,
+		float cutoff,
+		uint64_t buffer_size)
+{
+	return stream_pass_filter(in_file_name, out_file_name, cutoff, buffer_size, 0);
+}
 
-	curr->next = extra;
+WAV_State WAV_stream_apply_high_pass_filter(
+		const char *in_file_name,
+		const char *out_file_name,
+		float cutoff,
+		uint64_t buffer_size)
+{
+	return stream_pass_filter(in_file_name, out_file_name, cutoff, buffer_size, 1);
+}
 
-	return Success;
+static void stream_biquad_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	process_planar(buff, frames, fmt, biquad_planar_block, ctx);
 }
 
-WAV_State WAV_read_file(struct WAV_file *wav, const char *file_name)
+WAV_State WAV_stream_apply_biquad(
+		const char *in_file_name,
+		const char *out_file_name,
+		struct WAV_biquad *filter,
+		uint64_t buffer_size)
 {
-	if (file_name == NULL) return Error;
+	if (filter == NULL) return Error;
 
-	FILE *file = fopen(file_name, "rb");
+	struct WAV_stream in;
 
-	if (file == NULL) {
-		perror("Failed to open file for read.\n");
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+
+	if (!valid_pcm_format(fmt) || fmt->num_channels != filter->num_channels) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	while (!feof(file) && !ferror(file) ) {
-		unsigned char id[4] = {0};
-		
-		// Read the 4 bytes for the id of the next chunk
-		if ( fread(&id, sizeof(id), 1, file) != 1 ) break;
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			stream_biquad_block,
+			filter
+		);
 
-		if (memcmp(id, "RIFF", sizeof(id)) == 0 ||
-		    memcmp(id, "RIFX", sizeof(id)) == 0) {
-			if (!read_RIFF_chunk(wav, file, id)) break;
-		}
-		else if (memcmp(id, "fmt ", sizeof(id)) == 0) {
-			if (!read_FMT_chunk(wav, file)) break;
-		}
-		else if (memcmp(id, "data", sizeof(id)) == 0) {
-			if (!read_DATA_chunk(wav, file)) break;
-		}
-		else {
-			if (!read_EXTRA_chunk(wav, file, id)) break;
-		}
-	}
+	WAV_stream_close(&in);
 
-	if (ferror(file)) {
-		perror("I/O error when parsing WAV file.\n");
-		fclose(file);
-		return Error;
-	} else if (!feof(file)) {
-		perror("Did not parse entire WAV file.\n");
-		fclose(file);
-		return Error;
-	}
+	return ret;
+}
 
-	fclose(file);
-	
-	return Success;
+static void stream_fir_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	const struct WAV_fir *fir = (const struct WAV_fir*)ctx;
+
+	process_planar_blocks(buff, frames, fmt, fir->kernel->block, fir_planar_block, ctx);
 }
 
-WAV_State WAV_write_to_file(
-        struct WAV_file* wav,
-        const char* file_name)
+WAV_State WAV_stream_apply_fir(
+		const char *in_file_name,
+		const char *out_file_name,
+		struct WAV_fir *fir,
+		uint64_t buffer_size)
 {
-	if (wav == NULL) return Error;
-	if (file_name == NULL) return Error;
+	if (fir == NULL || fir->kernel == NULL) return Error;
 
-	FILE* file = fopen(file_name, "wb");
+	struct WAV_stream in;
 
-	if (file == NULL) {
-		perror("File opening failed\n");
-		fclose(file);
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+
+	if (!valid_pcm_format(fmt) || fmt->num_channels != fir->num_channels) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	size_t riff_ret = fwrite(
-			&wav->riff,
-			sizeof(wav->riff),
-			1,
-			file
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			stream_fir_block,
+			fir
 		);
 
-	if (riff_ret != 1) {
-		perror("Failed to write RIFF chunk\n");
-		fclose(file);
+	WAV_stream_close(&in);
+
+	return ret;
+}
+
+static void stream_convolver_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	process_planar(buff, frames, fmt, convolver_planar_block, ctx);
+}
+
+WAV_State WAV_stream_apply_convolver(
+		const char *in_file_name,
+		const char *out_file_name,
+		struct WAV_convolver *conv,
+		uint64_t buffer_size)
+{
+	if (conv == NULL || conv->state == NULL) return Error;
+
+	struct WAV_stream in;
+
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+
+	if (!valid_pcm_format(fmt) || fmt->num_channels != conv->num_channels) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	size_t fmt_ret = fwrite(
-			&wav->fmt,
-			sizeof(wav->fmt),
-			1,
-			file
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			stream_convolver_block,
+			conv
 		);
 
-	if (fmt_ret != 1) {
-		perror("Failed to write FMT chunk\n");
-		fclose(file);
+	WAV_stream_close(&in);
+
+	return ret;
+}
+
+static void stream_chain_block(unsigned char *buff, uint64_t frames, const struct FMT_chunk *fmt, void *ctx)
+{
+	process_planar(buff, frames, fmt, chain_planar_block, ctx);
+}
+
+WAV_State WAV_stream_apply_chain(
+		const char *in_file_name,
+		const char *out_file_name,
+		struct WAV_chain *chain,
+		uint64_t buffer_size)
+{
+	if (chain == NULL) return Error;
+
+	struct WAV_stream in;
+
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+
+	if (!valid_pcm_format(fmt) || fmt->num_channels != chain->num_channels) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	size_t data_ret = fwrite(
-			&wav->data,
-			sizeof(wav->data) - sizeof(wav->data.buff),
-			1,
-			file
+	const WAV_State ret = stream_transform(
+			&in,
+			out_file_name,
+			buffer_size,
+			stream_chain_block,
+			chain
 		);
-	
-	if (data_ret != 1) {
-		perror("Failed to write DATA chunk\n");
-		fclose(file);
+
+	WAV_stream_close(&in);
+
+	return ret;
+}
+
+WAV_State WAV_stream_resample(
+		const char *in_file_name,
+		const char *out_file_name,
+		uint32_t sample_rate,
+		uint32_t kernel_length,
+		uint64_t buffer_size)
+{
+	struct WAV_stream in;
+
+	if (WAV_stream_open(&in, in_file_name) == Error) return Error;
+
+	const struct FMT_chunk *fmt = &in.wav.fmt;
+	struct WAV_resampler rs;
+
+	if (!valid_pcm_format(fmt)
+	    || WAV_resampler_init(&rs, fmt->num_channels, fmt->sample_rate, sample_rate, kernel_length) == Error) {
+		WAV_stream_close(&in);
 		return Error;
 	}
 
-	size_t sound_data_ret = fwrite(
-			wav->data.buff,
-			sizeof(unsigned char),
-			wav->data.size,
-			file
-		);
+	// Half the buffer for the input and half for the output, whichever is longer
+	const uint64_t longer = sample_rate > fmt->sample_rate ? sample_rate : fmt->sample_rate;
+	if (buffer_size == 0) buffer_size = WAV_STREAM_DEFAULT_BUFFER;
 
-	if (sound_data_ret != wav->data.size) {
-		perror("Failed to write sound data\n");
+	const uint64_t block_frames = buffer_size / (2 * (uint64_t)fmt->block_align) * fmt->sample_rate / longer + 1;
+	const uint64_t out_capacity = WAV_resampler_max_output(&rs, block_frames);
+
+	unsigned char *in_buff = (unsigned char*)malloc(block_frames * fmt->block_align);
+	unsigned char *out_buff = (unsigned char*)malloc(out_capacity * fmt->block_align);
+	struct WAV_planar in_planar, out_planar;
+	struct WAV_stream out;
+
+	memset(&in_planar, 0, sizeof(in_planar));
+	memset(&out_planar, 0, sizeof(out_planar));
+
+	WAV_State ret = in_buff != NULL && out_buff != NULL
+		&& WAV_planar_alloc(&in_planar, fmt->num_channels, block_frames) == Success
+		&& WAV_planar_alloc(&out_planar, fmt->num_channels, out_capacity) == Success
+		? WAV_stream_create(&out, out_file_name, fmt->num_channels, sample_rate, fmt->bits_per_sample)
+		: Error;
+
+	const int created = ret == Success;
+
+	while (ret == Success) {
+		const uint64_t frames = WAV_stream_read_frames(&in, in_buff, block_frames);
+		uint64_t written;
+
+		if (frames > 0) {
+			decode_frames(in_buff, fmt, frames, in_planar.channels, 0);
+			written = resample_run(&rs, (const float *const *)in_planar.channels, frames, out_planar.channels, 0, UINT64_MAX);
+		} else if (in.position == in.frames) {
+			written = resample_flush(&rs, out_planar.channels, 0);
+		} else {
+			ret = Error;
+			break;
+		}
+
+		encode_frames((const float *const *)out_planar.channels, 0, &out.wav.fmt, written, out_buff);
+
+		if (WAV_stream_write_frames(&out, out_buff, written) == Error) ret = Error;
+		if (frames == 0) break;
+	}
+
+	if (created && WAV_stream_close(&out) == Error) ret = Error;
+
+	WAV_planar_free(&in_planar);
+	WAV_planar_free(&out_planar);
+	free(in_buff);
+	free(out_buff);
+	WAV_resampler_free(&rs);
+	WAV_stream_close(&in);
+
+	return ret;
+}
+
+// Write frames of a signal to a new file with the format of fmt. The render
+// of each block of the working buffer is split across the thread pool while
+// the pipeline writer thread drains the blocks before it.
+static WAV_State stream_write_signal(
+		const char *file_name,
+		const struct FMT_chunk *fmt,
+		signal_render_fn render,
+		const void *signal,
+		uint64_t frames,
+		uint64_t buffer_size)
+{
+	struct WAV_stream out;
+
+	if (WAV_stream_create(&out, file_name, fmt->num_channels, fmt->sample_rate, fmt->bits_per_sample) == Error) {
 		return Error;
 	}
-	
-	struct EXTRA_chunk *sentinel = wav->extra;
-
-	while (sentinel != NULL) {	
-		size_t extra_ret = fwrite(
-				&sentinel,
-				sizeof(*sentinel)
-					- sizeof(sentinel->buff)
-					- sizeof(sentinel->next),
-				1,
-				file
-			);
 
-		if (extra_ret != 1) {
-			perror("Failed to write an EXTRA chunk\n");
-			fclose(file);
-			return Error;
-		}
+	struct pipeline pipe;
+	memset(&pipe, 0, sizeof(pipe));
 
-		size_t extra_data_ret = fwrite(
-				sentinel->buff,
-				sizeof(unsigned char),
-				sentinel->size,
-				file
-			);
+	// Whole tone blocks, so every frame comes out as in a single render
+	pipe.block_frames = (stream_block_frames(&out, buffer_size) + TONE_BLOCK_FRAMES - 1)
+		/ TONE_BLOCK_FRAMES * TONE_BLOCK_FRAMES;
+	pipe.out = &out;
 
-		if (extra_data_ret != sentinel->size) {
-			perror("Failed to write the data of an EXTRA chunk\n");
-			fclose(file);
-			return Error;
+	WAV_State ret = Success;
+
+	for (int i = 0; i < WAV_PIPELINE_BLOCKS; ++i) {
+		pipe.blocks[i].buff = (unsigned char*)malloc(pipe.block_frames * out.wav.fmt.block_align);
+		if (pipe.blocks[i].buff == NULL) ret = Error;
+	}
+
+	pthread_t writer;
+	int writer_started = 0;
+
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.changed, NULL);
+
+	if (ret == Success) {
+		writer_started = pthread_create(&writer, NULL, pipeline_writer, &pipe) == 0;
+		if (!writer_started) ret = Error;
+	}
+
+	for (uint64_t i = 0, done = 0; ret == Success; ++i) {
+		struct pipeline_block *block = &pipe.blocks[i % WAV_PIPELINE_BLOCKS];
+
+		if (pipeline_wait(&pipe, block, BLOCK_FREE) != BLOCK_FREE) break;
+
+		if (done == frames) {
+			pipeline_set(&pipe, block, BLOCK_END);
+			break;
 		}
 
-		sentinel = sentinel->next;
+		block->frames = frames - done < pipe.block_frames ? frames - done : pipe.block_frames;
+		render_parallel(render, signal, &out.wav.fmt, block->buff, done, block->frames);
+		done += block->frames;
+
+		pipeline_set(&pipe, block, BLOCK_DONE);
 	}
 
+	if (writer_started) pthread_join(writer, NULL);
 
-	fclose(file);
+	if (pipe.failed) ret = Error;
+	if (WAV_stream_close(&out) == Error) ret = Error;
 
-	return Success;
+	pthread_cond_destroy(&pipe.changed);
+	pthread_mutex_destroy(&pipe.lock);
+
+	for (int i = 0; i < WAV_PIPELINE_BLOCKS; ++i) free(pipe.blocks[i].buff);
+
+	return ret;
 }
 
-void WAV_free(struct WAV_file *wav) {
-    if (wav == NULL) return;
+static WAV_State stream_write_tones(
+		const char *file_name,
+		uint16_t num_channels,
+		uint32_t sample_rate,
+		uint16_t bits_per_sample,
+		const double *freqs,
+		uint16_t num_tones,
+		double duration,
+		float db,
+		uint64_t buffer_size)
+{
+	struct WAV_file header;
+	uint64_t frames;
 
-    if (wav->data.buff != NULL) {
-	free(wav->data.buff);
-	wav->riff.size -= wav->data.size;
-	wav->data.size = 0;
-    }
+	WAV_init(&header, num_channels, sample_rate, bits_per_sample);
 
-    while (wav->extra != NULL) {
-	if (wav->extra->buff != NULL) {
-		free(wav->extra->buff);
-		wav->extra->buff = NULL;
+	if (file_name == NULL || num_channels == 0 || !is_int_pcm(&header.fmt)
+	    || duration_frames(duration, &header.fmt, &frames) == Error) {
+		return Error;
 	}
- 
-	struct EXTRA_chunk *t = wav->extra;
-	wav->extra = wav->extra->next;
-	free(t);
-    }
+
+	struct tone_set set;
+
+	if (tones_setup(&set, freqs, num_tones, &header.fmt, db) == Error) return Error;
+
+	const WAV_State ret = stream_write_signal(file_name, &header.fmt, tone_render, &set, frames, buffer_size);
+
+	tones_free(&set);
+
+	return ret;
+}
+
+WAV_State WAV_stream_write_sin_wave(
+		const char *file_name,
+		uint16_t num_channels,
+		uint32_t sample_rate,
+		uint16_t bits_per_sample,
+		double frequency,
+		double duration,
+		float db,
+		uint64_t buffer_size)
+{
+	return stream_write_tones(file_name, num_channels, sample_rate, bits_per_sample,
+				  &frequency, 1, duration, db, buffer_size);
+}
+
+WAV_State WAV_stream_write_binaural_wave(
+		const char *file_name,
+		uint16_t num_channels,
+		uint32_t sample_rate,
+		uint16_t bits_per_sample,
+		double frequency1,
+		double frequency2,
+		double duration,
+		float db,
+		uint64_t buffer_size)
+{
+	const double freqs[2] = { frequency1, frequency2 };
+
+	return stream_write_tones(file_name, num_channels, sample_rate, bits_per_sample,
+				  freqs, 2, duration, db, buffer_size);
+}
+
+WAV_State WAV_stream_write_noise(
+		const char *file_name,
+		uint16_t num_channels,
+		uint32_t sample_rate,
+		uint16_t bits_per_sample,
+		WAV_NoiseType type,
+		uint64_t seed,
+		double duration,
+		float db,
+		uint64_t buffer_size)
+{
+	struct WAV_file header;
+	uint64_t frames;
+	struct noise noise;
+
+	WAV_init(&header, num_channels, sample_rate, bits_per_sample);
+
+	if (file_name == NULL || num_channels == 0 || !is_int_pcm(&header.fmt)
+	    || duration_frames(duration, &header.fmt, &frames) == Error
+	    || noise_setup(&noise, type, seed, &header.fmt, db) == Error) {
+		return Error;
+	}
+
+	return stream_write_signal(file_name, &header.fmt, noise_render, &noise, frames, buffer_size);
 }
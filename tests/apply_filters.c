@@ -60,5 +60,111 @@ int main(int argc, char** argv)
 	
 	WAV_free(&wav);
 
+	memset(&wav, 0, sizeof(wav));
+
+	const double freq3 = 1000.0;
+
+	printf("\nApplying 4th order Linkwitz-Riley lowpass at %.2fhz to wav file: %s\n\n", freq3, argv[1]);
+
+	if (WAV_read_file(&wav, argv[1]) == Error) {
+		perror("Error: Could not read wav file!\n");
+		return 1;
+	}
+
+	struct WAV_biquad filter;
+
+	if (WAV_biquad_init(&filter, wav.fmt.num_channels) == Error
+	    || WAV_biquad_add_cascade(&filter, WAV_CASCADE_LINKWITZ_RILEY, WAV_BIQUAD_LOW_PASS, 4, freq3, wav.fmt.sample_rate) == Error
+	    || WAV_apply_biquad(&wav, &filter) == Error) {
+		fprintf(stderr, "ERROR: Could not apply the biquad filter!\n");
+		return 1;
+	}
+
+	WAV_biquad_free(&filter);
+
+	char file_name3[] = "test-biquad.wav";
+
+	if (WAV_write_to_file(&wav, file_name3) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file_name3);
+		return 1;
+	}
+
+	printf("\nWrote file with biquad lowpass applied to %s\n\n", file_name3);
+
+	WAV_free(&wav);
+
+	memset(&wav, 0, sizeof(wav));
+
+	const double freq4 = 500.0;
+	static float taps[1023];
+
+	printf("\nApplying %u tap FIR highpass at %.2fhz to wav file: %s\n\n", 1023u, freq4, argv[1]);
+
+	if (WAV_read_file(&wav, argv[1]) == Error) {
+		perror("Error: Could not read wav file!\n");
+		return 1;
+	}
+
+	struct WAV_fir fir;
+
+	if (WAV_fir_design(taps, 1023, WAV_FIR_HIGH_PASS, freq4, wav.fmt.sample_rate) == Error
+	    || WAV_fir_init(&fir, wav.fmt.num_channels, taps, 1023) == Error
+	    || WAV_apply_fir(&wav, &fir) == Error) {
+		fprintf(stderr, "ERROR: Could not apply the FIR filter!\n");
+		return 1;
+	}
+
+	WAV_fir_free(&fir);
+
+	char file_name4[] = "test-fir.wav";
+
+	if (WAV_write_to_file(&wav, file_name4) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file_name4);
+		return 1;
+	}
+
+	printf("\nWrote file with FIR highpass applied to %s\n\n", file_name4);
+
+	WAV_free(&wav);
+
+	memset(&wav, 0, sizeof(wav));
+
+	printf("\nApplying DC removal, lowpass, +6dB gain, clipping and a fade out in one pass to wav file: %s\n\n", argv[1]);
+
+	if (WAV_read_file(&wav, argv[1]) == Error) {
+		perror("Error: Could not read wav file!\n");
+		return 1;
+	}
+
+	struct WAV_chain chain;
+	const uint32_t rate = wav.fmt.sample_rate;
+
+	if (WAV_biquad_init(&filter, wav.fmt.num_channels) == Error
+	    || WAV_biquad_add_cascade(&filter, WAV_CASCADE_BUTTERWORTH, WAV_BIQUAD_LOW_PASS, 2, freq3, rate) == Error
+	    || WAV_chain_init(&chain, wav.fmt.num_channels, rate) == Error
+	    || WAV_chain_add_dc_removal(&chain, 10.0) == Error
+	    || WAV_chain_add_biquad(&chain, &filter) == Error
+	    || WAV_chain_add_gain(&chain, 6.0, WAV_GAIN_DB) == Error
+	    || WAV_chain_add_clip(&chain, -1.0) == Error
+	    || WAV_chain_add_fade(&chain, WAV_FADE_OUT, rate / 2, rate / 2) == Error
+	    || WAV_apply_chain(&wav, &chain) == Error) {
+		fprintf(stderr, "ERROR: Could not apply the effect chain!\n");
+		return 1;
+	}
+
+	WAV_chain_free(&chain);
+	WAV_biquad_free(&filter);
+
+	char file_name5[] = "test-chain.wav";
+
+	if (WAV_write_to_file(&wav, file_name5) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file_name5);
+		return 1;
+	}
+
+	printf("\nWrote file with effect chain applied to %s\n\n", file_name5);
+
+	WAV_free(&wav);
+
 	return 0;
 }
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "WavReader.h"
+
+#define SAMPLE_RATE 48000
+#define NUM_CHANNELS 2
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static float noise(uint32_t *seed)
+{
+	*seed = *seed * 1664525u + 1013904223u;
+	return (float)(*seed >> 8) / (float)(1u << 24) - 0.5f;
+}
+
+// Direct time domain convolution of one block, the baseline
+static void convolve_direct(
+		const float *ir,
+		uint32_t ir_frames,
+		const float *history,	// ir_frames - 1 inputs before the block, then the block
+		float *out,
+		uint32_t frames)
+{
+	for (uint32_t i = 0; i < frames; ++i) {
+		const float *x = &history[ir_frames - 1 + i];
+		float sum = 0.0f;
+
+		for (uint32_t k = 0; k < ir_frames; ++k) sum += ir[k] * x[-(int64_t)k];
+
+		out[i] = sum;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const double ir_seconds = argc > 1 ? atof(argv[1]) : 2.0;
+	const double signal_seconds = 10.0;
+	const uint32_t ir_frames = (uint32_t)(ir_seconds * SAMPLE_RATE);
+	const uint64_t frames = (uint64_t)(signal_seconds * SAMPLE_RATE);
+
+	if (ir_frames == 0) {
+		fprintf(stderr, "Usage: %s [impulse response seconds]\n", argv[0]);
+		return 1;
+	}
+
+	printf("\nConvolving %.1fs of %d channel audio with a %.2fs impulse response\n\n",
+			signal_seconds, NUM_CHANNELS, ir_seconds);
+
+	// Decaying noise, like a room response
+	uint32_t seed = 1;
+	float *ir = (float*)malloc(ir_frames * sizeof(float));
+
+	for (uint32_t i = 0; i < ir_frames; ++i) {
+		ir[i] = noise(&seed) * expf(-6.9f * (float)i / (float)ir_frames);
+	}
+
+	struct WAV_planar signal;
+
+	if (WAV_planar_alloc(&signal, NUM_CHANNELS, frames) == Error) {
+		perror("Error: Could not allocate the signal!\n");
+		return 1;
+	}
+
+	const uint32_t block_sizes[] = { 64, 128, 256, 512 };
+
+	for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); ++b) {
+		const uint32_t block = block_sizes[b];
+		const double budget = (double)block / SAMPLE_RATE;
+
+		for (uint16_t c = 0; c < NUM_CHANNELS; ++c) {
+			for (uint64_t i = 0; i < frames; ++i) signal.channels[c][i] = noise(&seed);
+		}
+
+		struct WAV_convolver conv;
+		const float *irs[] = { ir };
+
+		double start = now();
+
+		if (WAV_convolver_init(&conv, NUM_CHANNELS, block, irs, 1, ir_frames) == Error) {
+			fprintf(stderr, "ERROR: Could not set up the convolver!\n");
+			return 1;
+		}
+
+		const double setup = now() - start;
+
+		double *times = (double*)malloc((frames / block) * sizeof(double));
+		double total = 0.0;
+		uint64_t blocks = 0;
+
+		for (uint64_t done = 0; done + block <= frames; done += block) {
+			float *channels[NUM_CHANNELS];
+			for (uint16_t c = 0; c < NUM_CHANNELS; ++c) channels[c] = &signal.channels[c][done];
+
+			struct WAV_planar view = { channels, NUM_CHANNELS, block };
+
+			start = now();
+			WAV_convolver_process(&conv, &view);
+			const double elapsed = now() - start;
+
+			times[blocks++] = elapsed;
+			total += elapsed;
+		}
+
+		WAV_convolver_free(&conv);
+
+		// The worst case includes preemption by the OS; the 99th percentile shows the steady cost
+		qsort(times, blocks, sizeof(double), compare_double);
+
+		printf("block %4u: setup %6.2f ms, mean %7.1f us, p99 %7.1f us, worst %7.1f us (budget %6.0f us), %6.1fx real time\n",
+				block, setup * 1e3, total / blocks * 1e6, times[blocks * 99 / 100] * 1e6,
+				times[blocks - 1] * 1e6, budget * 1e6, blocks * budget / total);
+
+		free(times);
+	}
+
+	// Baseline: direct convolution of a few blocks, which is enough to time it
+	const uint32_t block = 512;
+	const uint32_t repeats = 4;
+	float *history = (float*)calloc(ir_frames - 1 + block, sizeof(float));
+	float *out = (float*)malloc(block * sizeof(float));
+
+	for (uint32_t i = 0; i < ir_frames - 1 + block; ++i) history[i] = noise(&seed);
+
+	const double start = now();
+
+	for (uint32_t r = 0; r < repeats; ++r) {
+		for (uint16_t c = 0; c < NUM_CHANNELS; ++c) convolve_direct(ir, ir_frames, history, out, block);
+	}
+
+	const double direct = (now() - start) / repeats;
+	const double budget = (double)block / SAMPLE_RATE;
+
+	printf("\ndirect time domain, block %u: %.1f us per block, %.2fx real time\n\n",
+			block, direct * 1e6, budget / direct);
+
+	free(history);
+	free(out);
+	free(ir);
+	WAV_planar_free(&signal);
+
+	return 0;
+}
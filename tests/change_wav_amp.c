@@ -63,6 +63,24 @@ int main(void) {
 
 	printf("\nWrote sin wav to file at %.2fdb: %s\n\n", new_db, file2_name);
 
+	char file3_name[] = "test-sin-mono-8bit.wav";
+
+	printf("\nConverting sin wav to 8-bit mono with dither\n\n");
+
+	if (WAV_convert_format(&wav, 8, 1, NULL, WAV_DITHER_TPDF) == Error) {
+		fprintf(stderr, "ERROR: Could not convert WAV struct to 8-bit mono!\n");
+		return 1;
+	}
+
+	if (WAV_write_to_file(&wav, file3_name) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file3_name);
+		return 1;
+	}
+
+	WAV_print(&wav);
+
+	printf("\nWrote 8-bit mono sin wav to file: %s\n\n", file3_name);
+
 	// Free data allocated for waveform & EXTRA_chunk(s)
 	WAV_free(&wav);
 
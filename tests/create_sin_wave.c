@@ -66,6 +66,73 @@ int main(void) {
 
 	WAV_print(&wav);
 
+	char file4_name[] = "test-sweep.wav\0";
+
+	ret = WAV_write_sweep(
+			&wav,
+			WAV_SWEEP_LOG,
+			20.0,		// start frequency
+			20000.0,	// end frequency
+			10.0,		// duration (sec)
+			-3.0f		// max decibel level
+		);
+
+	if (ret == Error) {
+		perror("ERROR: Could not write sweep to WAV struct!\n");
+		return 1;
+	}
+
+	if (WAV_write_to_file(&wav, file4_name) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file4_name);
+		return 1;
+	}
+
+	printf("\nWrote log sweep to file: %s\n", file4_name);
+
+	char file5_name[] = "test-pink-noise.wav\0";
+
+	ret = WAV_write_noise(
+			&wav,
+			WAV_NOISE_PINK,
+			1,		// seed
+			10.0,		// duration (sec)
+			-20.0f		// RMS decibel level
+		);
+
+	if (ret == Error) {
+		perror("ERROR: Could not write noise to WAV struct!\n");
+		return 1;
+	}
+
+	if (WAV_write_to_file(&wav, file5_name) == Error) {
+		fprintf(stderr, "ERROR: Could not write WAV struct to %s!\n", file5_name);
+		return 1;
+	}
+
+	printf("\nWrote pink noise to file: %s\n", file5_name);
+
+	char file3_name[] = "test-stream-binaural.wav\0";
+
+	// Streamed to disk a block at a time, so long signals need little memory
+	ret = WAV_stream_write_binaural_wave(
+			file3_name,
+			2,		// channels
+			96000,		// sample rate
+			24,		// bits per sample
+			174.0,		// frequency 1
+			164.0,		// frequency 2
+			60.5,		// duration (sec)
+			-1.0f,		// max decibel level
+			1024 * 1024	// buffer size (bytes)
+		);
+
+	if (ret == Error) {
+		fprintf(stderr, "ERROR: Could not stream binaural wave to %s!\n", file3_name);
+		return 1;
+	}
+
+	printf("\nStreamed binaural wav to file: %s\n", file3_name);
+
 	printf("\n");
 
 	// Free data allocated for waveform & EXTRA_chunk(s)
@@ -0,0 +1,53 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "WavReader.h"
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <wav file path>\n", argv[0]);
+		return 1;
+	}
+
+	struct WAV_file wav;
+	memset(&wav, 0, sizeof(wav));
+
+	printf("\nOpening wav file: %s\n\n", argv[1]);
+
+	// Index the chunks of the wav file; payloads are only read when needed
+	if (WAV_open_lazy(&wav, argv[1]) == Error) {
+		perror("Error: Could not open wav file!\n");
+		return 1;
+	}
+
+	// Only the fmt chunk and the chunk index are in memory so far
+	WAV_print_metadata(&wav);
+
+	// Read the first frames straight from the file
+	const uint64_t count = 4;
+	unsigned char *frames = (unsigned char*)malloc(count * wav.fmt.block_align + 1);
+
+	if (frames == NULL) {
+		WAV_free(&wav);
+		return 1;
+	}
+
+	const uint64_t read = WAV_read_frames(&wav, 0, count, frames);
+
+	printf("\nFirst %llu frames:", (unsigned long long)read);
+
+	for (uint64_t i = 0; i < read * wav.fmt.block_align; ++i) printf(" %02x", frames[i]);
+
+	printf("\n");
+
+	free(frames);
+
+	// Loads the sound data on first use
+	printf("\nWav file max db: %.2f dB.\n\n", WAV_get_max_db(&wav));
+
+	// Free data allocated for waveform & EXTRA_chunk(s)
+	WAV_free(&wav);
+
+	return 0;
+}
@@ -22,6 +22,22 @@ int main(int argc, char** argv)
 	
 	WAV_print(&wav);
 
+	// Computed in one pass; the max db below reuses the cached peak
+	const struct WAV_stats *stats = WAV_get_stats(&wav);
+
+	if (stats != NULL) {
+		for (uint16_t c = 0; c < stats->num_channels; ++c) {
+			const struct WAV_channel_stats *channel = &stats->channels[c];
+
+			printf("Channel %u: peak %llu, rms %.2f, dc offset %.2f, clipped samples %llu\n",
+			       c,
+			       (unsigned long long)channel->peak,
+			       channel->rms,
+			       channel->dc_offset,
+			       (unsigned long long)channel->clip_count);
+		}
+	}
+
 	printf("\nWav file max db: %.2f dB.\n\n", WAV_get_max_db(&wav));
 
 	// Free data allocated for waveform & EXTRA_chunk(s)
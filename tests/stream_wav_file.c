@@ -0,0 +1,76 @@
+#include <string.h>
+#include <stdio.h>
+#include "WavReader.h"
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <wav file path>\n", argv[0]);
+		return 1;
+	}
+
+	// Keep the working set small to show memory use does not depend on the file
+	const uint64_t buffer_size = 64 * 1024;
+
+	const double db = -16.0f;
+	char file_name[] = "test-stream-normalized.wav";
+
+	printf("\nStreaming normalize to %.2fdb of wav file: %s\n\n", db, argv[1]);
+
+	if (WAV_stream_normalize_max_db(argv[1], file_name, db, buffer_size) == Error) {
+		fprintf(stderr, "ERROR: Could not normalize %s!\n", argv[1]);
+		return 1;
+	}
+
+	printf("\nWrote normalized file to %s\n\n", file_name);
+
+	const float freq = 30.0f;
+	char file_name2[] = "test-stream-lowpass.wav";
+
+	printf("\nStreaming lowpass at %.2fhz of wav file: %s\n\n", freq, argv[1]);
+
+	if (WAV_stream_apply_low_pass_filter(argv[1], file_name2, freq, buffer_size) == Error) {
+		fprintf(stderr, "ERROR: Could not filter %s!\n", argv[1]);
+		return 1;
+	}
+
+	printf("\nWrote file with lowpass applied to %s\n\n", file_name2);
+
+	struct WAV_stream stream;
+
+	if (WAV_stream_open(&stream, file_name2) == Error) {
+		fprintf(stderr, "ERROR: Could not open %s!\n", file_name2);
+		return 1;
+	}
+
+	printf("%s has %lu frames at %u hz\n\n",
+		file_name2,
+		(unsigned long)stream.frames,
+		stream.wav.fmt.sample_rate);
+
+	const uint32_t rate = stream.wav.fmt.sample_rate == 48000 ? 44100 : 48000;
+	char file_name3[] = "test-stream-resampled.wav";
+
+	WAV_stream_close(&stream);
+
+	printf("\nStreaming resample to %u hz of wav file: %s\n\n", rate, argv[1]);
+
+	if (WAV_stream_resample(argv[1], file_name3, rate, 0, buffer_size) == Error) {
+		fprintf(stderr, "ERROR: Could not resample %s!\n", argv[1]);
+		return 1;
+	}
+
+	if (WAV_stream_open(&stream, file_name3) == Error) {
+		fprintf(stderr, "ERROR: Could not open %s!\n", file_name3);
+		return 1;
+	}
+
+	printf("%s has %lu frames at %u hz\n\n",
+		file_name3,
+		(unsigned long)stream.frames,
+		stream.wav.fmt.sample_rate);
+
+	WAV_stream_close(&stream);
+
+	return 0;
+}
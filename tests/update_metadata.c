@@ -0,0 +1,49 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "WavReader.h"
+
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <wav file path> <title>\n", argv[0]);
+		return 1;
+	}
+
+	// Build a LIST/INFO chunk holding a single INAM (title) entry
+	unsigned char list[512] = {0};
+	const uint32_t title_sz = strlen(argv[2]) + 1;
+
+	if (title_sz > sizeof(list) - 13) {
+		fprintf(stderr, "ERROR: Title is too long!\n");
+		return 1;
+	}
+
+	memcpy(list, "INFO", 4);
+	memcpy(&list[4], "INAM", 4);
+	memcpy(&list[8], &title_sz, 4);
+	memcpy(&list[12], argv[2], title_sz);
+
+	const uint32_t list_sz = 12 + title_sz + (title_sz % 2);
+
+	printf("\nSetting title of wav file %s to: %s\n\n", argv[1], argv[2]);
+
+	// Only the LIST chunk is rewritten, the sound data is left alone
+	if (WAV_update_chunk(argv[1], "LIST", list, list_sz) == Error) {
+		fprintf(stderr, "ERROR: Could not update metadata of %s!\n", argv[1]);
+		return 1;
+	}
+
+	struct WAV_file wav;
+
+	if (WAV_open_lazy(&wav, argv[1]) == Error) {
+		perror("Error: Could not read wav file!\n");
+		return 1;
+	}
+
+	WAV_print_metadata(&wav);
+
+	WAV_free(&wav);
+
+	return 0;
+}